@@ -0,0 +1,407 @@
+#include "agg_flash_log.h"
+#include "agg_stats.h"
+#include "thingy_db_cache.h"
+#include "app_aggregator.h"
+#include "app_error.h"
+#include "app_util.h"
+#include "nrf_fstorage.h"
+#include "nrf_fstorage_sd.h"
+#include <stddef.h>
+#include <string.h>
+
+#define AGG_FLASH_LOG_MAGIC             0x31474C46  // "FLG1", bump when the chunk layout changes
+#define AGG_FLASH_LOG_ERASED            0xFFFFFFFF
+
+#define AGG_FLASH_LOG_FLASH_ADDR        (THINGY_DB_CACHE_FLASH_ADDR - AGG_FLASH_LOG_PAGES * AGG_FLASH_LOG_PAGE_SIZE)
+#define AGG_FLASH_LOG_CHUNKS_PER_PAGE   (AGG_FLASH_LOG_PAGE_SIZE / AGG_FLASH_LOG_CHUNK_SIZE)
+
+typedef struct
+{
+    uint32_t replayed;      // not part of the chunk write, so the word is written only once
+    uint32_t seq;
+    uint16_t length;
+    uint16_t records;
+    uint8_t  data[AGG_FLASH_LOG_CHUNK_DATA_SIZE];
+    uint32_t magic;
+}agg_flash_log_chunk_t;
+
+STATIC_ASSERT(sizeof(agg_flash_log_chunk_t) == AGG_FLASH_LOG_CHUNK_SIZE);
+STATIC_ASSERT(AGG_FLASH_LOG_PAGE_SIZE % AGG_FLASH_LOG_CHUNK_SIZE == 0);
+STATIC_ASSERT(AGG_FLASH_LOG_PAGES >= 2);
+
+enum {AGG_FLASH_LOG_IDLE, AGG_FLASH_LOG_WRITE, AGG_FLASH_LOG_ERASE, AGG_FLASH_LOG_MARK};
+
+// The log in order: flash chunks read_seq to write_seq - 1, the chunk waiting to be written,
+// the chunk being filled
+static struct
+{
+    agg_flash_log_chunk_t chunk[2];         // filled one, written one; fstorage reads it after the call returns
+    agg_flash_log_chunk_t replay;           // copy of the flash chunk read_seq
+    uint8_t               fill;             // chunk being filled
+    bool                  write_pending;    // the other chunk is full, waiting for its slot
+    bool                  replay_loaded;
+    uint16_t              replay_pos;       // data of replay handed out
+    uint16_t              fill_pos;         // data of the filled chunk handed out, once flash is drained
+    uint16_t              fill_pos_records;
+    uint32_t              write_seq;        // sequence number of the next chunk written
+    uint32_t              read_seq;         // first chunk not all handed out
+    uint32_t              marked_seq;       // chunks below are marked as replayed in flash
+    uint32_t              blank_seq;        // write_seq of the last page found blank or erased
+    uint32_t              replayed_word;    // 0, source of the mark writes
+    uint8_t               state;
+    bool                  ready;
+}m_agg_flash_log;
+
+static void agg_flash_log_fstorage_evt_handler(nrf_fstorage_evt_t *p_evt);
+
+NRF_FSTORAGE_DEF(nrf_fstorage_t m_agg_flash_log_fstorage) =
+{
+    .evt_handler = agg_flash_log_fstorage_evt_handler,
+    .start_addr  = AGG_FLASH_LOG_FLASH_ADDR,
+    .end_addr    = AGG_FLASH_LOG_FLASH_ADDR + AGG_FLASH_LOG_PAGES * AGG_FLASH_LOG_PAGE_SIZE - 1,
+};
+
+static uint32_t agg_flash_log_slot_addr(uint32_t seq)
+{
+    return AGG_FLASH_LOG_FLASH_ADDR + (seq % AGG_FLASH_LOG_CHUNK_COUNT) * AGG_FLASH_LOG_CHUNK_SIZE;
+}
+
+static void agg_flash_log_chunk_read(uint32_t seq, agg_flash_log_chunk_t *p_chunk)
+{
+    ret_code_t err_code;
+
+    err_code = nrf_fstorage_read(&m_agg_flash_log_fstorage, agg_flash_log_slot_addr(seq), p_chunk, sizeof(agg_flash_log_chunk_t));
+    APP_ERROR_CHECK(err_code);
+}
+
+// A complete chunk of sequence number seq, what a cut short write left behind never is
+static bool agg_flash_log_chunk_valid(const agg_flash_log_chunk_t *p_chunk, uint32_t seq)
+{
+    return (p_chunk->magic == AGG_FLASH_LOG_MAGIC) && (p_chunk->seq == seq) &&
+           (p_chunk->length <= AGG_FLASH_LOG_CHUNK_DATA_SIZE);
+}
+
+static bool agg_flash_log_slot_blank(uint32_t seq)
+{
+    agg_flash_log_chunk_t chunk;
+    const uint32_t       *p_word = (const uint32_t *)&chunk;
+
+    agg_flash_log_chunk_read(seq, &chunk);
+    for (uint32_t i = 0; i < AGG_FLASH_LOG_CHUNK_SIZE / sizeof(uint32_t); i++)
+    {
+        if (p_word[i] != AGG_FLASH_LOG_ERASED)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The page of write_seq holds the chunks of the previous lap, it can go once they are all handed out
+static bool agg_flash_log_page_free(void)
+{
+    return (m_agg_flash_log.write_seq + AGG_FLASH_LOG_CHUNKS_PER_PAGE) <=
+           (m_agg_flash_log.read_seq + AGG_FLASH_LOG_CHUNK_COUNT);
+}
+
+// Starts the next flash operation, at most one is in flight. Marks go first, so no mark is left
+// for a page by the time it is erased.
+static void agg_flash_log_flush(void)
+{
+    ret_code_t             err_code;
+    agg_flash_log_chunk_t *p_chunk;
+    uint32_t               seq = m_agg_flash_log.write_seq;
+    uint32_t               i;
+
+    if (!m_agg_flash_log.ready || m_agg_flash_log.state != AGG_FLASH_LOG_IDLE)
+    {
+        return;
+    }
+
+    if (m_agg_flash_log.marked_seq < m_agg_flash_log.read_seq)
+    {
+        err_code = nrf_fstorage_write(&m_agg_flash_log_fstorage,
+                                      agg_flash_log_slot_addr(m_agg_flash_log.marked_seq) + offsetof(agg_flash_log_chunk_t, replayed),
+                                      &m_agg_flash_log.replayed_word, sizeof(uint32_t), NULL);
+        if (err_code == NRF_SUCCESS)
+        {
+            m_agg_flash_log.state = AGG_FLASH_LOG_MARK;
+        }
+        return;
+    }
+
+    if (!m_agg_flash_log.write_pending)
+    {
+        return;
+    }
+
+    if ((seq % AGG_FLASH_LOG_CHUNKS_PER_PAGE) == 0 && m_agg_flash_log.blank_seq != seq)
+    {
+        if (!agg_flash_log_page_free())
+        {
+            // Log full, the chunk waits for the phone to take the oldest page
+            return;
+        }
+        i = 0;
+        while (i < AGG_FLASH_LOG_CHUNKS_PER_PAGE && agg_flash_log_slot_blank(seq + i))
+        {
+            i++;
+        }
+        if (i == AGG_FLASH_LOG_CHUNKS_PER_PAGE)
+        {
+            // Not written since it was last erased, spare it an erase
+            m_agg_flash_log.blank_seq = seq;
+        }
+        else
+        {
+            err_code = nrf_fstorage_erase(&m_agg_flash_log_fstorage, agg_flash_log_slot_addr(seq), 1, NULL);
+            if (err_code == NRF_SUCCESS)
+            {
+                m_agg_flash_log.state = AGG_FLASH_LOG_ERASE;
+            }
+            return;
+        }
+    }
+
+    p_chunk = &m_agg_flash_log.chunk[m_agg_flash_log.fill ^ 1];
+    p_chunk->seq   = seq;
+    p_chunk->magic = AGG_FLASH_LOG_MAGIC;
+    err_code = nrf_fstorage_write(&m_agg_flash_log_fstorage, agg_flash_log_slot_addr(seq) + offsetof(agg_flash_log_chunk_t, seq),
+                                  &p_chunk->seq, sizeof(agg_flash_log_chunk_t) - offsetof(agg_flash_log_chunk_t, seq), NULL);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_agg_flash_log.state = AGG_FLASH_LOG_WRITE;
+    }
+}
+
+static void agg_flash_log_fstorage_evt_handler(nrf_fstorage_evt_t *p_evt)
+{
+    uint8_t state = m_agg_flash_log.state;
+
+    m_agg_flash_log.state = AGG_FLASH_LOG_IDLE;
+    if (state == AGG_FLASH_LOG_MARK)
+    {
+        // A failed mark costs a chunk replayed twice after a reset, not worth a retry
+        m_agg_flash_log.marked_seq++;
+    }
+    else if (state == AGG_FLASH_LOG_WRITE)
+    {
+        // A failed write may have left part of the chunk behind, the slot is skipped
+        // and the chunk goes to the next one
+        m_agg_flash_log.write_seq++;
+        if (p_evt->result == NRF_SUCCESS)
+        {
+            m_agg_flash_log.write_pending = false;
+        }
+        else
+        {
+            AGG_STATS_COUNT(AGG_STATS_CNT_FLASH_LOG_WRITE_RETRY);
+        }
+    }
+    else if (state == AGG_FLASH_LOG_ERASE && p_evt->result == NRF_SUCCESS)
+    {
+        m_agg_flash_log.blank_seq = m_agg_flash_log.write_seq;
+    }
+
+    if (p_evt->result != NRF_SUCCESS)
+    {
+        // Try again with the next put or pop rather than hammering the flash
+        return;
+    }
+    agg_flash_log_flush();
+}
+
+void agg_flash_log_init(void)
+{
+    ret_code_t            err_code;
+    agg_flash_log_chunk_t chunk;
+    bool                  found = false;
+    bool                  replayed_found = false;
+    uint32_t              last_seq = 0;
+    uint32_t              first_seq = UINT32_MAX;
+    uint32_t              last_replayed_seq = 0;
+    uint32_t              records = 0;
+
+    memset(&m_agg_flash_log, 0, sizeof(m_agg_flash_log));
+    m_agg_flash_log.blank_seq = UINT32_MAX;
+
+    err_code = nrf_fstorage_init(&m_agg_flash_log_fstorage, &nrf_fstorage_sd, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    // Every valid chunk belongs to the last lap of the ring, the newest one tells where writing goes on
+    // and the newest one replayed where replaying does
+    for (uint32_t slot = 0; slot < AGG_FLASH_LOG_CHUNK_COUNT; slot++)
+    {
+        agg_flash_log_chunk_read(slot, &chunk);
+        if (chunk.magic != AGG_FLASH_LOG_MAGIC || (chunk.seq % AGG_FLASH_LOG_CHUNK_COUNT) != slot)
+        {
+            continue;
+        }
+        if (!found || chunk.seq > last_seq)
+        {
+            last_seq = chunk.seq;
+        }
+        if (chunk.replayed != AGG_FLASH_LOG_ERASED)
+        {
+            if (!replayed_found || chunk.seq > last_replayed_seq)
+            {
+                last_replayed_seq = chunk.seq;
+            }
+            replayed_found = true;
+        }
+        else if (chunk.seq < first_seq)
+        {
+            first_seq = chunk.seq;
+        }
+        found = true;
+    }
+
+    if (found)
+    {
+        m_agg_flash_log.write_seq = last_seq + 1;
+        m_agg_flash_log.read_seq  = replayed_found ? (last_replayed_seq + 1) : first_seq;
+        if (m_agg_flash_log.read_seq > m_agg_flash_log.write_seq)
+        {
+            m_agg_flash_log.read_seq = m_agg_flash_log.write_seq;
+        }
+    }
+    // Slots after the newest chunk must be blank to be written, at a page start the erase sees to that
+    while ((m_agg_flash_log.write_seq % AGG_FLASH_LOG_CHUNKS_PER_PAGE) != 0 &&
+           !agg_flash_log_slot_blank(m_agg_flash_log.write_seq))
+    {
+        m_agg_flash_log.write_seq++;
+    }
+    m_agg_flash_log.marked_seq = m_agg_flash_log.read_seq;
+
+    for (uint32_t seq = m_agg_flash_log.read_seq; seq < m_agg_flash_log.write_seq; seq++)
+    {
+        agg_flash_log_chunk_read(seq, &chunk);
+        if (agg_flash_log_chunk_valid(&chunk, seq))
+        {
+            records += chunk.records;
+        }
+    }
+    m_agg_flash_log.replayed_word = 0;
+    m_agg_flash_log.ready = true;
+
+    UART_PRINTF_INFO("Flash log: %d records to replay, %d of %d chunks\r\n",
+                     records, m_agg_flash_log.write_seq - m_agg_flash_log.read_seq, AGG_FLASH_LOG_CHUNK_COUNT);
+}
+
+bool agg_flash_log_put(uint8_t const *p_data, uint16_t length)
+{
+    agg_flash_log_chunk_t *p_fill = &m_agg_flash_log.chunk[m_agg_flash_log.fill];
+
+    if (length == 0 || length > UINT8_MAX)
+    {
+        return false;
+    }
+
+    if ((p_fill->length + 1 + length) > AGG_FLASH_LOG_CHUNK_DATA_SIZE && m_agg_flash_log.fill_pos > 0)
+    {
+        // Drop what the phone already has, only the rest goes to flash
+        p_fill->length  -= m_agg_flash_log.fill_pos;
+        p_fill->records -= m_agg_flash_log.fill_pos_records;
+        memmove(p_fill->data, &p_fill->data[m_agg_flash_log.fill_pos], p_fill->length);
+        m_agg_flash_log.fill_pos = m_agg_flash_log.fill_pos_records = 0;
+    }
+
+    if ((p_fill->length + 1 + length) > AGG_FLASH_LOG_CHUNK_DATA_SIZE)
+    {
+        if (m_agg_flash_log.write_pending)
+        {
+            // Both chunks full, flash is busy or the log is full. Restarts a write that failed.
+            agg_flash_log_flush();
+            return false;
+        }
+        m_agg_flash_log.write_pending = true;
+        m_agg_flash_log.fill ^= 1;
+        p_fill = &m_agg_flash_log.chunk[m_agg_flash_log.fill];
+        p_fill->length = p_fill->records = 0;
+        agg_flash_log_flush();
+    }
+
+    p_fill->data[p_fill->length] = length;
+    memcpy(&p_fill->data[p_fill->length + 1], p_data, length);
+    p_fill->length += 1 + length;
+    p_fill->records++;
+    AGG_STATS_COUNT(AGG_STATS_CNT_FLASH_LOG_STORED);
+    return true;
+}
+
+bool agg_flash_log_peek(uint8_t const **pp_data, uint16_t *p_length)
+{
+    agg_flash_log_chunk_t *p_fill = &m_agg_flash_log.chunk[m_agg_flash_log.fill];
+
+    while (!m_agg_flash_log.replay_loaded && m_agg_flash_log.read_seq < m_agg_flash_log.write_seq)
+    {
+        agg_flash_log_chunk_read(m_agg_flash_log.read_seq, &m_agg_flash_log.replay);
+        if (agg_flash_log_chunk_valid(&m_agg_flash_log.replay, m_agg_flash_log.read_seq) &&
+            m_agg_flash_log.replay.length > 0)
+        {
+            m_agg_flash_log.replay_loaded = true;
+            m_agg_flash_log.replay_pos    = 0;
+        }
+        else
+        {
+            // Slot of a failed write
+            m_agg_flash_log.read_seq++;
+        }
+    }
+
+    if (m_agg_flash_log.replay_loaded)
+    {
+        *p_length = m_agg_flash_log.replay.data[m_agg_flash_log.replay_pos];
+        *pp_data  = &m_agg_flash_log.replay.data[m_agg_flash_log.replay_pos + 1];
+        return true;
+    }
+
+    // The chunk waiting for its slot comes before the filled one, the filled one can only
+    // be handed out from RAM once nothing is left in front of it
+    if (m_agg_flash_log.write_pending || m_agg_flash_log.fill_pos >= p_fill->length)
+    {
+        return false;
+    }
+    *p_length = p_fill->data[m_agg_flash_log.fill_pos];
+    *pp_data  = &p_fill->data[m_agg_flash_log.fill_pos + 1];
+    return true;
+}
+
+void agg_flash_log_pop(void)
+{
+    agg_flash_log_chunk_t *p_fill = &m_agg_flash_log.chunk[m_agg_flash_log.fill];
+
+    if (m_agg_flash_log.replay_loaded)
+    {
+        AGG_STATS_COUNT(AGG_STATS_CNT_FLASH_LOG_REPLAYED);
+        m_agg_flash_log.replay_pos += 1 + m_agg_flash_log.replay.data[m_agg_flash_log.replay_pos];
+        if (m_agg_flash_log.replay_pos >= m_agg_flash_log.replay.length)
+        {
+            m_agg_flash_log.replay_loaded = false;
+            m_agg_flash_log.read_seq++;
+            // Mark it, and a page may be free for a chunk waiting
+            agg_flash_log_flush();
+        }
+        return;
+    }
+
+    if (m_agg_flash_log.write_pending || m_agg_flash_log.fill_pos >= p_fill->length)
+    {
+        return;
+    }
+    AGG_STATS_COUNT(AGG_STATS_CNT_FLASH_LOG_REPLAYED);
+    m_agg_flash_log.fill_pos += 1 + p_fill->data[m_agg_flash_log.fill_pos];
+    m_agg_flash_log.fill_pos_records++;
+    if (m_agg_flash_log.fill_pos >= p_fill->length)
+    {
+        p_fill->length = p_fill->records = 0;
+        m_agg_flash_log.fill_pos = m_agg_flash_log.fill_pos_records = 0;
+    }
+}
+
+bool agg_flash_log_is_empty(void)
+{
+    return !m_agg_flash_log.replay_loaded && !m_agg_flash_log.write_pending &&
+           (m_agg_flash_log.read_seq == m_agg_flash_log.write_seq) &&
+           (m_agg_flash_log.chunk[m_agg_flash_log.fill].length == 0);
+}
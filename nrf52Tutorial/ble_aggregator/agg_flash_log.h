@@ -0,0 +1,55 @@
+#ifndef __AGG_FLASH_LOG_H
+#define __AGG_FLASH_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Store-and-forward log of phone records, for the records the RAM command buffer of app_aggregator.c
+// has no room for while the phone is away. A FIFO of records in a ring of flash pages below the
+// Thingy DB cache page; FLASH_SIZE in the SES projects stops the application below it.
+//
+// Records are collected in RAM chunks and written one chunk at a time, a chunk slot is written once
+// per lap of the ring and a page is erased only when the ring comes round to it again. A page whose
+// records have not all been replayed is never erased: when the ring is full new records are refused,
+// the oldest ones are kept. Replayed chunks are marked in flash, so a reset replays from the first
+// chunk not marked. Lost on a reset are the records still in RAM, at most two chunks.
+// Call from thread mode only, the fstorage events come through app_scheduler as well.
+//
+// Chunk slot, AGG_FLASH_LOG_CHUNK_SIZE bytes:
+//   word 0:        replayed, erased until the phone has all records of the chunk, then 0
+//   word 1:        sequence number, the chunk is in slot seq % AGG_FLASH_LOG_CHUNK_COUNT
+//   word 2:        data length in bytes, record count (16 bit each)
+//   word 3..:      records back to back, a length byte then the record
+//   last word:     magic, written last
+
+#ifndef AGG_FLASH_LOG_PAGES
+#if defined(NRF52840_XXAA)
+#define AGG_FLASH_LOG_PAGES             64      // 256 kB, about 15000 Thingy readings
+#else
+#define AGG_FLASH_LOG_PAGES             32      // 128 kB, about 7500 Thingy readings
+#endif
+#endif
+
+#define AGG_FLASH_LOG_PAGE_SIZE         0x1000
+
+#define AGG_FLASH_LOG_CHUNK_SIZE        256
+#define AGG_FLASH_LOG_CHUNK_DATA_SIZE   (AGG_FLASH_LOG_CHUNK_SIZE - 16)
+#define AGG_FLASH_LOG_CHUNK_COUNT       (AGG_FLASH_LOG_PAGES * AGG_FLASH_LOG_PAGE_SIZE / AGG_FLASH_LOG_CHUNK_SIZE)
+
+// Opens the flash pages and finds the records not replayed yet, call after the SoftDevice is enabled
+void agg_flash_log_init(void);
+
+// Appends a record (1 to 255 bytes), false if the log is full
+bool agg_flash_log_put(uint8_t const *p_data, uint16_t length);
+
+// Oldest record held, false if there is none or it is not readable yet (its chunk is being written).
+// The data stays valid until the next call to the log.
+bool agg_flash_log_peek(uint8_t const **pp_data, uint16_t *p_length);
+
+// Removes the record agg_flash_log_peek() returned
+void agg_flash_log_pop(void);
+
+// No records held, in flash or in RAM
+bool agg_flash_log_is_empty(void);
+
+#endif
@@ -0,0 +1,78 @@
+#include "agg_prof.h"
+#include "app_aggregator.h"
+#include <string.h>
+
+typedef struct
+{
+    uint32_t calls;
+    uint32_t max;
+    uint64_t sum;
+    uint16_t hist[AGG_PROF_HIST_BUCKETS];
+}agg_prof_probe_t;
+
+static const char *m_probe_name[AGG_PROF_END] =
+{
+    "ble_evt", "adv_report", "relay_adv", "hist_tick", "tes_c_evt", "phone_flush"
+};
+
+static agg_prof_probe_t m_probe[AGG_PROF_END];
+
+void agg_prof_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL  |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void agg_prof_record(uint8_t probe_id, uint32_t cycles)
+{
+    agg_prof_probe_t *p_probe;
+    uint32_t          bucket;
+
+    if(probe_id >= AGG_PROF_END)
+    {
+        return;
+    }
+    p_probe = &m_probe[probe_id];
+    p_probe->calls++;
+    p_probe->sum += cycles;
+    if(cycles > p_probe->max)
+    {
+        p_probe->max = cycles;
+    }
+
+    // Bits above bucket 0, one bucket per doubling
+    cycles /= AGG_PROF_BUCKET0_CYCLES;
+    bucket  = (cycles == 0) ? 0 : 32 - __CLZ(cycles);
+    if(bucket >= AGG_PROF_HIST_BUCKETS)
+    {
+        bucket = AGG_PROF_HIST_BUCKETS - 1;
+    }
+    if(p_probe->hist[bucket] < UINT16_MAX)
+    {
+        p_probe->hist[bucket]++;
+    }
+}
+
+void agg_prof_clear(void)
+{
+    memset(m_probe, 0, sizeof(m_probe));
+}
+
+void agg_prof_dump(void)
+{
+    uart_printf("\r\n------ Profile (cycles at 64 MHz, buckets from <1us doubling to >=1ms) ------\r\n");
+    uart_printf("Probe        Calls      Mean       Max  Buckets\r\n");
+    for(int i = 0; i < AGG_PROF_END; i++)
+    {
+        agg_prof_probe_t const *p_probe = &m_probe[i];
+        uint32_t mean = (p_probe->calls > 0) ? (uint32_t)(p_probe->sum / p_probe->calls) : 0;
+
+        uart_printf("%-11s %6u %9u %9u ", m_probe_name[i], (unsigned)p_probe->calls, (unsigned)mean, (unsigned)p_probe->max);
+        for(int b = 0; b < AGG_PROF_HIST_BUCKETS; b++)
+        {
+            uart_printf(" %u", (unsigned)p_probe->hist[b]);
+        }
+        uart_printf("\r\n");
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __AGG_PROF_H
+#define __AGG_PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nrf.h"
+
+// Cycle counts of the hot handlers, taken from DWT CYCCNT (64 MHz) at entry and exit.
+// A probe counts inclusive time: probes nested in it, and the interrupts (the SoftDevice, the UART)
+// that preempted it, are part of its cycles.
+// Histogram bucket b holds calls below AGG_PROF_BUCKET0_CYCLES << b, the last one the rest.
+#define AGG_PROF_HIST_BUCKETS   12
+#define AGG_PROF_BUCKET0_CYCLES 64      // 1 us, the last bucket starts at 1 ms
+
+#ifndef AGG_PROF_ENABLED
+#define AGG_PROF_ENABLED 1
+#endif
+
+// Keep in step with m_probe_name in agg_prof.c
+enum
+{
+    AGG_PROF_BLE_EVT,           // ble_evt_handler
+    AGG_PROF_ADV_REPORT,        // on_adv_report
+    AGG_PROF_RELAY_ADV,         // vf_relay_adv_data3
+    AGG_PROF_HIST_REFRESH,      // vf_refresh_history_buff_callback
+    AGG_PROF_TES_C_EVT,         // vf_tes_c_evt_handler
+    AGG_PROF_PHONE_FLUSH,       // main loop app_aggregator_flush_ble_commands()
+    AGG_PROF_END
+};
+
+// AGG_PROF_BEGIN declares the start count in the calling block, AGG_PROF_STOP must be in its scope
+#if AGG_PROF_ENABLED
+#define AGG_PROF_BEGIN(probe_id)    uint32_t agg_prof_start_ ## probe_id = DWT->CYCCNT
+#define AGG_PROF_STOP(probe_id)     agg_prof_record(probe_id, DWT->CYCCNT - agg_prof_start_ ## probe_id)
+#else
+#define AGG_PROF_BEGIN(probe_id)
+#define AGG_PROF_STOP(probe_id)
+#endif
+
+// Starts the DWT cycle counter
+void agg_prof_init(void);
+
+void agg_prof_record(uint8_t probe_id, uint32_t cycles);
+
+void agg_prof_clear(void);
+
+// Prints calls, mean, max and histogram of each probe with uart_printf
+void agg_prof_dump(void);
+
+#endif
@@ -0,0 +1,200 @@
+#include "agg_stats.h"
+#include "agg_trace.h"
+#include "app_aggregator.h"
+#include "app_util.h"
+#include "nrf.h"
+#include <string.h>
+
+#define AGG_STATS_MAGIC     0x53544132      // "STA2", changes with the layout of agg_stats_t
+
+typedef struct
+{
+    uint8_t  phy;
+    uint8_t  phy_changes;
+    uint8_t  connects;
+    int8_t   rssi_min;
+    int8_t   rssi_max;
+    int16_t  rssi_avg;          // 1/16 dBm, moving average over about 16 reports
+    uint16_t rssi_samples;
+}agg_stats_link_t;
+
+typedef struct
+{
+    uint32_t         magic;
+    uint32_t         counter[AGG_STATS_CNT_END];
+    uint16_t         hist[AGG_STATS_HIST_END][AGG_STATS_HIST_BUCKETS];
+    agg_stats_link_t link[AGG_STATS_LINK_COUNT];
+}agg_stats_t;
+
+// Bucket of a value: (value - offset) >> shift, clamped to the first and the last bucket
+typedef struct
+{
+    int16_t offset;
+    uint8_t shift;
+}agg_stats_hist_cfg_t;
+
+static const agg_stats_hist_cfg_t m_hist_cfg[AGG_STATS_HIST_END] =
+{
+    [AGG_STATS_HIST_RELAY_POOL] = {1, 1},       // 1-2, 3-4, ... 15-16 blocks
+    [AGG_STATS_HIST_CMD_BUF]    = {0, 8},       // 256 byte steps of the 2 kB buffer
+    [AGG_STATS_HIST_RSSI]       = {-100, 3},    // 8 dB steps, below -92 dBm to above -44 dBm
+};
+
+static agg_stats_t m_stats __attribute__((section(".non_init")));
+
+void agg_stats_init(void)
+{
+    // RESETREAS reads 0 after power-on and brownout, RAM is not to be trusted then
+    if((m_stats.magic != AGG_STATS_MAGIC) || (NRF_POWER->RESETREAS == 0))
+    {
+        agg_stats_clear();
+    }
+    m_stats.counter[AGG_STATS_CNT_BOOTS]++;
+}
+
+void agg_stats_clear(void)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.magic = AGG_STATS_MAGIC;
+}
+
+void agg_stats_count(uint8_t counter_id)
+{
+    if(counter_id < AGG_STATS_CNT_END)
+    {
+        m_stats.counter[counter_id]++;
+    }
+}
+
+void agg_stats_hist_add(uint8_t hist_id, int32_t value)
+{
+    int32_t bucket;
+
+    if(hist_id >= AGG_STATS_HIST_END)
+    {
+        return;
+    }
+    bucket = (value - m_hist_cfg[hist_id].offset) >> m_hist_cfg[hist_id].shift;
+    bucket = MAX(bucket, 0);
+    bucket = MIN(bucket, AGG_STATS_HIST_BUCKETS - 1);
+    if(m_stats.hist[hist_id][bucket] < UINT16_MAX)
+    {
+        m_stats.hist[hist_id][bucket]++;
+    }
+}
+
+void agg_stats_link_connect(uint16_t conn_handle, uint8_t phy)
+{
+    agg_stats_link_t *p_link;
+
+    if(conn_handle >= AGG_STATS_LINK_COUNT)
+    {
+        return;
+    }
+    // RSSI and PHY describe the latest connection, the connects pile up
+    p_link = &m_stats.link[conn_handle];
+    p_link->phy          = phy;
+    p_link->phy_changes  = 0;
+    p_link->rssi_samples = 0;
+    if(p_link->connects < UINT8_MAX)
+    {
+        p_link->connects++;
+    }
+}
+
+void agg_stats_link_phy(uint16_t conn_handle, uint8_t phy)
+{
+    agg_stats_link_t *p_link;
+
+    if(conn_handle >= AGG_STATS_LINK_COUNT)
+    {
+        return;
+    }
+    p_link = &m_stats.link[conn_handle];
+    if((p_link->phy != phy) && (p_link->phy_changes < UINT8_MAX))
+    {
+        p_link->phy_changes++;
+    }
+    p_link->phy = phy;
+}
+
+void agg_stats_link_rssi(uint16_t conn_handle, int8_t rssi)
+{
+    agg_stats_link_t *p_link;
+
+    agg_stats_hist_add(AGG_STATS_HIST_RSSI, rssi);
+    if(conn_handle >= AGG_STATS_LINK_COUNT)
+    {
+        return;
+    }
+    p_link = &m_stats.link[conn_handle];
+    if(p_link->rssi_samples == 0)
+    {
+        p_link->rssi_min = rssi;
+        p_link->rssi_max = rssi;
+        p_link->rssi_avg = rssi * 16;
+    }
+    else
+    {
+        p_link->rssi_min = MIN(p_link->rssi_min, rssi);
+        p_link->rssi_max = MAX(p_link->rssi_max, rssi);
+        p_link->rssi_avg += rssi - (p_link->rssi_avg >> 4);
+    }
+    if(p_link->rssi_samples < UINT16_MAX)
+    {
+        p_link->rssi_samples++;
+    }
+}
+
+uint32_t agg_stats_counter_get(uint8_t counter_id)
+{
+    return (counter_id < AGG_STATS_CNT_END) ? m_stats.counter[counter_id] : 0;
+}
+
+uint16_t agg_stats_serialize(uint8_t *p_buf, uint16_t max_len)
+{
+    uint8_t  snapshot[AGG_STATS_SERIALIZED_MAX];
+    uint16_t len = 4;
+    uint8_t  links = 0;
+
+    m_stats.counter[AGG_STATS_CNT_TRACE_DROPPED] = agg_trace_dropped_get();
+    m_stats.counter[AGG_STATS_CNT_UART_DROPPED]  = uart_printf_dropped_get();
+
+    snapshot[0] = AGG_STATS_FORMAT_VERSION;
+    snapshot[1] = AGG_STATS_CNT_END;
+    snapshot[2] = AGG_STATS_HIST_END;
+    for(int i = 0; i < AGG_STATS_CNT_END; i++)
+    {
+        len += uint32_encode(m_stats.counter[i], &snapshot[len]);
+    }
+    for(int i = 0; i < AGG_STATS_HIST_END; i++)
+    {
+        for(int b = 0; b < AGG_STATS_HIST_BUCKETS; b++)
+        {
+            len += uint16_encode(m_stats.hist[i][b], &snapshot[len]);
+        }
+    }
+    for(int i = 0; i < AGG_STATS_LINK_COUNT; i++)
+    {
+        agg_stats_link_t const *p_link = &m_stats.link[i];
+
+        if(p_link->connects == 0)
+        {
+            continue;
+        }
+        snapshot[len++] = i;
+        snapshot[len++] = p_link->phy;
+        snapshot[len++] = p_link->phy_changes;
+        snapshot[len++] = p_link->connects;
+        snapshot[len++] = (uint8_t)p_link->rssi_min;
+        snapshot[len++] = (uint8_t)p_link->rssi_max;
+        snapshot[len++] = (uint8_t)(int8_t)(p_link->rssi_avg / 16);
+        len += uint16_encode(p_link->rssi_samples, &snapshot[len]);
+        links++;
+    }
+    snapshot[3] = links;
+
+    len = MIN(len, max_len);
+    memcpy(p_buf, snapshot, len);
+    return len;
+}
@@ -0,0 +1,102 @@
+#ifndef __AGG_STATS_H
+#define __AGG_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Counters, histograms and per link RSSI/PHY of the aggregator, updated from the radio paths.
+// They live in .non_init RAM: a soft reset (fault, watchdog) keeps them, power-on clears them.
+// Updates are plain read-modify-writes, a count may be lost when two priorities hit the same one.
+//
+// Serialized snapshot (agg_stats_serialize), multi-byte values LSB first:
+//   byte 0:        AGG_STATS_FORMAT_VERSION
+//   byte 1:        counter count (c), AGG_STATS_CNT_END
+//   byte 2:        histogram count (h), AGG_STATS_HIST_END
+//   byte 3:        link count (l), only links seen since the stats were cleared
+//   byte 4..:      c counters, 32 bit each
+//   then:          h histograms, AGG_STATS_HIST_BUCKETS buckets of 16 bit each (saturating)
+//   then:          l links: conn handle, PHY, PHY changes, connects, RSSI min, max, average, samples (16 bit)
+#define AGG_STATS_FORMAT_VERSION    1
+#define AGG_STATS_HIST_BUCKETS      8
+#define AGG_STATS_LINK_SIZE         9
+
+#ifndef AGG_STATS_ENABLED
+#define AGG_STATS_ENABLED 1
+#endif
+
+// conn handles below this get link statistics
+#ifndef AGG_STATS_LINK_COUNT
+#define AGG_STATS_LINK_COUNT 20
+#endif
+
+// Keep in step with the phone app, new counters go at the end
+enum
+{
+    AGG_STATS_CNT_BOOTS,                // starts since the stats were cleared
+    AGG_STATS_CNT_CMD_BUF_DROP,         // phone records cmd_buffer_put() could not take
+    AGG_STATS_CNT_PHONE_TX,             // notifications sent to the phone
+    AGG_STATS_CNT_PHONE_TX_RETRY,       // notifications the SoftDevice refused, sent again later
+    AGG_STATS_CNT_RELAY_ADDED,          // relay records queued for advertising
+    AGG_STATS_CNT_RELAY_FULL,           // relay records dropped, pool full
+    AGG_STATS_CNT_RELAY_INVALID,        // relay records dropped, bad size
+    AGG_STATS_CNT_RELAY_PROCESSED,      // relay records for this cluster head
+    AGG_STATS_CNT_VALIDATE_NEW,         // relay records not seen before
+    AGG_STATS_CNT_VALIDATE_HIST_HIT,    // relay records found in the history
+    AGG_STATS_CNT_VALIDATE_POOL_HIT,    // relay records found in the relay pool
+    AGG_STATS_CNT_LINK_LIST_FULL,       // connects the link list had no room for
+    AGG_STATS_CNT_CONN_HANDLE_CONFLICT, // connects on a conn handle already listed
+    AGG_STATS_CNT_CONN_HANDLE_NOT_FOUND,// disconnects of a conn handle not listed
+    AGG_STATS_CNT_TRACE_DROPPED,        // agg_trace records lost, read at snapshot time
+    AGG_STATS_CNT_UART_DROPPED,         // uart_printf bytes lost, read at snapshot time
+    AGG_STATS_CNT_FLASH_LOG_STORED,     // phone records put in the flash log
+    AGG_STATS_CNT_FLASH_LOG_REPLAYED,   // phone records taken back out of it
+    AGG_STATS_CNT_FLASH_LOG_WRITE_RETRY,// flash log chunks written again in the next slot
+    AGG_STATS_CNT_END
+};
+
+enum
+{
+    AGG_STATS_HIST_RELAY_POOL,          // relay pool blocks used, per block queued
+    AGG_STATS_HIST_CMD_BUF,             // phone buffer bytes used, per record queued
+    AGG_STATS_HIST_RSSI,                // link RSSI, per RSSI report
+    AGG_STATS_HIST_END
+};
+
+#define AGG_STATS_SERIALIZED_MAX    (4 + AGG_STATS_CNT_END * 4 + AGG_STATS_HIST_END * AGG_STATS_HIST_BUCKETS * 2 + \
+                                     AGG_STATS_LINK_COUNT * AGG_STATS_LINK_SIZE)
+
+#if AGG_STATS_ENABLED
+#define AGG_STATS_COUNT(counter_id)             agg_stats_count(counter_id)
+#define AGG_STATS_HIST(hist_id, value)          agg_stats_hist_add(hist_id, value)
+#define AGG_STATS_LINK_CONNECT(conn_handle, phy) agg_stats_link_connect(conn_handle, phy)
+#define AGG_STATS_LINK_PHY(conn_handle, phy)    agg_stats_link_phy(conn_handle, phy)
+#define AGG_STATS_LINK_RSSI(conn_handle, rssi)  agg_stats_link_rssi(conn_handle, rssi)
+#else
+#define AGG_STATS_COUNT(counter_id)
+#define AGG_STATS_HIST(hist_id, value)
+#define AGG_STATS_LINK_CONNECT(conn_handle, phy)
+#define AGG_STATS_LINK_PHY(conn_handle, phy)
+#define AGG_STATS_LINK_RSSI(conn_handle, rssi)
+#endif
+
+// Call before anything counts, keeps the stats of a soft reset
+void agg_stats_init(void);
+
+void agg_stats_clear(void);
+
+void agg_stats_count(uint8_t counter_id);
+
+void agg_stats_hist_add(uint8_t hist_id, int32_t value);
+
+void agg_stats_link_connect(uint16_t conn_handle, uint8_t phy);
+
+void agg_stats_link_phy(uint16_t conn_handle, uint8_t phy);
+
+void agg_stats_link_rssi(uint16_t conn_handle, int8_t rssi);
+
+uint32_t agg_stats_counter_get(uint8_t counter_id);
+
+// Writes a snapshot as laid out above, cut to max_len. Returns the bytes written.
+uint16_t agg_stats_serialize(uint8_t *p_buf, uint16_t max_len);
+
+#endif
@@ -0,0 +1,64 @@
+#include "agg_trace.h"
+#include "app_aggregator.h"
+#include "app_timer.h"
+#include "app_util.h"
+#include <string.h>
+
+#if (AGG_TRACE_BACKEND == AGG_TRACE_BACKEND_RTT)
+#include "SEGGER_RTT.h"
+
+static char m_trace_rtt_buf[AGG_TRACE_RTT_BUF_SIZE];
+#endif
+
+static volatile uint32_t m_trace_dropped = 0;
+
+void agg_trace_init(void)
+{
+#if (AGG_TRACE_BACKEND == AGG_TRACE_BACKEND_RTT)
+    // Skip mode drops a whole record when the host falls behind, it never blocks
+    SEGGER_RTT_ConfigUpBuffer(AGG_TRACE_RTT_CHANNEL, "AggTrace", m_trace_rtt_buf, sizeof(m_trace_rtt_buf),
+                              SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+#endif
+}
+
+void agg_trace_put(uint8_t event_id, const uint8_t *p_head, uint8_t head_len, const uint8_t *p_data, uint8_t data_len)
+{
+    uint8_t  record[AGG_TRACE_HEADER_LENGTH + AGG_TRACE_PAYLOAD_MAX];
+    uint32_t tick = app_timer_cnt_get();
+    uint8_t  len;
+    bool     written;
+
+    head_len = MIN(head_len, AGG_TRACE_PAYLOAD_MAX);
+    data_len = MIN(data_len, AGG_TRACE_PAYLOAD_MAX - head_len);
+    len      = head_len + data_len;
+
+    record[0] = AGG_TRACE_SYNC;
+    record[1] = event_id;
+    record[2] = len;
+    record[3] = (uint8_t)tick;
+    record[4] = (uint8_t)(tick >> 8);
+    record[5] = (uint8_t)(tick >> 16);
+    if (head_len > 0)
+    {
+        memcpy(&record[AGG_TRACE_HEADER_LENGTH], p_head, head_len);
+    }
+    if (data_len > 0)
+    {
+        memcpy(&record[AGG_TRACE_HEADER_LENGTH + head_len], p_data, data_len);
+    }
+
+#if (AGG_TRACE_BACKEND == AGG_TRACE_BACKEND_RTT)
+    written = (SEGGER_RTT_Write(AGG_TRACE_RTT_CHANNEL, record, AGG_TRACE_HEADER_LENGTH + len) != 0);
+#else
+    written = uart_log_write(record, AGG_TRACE_HEADER_LENGTH + len);
+#endif
+    if (!written)
+    {
+        m_trace_dropped++;
+    }
+}
+
+uint32_t agg_trace_dropped_get(void)
+{
+    return m_trace_dropped;
+}
@@ -0,0 +1,71 @@
+#ifndef __AGG_TRACE_H
+#define __AGG_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Binary trace records, replacing the per-byte text dumps in the radio paths.
+// Record layout (decoded by agg_trace_decode.py):
+//   byte 0:        AGG_TRACE_SYNC
+//   byte 1:        event id, AGG_TRACE_EVT_*
+//   byte 2:        payload length (n), at most AGG_TRACE_PAYLOAD_MAX
+//   byte 3..5:     app_timer tick (RTC1, 24 bit), LSB first
+//   byte 6..n+5:   payload
+// uart_printf text is plain ASCII, so records can share the UART with it.
+#define AGG_TRACE_SYNC          0xA5
+#define AGG_TRACE_HEADER_LENGTH 6
+#define AGG_TRACE_PAYLOAD_MAX   32
+
+#define AGG_TRACE_BACKEND_UART  0   // through the uart_printf ring, drained by the main loop
+#define AGG_TRACE_BACKEND_RTT   1   // RTT up buffer AGG_TRACE_RTT_CHANNEL, read by the debugger
+
+#ifndef AGG_TRACE_ENABLED
+#define AGG_TRACE_ENABLED 1
+#endif
+
+#ifndef AGG_TRACE_BACKEND
+#define AGG_TRACE_BACKEND AGG_TRACE_BACKEND_UART
+#endif
+
+// Channel 0 belongs to the NRF_LOG RTT backend
+#define AGG_TRACE_RTT_CHANNEL   1
+#define AGG_TRACE_RTT_BUF_SIZE  1024
+
+// Keep in step with EVENTS in agg_trace_decode.py
+enum
+{
+    AGG_TRACE_EVT_ADV_USERDATA = 1, // rssi, relay record
+    AGG_TRACE_EVT_RELAY_REFLECT,    // source, destination, packet id
+    AGG_TRACE_EVT_RELAY_PROCESS,    // source, destination, packet id
+    AGG_TRACE_EVT_RELAY_REDUNDANT,  // source, destination, packet id
+    AGG_TRACE_EVT_RELAY_ADD,        // block, blocks used, relay record
+    AGG_TRACE_EVT_RELAY_DELETE,     // block, new head, blocks used, moved to history
+    AGG_TRACE_EVT_RELAY_TX,         // adv data length, blocks used, alloc count, fail count
+    AGG_TRACE_EVT_VALIDATE,         // source, destination, packet id, result (16 bit, LSB first)
+    AGG_TRACE_EVT_HIST_ADD,         // source, destination, packet id, slot
+    AGG_TRACE_EVT_HIST_TICK,        // history clock in seconds (32 bit, LSB first)
+    AGG_TRACE_EVT_THINGY_DATA,      // relay record built from the local Thingy
+    AGG_TRACE_EVT_PHONE_TX,         // command queued for the phone
+    AGG_TRACE_EVT_END
+};
+
+// AGG_TRACE2 appends p_data after a few header bytes, so callers need no staging buffer
+#if AGG_TRACE_ENABLED
+#define AGG_TRACE(event_id, p_head, head_len)                    agg_trace_put(event_id, p_head, head_len, NULL, 0)
+#define AGG_TRACE2(event_id, p_head, head_len, p_data, data_len) agg_trace_put(event_id, p_head, head_len, p_data, data_len)
+#else
+// The staging buffers of the callers stay used, so they build without warnings
+#define AGG_TRACE(event_id, p_head, head_len)                    ((void)(p_head))
+#define AGG_TRACE2(event_id, p_head, head_len, p_data, data_len) ((void)(p_head), (void)(p_data))
+#endif
+
+void agg_trace_init(void);
+
+// The payload is p_head followed by p_data, cut to AGG_TRACE_PAYLOAD_MAX. Safe to call from interrupt context.
+void agg_trace_put(uint8_t event_id, const uint8_t *p_head, uint8_t head_len, const uint8_t *p_data, uint8_t data_len);
+
+// Records lost because the backend buffer was full
+uint32_t agg_trace_dropped_get(void);
+
+#endif
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Decode the ble_aggregator trace stream (agg_trace.h).
+
+The UART carries uart_printf text and binary trace records mixed together.
+Text is printed as it is, records are printed one per line. An RTT capture
+of channel 1 (for example from JLinkRTTLogger) holds only records.
+
+    agg_trace_decode.py /dev/ttyACM0            # live, needs pyserial
+    agg_trace_decode.py capture.bin             # a saved UART or RTT capture
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+SYNC = 0xA5
+HEADER_LENGTH = 6
+PAYLOAD_MAX = 32
+TICK_HZ = 32768        # APP_TIMER_CONFIG_RTC_FREQUENCY 0
+TICK_WRAP = 1 << 24
+
+
+def ids(p):
+    return "src %d dst %d pkt %d" % (p[0], p[1], p[2])
+
+
+def record(p):
+    return " ".join("%d" % b for b in p)
+
+
+def adv_userdata(p):
+    return "rssi %d, %s" % (struct.unpack("b", p[:1])[0], record(p[1:]))
+
+
+def relay_add(p):
+    return "block %d, used %d, %s" % (p[0], p[1], record(p[2:]))
+
+
+def relay_delete(p):
+    return "block %d, head %d, used %d%s" % (p[0], p[1], p[2], ", to history" if p[3] else "")
+
+
+def relay_tx(p):
+    return "adv len %d, used %d, alloc %d, fail %d" % tuple(p[:4])
+
+
+def validate(p):
+    result = struct.unpack("<H", p[3:5])[0]
+    if result == 0xFFFF:
+        verdict = "new"
+    elif result >= 8000:
+        verdict = "history slot %d" % (result - 8000)
+    else:
+        verdict = "queued in block %d" % result
+    return "%s, %s" % (ids(p), verdict)
+
+
+def hist_add(p):
+    return "%s, slot %d" % (ids(p), p[3])
+
+
+def hist_tick(p):
+    return "%d s" % struct.unpack("<I", p[:4])[0]
+
+
+# Same order as the AGG_TRACE_EVT_* enum
+EVENTS = {
+    1: ("ADV_USERDATA", adv_userdata),
+    2: ("RELAY_REFLECT", ids),
+    3: ("RELAY_PROCESS", ids),
+    4: ("RELAY_REDUNDANT", ids),
+    5: ("RELAY_ADD", relay_add),
+    6: ("RELAY_DELETE", relay_delete),
+    7: ("RELAY_TX", relay_tx),
+    8: ("VALIDATE", validate),
+    9: ("HIST_ADD", hist_add),
+    10: ("HIST_TICK", hist_tick),
+    11: ("THINGY_DATA", record),
+    12: ("PHONE_TX", record),
+}
+
+
+class Decoder:
+    def __init__(self, out):
+        self.out = out
+        self.buf = bytearray()
+        self.last_tick = None
+        self.time = 0.0
+
+    def timestamp(self, tick):
+        # The RTC counter is 24 bit, keep a running time across wraps
+        if self.last_tick is not None:
+            self.time += ((tick - self.last_tick) % TICK_WRAP) / TICK_HZ
+        self.last_tick = tick
+        return self.time
+
+    def feed(self, data):
+        self.buf.extend(data)
+        while self.buf:
+            start = self.buf.find(SYNC)
+            if start < 0:
+                self.text(self.buf)
+                self.buf.clear()
+                return
+            if start > 0:
+                self.text(self.buf[:start])
+                del self.buf[:start]
+            if len(self.buf) < HEADER_LENGTH:
+                return
+            event_id, length = self.buf[1], self.buf[2]
+            if event_id not in EVENTS or length > PAYLOAD_MAX:
+                # Not a record, a stray byte in the text
+                self.text(self.buf[:1])
+                del self.buf[:1]
+                continue
+            if len(self.buf) < HEADER_LENGTH + length:
+                return
+            tick = self.buf[3] | (self.buf[4] << 8) | (self.buf[5] << 16)
+            payload = bytes(self.buf[HEADER_LENGTH:HEADER_LENGTH + length])
+            del self.buf[:HEADER_LENGTH + length]
+            name, fmt = EVENTS[event_id]
+            try:
+                detail = fmt(payload)
+            except (IndexError, struct.error):
+                detail = "short payload: " + record(payload)
+            self.out.write("[%10.4f] %-16s %s\n" % (self.timestamp(tick), name, detail))
+
+    def text(self, data):
+        self.out.write(data.decode("ascii", "replace"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="serial port or capture file")
+    parser.add_argument("-b", "--baud", type=int, default=460800, help="serial baud rate (default %(default)s)")
+    args = parser.parse_args()
+
+    decoder = Decoder(sys.stdout)
+    if os.path.isfile(args.input):
+        with open(args.input, "rb") as f:
+            decoder.feed(f.read())
+        return
+
+    import serial
+    port = serial.Serial(args.input, args.baud, timeout=0.1)
+    try:
+        while True:
+            data = port.read(256)
+            if data:
+                decoder.feed(data)
+                sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
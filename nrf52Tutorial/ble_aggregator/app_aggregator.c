@@ -1,16 +1,25 @@
 #include "app_aggregator.h"
+#include "agg_trace.h"
+#include "agg_stats.h"
+#include "agg_flash_log.h"
+#include "ble_gattc_queue.h"
+#include "relay_codec.h"
+#include "app_util.h"
+#include "app_util_platform.h"
 #include "nrf_log.h"
 #include <string.h>
 #include <stdio.h>
 
 #define BLE_AGG_CMD_BUFFER_SIZE 2048
 #define BLE_AGG_CMD_MAX_LENGTH  64
+#define BLE_AGG_CMD_BATCH_HEADER_LENGTH 1
+#define BLE_AGG_CMD_STATS_HEADER_LENGTH 3
 
 enum {APP_AGG_ERROR_CONN_HANDLE_CONFLICT = 1, APP_AGG_ERROR_LINK_INFO_LIST_FULL, APP_AGG_ERROR_CONN_HANDLE_NOT_FOUND};
 
 //vinh ver2 : this enum has been moved to app_aggregator.h
 //enum TX_COMMANDS {AGG_BLE_LINK_CONNECTED = 1, AGG_BLE_LINK_DISCONNECTED, AGG_BLE_LINK_DATA_UPDATE, AGG_BLE_LED_BUTTON_PRESSED};
-//enum TX_COMMANDS {AGG_BLE_LINK_CONNECTED = 1, AGG_BLE_LINK_DISCONNECTED, AGG_BLE_LINK_DATA_UPDATE, AGG_BLE_LED_BUTTON_PRESSED,\
+//enum TX_COMMANDS {AGG_BLE_LINK_CONNECTED = 1, AGG_BLE_LINK_DISCONNECTED, AGG_BLE_LINK_DATA_UPDATE, AGG_BLE_LED_BUTTON_PRESSED,
                // AGG_NODE_LINK_CONNECTED, AGG_NODE_LINK_DISCONNECTED, AGG_NODE_LINK_DATA_UPDATE, AGG_NODE_LED_BUTTON_PRESSED};
 enum {APP_AGG_DEVICE_TYPE_UNKNOWN, APP_AGG_DEVICE_TYPE_BLINKY, APP_AGG_DEVICE_TYPE_THINGY, APP_AGG_DEVICE_TYPE_END};
 //static char *device_type_string_list[] = {"Unknown", "Blinky", "Thingy"};
@@ -23,141 +32,327 @@ static ble_agg_cfg_service_t *m_ble_service;
 
 static uint8_t ble_cmd_buf[BLE_AGG_CMD_BUFFER_SIZE] = {0};
 static uint32_t ble_cmd_buf_in_ptr = 0, ble_cmd_buf_out_ptr = 0;
+static uint32_t ble_cmd_buf_used = 0;           // bytes held, including length bytes and a skipped tail
+static uint32_t ble_cmd_buf_records = 0;
+static uint32_t ble_cmd_buf_high_water = 0;
+static uint32_t ble_cmd_buf_drop_count = 0;
 
 static link_info_t m_link_info_list[MAX_NUMBER_OF_LINKS];
+// One bit per m_link_info_list entry with a data update not yet queued for the phone
+static uint32_t m_link_dirty_mask[(MAX_NUMBER_OF_LINKS + 31) / 32];
+// Notifications sent while a link was dirty, see LINK_DIRTY_MAX_WAIT
+static uint32_t m_link_dirty_wait = 0;
+// One bit per m_link_info_list entry that is not in use
+static uint32_t m_link_free_mask[(MAX_NUMBER_OF_LINKS + 31) / 32];
+// m_link_info_list index for each conn_handle below APP_AGG_CONN_HANDLE_MAP_SIZE
+#define LINK_INDEX_INVALID 0xFF
+#if (MAX_NUMBER_OF_LINKS >= LINK_INDEX_INVALID)
+#error "MAX_NUMBER_OF_LINKS does not fit the conn_handle map"
+#endif
+static uint8_t m_conn_handle_to_index[APP_AGG_CONN_HANDLE_MAP_SIZE];
 static uint32_t m_error_flags = 0;
 
 static volatile bool m_schedule_device_list_print = true;
 
+// Largest notification payload on the phone link, follows the negotiated ATT MTU
+static uint16_t m_att_payload_max_length = BLE_GATT_ATT_MTU_DEFAULT - OPCODE_LENGTH - HANDLE_LENGTH;
+static bool     m_batch_mode_enabled = AGG_BLE_BATCH_DEFAULT_ENABLED;
+
+// Relayed Thingies as the sink sees them, per source cluster and local id. In snapshot mode only the
+// latest reading of each is kept, the changed ones go to the phone once per snapshot period.
+// Every local id a compact record can carry has an entry, about 1 kB per cluster. Only the sink
+// build gets a table for every cluster of the network, the other cluster heads do not hand relayed
+// readings on
+#if (CLUSTER_ID == SINK_ID)
+#define AGG_RELAY_CLUSTER_COUNT     AGG_NETWORK_CLUSTER_COUNT
+#else
+#define AGG_RELAY_CLUSTER_COUNT     1
+#endif
+// RAM the table may take. On an nRF52832 it is under 30 % of the s132 application RAM, which also
+// holds the command buffer and the flash log chunks; 11 clusters, the default network, take 11 kB
+#ifndef AGG_SINK_TABLE_RAM_MAX
+#ifdef NRF52832_XXAA
+#define AGG_SINK_TABLE_RAM_MAX      0x3000
+#else
+#define AGG_SINK_TABLE_RAM_MAX      0x10000
+#endif
+#endif
+#define AGG_RELAY_LOCAL_ID_COUNT    (RELAY_CODEC_LOCAL_ID_MAX + 1)
+#define AGG_SINK_ENTRY_COUNT        (AGG_RELAY_CLUSTER_COUNT * AGG_RELAY_LOCAL_ID_COUNT)
+typedef struct
+{
+    relay_codec_ref_t     ref;          // keyframe of the compact readings
+    relay_codec_reading_t reading;      // latest reading
+    uint8_t               hops;
+    bool                  valid;        // reading holds data
+}agg_sink_entry_t;
+static agg_sink_entry_t m_sink_table[AGG_RELAY_CLUSTER_COUNT][AGG_RELAY_LOCAL_ID_COUNT];
+STATIC_ASSERT(sizeof(m_sink_table) <= AGG_SINK_TABLE_RAM_MAX);
+static uint32_t m_sink_dirty_mask[(AGG_SINK_ENTRY_COUNT + 31) / 32];
+static bool     m_sink_snapshot_enabled = false;
+static bool     m_sink_snapshot_due = false;
+static uint32_t m_sink_readings = 0;            // readings received
+static uint32_t m_sink_records = 0;             // phone records they turned into
+static uint32_t m_relay_readings_dropped = 0;   // deltas on a keyframe the sink missed
+
 static uint16_t device_list_search(uint16_t conn_handle);
 static uint16_t device_list_find_available(void);
 static void device_connected(uint16_t conn_handle, connected_device_info_t *con_dev_info);
 static void device_disconnected(uint16_t conn_handle);
+static void link_dirty_set(uint16_t device_index);
+static void link_dirty_clear(uint16_t device_index);
+static void link_index_map(uint16_t conn_handle, uint16_t device_index);
 static bool cmd_buffer_put(uint8_t *data, uint16_t length);
-/*static bool cmd_buffer_put(uint8_t *data, uint16_t length)
+static bool cmd_buffer_log_put(uint8_t *data, uint16_t length);
+
+//vinh
+//put data into buffer to send to phone 
+// records are packed back to back in "cmd buffer" @ref ble_cmd_buf
+// length: ble_cmd_buf[ble_cmd_buf_in_ptr+0]
+//data from: ble_cmd_buf[ble_cmd_buf_in_ptr+1 -> length]
+//update  new ble_cmd_buf_in_ptr= current ble_cmd_buf_in_ptr + 1 + length
+//a record never wraps: when it does not fit in the tail, a 0 length byte marks the
+//tail as unused and the record starts again at addr 0, so get/peek can hand out a pointer
+//puts come from the BLE event handlers and gets from the main loop, the indexes and counts
+//are only touched in a critical region so it also holds when the handlers run in interrupt context
+//the buffer is filled up to limit, see CMD_BUFFER_LOG_FILL
+
+static bool cmd_buffer_ram_put(uint8_t const *data, uint16_t length, uint32_t limit)
 {
-    if(length > BLE_AGG_CMD_MAX_LENGTH) return false;
+    uint32_t record_size = length + 1;
+    uint32_t tail_size;
+    uint32_t skip_size = 0;
+    bool     queued = false;
+
+    CRITICAL_REGION_ENTER();
+    tail_size = BLE_AGG_CMD_BUFFER_SIZE - ble_cmd_buf_in_ptr;
+    if(record_size > tail_size)
+    {
+        // Does not fit before the end of the buffer, skip the tail and wrap to 0
+        skip_size = tail_size;
+    }
     
-    if(ble_cmd_buf_out_ptr <= ble_cmd_buf_in_ptr)
+    // Buffer full unless this holds
+    if((ble_cmd_buf_used + skip_size + record_size) <= limit)
     {
-        if(length < (BLE_AGG_CMD_BUFFER_SIZE - ble_cmd_buf_in_ptr - 1))
+        if(skip_size > 0)
         {
-            ble_cmd_buf[ble_cmd_buf_in_ptr++] = length;
-            memcpy(&ble_cmd_buf[ble_cmd_buf_in_ptr], data, length);
-            ble_cmd_buf_in_ptr += length;
             ble_cmd_buf[ble_cmd_buf_in_ptr] = 0;
+            ble_cmd_buf_in_ptr = 0;
         }
-        else if(ble_cmd_buf_out_ptr > (length + 1))
-        {          
-            ble_cmd_buf[0] = length;
-            memcpy(&ble_cmd_buf[1], data, length);
-            ble_cmd_buf[length + 1] = 0;
-            ble_cmd_buf_in_ptr = length + 1;
-        }
-        else return false;
-    }
-    else
-    {
-        if((length + 1) < (ble_cmd_buf_out_ptr - ble_cmd_buf_in_ptr))
+        
+        ble_cmd_buf[ble_cmd_buf_in_ptr] = length;
+        memcpy(&ble_cmd_buf[ble_cmd_buf_in_ptr + 1], data, length);
+        ble_cmd_buf_in_ptr = (ble_cmd_buf_in_ptr + record_size) % BLE_AGG_CMD_BUFFER_SIZE;
+        ble_cmd_buf_used += skip_size + record_size;
+        ble_cmd_buf_records++;
+        
+        if(ble_cmd_buf_used > ble_cmd_buf_high_water)
         {
-            ble_cmd_buf[ble_cmd_buf_in_ptr++] = length;
-            memcpy(&ble_cmd_buf[ble_cmd_buf_in_ptr], data, length);
-            ble_cmd_buf_in_ptr += length;
-            ble_cmd_buf[ble_cmd_buf_in_ptr] = 0;            
+            ble_cmd_buf_high_water = ble_cmd_buf_used;
         }
-        else return false;
+        AGG_STATS_HIST(AGG_STATS_HIST_CMD_BUF, ble_cmd_buf_used);
+        queued = true;
     }
-    //NRF_LOG_INFO("BPUT: In: %i, Out: %i\r\n", ble_cmd_buf_in_ptr, ble_cmd_buf_out_ptr);
-    return true;
-}*/
+    CRITICAL_REGION_EXIT();
 
-//vinh
-//put data into buffer to send to phone 
-// in "cmd buffer" @ref ble_cmd_buf[ble_cmd_buf_in_ptr]
-// length: ble_cmd_buf[ble_cmd_buf_in_ptr+0]
-//data from: ble_cmd_buf[ble_cmd_buf_in_ptr+1 -> length]
-//update  new ble_cmd_buf_in_ptr= current ble_cmd_buf_in_ptr +64
-//start at addr 0x64, max at 2048-64
+    return queued;   
+}
+
+//sensor records and the flash log backlog fill the RAM buffer up to here, the rest is kept for
+//the live link state. the log is not pumped while a link is dirty, so a link update waits for at
+//most this much backlog and not for the whole log, see app_aggregator_flush_ble_commands()
+#define CMD_BUFFER_LOG_FILL     (BLE_AGG_CMD_BUFFER_SIZE / 2)
 
+//the sensor records put while a link is dirty keep the buffer from draining when they come in as
+//fast as the phone takes them. after this many notifications the dirty links are queued behind them
+#define LINK_DIRTY_MAX_WAIT     8
 
+static bool cmd_buffer_drop(void)
+{
+    ble_cmd_buf_drop_count++;
+    AGG_STATS_COUNT(AGG_STATS_CNT_CMD_BUF_DROP);
+    return false;
+}
 
+//live state: link, LED and stats records. only the latest state matters, so it goes straight to
+//the RAM buffer and is not logged; the link state is sent again to the next phone, and the links
+//still dirty are put again on the next flush
 static bool cmd_buffer_put(uint8_t *data, uint16_t length)
 {
-    if(length > BLE_AGG_CMD_MAX_LENGTH) return false;
-    
-    uint32_t in_ptr_new_pos = (ble_cmd_buf_in_ptr + BLE_AGG_CMD_MAX_LENGTH) % BLE_AGG_CMD_BUFFER_SIZE;
-    
-    if(in_ptr_new_pos == ble_cmd_buf_out_ptr)
+    if(length == 0 || length > BLE_AGG_CMD_MAX_LENGTH)
     {
-        // Buffer full, exit
-        return false;
+        return cmd_buffer_drop();
     }
-    
-    ble_cmd_buf[ble_cmd_buf_in_ptr] = length;
-    memcpy(&ble_cmd_buf[ble_cmd_buf_in_ptr + 1], data, length);
-    ble_cmd_buf_in_ptr = in_ptr_new_pos;
-
-    return true;   
+    return cmd_buffer_ram_put(data, length, BLE_AGG_CMD_BUFFER_SIZE) || cmd_buffer_drop();
 }
 
-static bool cmd_buffer_get(uint8_t ** data_ptr, uint16_t * length_ptr)
+//time series: sensor readings, and in snapshot mode the snapshots of them, the phone wants every
+//one of them. those the RAM buffer has no
+//room for, while the phone is away or slow, go to the flash log (agg_flash_log.h). Once the log
+//holds any, newer ones queue behind them there, so the phone gets them in order.
+static bool cmd_buffer_log_put(uint8_t *data, uint16_t length)
 {
-    uint32_t out_ptr_new_pos = (ble_cmd_buf_out_ptr + BLE_AGG_CMD_MAX_LENGTH) % BLE_AGG_CMD_BUFFER_SIZE;
-    
-    if(ble_cmd_buf_out_ptr == ble_cmd_buf_in_ptr)
+    if(length == 0 || length > BLE_AGG_CMD_MAX_LENGTH)
     {
-        // Buffer empty, return false
-        return false;
+        return cmd_buffer_drop();
     }
 
-    *data_ptr = &ble_cmd_buf[ble_cmd_buf_out_ptr + 1];
-    *length_ptr = ble_cmd_buf[ble_cmd_buf_out_ptr];
-    ble_cmd_buf_out_ptr = out_ptr_new_pos;
+    if(agg_flash_log_is_empty() && cmd_buffer_ram_put(data, length, CMD_BUFFER_LOG_FILL))
+    {
+        return true;
+    }
+    // RAM buffer and flash log full otherwise
+    return agg_flash_log_put(data, length) || cmd_buffer_drop();
+}
 
-    //NRF_LOG_INFO("BGET: In: %i, Out: %i\r\n", ble_cmd_buf_in_ptr, ble_cmd_buf_out_ptr);
-    return true;
+//refill the RAM buffer from the flash log, the batches sent from it carry the log to the phone
+static void cmd_buffer_log_pump(void)
+{
+    uint8_t const *record_ptr;
+    uint16_t       record_length;
+
+    while(agg_flash_log_peek(&record_ptr, &record_length))
+    {
+        if(!cmd_buffer_ram_put(record_ptr, record_length, CMD_BUFFER_LOG_FILL)) break;
+        agg_flash_log_pop();
+    }
 }
 
-static void cmd_buffer_flush()
+//step over a wrap marker left by cmd_buffer_put, returns false if the buffer is empty.
+//called in the critical region of get/peek
+static bool cmd_buffer_out_ptr_update(void)
 {
-    ble_cmd_buf_in_ptr = ble_cmd_buf_out_ptr = 0;
+    if(ble_cmd_buf_records == 0)
+    {
+        return false;
+    }
+    
+    if(ble_cmd_buf[ble_cmd_buf_out_ptr] == 0)
+    {
+        ble_cmd_buf_used -= (BLE_AGG_CMD_BUFFER_SIZE - ble_cmd_buf_out_ptr);
+        ble_cmd_buf_out_ptr = 0;
+    }
+    return true;
 }
 
-/*static bool cmd_buffer_peek(uint8_t **data_ptr, uint16_t *length_ptr)
+//the returned data may be overwritten by the next put, copy or send it first.
+//a record being notified is peeked, and only taken out once the SoftDevice has it
+static bool cmd_buffer_get(uint8_t ** data_ptr, uint16_t * length_ptr)
 {
-    if(ble_cmd_buf[ble_cmd_buf_out_ptr] != 0)
+    uint32_t record_size;
+    bool     has_data;
+    
+    CRITICAL_REGION_ENTER();
+    has_data = cmd_buffer_out_ptr_update();
+    if(has_data)
     {
         *data_ptr = &ble_cmd_buf[ble_cmd_buf_out_ptr + 1];
         *length_ptr = ble_cmd_buf[ble_cmd_buf_out_ptr];
-        return true;
+        record_size = *length_ptr + 1;
+        ble_cmd_buf_out_ptr = (ble_cmd_buf_out_ptr + record_size) % BLE_AGG_CMD_BUFFER_SIZE;
+        ble_cmd_buf_used -= record_size;
+        ble_cmd_buf_records--;
+        
+        if(ble_cmd_buf_records == 0)
+        {
+            // Start over at 0 so the next records get the whole buffer without wrapping
+            ble_cmd_buf_used = 0;
+            ble_cmd_buf_in_ptr = ble_cmd_buf_out_ptr = 0;
+        }
     }
-    return false;    
-}*/
+    CRITICAL_REGION_EXIT();
+
+    //NRF_LOG_INFO("BGET: In: %i, Out: %i\r\n", ble_cmd_buf_in_ptr, ble_cmd_buf_out_ptr);
+    return has_data;
+}
 
-/*static bool cmd_buffer_get(uint8_t **data_ptr, uint16_t *length_ptr)
+static bool cmd_buffer_peek(uint8_t ** data_ptr, uint16_t * length_ptr)
 {
-    if(ble_cmd_buf[ble_cmd_buf_out_ptr] != 0)
+    bool has_data;
+
+    CRITICAL_REGION_ENTER();
+    has_data = cmd_buffer_out_ptr_update();
+    if(has_data)
     {
         *data_ptr = &ble_cmd_buf[ble_cmd_buf_out_ptr + 1];
         *length_ptr = ble_cmd_buf[ble_cmd_buf_out_ptr];
-        ble_cmd_buf_out_ptr += (*length_ptr + 1);
-        if(ble_cmd_buf_in_ptr < ble_cmd_buf_out_ptr && ble_cmd_buf[ble_cmd_buf_out_ptr] == 0)
-        {
-            ble_cmd_buf_out_ptr = 0;
-        }
-        //NRF_LOG_INFO("BGET: In: %i, Out: %i\r\n", ble_cmd_buf_in_ptr, ble_cmd_buf_out_ptr);
-        return true;
     }
-    return false;
-}*/
+    CRITICAL_REGION_EXIT();
+    return has_data;
+}
+
+//pack as many queued records as fit in one notification into p_batch, see AGG_BLE_RECORD_BATCH
+//a single record is returned as is, without the batch header
+static bool cmd_buffer_batch_get(uint8_t * p_batch, uint16_t * length_ptr)
+{
+    uint8_t  *record_ptr;
+    uint16_t record_length;
+    uint16_t batch_length = BLE_AGG_CMD_BATCH_HEADER_LENGTH;
+    uint16_t record_count = 0;
+
+    p_batch[0] = AGG_BLE_RECORD_BATCH;
+    while(cmd_buffer_peek(&record_ptr, &record_length))
+    {
+        if((batch_length + 1 + record_length) > m_att_payload_max_length) break;
+
+        p_batch[batch_length++] = record_length;
+        memcpy(&p_batch[batch_length], record_ptr, record_length);
+        batch_length += record_length;
+        record_count++;
+        cmd_buffer_get(&record_ptr, &record_length);
+    }
+
+    if(record_count == 0)
+    {
+        // Nothing queued, or the next record only fits without the batch header.
+        // Copied before it is taken out, a put may reuse its room after that
+        if(!cmd_buffer_peek(&record_ptr, &record_length)) return false;
+        memcpy(p_batch, record_ptr, record_length);
+        cmd_buffer_get(&record_ptr, &record_length);
+        *length_ptr = record_length;
+    }
+    else if(record_count == 1)
+    {
+        batch_length -= (BLE_AGG_CMD_BATCH_HEADER_LENGTH + 1);
+        memmove(p_batch, &p_batch[BLE_AGG_CMD_BATCH_HEADER_LENGTH + 1], batch_length);
+        *length_ptr = batch_length;
+    }
+    else
+    {
+        *length_ptr = batch_length;
+    }
+    return true;
+}
+
+void app_aggregator_buffer_stats_get(app_aggregator_buffer_stats_t *p_stats)
+{
+    p_stats->records    = ble_cmd_buf_records;
+    p_stats->bytes_used = ble_cmd_buf_used;
+    p_stats->high_water = ble_cmd_buf_high_water;
+    p_stats->drop_count = ble_cmd_buf_drop_count;
+}
 
 void app_aggregator_init(ble_agg_cfg_service_t *agg_cfg_service)
 {//vinh, clear link info list, set default aggr name is "Name    "
     m_ble_service = agg_cfg_service;
+    // Empty buffer and sink table, so a repeated init starts over (host/relay_bench.c)
+    ble_cmd_buf_in_ptr = ble_cmd_buf_out_ptr = 0;
+    ble_cmd_buf_used = ble_cmd_buf_records = 0;
+    ble_cmd_buf_high_water = ble_cmd_buf_drop_count = 0;
+    memset(m_link_dirty_mask, 0, sizeof(m_link_dirty_mask));
+    m_link_dirty_wait = 0;
+    memset(m_sink_table, 0, sizeof(m_sink_table));
+    memset(m_sink_dirty_mask, 0, sizeof(m_sink_dirty_mask));
+    m_sink_snapshot_due = false;
+    m_sink_readings = m_sink_records = m_relay_readings_dropped = 0;
+    memset(m_link_free_mask, 0, sizeof(m_link_free_mask));
     for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
     {
         m_link_info_list[i].conn_handle = BLE_CONN_HANDLE_INVALID;
+        m_link_free_mask[i / 32] |= (1UL << (i % 32));
     }
+    memset(m_conn_handle_to_index, LINK_INDEX_INVALID, sizeof(m_conn_handle_to_index));
     strcpy(m_device_name_header_string, "Name");
     for(int i = 4; i < MAX_ADV_NAME_LENGTH; i++)
     {
@@ -175,6 +370,7 @@ void app_aggregator_on_central_connect(const ble_gap_evt_t *ble_gap_evt, connect
     
     // Update local device list
     device_connected(conn_handle, con_dev_info);
+    AGG_STATS_LINK_CONNECT(conn_handle, con_dev_info->phy);
     
     // Send info to central device (if connected)
     tx_command_payload[0] = AGG_BLE_LINK_CONNECTED;
@@ -229,7 +425,7 @@ void app_aggregator_data_update(uint16_t conn_handle, uint8_t *p_data, uint32_t
     }
 }
 
-void app_aggregator_data_update_by_index(uint16_t device_index)
+static bool app_aggregator_data_update_by_index(uint16_t device_index)
 {
 
     tx_command_payload[0] = AGG_BLE_LINK_DATA_UPDATE;
@@ -240,8 +436,7 @@ void app_aggregator_data_update_by_index(uint16_t device_index)
     tx_command_payload[5] = m_link_info_list[device_index].rf_phy;
     tx_command_payload[6] = m_link_info_list[device_index].last_rssi;
     tx_command_payload_length = 7;
-    cmd_buffer_put(tx_command_payload, tx_command_payload_length);
-        
+    return cmd_buffer_put(tx_command_payload, tx_command_payload_length);
 }
 
 void app_aggregator_all_led_update(uint8_t button_state)
@@ -259,7 +454,7 @@ void app_aggregator_on_blinky_data(uint16_t conn_handle, uint8_t button_state)
     if(device_index != BLE_CONN_HANDLE_INVALID)
     {
         m_link_info_list[device_index].button_state = button_state;
-        app_aggregator_data_update_by_index(device_index);
+        link_dirty_set(device_index);
         //app_aggregator_data_update(conn_handle, &button_state, 1);
         m_schedule_device_list_print = true;
     }
@@ -267,9 +462,13 @@ void app_aggregator_on_blinky_data(uint16_t conn_handle, uint8_t button_state)
 
 void app_aggregator_on_led_update(uint8_t led_state, uint32_t conn_handle_mask)
 {
-    for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
+    // Only visit the conn handles set in the mask
+    while(conn_handle_mask != 0)
     {
-        if(m_link_info_list[i].conn_handle < 32 && ((conn_handle_mask & (1 << m_link_info_list[i].conn_handle)) != 0))
+        uint16_t conn_handle = __builtin_ctz(conn_handle_mask);
+        uint16_t i = device_list_search(conn_handle);
+        conn_handle_mask &= (conn_handle_mask - 1);
+        if(i != BLE_CONN_HANDLE_INVALID)
         {
             m_link_info_list[i].led_state = led_state;
             m_schedule_device_list_print = true;
@@ -279,9 +478,12 @@ void app_aggregator_on_led_update(uint8_t led_state, uint32_t conn_handle_mask)
 
 void app_aggregator_on_led_color_set(uint8_t r, uint8_t g, uint8_t b, uint32_t conn_handle_mask)
 {
-    for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
+    while(conn_handle_mask != 0)
     {
-        if(m_link_info_list[i].conn_handle < 32 && ((conn_handle_mask & (1 << m_link_info_list[i].conn_handle)) != 0))
+        uint16_t conn_handle = __builtin_ctz(conn_handle_mask);
+        uint16_t i = device_list_search(conn_handle);
+        conn_handle_mask &= (conn_handle_mask - 1);
+        if(i != BLE_CONN_HANDLE_INVALID)
         {
             NRF_LOG_DEBUG("Device %i color update: %i, %i, %i", m_link_info_list[i].conn_handle, r, g, b);
             m_link_info_list[i].led_color[APP_AGGR_COL_IND_RED]   = r;
@@ -294,6 +496,7 @@ void app_aggregator_on_led_color_set(uint8_t r, uint8_t g, uint8_t b, uint32_t c
 void app_aggregator_rssi_changed(uint16_t conn_handle, int8_t rssi)
 {
     uint16_t device_index = device_list_search(conn_handle);
+    AGG_STATS_LINK_RSSI(conn_handle, rssi);
     if(device_index != BLE_CONN_HANDLE_INVALID)
     {
         m_link_info_list[device_index].last_rssi = rssi;
@@ -303,16 +506,101 @@ void app_aggregator_rssi_changed(uint16_t conn_handle, int8_t rssi)
 void app_aggregator_phy_update(uint16_t conn_handle, uint8_t tx_phy, uint8_t rx_phy)
 {
     uint16_t device_index = device_list_search(conn_handle);
+    UNUSED_PARAMETER(rx_phy);   // tx and rx PHY are requested alike, the tx PHY is shown
+    AGG_STATS_LINK_PHY(conn_handle, tx_phy);
     if(device_index != BLE_CONN_HANDLE_INVALID)
     {
         m_link_info_list[device_index].rf_phy = tx_phy;
-        app_aggregator_data_update_by_index(device_index);
+        link_dirty_set(device_index);
         m_schedule_device_list_print = true;
     }    
 }
 
+//set from the BLE event handlers, cleared from the main loop
+static void link_dirty_set(uint16_t device_index)
+{
+    CRITICAL_REGION_ENTER();
+    m_link_dirty_mask[device_index / 32] |= (1UL << (device_index % 32));
+    CRITICAL_REGION_EXIT();
+}
+
+static void link_dirty_clear(uint16_t device_index)
+{
+    CRITICAL_REGION_ENTER();
+    m_link_dirty_mask[device_index / 32] &= ~(1UL << (device_index % 32));
+    CRITICAL_REGION_EXIT();
+}
+
+static bool link_dirty_any(void)
+{
+    for(int w = 0; w < (int)(sizeof(m_link_dirty_mask) / sizeof(m_link_dirty_mask[0])); w++)
+    {
+        if(m_link_dirty_mask[w] != 0) return true;
+    }
+    return false;
+}
+
+//vinh
+//queue one data update per dirty link, carrying the latest link_info_t state.
+//called once ble_cmd_buf is drained, or after LINK_DIRTY_MAX_WAIT notifications. the records
+//queued earlier, connect/disconnect too, reach the phone first and a noisy link holds at most one entry
+static void cmd_buffer_dirty_links_put(void)
+{
+    for(int w = 0; w < (int)(sizeof(m_link_dirty_mask) / sizeof(m_link_dirty_mask[0])); w++)
+    {
+        while(m_link_dirty_mask[w] != 0)
+        {
+            uint16_t device_index = w * 32 + __builtin_ctz(m_link_dirty_mask[w]);
+            
+            if(!app_aggregator_data_update_by_index(device_index))
+            {
+                // Could not be queued, keep it dirty and retry on the next flush
+                return;
+            }
+            link_dirty_clear(device_index);
+        }
+    }
+}
+
+static void sink_dirty_set(uint16_t entry_index)
+{
+    m_sink_dirty_mask[entry_index / 32] |= (1UL << (entry_index % 32));
+}
+
+static void sink_dirty_clear(uint16_t entry_index)
+{
+    m_sink_dirty_mask[entry_index / 32] &= ~(1UL << (entry_index % 32));
+}
+
+static bool vf_app_thingy_record_put(uint8_t cluster, uint8_t local_id, uint8_t hops,
+                                     relay_codec_reading_t const *p_reading, bool with_name);
+
+//queue the latest reading of every changed sink entry, the snapshot is over once all are queued
+static void cmd_buffer_sink_snapshot_put(void)
+{
+    for(int w = 0; w < (int)(sizeof(m_sink_dirty_mask) / sizeof(m_sink_dirty_mask[0])); w++)
+    {
+        while(m_sink_dirty_mask[w] != 0)
+        {
+            uint16_t entry_index = w * 32 + __builtin_ctz(m_sink_dirty_mask[w]);
+            uint8_t  cluster = entry_index / AGG_RELAY_LOCAL_ID_COUNT;
+            uint8_t  local_id = entry_index % AGG_RELAY_LOCAL_ID_COUNT;
+            agg_sink_entry_t *p_entry = &m_sink_table[cluster][local_id];
+
+            // No name string, the phone has it from the connect record
+            if(!vf_app_thingy_record_put(cluster, local_id, p_entry->hops, &p_entry->reading, false))
+            {
+                // Buffer and log full, the rest goes out on the next flush
+                return;
+            }
+            sink_dirty_clear(entry_index);
+        }
+    }
+    m_sink_snapshot_due = false;
+}
+
 uint8_t   *data_ptr;
-uint8_t   tmp_buffer[BLE_AGG_CMD_MAX_LENGTH];
+uint8_t   tmp_buffer[BLE_AGG_CFG_SERVICE_MAX_DATA_LEN];
 uint16_t  length;
 bool      reuse_packet = false;
 
@@ -320,20 +608,52 @@ bool app_aggregator_flush_ble_commands(void)
 {
 
     uint32_t    err_code;
+    bool        has_data;
     if(!reuse_packet)
     {
-        if(cmd_buffer_get(&data_ptr, &length))  //vinh, get data from receive buff
+        // A dirty link waits for the backlog already queued to drain, not for the rest of
+        // the log: the log is pumped again once the link updates are queued
+        if(link_dirty_any() && ((ble_cmd_buf_records == 0) || (m_link_dirty_wait >= LINK_DIRTY_MAX_WAIT)))
+        {
+            cmd_buffer_dirty_links_put();
+        }
+        if(!link_dirty_any())
+        {
+            m_link_dirty_wait = 0;
+            cmd_buffer_log_pump();
+        }
+        if(m_sink_snapshot_due)
+        {
+            cmd_buffer_sink_snapshot_put();
+        }
+        if(m_batch_mode_enabled || m_sink_snapshot_enabled)
+        {
+            has_data = cmd_buffer_batch_get(tmp_buffer, &length);
+            data_ptr = tmp_buffer;
+        }
+        else
+        {
+            // Stays queued until it is sent, so no put can take its place meanwhile
+            has_data = cmd_buffer_peek(&data_ptr, &length);  //vinh, get data from receive buff
+        }
+        if(has_data)
         {//vinh, has new data
             //NRF_LOG_INFO("PCKBUF: \r\n");
             //NRF_LOG_HEXDUMP_INFO(data_ptr, length);
             err_code = ble_agg_cfg_service_string_send(m_ble_service, data_ptr, &length);
             if(err_code != NRF_SUCCESS)
             {//if error, quit and return next time, return false for the main go to next step
-                memcpy(tmp_buffer, data_ptr, length);
-                data_ptr = tmp_buffer;
-                reuse_packet = true;
+                AGG_STATS_COUNT(AGG_STATS_CNT_PHONE_TX_RETRY);
+                // A batch is only in tmp_buffer, a single record is peeked again
+                reuse_packet = (data_ptr == tmp_buffer);
                 return false;
             }
+            if(data_ptr != tmp_buffer)
+            {
+                cmd_buffer_get(&data_ptr, &length);
+            }
+            if(link_dirty_any()) m_link_dirty_wait++;
+            AGG_STATS_COUNT(AGG_STATS_CNT_PHONE_TX);
             return true;
         }
     }
@@ -343,16 +663,83 @@ bool app_aggregator_flush_ble_commands(void)
         if(err_code == NRF_SUCCESS)
         {
             reuse_packet = false;
+            if(link_dirty_any()) m_link_dirty_wait++;
+            AGG_STATS_COUNT(AGG_STATS_CNT_PHONE_TX);
             return true;
         }   
+        AGG_STATS_COUNT(AGG_STATS_CNT_PHONE_TX_RETRY);
 
     }
     return false;
 }
 
+//queued records are kept for the next phone, the flash log takes the ones that follow.
+//link updates are not, the next phone gets the state of every link at connect
 void app_aggregator_clear_buffer(void)
 {
-    cmd_buffer_flush();
+    CRITICAL_REGION_ENTER();
+    memset(m_link_dirty_mask, 0, sizeof(m_link_dirty_mask));
+    CRITICAL_REGION_EXIT();
+    m_link_dirty_wait = 0;
+}
+
+//vinh, called from the nrf_ble_gatt event handler when the phone link changes its ATT MTU
+void app_aggregator_att_mtu_set(uint16_t att_mtu)
+{
+    uint16_t payload_length = att_mtu - OPCODE_LENGTH - HANDLE_LENGTH;
+
+    m_att_payload_max_length = (payload_length > BLE_AGG_CFG_SERVICE_MAX_DATA_LEN) ? BLE_AGG_CFG_SERVICE_MAX_DATA_LEN : payload_length;
+    NRF_LOG_INFO("Phone link ATT payload: %i bytes", m_att_payload_max_length);
+}
+
+void app_aggregator_batch_mode_set(bool enable)
+{
+    m_batch_mode_enabled = enable;
+}
+
+void app_aggregator_sink_snapshot_mode_set(bool enable)
+{
+    if(m_sink_snapshot_enabled && !enable)
+    {
+        // Readings held back so far go out in one last snapshot
+        m_sink_snapshot_due = true;
+        cmd_buffer_sink_snapshot_put();
+    }
+    m_sink_snapshot_enabled = enable;
+}
+
+//the snapshot is larger than a record, it goes out in parts the phone puts back together
+bool app_aggregator_stats_send(void)
+{
+    uint8_t  snapshot[AGG_STATS_SERIALIZED_MAX];
+    uint16_t snapshot_length = agg_stats_serialize(snapshot, sizeof(snapshot));
+    uint16_t part_max = BLE_AGG_CMD_MAX_LENGTH - BLE_AGG_CMD_STATS_HEADER_LENGTH;
+    uint8_t  part_count = (snapshot_length + part_max - 1) / part_max;
+    bool     queued = true;
+
+    for(uint8_t part = 0; part < part_count; part++)
+    {
+        uint16_t offset = part * part_max;
+        uint16_t part_length = MIN(part_max, snapshot_length - offset);
+
+        tx_command_payload[0] = AGG_BLE_STATS;
+        tx_command_payload[1] = part;
+        tx_command_payload[2] = part_count;
+        memcpy(&tx_command_payload[BLE_AGG_CMD_STATS_HEADER_LENGTH], &snapshot[offset], part_length);
+        tx_command_payload_length = BLE_AGG_CMD_STATS_HEADER_LENGTH + part_length;
+        queued &= cmd_buffer_put(tx_command_payload, tx_command_payload_length);
+    }
+    return queued;
+}
+
+//taken on time with the phone away as well, the flash log keeps the snapshots for it
+void app_aggregator_sink_snapshot(void)
+{
+    if(m_sink_snapshot_enabled)
+    {
+        m_sink_snapshot_due = true;
+        cmd_buffer_sink_snapshot_put();
+    }
 }
 
 //vinh, 2 sec after new connection, send all link status all central by put inf in to tx_buffer
@@ -389,14 +776,34 @@ void app_aggregator_update_link_status(void)
                 tx_command_payload_length = 11;
             }
             cmd_buffer_put(tx_command_payload, tx_command_payload_length);
+            // The connect record carries the full link state, nothing left to update
+            link_dirty_clear(i);
             NRF_LOG_HEXDUMP_INFO(tx_command_payload, tx_command_payload_length);
         }
     }
 
+    // A phone that just connected gets every relayed Thingy with the next snapshot
+    for(uint16_t i = 0; i < AGG_SINK_ENTRY_COUNT; i++)
+    {
+        if(m_sink_table[i / AGG_RELAY_LOCAL_ID_COUNT][i % AGG_RELAY_LOCAL_ID_COUNT].valid)
+        {
+            sink_dirty_set(i);
+        }
+    }
+
 }
 
+//vinh, conn handles handed out by the SoftDevice are small, so they index m_conn_handle_to_index
+//directly. Anything outside the table falls back to scanning the list.
 static uint16_t device_list_search(uint16_t conn_handle)
 {
+    if(conn_handle < APP_AGG_CONN_HANDLE_MAP_SIZE)
+    {
+        uint8_t device_index = m_conn_handle_to_index[conn_handle];
+        return (device_index != LINK_INDEX_INVALID) ? device_index : BLE_CONN_HANDLE_INVALID;
+    }
+    if(conn_handle == BLE_CONN_HANDLE_INVALID) return BLE_CONN_HANDLE_INVALID;
+    
     for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
     {
         if(m_link_info_list[i].conn_handle == conn_handle) return i;
@@ -406,7 +813,35 @@ static uint16_t device_list_search(uint16_t conn_handle)
 
 static uint16_t device_list_find_available()
 {
-    return device_list_search(BLE_CONN_HANDLE_INVALID);
+    for(int w = 0; w < (int)(sizeof(m_link_free_mask) / sizeof(m_link_free_mask[0])); w++)
+    {
+        if(m_link_free_mask[w] != 0) return w * 32 + __builtin_ctz(m_link_free_mask[w]);
+    }
+    return BLE_CONN_HANDLE_INVALID;
+}
+
+//claim (conn_handle valid) or release (BLE_CONN_HANDLE_INVALID) the m_link_info_list entry at device_index
+static void link_index_map(uint16_t conn_handle, uint16_t device_index)
+{
+    uint16_t old_conn_handle = m_link_info_list[device_index].conn_handle;
+    
+    if(old_conn_handle < APP_AGG_CONN_HANDLE_MAP_SIZE)
+    {
+        m_conn_handle_to_index[old_conn_handle] = LINK_INDEX_INVALID;
+    }
+    m_link_info_list[device_index].conn_handle = conn_handle;
+    if(conn_handle == BLE_CONN_HANDLE_INVALID)
+    {
+        m_link_free_mask[device_index / 32] |= (1UL << (device_index % 32));
+    }
+    else
+    {
+        m_link_free_mask[device_index / 32] &= ~(1UL << (device_index % 32));
+        if(conn_handle < APP_AGG_CONN_HANDLE_MAP_SIZE)
+        {
+            m_conn_handle_to_index[conn_handle] = device_index;
+        }
+    }
 }
 
 static void device_connected(uint16_t conn_handle, connected_device_info_t *con_dev_info)
@@ -415,10 +850,10 @@ static void device_connected(uint16_t conn_handle, connected_device_info_t *con_
     {//vinh, check this handle not connected before -> add new device and info to list
         uint16_t new_device_index;
         new_device_index = device_list_find_available();
-        if(new_device_index != 0xFFFF)
+        if(new_device_index != BLE_CONN_HANDLE_INVALID)
         {
             uint32_t device_name_length;
-            m_link_info_list[new_device_index].conn_handle = conn_handle;
+            link_index_map(conn_handle, new_device_index);
             m_link_info_list[new_device_index].device_type = con_dev_info->dev_type; 
             m_link_info_list[new_device_index].button_state = 0; 
             m_link_info_list[new_device_index].led_state = 1; 
@@ -431,11 +866,20 @@ static void device_connected(uint16_t conn_handle, connected_device_info_t *con_
             m_link_info_list[new_device_index].adv_name[MAX_ADV_NAME_LENGTH - 1] = 0;
             m_link_info_list[new_device_index].rf_phy = con_dev_info->phy;
             m_link_info_list[new_device_index].last_rssi = 0;
+            link_dirty_clear(new_device_index);
             m_schedule_device_list_print = true;
         }
-        else m_error_flags |= 1 << APP_AGG_ERROR_LINK_INFO_LIST_FULL;
+        else
+        {
+            m_error_flags |= 1 << APP_AGG_ERROR_LINK_INFO_LIST_FULL;
+            AGG_STATS_COUNT(AGG_STATS_CNT_LINK_LIST_FULL);
+        }
+    }
+    else
+    {
+        m_error_flags |= 1 << APP_AGG_ERROR_CONN_HANDLE_CONFLICT;
+        AGG_STATS_COUNT(AGG_STATS_CNT_CONN_HANDLE_CONFLICT);
     }
-    else m_error_flags |= 1 << APP_AGG_ERROR_CONN_HANDLE_CONFLICT;
 }
 
 static void device_disconnected(uint16_t conn_handle)
@@ -443,10 +887,16 @@ static void device_disconnected(uint16_t conn_handle)
     uint16_t device_index;
     if((device_index = device_list_search(conn_handle)) != BLE_CONN_HANDLE_INVALID)
     {
-        m_link_info_list[device_index].conn_handle = BLE_CONN_HANDLE_INVALID;
+        link_index_map(BLE_CONN_HANDLE_INVALID, device_index);
+        // Drop any pending update, the phone gets the disconnect record instead
+        link_dirty_clear(device_index);
         m_schedule_device_list_print = true;
     }
-    else m_error_flags |= 1 << APP_AGG_ERROR_CONN_HANDLE_NOT_FOUND;       
+    else
+    {
+        m_error_flags |= 1 << APP_AGG_ERROR_CONN_HANDLE_NOT_FOUND;
+        AGG_STATS_COUNT(AGG_STATS_CNT_CONN_HANDLE_NOT_FOUND);
+    }
 }
 
 void device_list_print()
@@ -454,6 +904,7 @@ void device_list_print()
     if(m_schedule_device_list_print)
     {
         uint32_t device_count = 0;
+        ble_gattc_queue_stats_t gattc_stats;
         m_schedule_device_list_print = false;
         for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
         {
@@ -463,7 +914,7 @@ void device_list_print()
             }
         }
         uart_printf("\r\n------ Device list overview (%i device%s------\r\n\n", device_count, (device_count != 1) ? "s total) " : " total) -");
-        uart_printf("ID   %sBtn LED Phy   RSSI\r\n", m_device_name_header_string);
+        uart_printf("ID   %sBtn LED Phy   RSSI  GQ\r\n", m_device_name_header_string);
         for(int i = 0; i < MAX_NUMBER_OF_LINKS; i++)
         {
             if(m_link_info_list[i].conn_handle != BLE_CONN_HANDLE_INVALID)
@@ -482,12 +933,104 @@ void device_list_print()
                     uart_printf("%i   ",     m_link_info_list[i].button_state);
                     uart_printf("%i   ",     m_link_info_list[i].led_state);
                     uart_printf("%s ",       m_link_info_list[i].rf_phy <= 4 ? m_phy_name_string_list[m_link_info_list[i].rf_phy] : "ERR!");
-                    uart_printf("%i\r\n", (int)m_link_info_list[i].last_rssi);
+                    uart_printf("%-5i %i\r\n", (int)m_link_info_list[i].last_rssi, (int)ble_gattc_queue_depth_get(m_link_info_list[i].conn_handle));
                 }
             }
         }
-        uart_printf("\r\n");
+        uart_printf("\r\nPhone buffer: %i records, %i/%i bytes, max %i, dropped %i\r\n",
+                    (int)ble_cmd_buf_records, (int)ble_cmd_buf_used, BLE_AGG_CMD_BUFFER_SIZE, (int)ble_cmd_buf_high_water, (int)ble_cmd_buf_drop_count);
+        ble_gattc_queue_stats_get(&gattc_stats);
+        uart_printf("GATTC queue (GQ): %i pending, max %i/%i, sent %i, dropped %i\r\n",
+                    (int)gattc_stats.pending, (int)gattc_stats.high_water, BLE_GATTC_QUEUE_SIZE, (int)gattc_stats.sent, (int)gattc_stats.dropped);
+        uart_printf("Sink: %i readings, %i phone records%s, %i without keyframe\r\n", (int)m_sink_readings,
+                    (int)m_sink_records, m_sink_snapshot_enabled ? " (snapshots)" : "", (int)m_relay_readings_dropped);
+        uart_printf("Log bytes dropped: %i, trace records dropped: %i\r\n\n", (int)uart_printf_dropped_get(), (int)agg_trace_dropped_get());
+    }
+}
+
+//queue a Thingy data update for the phone, false if the buffer is full
+static bool vf_app_thingy_record_put(uint8_t cluster, uint8_t local_id, uint8_t hops,
+                                     relay_codec_reading_t const *p_reading, bool with_name)
+{
+  char str1[]="Thingy";
+  bool queued;
+
+  tx_command_payload[0] = AGG_NODE_LINK_DATA_UPDATE;
+  tx_command_payload[1] = cluster;//source cluster id
+  tx_command_payload[2] = local_id;//local id
+  tx_command_payload[3] = 4; //type: 1:blinky 2:direct thingy; //3:remoted blinky; 4:remote thingy; 5:routing
+  tx_command_payload[4] = 10; //length
+  tx_command_payload[5] = hops; //hopcounts
+  tx_command_payload[6] = (uint8_t)(p_reading->temperature>>8); //temp1
+  tx_command_payload[7] = (uint8_t)p_reading->temperature; //temp2
+  tx_command_payload[8] = (uint8_t)(p_reading->pressure>>24); //pressure 1: MSB
+  tx_command_payload[9] = (uint8_t)(p_reading->pressure>>16); //pressure 2
+  tx_command_payload[10] = (uint8_t)(p_reading->pressure>>8); //pressure 3
+  tx_command_payload[11] = (uint8_t)p_reading->pressure; //pressure 4:LSB
+  tx_command_payload[12] = (uint8_t)(p_reading->humidity>>8); //hum 1
+  tx_command_payload[13] = (uint8_t)p_reading->humidity; //hum 2
+  tx_command_payload[14] = p_reading->button; //button
+  tx_command_payload_length = 15;
+  if(with_name)
+  {
+    memcpy(&tx_command_payload[15], str1, strlen(str1));
+    tx_command_payload_length = 15 + strlen(str1);
+  }
+
+  queued = cmd_buffer_log_put(tx_command_payload, tx_command_payload_length);
+  if(queued)
+  {
+    m_sink_records++;
+    AGG_TRACE(AGG_TRACE_EVT_PHONE_TX, tx_command_payload, tx_command_payload_length);
+  }
+  return queued;
+}
+
+//a reading for the phone: into the sink table in snapshot mode, else straight to the phone
+static void vf_app_thingy_reading_put(uint8_t cluster, uint8_t local_id, uint8_t hops, relay_codec_reading_t const *p_reading)
+{
+  agg_sink_entry_t *p_entry;
+
+  m_sink_readings++;
+  if(!m_sink_snapshot_enabled || (cluster >= AGG_RELAY_CLUSTER_COUNT) || (local_id >= AGG_RELAY_LOCAL_ID_COUNT))
+  {
+    vf_app_thingy_record_put(cluster, local_id, hops, p_reading, true);
+    return;
+  }
+  p_entry = &m_sink_table[cluster][local_id];
+  p_entry->reading = *p_reading;
+  p_entry->hops = hops;
+  p_entry->valid = true;
+  sink_dirty_set(cluster * AGG_RELAY_LOCAL_ID_COUNT + local_id);
+}
+
+//unpack a compact record (relay_codec.h), each reading is an AGG_NODE_LINK_DATA_UPDATE for the phone
+static void vf_app_compact_data_send_to_phone(uint8_array_t *data)
+{
+  relay_codec_entry_t entry;
+  relay_codec_reading_t reading;
+  relay_codec_ref_t unknown_ref = {0};
+  relay_codec_ref_t *p_ref;
+  uint8_t cluster=data->p_data[0];
+  uint16_t pos=RELAY_CODEC_HEADER_LENGTH;
+  uint8_t len;
+
+  while(pos<data->size)
+  {
+    len=relay_codec_entry_decode(&data->p_data[pos], data->size-pos, &entry);
+    if(len==0) break; //cut short, nothing after it can be read
+    pos+=len;
+
+    //outside the table only keyframes can be read
+    p_ref=((cluster<AGG_RELAY_CLUSTER_COUNT)&&(entry.local_id<AGG_RELAY_LOCAL_ID_COUNT)) ?
+          &m_sink_table[cluster][entry.local_id].ref : &unknown_ref;
+    if(!relay_codec_entry_apply(&entry, p_ref, &reading))
+    {
+      m_relay_readings_dropped++;
+      continue;
     }
+    vf_app_thingy_reading_put(cluster, entry.local_id, data->p_data[3], &reading);
+  }
 }
 
 //vinh ver2
@@ -496,23 +1039,44 @@ void device_list_print()
 void vf_app_adv_data_send_to_phone(uint8_array_t *data)
 {
 
-  uint8_t i=0,state;
-  uint16_t thingy_id;
+  uint8_t state;
+  relay_codec_reading_t reading;
   
 
-  char str1[30]="Thingy",str2[10];
+  char str1[30]="Thingy";
 
-  thingy_id=data->p_data[0]<<8+ data->p_data[5];
-  //sprintf(str2,"0x%x :",thingy_id);
-  //strcat(str1,str2);
-  uart_printf(str1); 
-  uart_printf(" to phone:");
+  state=data->p_data[4];
+  //tx_command_payload[0] =   AGG_NODE_LINK_CONNECTED;
 
+  switch(state)
+  {
+    case AGG_NODE_LINK_DATA_COMPACT:
+        if(data->size>RELAY_CODEC_HEADER_LENGTH)
+        {
+          vf_app_compact_data_send_to_phone(data);
+        }
+        return;
 
+    case AGG_NODE_LINK_DATA_UPDATE:
+        if(data->size<15) return;
+        reading.temperature=(int16_t)(((uint16_t)data->p_data[6]<<8)|data->p_data[7]);
+        reading.pressure=(int32_t)uint32_big_decode(&data->p_data[8]);
+        reading.humidity=(int16_t)(((uint16_t)data->p_data[12]<<8)|data->p_data[13]);
+        reading.button=data->p_data[14];
+        vf_app_thingy_reading_put(data->p_data[0], data->p_data[5], data->p_data[3], &reading);
+        return;
 
+    case AGG_NODE_LINK_DISCONNECTED:
+        if((data->p_data[0]<AGG_RELAY_CLUSTER_COUNT)&&(data->p_data[5]<AGG_RELAY_LOCAL_ID_COUNT))
+        {//nothing more to report of it, and its next keyframe starts over
+          memset(&m_sink_table[data->p_data[0]][data->p_data[5]], 0, sizeof(agg_sink_entry_t));
+          sink_dirty_clear(data->p_data[0]*AGG_RELAY_LOCAL_ID_COUNT+data->p_data[5]);
+        }
+        break;
 
-  state=data->p_data[4];
-  //tx_command_payload[0] =   AGG_NODE_LINK_CONNECTED;
+    default:
+        break;
+  }
 
   tx_command_payload[0] =   data->p_data[4];
   tx_command_payload[1] = data->p_data[0];//source cluster id
@@ -550,41 +1114,10 @@ void vf_app_adv_data_send_to_phone(uint8_array_t *data)
         tx_command_payload_length=3;
         break;
 
-    case AGG_NODE_LINK_DATA_UPDATE:
-       tx_command_payload[3] = 4; ;//type: 1:blinky 2:direct thingy; //3:remoted blinky; 4:remote thingy; 5:routing
-        tx_command_payload[4] =  10; //length
-        tx_command_payload[5]=data->p_data[3]; //hopcounts
-        tx_command_payload[6] = data->p_data[6]; //temp1
-        tx_command_payload[7] = data->p_data[7];; //temp2
-        tx_command_payload[8] =  data->p_data[8]; //pressure 1: MSB
-        tx_command_payload[9] =  data->p_data[9];; //pressure 2
-        tx_command_payload[10] =  data->p_data[10];; //pressure 3
-        tx_command_payload[11] =  data->p_data[11];; //pressure 4:LSB
-        tx_command_payload[12] = data->p_data[12];; //hum 1
-        tx_command_payload[13] =  data->p_data[13];; //hum 2
-        tx_command_payload[14] =  data->p_data[14];; //button
-
-        tx_command_payload_length=15;
-        if(strlen(str1) <= MAX_ADV_NAME_LENGTH)
-        {
-            memcpy(&tx_command_payload[15], str1, strlen(str1));
-            tx_command_payload_length = 15 + strlen(str1);
-        }
-        else 
-        {
-            tx_command_payload_length = 15;
-        }
-        break;
   }
 
 
   cmd_buffer_put(tx_command_payload, tx_command_payload_length);
-  for(i=0;i<tx_command_payload_length;i++)
-  {
-    sprintf(str2,"%d ",tx_command_payload[i]);
-    uart_printf(str2);
-  }
-  uart_printf("\r\n");
-  NRF_LOG_HEXDUMP_INFO(tx_command_payload, tx_command_payload_length);
+  AGG_TRACE(AGG_TRACE_EVT_PHONE_TX, tx_command_payload, tx_command_payload_length);
 }
 
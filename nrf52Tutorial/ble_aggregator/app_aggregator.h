@@ -6,15 +6,59 @@
 #include "ble_gap.h"
 #include "ble_agg_config_service.h"
 
+#ifndef MAX_NUMBER_OF_LINKS
 #define MAX_NUMBER_OF_LINKS 20
+#endif
+
+// conn handles below this are looked up in a direct table, at most 255 links
+#ifndef APP_AGG_CONN_HANDLE_MAP_SIZE
+#define APP_AGG_CONN_HANDLE_MAP_SIZE 32
+#endif
 
 #define MAX_ADV_NAME_LENGTH 15
 
+// Cluster head configuration: the cluster of this node and the cluster of the sink, the node that
+// hands the readings of every cluster to the phone. The sink alone keeps the relayed Thingies,
+// see AGG_RELAY_CLUSTER_COUNT in app_aggregator.c
+#ifndef CLUSTER_ID
+#define CLUSTER_ID      5
+#endif
+#ifndef SINK_ID
+#define SINK_ID         10
+#endif
+// Cluster ids of the network run from 0 to AGG_NETWORK_CLUSTER_COUNT - 1. The default covers the
+// ids up to the sink's, set it in the project for a network with more clusters
+#ifndef AGG_NETWORK_CLUSTER_COUNT
+#define AGG_NETWORK_CLUSTER_COUNT   (SINK_ID + 1)
+#endif
+
 enum {APP_AGGR_COL_IND_RED, APP_AGGR_COL_IND_GREEN, APP_AGGR_COL_IND_BLUE};
 
 //vinh
 enum TX_COMMANDS {AGG_BLE_LINK_CONNECTED = 1, AGG_BLE_LINK_DISCONNECTED, AGG_BLE_LINK_DATA_UPDATE, AGG_BLE_LED_BUTTON_PRESSED,\
-                AGG_NODE_LINK_CONNECTED, AGG_NODE_LINK_DISCONNECTED, AGG_NODE_LINK_DATA_UPDATE, AGG_NODE_LED_BUTTON_PRESSED};
+                AGG_NODE_LINK_CONNECTED, AGG_NODE_LINK_DISCONNECTED, AGG_NODE_LINK_DATA_UPDATE, AGG_NODE_LED_BUTTON_PRESSED,\
+                AGG_NODE_LINK_DATA_COMPACT, AGG_BLE_RECORD_BATCH = 0x10, AGG_BLE_STATS};
+
+// AGG_NODE_LINK_DATA_COMPACT only travels between cluster heads (relay_codec.h), the sink hands
+// each reading in it to the phone as an AGG_NODE_LINK_DATA_UPDATE.
+
+// Batched notification (sent when batch mode is enabled and more than one record is queued):
+//   byte 0:        AGG_BLE_RECORD_BATCH
+//   byte 1:        length of record 0 (n0)
+//   byte 2..n0+1:  record 0, same layout as an unbatched notification
+//   byte n0+2:     length of record 1, and so on until the end of the notification
+// A single pending record is always sent unbatched, so the phone must accept both forms.
+
+// Statistics record (sent on APPCMD_GET_STATS), a snapshot as laid out in agg_stats.h cut in parts:
+//   byte 0:        AGG_BLE_STATS
+//   byte 1:        part index
+//   byte 2:        part count
+//   byte 3..:      part of the snapshot
+// Off by default: the phone apps in android_apk/ read one record per notification, a phone that
+// unpacks batches turns them on with APPCMD_SET_BATCH_MODE
+#ifndef AGG_BLE_BATCH_DEFAULT_ENABLED
+#define AGG_BLE_BATCH_DEFAULT_ENABLED 0
+#endif
 
 typedef struct
 {
@@ -35,6 +79,15 @@ typedef struct
     uint32_t phy;
 }connected_device_info_t;
 
+// Phone command buffer usage, sizes in bytes of ble_cmd_buf
+typedef struct
+{
+    uint32_t records;
+    uint32_t bytes_used;
+    uint32_t high_water;
+    uint32_t drop_count;
+}app_aggregator_buffer_stats_t;
+
 void app_aggregator_init(ble_agg_cfg_service_t *agg_cfg_service);
 
 void app_aggregator_on_central_connect(const ble_gap_evt_t *ble_gap_evt, connected_device_info_t *con_dev_info);
@@ -55,14 +108,67 @@ bool app_aggregator_flush_ble_commands(void);
 
 void app_aggregator_clear_buffer(void);
 
+void app_aggregator_att_mtu_set(uint16_t att_mtu);
+
+void app_aggregator_batch_mode_set(bool enable);
+
+// Sink snapshot mode: relayed Thingy readings are held per (cluster, local id) and only the latest of
+// each goes to the phone, batched, when app_aggregator_sink_snapshot() is called. Off by default.
+void app_aggregator_sink_snapshot_mode_set(bool enable);
+
+void app_aggregator_sink_snapshot(void);
+
+void app_aggregator_buffer_stats_get(app_aggregator_buffer_stats_t *p_stats);
+
+// Queues an agg_stats snapshot for the phone, false if a part did not fit in the buffer
+bool app_aggregator_stats_send(void);
+
 void app_aggregator_update_link_status(void);
 
 void device_list_print(void);
 
 void app_aggregator_all_led_update(uint8_t button_state);
 
+// uart_printf output levels. UART_PRINTF_DEBUG is meant for per-packet and per-byte dumps
+// and compiles to nothing when UART_LOG_LEVEL is below UART_LOG_LEVEL_DEBUG. A level compiled
+// out still uses its arguments, so the values only logged do not warn as unused.
+// Release builds (NDEBUG) default to UART_LOG_LEVEL_INFO, so the dumps are left out of them.
+#define UART_LOG_LEVEL_OFF      0
+#define UART_LOG_LEVEL_INFO     3
+#define UART_LOG_LEVEL_DEBUG    4
+
+#ifndef UART_LOG_LEVEL
+#ifdef NDEBUG
+#define UART_LOG_LEVEL UART_LOG_LEVEL_INFO
+#else
+#define UART_LOG_LEVEL UART_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if (UART_LOG_LEVEL >= UART_LOG_LEVEL_INFO)
+#define UART_PRINTF_INFO(...)   uart_printf(__VA_ARGS__)
+#else
+#define UART_PRINTF_INFO(...)   do { if(0) uart_printf(__VA_ARGS__); } while(0)
+#endif
+
+#if (UART_LOG_LEVEL >= UART_LOG_LEVEL_DEBUG)
+#define UART_PRINTF_DEBUG(...)  uart_printf(__VA_ARGS__)
+#else
+#define UART_PRINTF_DEBUG(...)  do { if(0) uart_printf(__VA_ARGS__); } while(0)
+#endif
+
+// Formats into a ring buffer and returns, safe to call from interrupt context
 void uart_printf(const char *fmt, ...);
 
+// Queues raw bytes, e.g. agg_trace records, as one unit behind earlier output, false if they do not fit
+bool uart_log_write(const uint8_t *p_data, uint16_t len);
+
+// Moves buffered uart_printf output to the UART, call from the main loop
+void uart_printf_process(void);
+
+// Bytes of uart_printf output lost because the ring buffer was full
+uint32_t uart_printf_dropped_get(void);
+
 //vinh
 void vf_app_adv_data_send_to_phone(uint8_array_t *data);
 
@@ -46,6 +46,7 @@
 
 #define BLE_UUID_AGG_CFG_SERVICE_RX_CHARACTERISTIC 0x0002                      /**< The UUID of the RX Characteristic. */
 #define BLE_UUID_AGG_CFG_SERVICE_TX_CHARACTERISTIC 0x0003                      /**< The UUID of the TX Characteristic. */
+#define BLE_UUID_AGG_CFG_SERVICE_STATS_CHARACTERISTIC 0x0004                   /**< The UUID of the statistics Characteristic. */
 
 #define BLE_AGG_CFG_SERVICE_MAX_RX_CHAR_LEN        BLE_AGG_CFG_SERVICE_MAX_DATA_LEN        /**< Maximum length of the RX Characteristic (in bytes). */
 #define BLE_AGG_CFG_SERVICE_MAX_TX_CHAR_LEN        BLE_AGG_CFG_SERVICE_MAX_DATA_LEN        /**< Maximum length of the TX Characteristic (in bytes). */
@@ -129,6 +130,42 @@ static void on_write(ble_agg_cfg_service_t * p_agg_cfg_service, ble_evt_t const
 }
 
 
+/**@brief Function for handling the @ref BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST event from the SoftDevice.
+ *
+ * @details A read of the statistics characteristic at offset 0 takes a new snapshot. The peer reads
+ *          the rest of it with read blob requests, those get the stored value, so the parts match.
+ *
+ * @param[in] p_agg_cfg_service     Nordic UART Service structure.
+ * @param[in] p_ble_evt Pointer to the event received from BLE stack.
+ */
+static void on_rw_authorize_request(ble_agg_cfg_service_t * p_agg_cfg_service, ble_evt_t const * p_ble_evt)
+{
+    static uint8_t stats_value[BLE_AGG_CFG_SERVICE_MAX_STATS_LEN];
+
+    ble_gatts_evt_rw_authorize_request_t const * p_auth_req = &p_ble_evt->evt.gatts_evt.params.authorize_request;
+    ble_gatts_rw_authorize_reply_params_t        auth_reply;
+
+    if (   (p_auth_req->type != BLE_GATTS_AUTHORIZE_TYPE_READ)
+        || (p_auth_req->request.read.handle != p_agg_cfg_service->stats_handles.value_handle))
+    {
+        // Do Nothing. This event is not relevant for this service.
+        return;
+    }
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type                     = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    auth_reply.params.read.gatt_status  = BLE_GATT_STATUS_SUCCESS;
+    if (p_auth_req->request.read.offset == 0)
+    {
+        auth_reply.params.read.update   = 1;
+        auth_reply.params.read.len      = p_agg_cfg_service->stats_handler(stats_value, sizeof(stats_value));
+        auth_reply.params.read.p_data   = stats_value;
+    }
+
+    (void)sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply);
+}
+
+
 /**@brief Function for adding TX characteristic.
  *
  * @param[in] p_agg_cfg_service       Nordic UART Service structure.
@@ -241,6 +278,55 @@ static uint32_t rx_char_add(ble_agg_cfg_service_t * p_agg_cfg_service, const ble
                                            &p_agg_cfg_service->rx_handles);
 }
 
+/**@brief Function for adding the statistics characteristic.
+ *
+ * @param[in] p_agg_cfg_service       Nordic UART Service structure.
+ *
+ * @return NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t stats_char_add(ble_agg_cfg_service_t * p_agg_cfg_service)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read  = 1;
+    char_md.p_char_user_desc = NULL;
+    char_md.p_char_pf        = NULL;
+    char_md.p_user_desc_md   = NULL;
+    char_md.p_cccd_md        = NULL;
+    char_md.p_sccd_md        = NULL;
+
+    ble_uuid.type = p_agg_cfg_service->uuid_type;
+    ble_uuid.uuid = BLE_UUID_AGG_CFG_SERVICE_STATS_CHARACTERISTIC;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 1;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_AGG_CFG_SERVICE_MAX_STATS_LEN;
+
+    return sd_ble_gatts_characteristic_add(p_agg_cfg_service->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_agg_cfg_service->stats_handles);
+}
+
 //vinh, for phone connecting
 void ble_agg_cfg_service_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
 {
@@ -267,6 +353,14 @@ void ble_agg_cfg_service_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_contex
             on_write(p_agg_cfg_service, p_ble_evt);
             break;
 
+        case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+            //phone reads the statistics
+            if (p_agg_cfg_service->stats_handler != NULL)
+            {
+                on_rw_authorize_request(p_agg_cfg_service, p_ble_evt);
+            }
+            break;
+
         case BLE_GATTS_EVT_HVN_TX_COMPLETE:
         {
             //phone response
@@ -298,6 +392,7 @@ uint32_t ble_agg_cfg_service_init(ble_agg_cfg_service_t * p_agg_cfg_service, ble
     // Initialize the service structure.
     p_agg_cfg_service->conn_handle             = BLE_CONN_HANDLE_INVALID;
     p_agg_cfg_service->data_handler            = p_agg_cfg_service_init->data_handler;
+    p_agg_cfg_service->stats_handler           = p_agg_cfg_service_init->stats_handler;
     p_agg_cfg_service->is_notification_enabled = false;
 
     /**@snippet [Adding proprietary Service to the SoftDevice] */
@@ -323,6 +418,13 @@ uint32_t ble_agg_cfg_service_init(ble_agg_cfg_service_t * p_agg_cfg_service, ble
     err_code = tx_char_add(p_agg_cfg_service, p_agg_cfg_service_init);
     VERIFY_SUCCESS(err_code);
 
+    // Add the statistics Characteristic.
+    if (p_agg_cfg_service->stats_handler != NULL)
+    {
+        err_code = stats_char_add(p_agg_cfg_service);
+        VERIFY_SUCCESS(err_code);
+    }
+
     return NRF_SUCCESS;
 }
 
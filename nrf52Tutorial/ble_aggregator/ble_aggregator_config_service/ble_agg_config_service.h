@@ -98,6 +98,9 @@ NRF_SDH_BLE_OBSERVER(_name ## _obs,
     #warning NRF_SDH_BLE_GATT_MAX_MTU_SIZE is not defined.
 #endif
 
+/**@brief   Maximum length of the statistics characteristic value (in bytes), read by the peer with long reads. */
+#define BLE_AGG_CFG_SERVICE_MAX_STATS_LEN 320
+
 /**@brief   Nordic UART Service event types. */
 typedef enum
 {
@@ -139,6 +142,10 @@ typedef struct
 /**@brief   Nordic UART Service event handler type. */
 typedef void (*ble_agg_cfg_service_data_handler_t) (ble_agg_cfg_service_evt_t * p_evt);
 
+/**@brief   Statistics handler type. Writes the current statistics to p_data and returns their length,
+ *          at most max_len. Called when the peer starts reading the statistics characteristic. */
+typedef uint16_t (*ble_agg_cfg_service_stats_handler_t) (uint8_t * p_data, uint16_t max_len);
+
 /**@brief   Nordic UART Service initialization structure.
  *
  * @details This structure contains the initialization information for the service. The application
@@ -148,6 +155,7 @@ typedef void (*ble_agg_cfg_service_data_handler_t) (ble_agg_cfg_service_evt_t *
 typedef struct
 {
     ble_agg_cfg_service_data_handler_t data_handler; /**< Event handler to be called for handling received data. */
+    ble_agg_cfg_service_stats_handler_t stats_handler; /**< Handler filling the statistics characteristic, NULL for none. */
 } ble_agg_cfg_service_init_t;
 
 /**@brief   Nordic UART Service structure.
@@ -160,9 +168,11 @@ struct ble_agg_cfg_service_s
     uint16_t                 service_handle;          /**< Handle of Nordic UART Service (as provided by the SoftDevice). */
     ble_gatts_char_handles_t tx_handles;              /**< Handles related to the TX characteristic (as provided by the SoftDevice). */
     ble_gatts_char_handles_t rx_handles;              /**< Handles related to the RX characteristic (as provided by the SoftDevice). */
+    ble_gatts_char_handles_t stats_handles;           /**< Handles related to the statistics characteristic (as provided by the SoftDevice). */
     uint16_t                 conn_handle;             /**< Handle of the current connection (as provided by the SoftDevice). BLE_CONN_HANDLE_INVALID if not in a connection. */
     bool                     is_notification_enabled; /**< Variable to indicate if the peer has enabled notification of the RX characteristic.*/
     ble_agg_cfg_service_data_handler_t   data_handler;            /**< Event handler to be called for handling received data. */
+    ble_agg_cfg_service_stats_handler_t  stats_handler;           /**< Handler filling the statistics characteristic. */
 };
 
 
@@ -45,102 +45,14 @@
 #include "ble_types.h"
 #include "ble_srv_common.h"
 #include "ble_gattc.h"
+#include "ble_gattc_queue.h"
 #define NRF_LOG_MODULE_NAME ble_tes_c
 #include "nrf_log.h"
 NRF_LOG_MODULE_REGISTER();
 
-#define TX_BUFFER_MASK         0x07                  /**< TX Buffer mask, must be a mask of continuous zeroes, followed by continuous sequence of ones: 000...111. */
-#define TX_BUFFER_SIZE         (TX_BUFFER_MASK + 1)  /**< Size of send buffer, which is 1 higher than the mask. */
-
-#define WRITE_MESSAGE_LENGTH   BLE_CCCD_VALUE_LEN    /**< Length of the write message for CCCD. */
-#define WRITE_MESSAGE_LENGTH   BLE_CCCD_VALUE_LEN    /**< Length of the write message for CCCD. */
-
 //vinh
 extern void uart_printf(const char *fmt, ...);
 
-typedef enum
-{
-    READ_REQ,  /**< Type identifying that this tx_message is a read request. */
-    WRITE_REQ  /**< Type identifying that this tx_message is a write request. */
-} tx_request_t;
-
-/**@brief Structure for writing a message to the peer, i.e. CCCD.
- */
-typedef struct
-{
-    uint8_t                  gattc_value[WRITE_MESSAGE_LENGTH];  /**< The message to write. */
-    ble_gattc_write_params_t gattc_params;                       /**< GATTC parameters for this message. */
-} write_params_t;
-
-/**@brief Structure for holding data to be transmitted to the connected central.
- */
-typedef struct
-{
-    uint16_t     conn_handle;  /**< Connection handle to be used when transmitting this message. */
-    tx_request_t type;         /**< Type of this message, i.e. read or write message. */
-    union
-    {
-        uint16_t       read_handle;  /**< Read request message. */
-        write_params_t write_req;    /**< Write request message. */
-    } req;
-} tx_message_t;
-
-
-static tx_message_t m_tx_buffer[TX_BUFFER_SIZE];  /**< Transmit buffer for messages to be transmitted to the central. */
-static uint32_t     m_tx_insert_index = 0;        /**< Current index in the transmit buffer where the next message should be inserted. */
-static uint32_t     m_tx_index = 0;               /**< Current index in the transmit buffer from where the next message to be transmitted resides. */
-
-
-/**@brief Function for passing any pending request from the buffer to the stack.
- */
-static void tx_buffer_process(void)
-{
-    if (m_tx_index != m_tx_insert_index)
-    {
-        uint32_t err_code;
-
-        if (m_tx_buffer[m_tx_index].type == READ_REQ)
-        {
-            err_code = sd_ble_gattc_read(m_tx_buffer[m_tx_index].conn_handle,
-                                         m_tx_buffer[m_tx_index].req.read_handle,
-                                         0);
-        }
-        else
-        {
-            err_code = sd_ble_gattc_write(m_tx_buffer[m_tx_index].conn_handle,
-                                          &m_tx_buffer[m_tx_index].req.write_req.gattc_params);
-        }
-        if (err_code == NRF_SUCCESS)
-        {
-            NRF_LOG_DEBUG("SD Read/Write API returns Success..");
-            m_tx_index++;
-            m_tx_index &= TX_BUFFER_MASK;
-        }
-        else
-        {
-            NRF_LOG_DEBUG("SD Read/Write API returns error. This message sending will be "
-                "attempted again..");
-        }
-    }
-}
-
-
-/**@brief Function for handling write response events.
- *
- * @param[in] p_ble_tes_c Pointer to the Thingy Enviroment Client structure.
- * @param[in] p_ble_evt   Pointer to the BLE event received.
- */
-static void on_write_rsp(ble_tes_c_t * p_ble_tes_c, ble_evt_t const * p_ble_evt)
-{
-    // Check if the event if on the link for this instance
-    if (p_ble_tes_c->conn_handle != p_ble_evt->evt.gattc_evt.conn_handle)
-    {
-        return;
-    }
-    // Check if there is any message to be sent across to the peer and send it.
-    tx_buffer_process();
-}
-
 
 /**@brief Function for handling Handle Value Notification received from the SoftDevice.
  *
@@ -228,10 +140,48 @@ uart_printf("disconnect in ble_tes \n\r");
         p_ble_tes_c->peer_tes_db.gas_handle                 = BLE_GATT_HANDLE_INVALID;
         p_ble_tes_c->peer_tes_db.color_handle               = BLE_GATT_HANDLE_INVALID;
         p_ble_tes_c->peer_tes_db.config_handle              = BLE_GATT_HANDLE_INVALID;
+        p_ble_tes_c->config_valid                           = false;
     }
 }
 
 
+/**@brief     Function for handling read responses, of which only the config read is ours.
+ *
+ * @param[in] p_ble_tes_c Pointer to the Thingy Enviroment Client structure.
+ * @param[in] p_ble_evt   Pointer to the BLE event received.
+ */
+static void on_read_rsp(ble_tes_c_t * p_ble_tes_c, ble_evt_t const * p_ble_evt)
+{
+    ble_gattc_evt_t const          * p_gattc_evt = &p_ble_evt->evt.gattc_evt;
+    ble_gattc_evt_read_rsp_t const * p_read_rsp  = &p_gattc_evt->params.read_rsp;
+    ble_tes_c_evt_t                  ble_tes_c_evt;
+
+    if ((p_ble_tes_c->conn_handle != p_gattc_evt->conn_handle) ||
+        (p_ble_tes_c->peer_tes_db.config_handle != p_read_rsp->handle))
+    {
+        return;
+    }
+
+    if ((p_gattc_evt->gatt_status == BLE_GATT_STATUS_SUCCESS) &&
+        (p_read_rsp->offset == 0) && (p_read_rsp->len == BLE_TES_CONFIG_LEN))
+    {
+        p_ble_tes_c->config.temperature_interval_ms = uint16_decode(&p_read_rsp->data[0]);
+        p_ble_tes_c->config.pressure_interval_ms    = uint16_decode(&p_read_rsp->data[2]);
+        p_ble_tes_c->config.humidity_interval_ms    = uint16_decode(&p_read_rsp->data[4]);
+        p_ble_tes_c->config.color_interval_ms       = uint16_decode(&p_read_rsp->data[6]);
+        p_ble_tes_c->config.gas_interval_mode       = p_read_rsp->data[8];
+        p_ble_tes_c->config.color_led_red           = p_read_rsp->data[9];
+        p_ble_tes_c->config.color_led_green         = p_read_rsp->data[10];
+        p_ble_tes_c->config.color_led_blue          = p_read_rsp->data[11];
+        p_ble_tes_c->config_valid                   = true;
+    }
+
+    ble_tes_c_evt.evt_type    = BLE_TES_C_EVT_CONFIG_READ;
+    ble_tes_c_evt.conn_handle = p_ble_tes_c->conn_handle;
+    p_ble_tes_c->evt_handler(p_ble_tes_c, &ble_tes_c_evt);
+}
+
+
 void ble_tes_on_db_disc_evt(ble_tes_c_t * p_ble_tes_c, ble_db_discovery_evt_t const * p_evt)
 {
 
@@ -332,6 +282,7 @@ uint32_t ble_tes_c_init(ble_tes_c_t * p_ble_tes_c, ble_tes_c_init_t * p_ble_tes_
     p_ble_tes_c->peer_tes_db.gas_handle                 = BLE_GATT_HANDLE_INVALID;
     p_ble_tes_c->peer_tes_db.color_handle               = BLE_GATT_HANDLE_INVALID;
     p_ble_tes_c->peer_tes_db.config_handle              = BLE_GATT_HANDLE_INVALID;
+    p_ble_tes_c->config_valid                           = false;
     p_ble_tes_c->evt_handler                    = p_ble_tes_c_init->evt_handler;
 
     err_code = sd_ble_uuid_vs_add(&tes_base_uuid, &p_ble_tes_c->uuid_type);
@@ -366,8 +317,8 @@ void ble_tes_c_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
             on_hvx(p_ble_tes_c, p_ble_evt);
             break;
 
-        case BLE_GATTC_EVT_WRITE_RSP:
-            on_write_rsp(p_ble_tes_c, p_ble_evt);
+        case BLE_GATTC_EVT_READ_RSP:
+            on_read_rsp(p_ble_tes_c, p_ble_evt);
             break;
 
         case BLE_GAP_EVT_DISCONNECTED:
@@ -380,40 +331,6 @@ void ble_tes_c_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
 }
 
 
-/**@brief Function for configuring the CCCD.
- *
- * @param[in] conn_handle The connection handle on which to configure the CCCD.
- * @param[in] handle_cccd The handle of the CCCD to be configured.
- * @param[in] enable      Whether to enable or disable the CCCD.
- *
- * @return NRF_SUCCESS if the CCCD configure was successfully sent to the peer.
- */
-static uint32_t cccd_configure_tes(uint16_t conn_handle, uint16_t handle_cccd, bool enable)
-{
-    NRF_LOG_DEBUG("Configuring CCCD. CCCD Handle = %d, Connection Handle = %d",
-        handle_cccd,conn_handle);
-
-    tx_message_t * p_msg;
-    uint16_t       cccd_val = enable ? BLE_GATT_HVX_NOTIFICATION : 0;
-    
-    p_msg              = &m_tx_buffer[m_tx_insert_index++];
-    m_tx_insert_index &= TX_BUFFER_MASK;
-
-    p_msg->req.write_req.gattc_params.handle   = handle_cccd;
-    p_msg->req.write_req.gattc_params.len      = WRITE_MESSAGE_LENGTH;
-    p_msg->req.write_req.gattc_params.p_value  = p_msg->req.write_req.gattc_value;
-    p_msg->req.write_req.gattc_params.offset   = 0;
-    p_msg->req.write_req.gattc_params.write_op = BLE_GATT_OP_WRITE_REQ;
-    p_msg->req.write_req.gattc_value[0]        = LSB_16(cccd_val);
-    p_msg->req.write_req.gattc_value[1]        = MSB_16(cccd_val);
-    p_msg->conn_handle                         = conn_handle;
-    p_msg->type                                = WRITE_REQ;
-
-    tx_buffer_process();
-    return NRF_SUCCESS;
-}
-
-
 uint32_t ble_tes_c_temperature_notif_enable(ble_tes_c_t * p_ble_tes_c)
 {
     VERIFY_PARAM_NOT_NULL(p_ble_tes_c);
@@ -423,9 +340,9 @@ uint32_t ble_tes_c_temperature_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.temperature_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.temperature_cccd_handle,
+                                          true);
 }
 
 uint32_t ble_tes_c_pressure_notif_enable(ble_tes_c_t * p_ble_tes_c)
@@ -437,9 +354,9 @@ uint32_t ble_tes_c_pressure_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.pressure_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.pressure_cccd_handle,
+                                          true);
 }
 
 uint32_t ble_tes_c_humidity_notif_enable(ble_tes_c_t * p_ble_tes_c)
@@ -451,9 +368,9 @@ uint32_t ble_tes_c_humidity_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.humidity_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.humidity_cccd_handle,
+                                          true);
 }
 
 uint32_t ble_tes_c_gas_notif_enable(ble_tes_c_t * p_ble_tes_c)
@@ -465,9 +382,9 @@ uint32_t ble_tes_c_gas_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.gas_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.gas_cccd_handle,
+                                          true);
 }
 
 uint32_t ble_tes_c_color_notif_enable(ble_tes_c_t * p_ble_tes_c)
@@ -479,9 +396,9 @@ uint32_t ble_tes_c_color_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.color_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.color_cccd_handle,
+                                          true);
 }
 
 uint32_t ble_tes_c_config_notif_enable(ble_tes_c_t * p_ble_tes_c)
@@ -493,9 +410,59 @@ uint32_t ble_tes_c_config_notif_enable(ble_tes_c_t * p_ble_tes_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure_tes(p_ble_tes_c->conn_handle,
-                          p_ble_tes_c->peer_tes_db.config_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_tes_c->conn_handle,
+                                          p_ble_tes_c->peer_tes_db.config_cccd_handle,
+                                          true);
+}
+
+uint32_t ble_tes_c_config_write(ble_tes_c_t * p_ble_tes_c, ble_tes_config_t const * p_config)
+{
+    uint8_t  value[BLE_TES_CONFIG_LEN];
+    uint32_t err_code;
+
+    VERIFY_PARAM_NOT_NULL(p_ble_tes_c);
+    VERIFY_PARAM_NOT_NULL(p_config);
+
+    if ((p_ble_tes_c->conn_handle == BLE_CONN_HANDLE_INVALID) ||
+        (p_ble_tes_c->peer_tes_db.config_handle == BLE_GATT_HANDLE_INVALID))
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
+    // Little endian, packed, as the Thingy firmware lays out the characteristic
+    (void)uint16_encode(p_config->temperature_interval_ms, &value[0]);
+    (void)uint16_encode(p_config->pressure_interval_ms,    &value[2]);
+    (void)uint16_encode(p_config->humidity_interval_ms,    &value[4]);
+    (void)uint16_encode(p_config->color_interval_ms,       &value[6]);
+    value[8]  = p_config->gas_interval_mode;
+    value[9]  = p_config->color_led_red;
+    value[10] = p_config->color_led_green;
+    value[11] = p_config->color_led_blue;
+
+    err_code = ble_gattc_queue_write(p_ble_tes_c->conn_handle,
+                                     p_ble_tes_c->peer_tes_db.config_handle,
+                                     BLE_GATT_OP_WRITE_REQ,
+                                     value,
+                                     sizeof(value));
+    if (err_code == NRF_SUCCESS)
+    {
+        p_ble_tes_c->config       = *p_config;
+        p_ble_tes_c->config_valid = true;
+    }
+    return err_code;
+}
+
+uint32_t ble_tes_c_config_read(ble_tes_c_t * p_ble_tes_c)
+{
+    VERIFY_PARAM_NOT_NULL(p_ble_tes_c);
+
+    if ((p_ble_tes_c->conn_handle == BLE_CONN_HANDLE_INVALID) ||
+        (p_ble_tes_c->peer_tes_db.config_handle == BLE_GATT_HANDLE_INVALID))
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
+    return ble_gattc_queue_read(p_ble_tes_c->conn_handle, p_ble_tes_c->peer_tes_db.config_handle);
 }
 
 uint32_t ble_tes_c_handles_assign(ble_tes_c_t    * p_ble_tes_c,
@@ -506,7 +473,8 @@ uint32_t ble_tes_c_handles_assign(ble_tes_c_t    * p_ble_tes_c,
 
     VERIFY_PARAM_NOT_NULL(p_ble_tes_c);
 
-    p_ble_tes_c->conn_handle = conn_handle;
+    p_ble_tes_c->conn_handle  = conn_handle;
+    p_ble_tes_c->config_valid = false;
     if (p_peer_handles != NULL)
     {
         p_ble_tes_c->peer_tes_db = *p_peer_handles;
@@ -542,82 +510,92 @@ ble_tes_humidity_hex_t vf_humidity_dec_to_hex(ble_tes_humidity_t humidity)
   return (ble_tes_humidity_hex_t)humidity;
 }
 
-void vf_ble_tes_add_sum_temperature(thingy_edata_t *p_edata, ble_tes_temperature_t in_temperature)
+uint16_t vf_ble_tes_sampling_interval_ms(uint32_t window_ms, uint8_t samples_per_window)
 {
-    ble_tes_temperature_hex_t temperature;
-    temperature=vf_temperature_dec_to_hex(in_temperature);
-    
+  uint32_t interval;
 
-    p_edata->temperature.sum +=temperature;
-    p_edata->temperature.cnt++;
-    if(p_edata->temperature.cnt==255)
-    {
-      vf_ble_tes_average_temperature(p_edata);
-    }
-  return;
+  if(samples_per_window==0) samples_per_window=1;
+  interval=window_ms/samples_per_window;
+  if(interval<BLE_TES_CONFIG_INTERVAL_MIN_MS) interval=BLE_TES_CONFIG_INTERVAL_MIN_MS;
+  if(interval>BLE_TES_CONFIG_INTERVAL_MAX_MS) interval=BLE_TES_CONFIG_INTERVAL_MAX_MS;
+  return (uint16_t)interval;
 }
 
-int16_t vf_ble_tes_average_temperature(thingy_edata_t *p_edata)
+static void vf_window_add(thingy_sensor_window_t *p_window, int32_t value)
 {
-  if(p_edata->temperature.cnt!=0)
+  if(p_window->cnt==0)
+  {
+    p_window->min=value;
+    p_window->max=value;
+  }
+  else
+  {
+    if(value<p_window->min) p_window->min=value;
+    if(value>p_window->max) p_window->max=value;
+  }
+  p_window->last=value;
+  p_window->seen=true;
+  //a window longer than the counter covers keeps the mean of its first 65535 samples
+  if(p_window->cnt!=UINT16_MAX)
   {
-    p_edata->temperature.avg=(int16_t)(p_edata->temperature.sum/p_edata->temperature.cnt);
-    p_edata->temperature.cnt=0;
-    p_edata->temperature.sum=0;
+    p_window->sum+=value;
+    p_window->cnt++;
   }
+}
 
-  return p_edata->temperature.avg;
+static void vf_window_close(thingy_sensor_window_t *p_window)
+{
+  if(p_window->cnt!=0)
+  {
+    p_window->done.min=p_window->min;
+    p_window->done.max=p_window->max;
+    p_window->done.mean=(int32_t)(p_window->sum/p_window->cnt);
+    p_window->done.last=p_window->last;
+  }
+  else
+  {//nothing arrived, report the last known value
+    p_window->done.min=p_window->last;
+    p_window->done.max=p_window->last;
+    p_window->done.mean=p_window->last;
+    p_window->done.last=p_window->last;
+  }
+  p_window->done.cnt=p_window->cnt;
+  p_window->sum=0;
+  p_window->cnt=0;
 }
 
+void vf_ble_tes_add_sum_temperature(thingy_edata_t *p_edata, ble_tes_temperature_t in_temperature)
+{
+  vf_window_add(&p_edata->temperature, vf_temperature_dec_to_hex(in_temperature));
+}
 
 void vf_ble_tes_add_sum_pressure(thingy_edata_t *p_edata, ble_tes_pressure_t in_pressure)
 {
-    ble_tes_pressure_hex_t pressure;
-    pressure=vf_pressure_dec_to_hex(in_pressure);
-
-    p_edata->pressure.sum+=pressure;
-    p_edata->pressure.cnt++;
-    if(p_edata->pressure.cnt==255)
-    {
-      vf_ble_tes_average_pressure(p_edata);
-    }
-  return;
+  vf_window_add(&p_edata->pressure, vf_pressure_dec_to_hex(in_pressure));
 }
 
-int32_t vf_ble_tes_average_pressure(thingy_edata_t *p_edata)
+void vf_ble_tes_add_sum_humidity(thingy_edata_t *p_edata, ble_tes_humidity_t in_humidity)
 {
-  if(p_edata->pressure.cnt!=0)
-  {
-    p_edata->pressure.avg=(int32_t)(p_edata->pressure.sum/p_edata->pressure.cnt);
-    p_edata->pressure.cnt=0;
-    p_edata->pressure.sum=0;
-  }
-  return p_edata->pressure.avg;
+  vf_window_add(&p_edata->humidity, vf_humidity_dec_to_hex(in_humidity));
 }
 
-void vf_ble_tes_add_sum_humidity(thingy_edata_t *p_edata, ble_tes_humidity_t in_humidity)
+void vf_ble_tes_window_close(thingy_edata_t *p_edata)
 {
-    ble_tes_humidity_hex_t humidity;
-    humidity=vf_humidity_dec_to_hex(in_humidity);
+  vf_window_close(&p_edata->temperature);
+  vf_window_close(&p_edata->pressure);
+  vf_window_close(&p_edata->humidity);
+}
 
-    p_edata->humidity.sum+=humidity;
-    p_edata->humidity.cnt++;
-    if(p_edata->humidity.cnt==255)
-    {
-      vf_ble_tes_average_humidity(p_edata);
-    }
-  return;
+void vf_ble_tes_window_reset(thingy_edata_t *p_edata)
+{
+  memset(&p_edata->temperature,0,sizeof(p_edata->temperature));
+  memset(&p_edata->pressure,0,sizeof(p_edata->pressure));
+  memset(&p_edata->humidity,0,sizeof(p_edata->humidity));
 }
 
-int16_t vf_ble_tes_average_humidity(thingy_edata_t *p_edata)
+bool vf_ble_tes_window_has_data(thingy_edata_t const *p_edata)
 {
-  if(p_edata->humidity.cnt!=0)
-  {
-    p_edata->humidity.avg=(int16_t)(p_edata->humidity.sum/p_edata->humidity.cnt);
-    p_edata->humidity.cnt=0;
-    p_edata->humidity.sum=0;
-  }
-  return p_edata->humidity.avg;
+  return p_edata->temperature.seen && p_edata->pressure.seen && p_edata->humidity.seen;
 }
 
 //#endif // NRF_MODULE_ENABLED(BLE_TES_C)
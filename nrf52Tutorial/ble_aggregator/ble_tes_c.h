@@ -62,6 +62,7 @@
 #define BLE_TES_C_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "ble.h"
 #include "ble_db_discovery.h"
 #include "nrf_sdh_ble.h"
@@ -139,7 +140,8 @@ typedef enum
     BLE_TES_C_EVT_HUMIDITY_NOTIFICATION,        /**< Event indicating that a notification of the Thingy enviroment humidity characteristic has been received from the peer. */ 
     BLE_TES_C_EVT_GAS_NOTIFICATION,             /**< Event indicating that a notification of the Thingy enviroment gas characteristic has been received from the peer. */
     BLE_TES_C_EVT_COLOR_NOTIFICATION,           /**< Event indicating that a notification of the Thingy enviroment color characteristic has been received from the peer. */
-    BLE_TES_C_EVT_CONFIG_NOTIFICATION           /**< Event indicating that a notification of the Thingy enviroment config characteristic has been received from the peer. Can't handle this yet. */
+    BLE_TES_C_EVT_CONFIG_NOTIFICATION,          /**< Event indicating that a notification of the Thingy enviroment config characteristic has been received from the peer. Can't handle this yet. */
+    BLE_TES_C_EVT_CONFIG_READ                   /**< Event indicating that a read of the Thingy enviroment config characteristic has completed. The config is in ble_tes_c_t if config_valid is set. */
 } ble_tes_c_evt_type_t;
 
 typedef struct
@@ -219,6 +221,19 @@ typedef struct
     } params;
 } ble_tes_c_evt_t;
 
+/**@brief Thingy enviroment config, the value of the config characteristic. Intervals are in ms. */
+typedef struct
+{
+    uint16_t temperature_interval_ms;   /**< 100 to 60000 ms. */
+    uint16_t pressure_interval_ms;      /**< 50 to 60000 ms. */
+    uint16_t humidity_interval_ms;      /**< 100 to 60000 ms. */
+    uint16_t color_interval_ms;         /**< 200 to 60000 ms. */
+    uint8_t  gas_interval_mode;         /**< 1: 1 s, 2: 10 s, 3: 60 s. */
+    uint8_t  color_led_red;             /**< LED color used while measuring color. */
+    uint8_t  color_led_green;
+    uint8_t  color_led_blue;
+} ble_tes_config_t;
+
 // Forward declaration of the ble_tes_c_t type.
 typedef struct ble_tes_c_s ble_tes_c_t;
 
@@ -236,6 +251,8 @@ struct ble_tes_c_s
     tes_db_t                peer_tes_db;  /**< Handles related to tes on the peer*/
     ble_tes_c_evt_handler_t evt_handler;  /**< Application event handler to be called when there is an event related to the Thingy Enviroment service. */
     uint8_t                 uuid_type;    /**< UUID type. */
+    ble_tes_config_t        config;       /**< Config of the peer, as last read or written. */
+    bool                    config_valid; /**< config holds the peer's config, cleared on connect and disconnect. */
 };
 
 /**@brief Thingy Enviroment Client initialization structure. */
@@ -245,32 +262,37 @@ typedef struct
 } ble_tes_c_init_t;
 
 
-typedef struct struct_thingy_temparature_process_type
-{
-  int16_t avg;
-  ble_tes_temperature_hex_t sum;
-  uint8_t cnt;    
-}thingy_temperature_process_t;
+#define BLE_TES_CONFIG_LEN              12      /**< Encoded length of ble_tes_config_t, the Thingy takes no other. */
+#define BLE_TES_CONFIG_INTERVAL_MIN_MS  100     /**< Shortest interval all sensors accept. */
+#define BLE_TES_CONFIG_INTERVAL_MAX_MS  60000
 
-typedef struct struct_thingy_pressure_process_type
+//statistics of one closed aggregation window
+typedef struct struct_thingy_sensor_stats_type
 {
-  int32_t avg;
-  ble_tes_pressure_hex_t sum;
-  uint8_t cnt;    
-}thingy_pressure_process_t;
-
-typedef struct struct_thingy_humidity_process_type
+  int32_t  min;
+  int32_t  max;
+  int32_t  mean;
+  int32_t  last;
+  uint16_t cnt;   //samples in the window, 0 if none arrived (the values are then the last known one)
+}thingy_sensor_stats_t;
+
+//aggregation window of one sensor, values in hundredths (temperature, pressure) or percent (humidity)
+typedef struct struct_thingy_sensor_window_type
 {
-  int16_t avg;
-  ble_tes_humidity_hex_t sum;
-  uint8_t cnt;    
-}thingy_humidity_process_t;
+  thingy_sensor_stats_t done;   //last closed window, this is what gets reported
+  int64_t  sum;                 //open window
+  int32_t  min;
+  int32_t  max;
+  int32_t  last;
+  uint16_t cnt;
+  bool     seen;                //a sample arrived since the last reset, last is a real value
+}thingy_sensor_window_t;
 
 typedef struct struct_thingy_enviroment_process_type
 {
-  thingy_temperature_process_t temperature;
-  thingy_pressure_process_t pressure;
-  thingy_humidity_process_t humidity; 
+  thingy_sensor_window_t temperature;
+  thingy_sensor_window_t pressure;
+  thingy_sensor_window_t humidity; 
   uint8_t button;
 }thingy_edata_t;
 
@@ -354,11 +376,43 @@ uint32_t ble_tes_c_handles_assign(ble_tes_c_t *    p_ble_tes_c,
                                   uint16_t         conn_handle,
                                   const tes_db_t * p_peer_handles);
 
+/**@brief Function for writing the Thingy enviroment config characteristic.
+ *
+ * @param[in] p_ble_tes_c Pointer to the Thingy Enviroment Client structure.
+ * @param[in] p_config    Config to write, the intervals must be in the ranges the Thingy accepts.
+ *
+ * @retval  NRF_SUCCESS If the write has been queued. Otherwise, an error code returned by
+ *                      @ref ble_gattc_queue_write.
+ *          NRF_ERROR_INVALID_STATE if no connection handle or config handle has been assigned
+ *          NRF_ERROR_NULL if a given parameter is NULL
+ */
+uint32_t ble_tes_c_config_write(ble_tes_c_t * p_ble_tes_c, ble_tes_config_t const * p_config);
+
+/**@brief Function for reading the Thingy enviroment config characteristic.
+ *
+ * @details The config is kept in p_ble_tes_c and @ref BLE_TES_C_EVT_CONFIG_READ is sent when
+ *          the read has completed, so that a write can change some fields and keep the others.
+ *
+ * @param[in] p_ble_tes_c Pointer to the Thingy Enviroment Client structure.
+ *
+ * @retval  NRF_SUCCESS If the read has been queued. Otherwise, an error code returned by
+ *                      @ref ble_gattc_queue_read.
+ *          NRF_ERROR_INVALID_STATE if no connection handle or config handle has been assigned
+ *          NRF_ERROR_NULL if a given parameter is NULL
+ */
+uint32_t ble_tes_c_config_read(ble_tes_c_t * p_ble_tes_c);
+
+//sampling interval that gives samples_per_window samples per window, clamped to what all sensors accept
+uint16_t vf_ble_tes_sampling_interval_ms(uint32_t window_ms, uint8_t samples_per_window);
+
 void vf_ble_tes_add_sum_temperature(thingy_edata_t *p_edata, ble_tes_temperature_t in_temperature);
-int16_t vf_ble_tes_average_temperature(thingy_edata_t *p_edata);
 void vf_ble_tes_add_sum_pressure(thingy_edata_t *p_edata, ble_tes_pressure_t in_pressure);
-int32_t vf_ble_tes_average_pressure(thingy_edata_t *p_edata);
 void vf_ble_tes_add_sum_humidity(thingy_edata_t *p_edata, ble_tes_humidity_t in_humidity);
-int16_t vf_ble_tes_average_humidity(thingy_edata_t *p_edata);
+//closes the open window of every sensor, the results are in <sensor>.done
+void vf_ble_tes_window_close(thingy_edata_t *p_edata);
+//drops the open windows and the last results, for a new Thingy on the link
+void vf_ble_tes_window_reset(thingy_edata_t *p_edata);
+//every sensor has sent a sample since the last reset, before that closed windows hold no real values
+bool vf_ble_tes_window_has_data(thingy_edata_t const *p_edata);
 
 #endif
\ No newline at end of file
@@ -150,6 +150,7 @@ typedef struct
     uint16_t button_cccd_handle;  /**< Handle of the CCCD of the Button characteristic. */
     uint16_t button_handle;       /**< Handle of the Button characteristic as provided by the SoftDevice. */
     uint16_t led_handle;          /**< Handle of the LED characteristic as provided by the SoftDevice. */
+    uint8_t  led_write_op;        /**< Write operation the LED characteristic allows, BLE_GATT_OP_WRITE_CMD or BLE_GATT_OP_WRITE_REQ. */
 } thingy_uis_db_t;
 
 /**@brief LED Button Event structure. */
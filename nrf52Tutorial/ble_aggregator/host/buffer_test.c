@@ -0,0 +1,102 @@
+// Phone buffer test: a link made dirty while the flash log is replayed reaches the phone after the
+// backlog already in the RAM buffer, not after the whole log, and the log still reaches the phone
+// whole and in order. Returns non-zero on a failed check.
+#include "app_aggregator.h"
+#include "agg_flash_log.h"
+#include "host_shim.h"
+#include "sdk_config.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_CONN_HANDLE        0
+#define TEST_READINGS           3000    // well over what the RAM buffer holds
+#define TEST_READING_SIZE       15      // AGG_NODE_LINK_DATA_UPDATE, as the sink hands it on
+#define TEST_LIVE_WAIT_MAX      64      // readings of 15 bytes in CMD_BUFFER_LOG_FILL of app_aggregator.c
+
+#define TEST_CHECK(cond) do { if(!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); m_failed++; } } while(0)
+
+static uint32_t m_failed;
+static uint32_t m_readings;             // got by the phone
+static uint32_t m_readings_in_order;
+static uint32_t m_link_updates;
+static uint32_t m_readings_before_update;
+
+static void test_phone_record(uint8_t const *p_record, uint16_t length)
+{
+    if((p_record[0] == AGG_NODE_LINK_DATA_UPDATE) && (length >= TEST_READING_SIZE))
+    {
+        // the pressure carries the serial number
+        uint32_t serial = ((uint32_t)p_record[8] << 24) | ((uint32_t)p_record[9] << 16) |
+                          ((uint32_t)p_record[10] << 8) | p_record[11];
+
+        m_readings_in_order += (serial == m_readings);
+        m_readings++;
+    }
+    else if((p_record[0] == AGG_BLE_LINK_DATA_UPDATE) && (length >= 7) && (p_record[2] == TEST_CONN_HANDLE))
+    {
+        if(m_link_updates++ == 0)
+        {
+            m_readings_before_update = m_readings;
+        }
+        TEST_CHECK(p_record[4] == 1);   // the button state set below
+    }
+}
+
+// A relay record from cluster 1 for the sink, as vf_process_adv_command3() hands it on
+static void test_reading_put(uint32_t serial)
+{
+    uint8_t       data[TEST_READING_SIZE] = {1, 0, (uint8_t)serial, 0, AGG_NODE_LINK_DATA_UPDATE, 0, 0x07, 0xD0,
+                                             (uint8_t)(serial >> 24), (uint8_t)(serial >> 16),
+                                             (uint8_t)(serial >> 8), (uint8_t)serial, 0x12, 0x34, 0};
+    uint8_array_t userdata = {.size = sizeof(data), .p_data = data};
+
+    vf_app_adv_data_send_to_phone(&userdata);
+}
+
+int main(void)
+{
+    static ble_agg_cfg_service_t  service;
+    ble_gap_evt_t                 gap_evt = {.conn_handle = TEST_CONN_HANDLE};
+    connected_device_info_t       dev_info = {.dev_type = 1, .dev_name = "Blinky", .phy = BLE_GAP_PHY_1MBPS};
+    app_aggregator_buffer_stats_t buf_stats;
+    uint32_t                      flushes = 0;
+
+    agg_flash_log_init();
+    app_aggregator_init(&service);
+    app_aggregator_batch_mode_set(true);
+    app_aggregator_att_mtu_set(NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+    host_phone_init(test_phone_record);
+
+    // The phone has the link, then goes away while the readings come in
+    app_aggregator_on_central_connect(&gap_evt, &dev_info);
+    host_phone_budget_set(UINT16_MAX);
+    while(app_aggregator_flush_ble_commands());
+    host_phone_budget_set(0);
+    for(uint32_t serial = 0; serial < TEST_READINGS; serial++)
+    {
+        test_reading_put(serial);
+    }
+    TEST_CHECK(!agg_flash_log_is_empty());
+
+    // Back, one notification per connection event; the button is pressed on the replay's first event
+    for(host_phone_budget_set(1); app_aggregator_flush_ble_commands(); host_phone_budget_set(1))
+    {
+        if(flushes++ == 0)
+        {
+            app_aggregator_on_blinky_data(TEST_CONN_HANDLE, 1);
+        }
+    }
+
+    app_aggregator_buffer_stats_get(&buf_stats);
+    TEST_CHECK(m_link_updates == 1);
+    TEST_CHECK(m_readings_before_update <= TEST_LIVE_WAIT_MAX);
+    TEST_CHECK(m_readings == TEST_READINGS);
+    TEST_CHECK(m_readings_in_order == TEST_READINGS);
+    TEST_CHECK(agg_flash_log_is_empty());
+    TEST_CHECK((buf_stats.records == 0) && (buf_stats.drop_count == 0));
+
+    printf("buffer_test: link update after %u of %u readings, %u notifications, %s\n",
+           (unsigned)m_readings_before_update, (unsigned)m_readings, (unsigned)flushes,
+           m_failed ? "FAILED" : "passed");
+    return m_failed ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+#include "host_shim.h"
+#include "app_aggregator.h"
+#include "agg_flash_log.h"
+#include "agg_stats.h"
+#include "agg_trace.h"
+#include "ble_gattc_queue.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static host_phone_record_handler_t m_phone_handler;
+static uint16_t                    m_phone_budget;
+static uint32_t                    m_phone_sent;
+static uint32_t                    m_phone_refused;
+
+void host_phone_init(host_phone_record_handler_t handler)
+{
+    m_phone_handler = handler;
+    m_phone_budget  = 0;
+    m_phone_sent    = 0;
+    m_phone_refused = 0;
+}
+
+void host_phone_budget_set(uint16_t notifications)
+{
+    m_phone_budget = notifications;
+}
+
+void host_phone_counts_get(uint32_t *p_sent, uint32_t *p_refused)
+{
+    *p_sent    = m_phone_sent;
+    *p_refused = m_phone_refused;
+}
+
+// The notification as the phone gets it, see AGG_BLE_RECORD_BATCH in app_aggregator.h
+uint32_t ble_agg_cfg_service_string_send(ble_agg_cfg_service_t *p_agg_cfg_service, uint8_t *p_string, uint16_t *p_length)
+{
+    uint16_t pos;
+
+    UNUSED_PARAMETER(p_agg_cfg_service);
+    if(m_phone_budget == 0)
+    {
+        // No buffer left in the SoftDevice for this connection event
+        m_phone_refused++;
+        return NRF_ERROR_RESOURCES;
+    }
+    m_phone_budget--;
+    m_phone_sent++;
+
+    if(m_phone_handler == NULL)
+    {
+        return NRF_SUCCESS;
+    }
+    if(p_string[0] != AGG_BLE_RECORD_BATCH)
+    {
+        m_phone_handler(p_string, *p_length);
+        return NRF_SUCCESS;
+    }
+    for(pos = 1; (pos < *p_length) && (pos + 1 + p_string[pos] <= *p_length); pos += 1 + p_string[pos])
+    {
+        m_phone_handler(&p_string[pos + 1], p_string[pos]);
+    }
+    return NRF_SUCCESS;
+}
+
+uint16_t ble_gattc_queue_depth_get(uint16_t conn_handle)
+{
+    UNUSED_PARAMETER(conn_handle);
+    return 0;
+}
+
+void ble_gattc_queue_stats_get(ble_gattc_queue_stats_t *p_stats)
+{
+    memset(p_stats, 0, sizeof(*p_stats));
+}
+
+void uart_printf(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+uint32_t uart_printf_dropped_get(void)
+{
+    return 0;
+}
+
+uint32_t agg_trace_dropped_get(void)
+{
+    return 0;
+}
+
+#if !AGG_STATS_ENABLED
+uint16_t agg_stats_serialize(uint8_t *p_buf, uint16_t max_len)
+{
+    UNUSED_PARAMETER(p_buf);
+    UNUSED_PARAMETER(max_len);
+    return 0;
+}
+#endif
+
+// agg_flash_log.h: records back to back, a length byte then the record, in a ring of
+// the data room of the flash ring
+#define HOST_FLASH_LOG_SIZE     (AGG_FLASH_LOG_CHUNK_COUNT * AGG_FLASH_LOG_CHUNK_DATA_SIZE)
+
+static struct
+{
+    uint8_t                data[HOST_FLASH_LOG_SIZE];
+    uint32_t               in;
+    uint32_t               out;
+    uint32_t               used;
+    uint8_t                peek[UINT8_MAX];
+    host_flash_log_stats_t stats;
+}m_host_flash_log;
+
+static void host_flash_log_copy_out(uint32_t pos, uint8_t *p_dst, uint16_t length)
+{
+    for(uint16_t i = 0; i < length; i++)
+    {
+        p_dst[i] = m_host_flash_log.data[(pos + i) % HOST_FLASH_LOG_SIZE];
+    }
+}
+
+void agg_flash_log_init(void)
+{
+    memset(&m_host_flash_log, 0, sizeof(m_host_flash_log));
+}
+
+bool agg_flash_log_put(uint8_t const *p_data, uint16_t length)
+{
+    if((length == 0) || (length > UINT8_MAX) || (m_host_flash_log.used + 1 + length > HOST_FLASH_LOG_SIZE))
+    {
+        m_host_flash_log.stats.refused++;
+        return false;
+    }
+    m_host_flash_log.data[m_host_flash_log.in] = (uint8_t)length;
+    for(uint16_t i = 0; i < length; i++)
+    {
+        m_host_flash_log.data[(m_host_flash_log.in + 1 + i) % HOST_FLASH_LOG_SIZE] = p_data[i];
+    }
+    m_host_flash_log.in = (m_host_flash_log.in + 1 + length) % HOST_FLASH_LOG_SIZE;
+    m_host_flash_log.used += 1 + length;
+    m_host_flash_log.stats.stored++;
+    if(m_host_flash_log.used > m_host_flash_log.stats.high_water)
+    {
+        m_host_flash_log.stats.high_water = m_host_flash_log.used;
+    }
+    return true;
+}
+
+bool agg_flash_log_peek(uint8_t const **pp_data, uint16_t *p_length)
+{
+    if(m_host_flash_log.used == 0)
+    {
+        return false;
+    }
+    *p_length = m_host_flash_log.data[m_host_flash_log.out];
+    host_flash_log_copy_out(m_host_flash_log.out + 1, m_host_flash_log.peek, *p_length);
+    *pp_data = m_host_flash_log.peek;
+    return true;
+}
+
+void agg_flash_log_pop(void)
+{
+    uint32_t record_size;
+
+    if(m_host_flash_log.used == 0)
+    {
+        return;
+    }
+    record_size = 1 + m_host_flash_log.data[m_host_flash_log.out];
+    m_host_flash_log.out = (m_host_flash_log.out + record_size) % HOST_FLASH_LOG_SIZE;
+    m_host_flash_log.used -= record_size;
+    m_host_flash_log.stats.replayed++;
+}
+
+bool agg_flash_log_is_empty(void)
+{
+    return m_host_flash_log.used == 0;
+}
+
+void host_flash_log_stats_get(host_flash_log_stats_t *p_stats)
+{
+    *p_stats = m_host_flash_log.stats;
+}
@@ -0,0 +1,33 @@
+#ifndef __HOST_SHIM_H
+#define __HOST_SHIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// What the SoftDevice and the rest of the firmware are to app_aggregator.c and relay_pool.c in
+// the host build: the phone link, the GATTC queue, the UART and an agg_flash_log.h kept in RAM.
+// Nothing here runs on the target.
+
+// Called for each record the phone gets, a batch is handed over one record at a time
+typedef void (*host_phone_record_handler_t)(uint8_t const *p_record, uint16_t length);
+
+void host_phone_init(host_phone_record_handler_t handler);
+
+// Notifications the phone link takes until the next call, 0 while the phone is away
+void host_phone_budget_set(uint16_t notifications);
+
+// Notifications the phone link took and refused since host_phone_init()
+void host_phone_counts_get(uint32_t *p_sent, uint32_t *p_refused);
+
+// The flash log has the room of AGG_FLASH_LOG_CHUNK_COUNT chunks, it is written and read at once
+typedef struct
+{
+    uint32_t stored;
+    uint32_t replayed;
+    uint32_t refused;       // log full
+    uint32_t high_water;    // bytes
+}host_flash_log_stats_t;
+
+void host_flash_log_stats_get(host_flash_log_stats_t *p_stats);
+
+#endif
@@ -0,0 +1,670 @@
+// Relay benchmark: replays the relay records a cluster head hears through the relay logic of
+// main.c (relay_sched_rx() from on_adv_report, relay_sched_tick() from vf_relay_adv_data3) with
+// relay_sched.c, relay_pool.c and app_aggregator.c as they are built for the target, see host_shim.h
+// for what stands in for the rest. The relay tick follows the relay level as m_adv_timer_id does.
+//
+//   relay_bench [-c clusters] [-t Thingies per cluster] [-H max hops] [-d copies] [-l loss %]
+//               [-i reading interval ms] [-s seconds] [-x seed]
+//               [-p notifications per step] [-w phone away s] [-m ATT MTU] [-b] [-S] [trace file]
+//
+// Without a trace file the stream is synthetic: every Thingy sends a reading to the sink once per
+// interval (the sensor window of main.c, 10 s), heard here up to d times from neighbours 1 to H hops from its cluster, each copy lost
+// with l % probability. A trace file is the UART or RTT output of a cluster head with agg_trace
+// enabled, its AGG_TRACE_EVT_ADV_USERDATA records are replayed at their timing.
+//
+// Each stream runs twice: at a cluster head half way, which relays the records, then at the sink,
+// which hands the readings to the phone. Printed for each run:
+//   reports/s      relay records through the relay logic per second of host time, with the relay ticks
+//                  and the phone flushes of the run
+//   relay ticks    ticks and relay level changes, advertising times saved by duplicates heard
+//   high-water     relay pool blocks and live history ids, phone buffer and flash log bytes
+//   dedup          copies the relay pool told apart right, the first copy of a record as new and
+//                  the others heard within HIST_ADV_TTL_SEC of it as duplicates
+//   delivery       records put on the air at least once (relay), readings the phone got (sink),
+//                  of those sent by the Thingies
+#include "relay_pool.h"
+#include "relay_sched.h"
+#include "relay_codec.h"
+#include "agg_trace.h"
+#include "agg_flash_log.h"
+#include "app_aggregator.h"
+#include "host_shim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SINK_ID           0
+#define BENCH_RECORD_SIZE       15      // AGG_NODE_LINK_DATA_UPDATE, as vf_adv_thingy_data() builds it
+#define BENCH_HOP_DELAY_MS      150     // relay ticks a block waits per hop, about
+#define BENCH_ORG_ADV_SIZE      10      // flags and the CH<id> name ahead of the relay records
+#define BENCH_ADV_MAX_LENGTH    31      // legacy advertising, one block per packet
+#define BENCH_DRAIN_MAX_SEC     120     // run on after the stream until the queues are empty, at most
+#define BENCH_STEP_MS           100     // time step of a run, the fastest relay tick
+#define BENCH_TIME_MIN_SEC      0.2     // a run is repeated until this much host time is measured
+#define BENCH_THINGIES_MAX      8       // with an interval of 1 s or more, the packet ids of a cluster do not
+                                        // come round within the history TTL
+
+#define TRACE_TICK_HZ           32768   // app_timer RTC1, no prescaler
+
+typedef struct
+{
+    uint32_t time_ms;
+    uint32_t order;
+    uint8_t  size;
+    uint8_t  data[MAX_USERDATA_BUFFER_BLOCKSIZE];
+}bench_event_t;
+
+typedef struct
+{
+    uint32_t clusters;
+    uint32_t thingies;
+    uint32_t max_hops;
+    uint32_t copies;
+    uint32_t loss_pct;
+    uint32_t interval_ms;
+    uint32_t seconds;
+    uint32_t seed;
+    uint16_t phone_budget;
+    uint32_t phone_away_sec;
+    uint16_t att_mtu;           // negotiated on the phone link
+    bool     batch;
+    bool     snapshot;
+    char const *p_trace;
+}bench_config_t;
+
+typedef struct
+{
+    uint32_t reports;
+    uint32_t reflected;
+    uint32_t truth_new;
+    uint32_t truth_dup;
+    uint32_t new_ok;            // first copies validated as new
+    uint32_t dup_ok;            // later copies found in the pool or the history
+    uint32_t pool_full;
+    uint32_t ticks;             // relay ticks
+    uint32_t on_air;            // records packed at least once
+    uint32_t readings_sent;     // by the Thingies, for the sink
+    uint32_t readings_heard;
+    uint32_t readings_phone;    // unique at the phone
+    uint32_t phone_dup;
+    uint16_t pool_high_water;
+    uint16_t hist_high_water;
+    double   seconds;
+}bench_result_t;
+
+// Ground truth per relay id: when its record was first heard, and whether it went on the air
+typedef struct
+{
+    uint32_t id_plus_1;         // 0: slot free
+    uint32_t first_ms;
+    bool     on_air;
+}bench_truth_t;
+
+static bench_event_t  *m_events;
+static uint32_t        m_event_count;
+static uint32_t        m_readings_sent;
+static bench_truth_t  *m_truth;
+static uint32_t        m_truth_mask;
+static uint32_t       *m_phone_seen;    // fingerprints of the readings the phone got, 0: free
+static uint32_t        m_phone_mask;
+static bench_result_t *m_result;
+static bench_config_t  m_cfg;
+static uint32_t        m_now_ms;
+static uint32_t        m_tick_next_ms;  // of m_adv_timer_id
+
+static uint32_t bench_rand(uint32_t *p_state)
+{
+    // xorshift32
+    *p_state ^= *p_state << 13;
+    *p_state ^= *p_state >> 17;
+    *p_state ^= *p_state << 5;
+    return *p_state;
+}
+
+static void *bench_calloc(size_t count, size_t size)
+{
+    void *p = calloc(count, size);
+
+    if(p == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t bench_pow2_above(uint32_t n)
+{
+    uint32_t size = 1024;
+
+    while(size < 2 * n) size *= 2;
+    return size;
+}
+
+static bench_event_t *bench_event_new(void)
+{
+    static uint32_t capacity;
+
+    if(m_event_count == capacity)
+    {
+        capacity = (capacity == 0) ? 4096 : capacity * 2;
+        m_events = realloc(m_events, capacity * sizeof(bench_event_t));
+        if(m_events == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memset(&m_events[m_event_count], 0, sizeof(bench_event_t));
+    m_events[m_event_count].order = m_event_count;
+    return &m_events[m_event_count++];
+}
+
+static int bench_event_compare(void const *p_a, void const *p_b)
+{
+    bench_event_t const *a = p_a;
+    bench_event_t const *b = p_b;
+
+    if(a->time_ms != b->time_ms) return (a->time_ms < b->time_ms) ? -1 : 1;
+    return (a->order < b->order) ? -1 : (a->order > b->order);
+}
+
+static void bench_synthetic_build(bench_config_t const *p_cfg)
+{
+    uint32_t rng = p_cfg->seed ? p_cfg->seed : 1;
+    uint32_t serial = 0;
+    uint8_t  packet_id[256] = {0};
+
+    for(uint32_t start = 0; start < p_cfg->seconds * 1000; start += p_cfg->interval_ms)
+    {
+        for(uint32_t c = 1; c <= p_cfg->clusters; c++)
+        {
+            for(uint32_t t = 0; t < p_cfg->thingies; t++)
+            {
+                uint32_t origin = start + bench_rand(&rng) % p_cfg->interval_ms;
+                uint32_t hops = 1 + bench_rand(&rng) % p_cfg->max_hops;
+                uint32_t copies = 1 + bench_rand(&rng) % p_cfg->copies;
+                uint8_t  pid = packet_id[c]++;
+
+                serial++;
+                m_readings_sent++;
+                for(uint32_t k = 0; k < copies; k++)
+                {
+                    bench_event_t *p_evt;
+                    uint32_t       copy_hops = hops + bench_rand(&rng) % 2;
+
+                    if(bench_rand(&rng) % 100 < p_cfg->loss_pct) continue;
+
+                    p_evt = bench_event_new();
+                    p_evt->time_ms = origin + copy_hops * BENCH_HOP_DELAY_MS + bench_rand(&rng) % BENCH_HOP_DELAY_MS;
+                    p_evt->size = BENCH_RECORD_SIZE;
+                    p_evt->data[0] = (uint8_t)c;
+                    p_evt->data[1] = BENCH_SINK_ID;
+                    p_evt->data[2] = pid;
+                    p_evt->data[3] = (uint8_t)(copy_hops - 1);
+                    p_evt->data[4] = AGG_NODE_LINK_DATA_UPDATE;
+                    p_evt->data[5] = (uint8_t)t;
+                    p_evt->data[6] = (uint8_t)((2000 + c) >> 8);
+                    p_evt->data[7] = (uint8_t)(2000 + c);
+                    // the pressure carries the serial number, so the phone can tell every reading apart
+                    p_evt->data[8] = (uint8_t)(serial >> 24);
+                    p_evt->data[9] = (uint8_t)(serial >> 16);
+                    p_evt->data[10] = (uint8_t)(serial >> 8);
+                    p_evt->data[11] = (uint8_t)serial;
+                    p_evt->data[12] = 0x12;
+                    p_evt->data[13] = 0x34;
+                    p_evt->data[14] = 0;
+                }
+            }
+        }
+    }
+}
+
+static bool bench_trace_load(char const *p_path)
+{
+    FILE    *p_file = fopen(p_path, "rb");
+    uint8_t *p_buf;
+    long     size;
+    uint32_t last_tick = 0;
+    uint64_t ticks = 0;
+    bool     first = true;
+
+    if(p_file == NULL)
+    {
+        perror(p_path);
+        return false;
+    }
+    fseek(p_file, 0, SEEK_END);
+    size = ftell(p_file);
+    fseek(p_file, 0, SEEK_SET);
+    p_buf = bench_calloc(size + 1, 1);
+    if(fread(p_buf, 1, size, p_file) != (size_t)size)
+    {
+        perror(p_path);
+        fclose(p_file);
+        return false;
+    }
+    fclose(p_file);
+
+    // UART text may sit between the records, resync on the next sync byte
+    for(long pos = 0; pos + AGG_TRACE_HEADER_LENGTH <= size; )
+    {
+        uint8_t const *p_rec = &p_buf[pos];
+        uint8_t        length = p_rec[2];
+        uint32_t       tick;
+
+        if((p_rec[0] != AGG_TRACE_SYNC) || (p_rec[1] == 0) || (p_rec[1] >= AGG_TRACE_EVT_END) ||
+           (length > AGG_TRACE_PAYLOAD_MAX) || (pos + AGG_TRACE_HEADER_LENGTH + length > size))
+        {
+            pos++;
+            continue;
+        }
+        pos += AGG_TRACE_HEADER_LENGTH + length;
+
+        // 24 bit RTC ticks, wrapping
+        tick = p_rec[3] | ((uint32_t)p_rec[4] << 8) | ((uint32_t)p_rec[5] << 16);
+        ticks += first ? 0 : ((tick - last_tick) & 0xFFFFFF);
+        last_tick = tick;
+        first = false;
+
+        // rssi, then the relay record
+        if((p_rec[1] == AGG_TRACE_EVT_ADV_USERDATA) && (length >= 1 + 4) && (length - 1 <= MAX_USERDATA_BUFFER_BLOCKSIZE))
+        {
+            bench_event_t *p_evt = bench_event_new();
+
+            p_evt->time_ms = (uint32_t)(ticks * 1000 / TRACE_TICK_HZ);
+            p_evt->size = length - 1;
+            memcpy(p_evt->data, &p_rec[AGG_TRACE_HEADER_LENGTH + 1], p_evt->size);
+        }
+    }
+    free(p_buf);
+    return true;
+}
+
+static uint32_t bench_record_readings(uint8_t const *p_data, uint8_t size)
+{
+    relay_codec_entry_t entry;
+    uint16_t            pos = RELAY_CODEC_HEADER_LENGTH;
+    uint32_t            count = 0;
+    uint8_t             len;
+
+    if(p_data[4] == AGG_NODE_LINK_DATA_UPDATE)
+    {
+        return (size >= BENCH_RECORD_SIZE) ? 1 : 0;
+    }
+    if(p_data[4] != AGG_NODE_LINK_DATA_COMPACT)
+    {
+        return 0;
+    }
+    while((pos < size) && ((len = relay_codec_entry_decode(&p_data[pos], size - pos, &entry)) != 0))
+    {
+        pos += len;
+        count++;
+    }
+    return count;
+}
+
+static bench_truth_t *bench_truth_get(uint32_t id)
+{
+    uint32_t slot = (id * 2654435761UL) & m_truth_mask;
+
+    while((m_truth[slot].id_plus_1 != 0) && (m_truth[slot].id_plus_1 != id + 1))
+    {
+        slot = (slot + 1) & m_truth_mask;
+    }
+    return &m_truth[slot];
+}
+
+static void bench_phone_record(uint8_t const *p_record, uint16_t length)
+{
+    uint32_t hash = 2166136261UL;
+    uint32_t slot;
+
+    if((p_record[0] != AGG_NODE_LINK_DATA_UPDATE) || (length < BENCH_RECORD_SIZE))
+    {
+        return;
+    }
+    // cluster, local id, reading
+    for(uint16_t i = 1; i < BENCH_RECORD_SIZE; i++)
+    {
+        if(i == 3 || i == 4 || i == 5) continue;    // type, length and hop count differ between copies
+        hash = (hash ^ p_record[i]) * 16777619UL;
+    }
+    hash |= 1;
+    for(slot = hash & m_phone_mask; m_phone_seen[slot] != 0; slot = (slot + 1) & m_phone_mask)
+    {
+        if(m_phone_seen[slot] == hash)
+        {
+            m_result->phone_dup++;
+            return;
+        }
+    }
+    m_phone_seen[slot] = hash;
+    m_result->readings_phone++;
+}
+
+// relay_sched_level_handler_t, vf_relay_sched_level_set() restarts m_adv_timer_id with the tick of the level
+static void bench_level_set(uint8_t level)
+{
+    m_tick_next_ms = m_now_ms + g_relay_levels[level].tick_ms;
+}
+
+// relay_sched_process_handler_t, vf_process_adv_command3()
+static void bench_process(uint8_t const *p_data, uint8_t size)
+{
+    uint8_array_t userdata = {.size = size, .p_data = (uint8_t *)p_data};
+
+    vf_app_adv_data_send_to_phone(&userdata);
+}
+
+// The cluster head branch of on_adv_report() for one relay record
+static void bench_report(uint8_t own_id, bench_event_t *p_evt)
+{
+    uint32_t       id = ((uint32_t)p_evt->data[0] << 16) | ((uint32_t)p_evt->data[1] << 8) | p_evt->data[2];
+    bench_truth_t *p_truth;
+    bool           truth_new;
+    uint8_t        result;
+
+    m_result->reports++;
+    result = relay_sched_rx(p_evt->data, p_evt->size);
+    if(result == RELAY_RX_REFLECTED)
+    {
+        m_result->reflected++;
+        return;
+    }
+
+    p_truth = bench_truth_get(id);
+    truth_new = (p_truth->id_plus_1 == 0) || (p_evt->time_ms - p_truth->first_ms >= HIST_ADV_TTL_SEC * 1000);
+    if(truth_new)
+    {
+        p_truth->id_plus_1 = id + 1;
+        p_truth->first_ms = p_evt->time_ms;
+        p_truth->on_air = false;
+        m_result->truth_new++;
+        if(p_evt->data[1] == own_id)
+        {
+            m_result->readings_heard += bench_record_readings(p_evt->data, p_evt->size);
+        }
+    }
+    else
+    {
+        m_result->truth_dup++;
+    }
+
+    if(result == RELAY_RX_DUPLICATE)
+    {
+        m_result->dup_ok += !truth_new;
+    }
+    else
+    {
+        m_result->new_ok += truth_new;
+    }
+    if(result == RELAY_RX_FULL)
+    {
+        m_result->pool_full++;
+    }
+    if(g_relay_pool.used > m_result->pool_high_water)
+    {
+        m_result->pool_high_water = g_relay_pool.used;
+    }
+}
+
+// vf_relay_adv_data3(): the next advertising packet, the records in it are on the air
+static void bench_relay_tick(void)
+{
+    uint8_t adv[BENCH_ADV_MAX_LENGTH];
+    uint8_t advlen;
+
+    m_tick_next_ms = m_now_ms + g_relay_levels[g_relay_sched.level].tick_ms;
+    m_result->ticks++;
+    advlen = relay_sched_tick(adv, BENCH_ORG_ADV_SIZE, BENCH_ADV_MAX_LENGTH);
+    for(uint8_t pos = BENCH_ORG_ADV_SIZE; pos + 1 < advlen; pos += 1 + adv[pos])
+    {
+        uint8_t const *p_rec = &adv[pos + 2];
+        uint32_t       id = ((uint32_t)p_rec[0] << 16) | ((uint32_t)p_rec[1] << 8) | p_rec[2];
+        bench_truth_t *p_truth = bench_truth_get(id);
+
+        if((p_truth->id_plus_1 != 0) && !p_truth->on_air)
+        {
+            p_truth->on_air = true;
+            m_result->on_air++;
+        }
+    }
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_run(uint8_t own_id, bench_result_t *p_result)
+{
+    static ble_agg_cfg_service_t service;
+    relay_sched_init_t relay_init = {.own_id = own_id, .multi_phy = false,
+                                     .level_handler = bench_level_set, .process_handler = bench_process};
+    app_aggregator_buffer_stats_t buf_stats;
+    uint32_t next = 0;
+    uint32_t end_ms = (m_event_count > 0) ? m_events[m_event_count - 1].time_ms : 0;
+    uint32_t drain_end_ms = end_ms + BENCH_DRAIN_MAX_SEC * 1000;
+    double   start;
+
+    memset(p_result, 0, sizeof(*p_result));
+    memset(m_truth, 0, (m_truth_mask + 1) * sizeof(bench_truth_t));
+    memset(m_phone_seen, 0, (m_phone_mask + 1) * sizeof(uint32_t));
+    m_result = p_result;
+
+    relay_pool_init();
+    relay_sched_init(&relay_init);
+    m_tick_next_ms = g_relay_levels[g_relay_sched.level].tick_ms;
+    agg_flash_log_init();
+    app_aggregator_init(&service);
+    app_aggregator_batch_mode_set(m_cfg.batch);
+    app_aggregator_sink_snapshot_mode_set(m_cfg.snapshot);
+    app_aggregator_att_mtu_set(m_cfg.att_mtu);
+    host_phone_init(bench_phone_record);
+
+    start = bench_now();
+    for(m_now_ms = 0; ; m_now_ms += BENCH_STEP_MS)
+    {
+        uint32_t now_ms = m_now_ms;
+        bool phone_here = (now_ms >= m_cfg.phone_away_sec * 1000);
+        uint16_t hist_live;
+
+        while((next < m_event_count) && (m_events[next].time_ms < now_ms + BENCH_STEP_MS))
+        {
+            bench_report(own_id, &m_events[next++]);
+        }
+        if(now_ms >= m_tick_next_ms)
+        {
+            bench_relay_tick();
+        }
+
+        // vf_refresh_history_buff_callback() and the snapshot timer
+        if((now_ms + BENCH_STEP_MS) / 1000 != now_ms / 1000)
+        {
+            g_hist_time_sec++;
+            app_aggregator_sink_snapshot();
+        }
+        hist_live = relay_hist_live_count();
+        if(hist_live > p_result->hist_high_water)
+        {
+            p_result->hist_high_water = hist_live;
+        }
+
+        // main loop: the phone buffer is flushed while the phone is connected
+        if(phone_here)
+        {
+            host_phone_budget_set(m_cfg.phone_budget);
+            while(app_aggregator_flush_ble_commands());
+        }
+
+        if(next == m_event_count)
+        {
+            app_aggregator_buffer_stats_get(&buf_stats);
+            if(((g_relay_pool.used == 0) && (buf_stats.records == 0) && agg_flash_log_is_empty() && phone_here) ||
+               (now_ms >= drain_end_ms))
+            {
+                break;
+            }
+        }
+    }
+    p_result->seconds = bench_now() - start;
+    p_result->readings_sent = m_cfg.p_trace ? p_result->readings_heard : m_readings_sent;
+}
+
+// The runs give the same results each time, they are repeated for the time alone
+static void bench_measure(uint8_t own_id, bench_result_t *p_result)
+{
+    double   total = 0;
+    uint32_t runs = 0;
+
+    do
+    {
+        bench_run(own_id, p_result);
+        total += p_result->seconds;
+        runs++;
+    } while(total < BENCH_TIME_MIN_SEC);
+    p_result->seconds = total / runs;
+}
+
+static double bench_pct(uint32_t part, uint32_t whole)
+{
+    return whole ? (100.0 * part) / whole : 100.0;
+}
+
+static void bench_print(char const *p_role, uint8_t own_id, bench_result_t const *p_result, bool sink)
+{
+    app_aggregator_buffer_stats_t buf_stats;
+    host_flash_log_stats_t        log_stats;
+    uint32_t                      sent, refused;
+    uint32_t                      processed = p_result->reports - p_result->reflected;
+
+    app_aggregator_buffer_stats_get(&buf_stats);
+    host_flash_log_stats_get(&log_stats);
+    host_phone_counts_get(&sent, &refused);
+
+    printf("%s, cluster %u\n", p_role, own_id);
+    printf("  reports      %u in %.3f ms, %.0f reports/s\n", p_result->reports, p_result->seconds * 1000,
+           p_result->seconds > 0 ? p_result->reports / p_result->seconds : 0.0);
+    printf("  high-water   pool %u/%u blocks, history %u/%u ids\n", p_result->pool_high_water, MAX_USERDATA_BUFFER_BLOCK,
+           p_result->hist_high_water, MAX_HIST_ADV_BUFF_SIZE);
+    printf("  dedup        %.2f %% right: new %u/%u, duplicates %u/%u, %u turned down by a full pool\n",
+           bench_pct(p_result->new_ok + p_result->dup_ok, processed), p_result->new_ok, p_result->truth_new,
+           p_result->dup_ok, p_result->truth_dup, p_result->pool_full);
+    printf("  relay ticks  %u, %u level changes, %u advertising times saved\n",
+           p_result->ticks, g_relay_sched.level_changes, g_relay_sched.suppressed);
+    if(!sink)
+    {
+        printf("  delivery     %.2f %% on the air: %u of %u records heard\n",
+               bench_pct(p_result->on_air, p_result->truth_new), p_result->on_air, p_result->truth_new);
+        return;
+    }
+    printf("  delivery     %.2f %% at the phone: %u of %u readings sent, %u heard, %u twice\n",
+           bench_pct(p_result->readings_phone, p_result->readings_sent), p_result->readings_phone,
+           p_result->readings_sent, p_result->readings_heard, p_result->phone_dup);
+    printf("  phone        %u notifications, %u refused, buffer high-water %u bytes, %u records dropped\n",
+           sent, refused, buf_stats.high_water, buf_stats.drop_count);
+    printf("  flash log    %u stored, %u replayed, %u refused, high-water %u bytes\n",
+           log_stats.stored, log_stats.replayed, log_stats.refused, log_stats.high_water);
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: relay_bench [-c clusters] [-t thingies] [-H max hops] [-d copies] [-l loss %%]\n"
+                    "                   [-i interval ms] [-s seconds] [-x seed]\n"
+                    "                   [-p notifications per step] [-w phone away s] [-m ATT MTU] [-b] [-S]\n"
+                    "                   [trace file]\n");
+    exit(2);
+}
+
+// Own ids of the two runs: the most common destination is the sink, the relay is on none of them
+static void bench_roles_get(uint8_t *p_relay_id, uint8_t *p_sink_id)
+{
+    uint32_t dst_count[256] = {0};
+    bool     used[256] = {false};
+    uint32_t best = 0;
+
+    *p_sink_id = BENCH_SINK_ID;
+    for(uint32_t i = 0; i < m_event_count; i++)
+    {
+        used[m_events[i].data[0]] = used[m_events[i].data[1]] = true;
+        if(++dst_count[m_events[i].data[1]] > best)
+        {
+            best = dst_count[m_events[i].data[1]];
+            *p_sink_id = m_events[i].data[1];
+        }
+    }
+    for(*p_relay_id = 0xFE; used[*p_relay_id] && (*p_relay_id > 0); (*p_relay_id)--);
+}
+
+int main(int argc, char **argv)
+{
+    bench_result_t relay_result, sink_result;
+    uint8_t        relay_id, sink_id;
+    int            opt;
+
+    m_cfg = (bench_config_t){.clusters = 8, .thingies = 4, .max_hops = 4, .copies = 3, .loss_pct = 10,
+                             .interval_ms = 10000, .seconds = 600, .seed = 1, .phone_budget = 2,
+                             .att_mtu = NRF_SDH_BLE_GATT_MAX_MTU_SIZE};
+    while((opt = getopt(argc, argv, "c:t:H:d:l:i:s:x:p:w:m:bS")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': m_cfg.clusters = atoi(optarg); break;
+            case 't': m_cfg.thingies = atoi(optarg); break;
+            case 'H': m_cfg.max_hops = atoi(optarg); break;
+            case 'd': m_cfg.copies = atoi(optarg); break;
+            case 'l': m_cfg.loss_pct = atoi(optarg); break;
+            case 'i': m_cfg.interval_ms = atoi(optarg); break;
+            case 's': m_cfg.seconds = atoi(optarg); break;
+            case 'x': m_cfg.seed = strtoul(optarg, NULL, 0); break;
+            case 'p': m_cfg.phone_budget = atoi(optarg); break;
+            case 'w': m_cfg.phone_away_sec = atoi(optarg); break;
+            case 'm': m_cfg.att_mtu = atoi(optarg); break;
+            case 'b': m_cfg.batch = true; break;
+            case 'S': m_cfg.snapshot = true; break;
+            default:  bench_usage();
+        }
+    }
+    if(optind < argc)
+    {
+        m_cfg.p_trace = argv[optind];
+    }
+    if((m_cfg.clusters < 1) || (m_cfg.clusters > 200) || (m_cfg.thingies < 1) || (m_cfg.thingies > BENCH_THINGIES_MAX) ||
+       (m_cfg.max_hops < 1) || (m_cfg.interval_ms < 1000) || (m_cfg.copies < 1) ||
+       (m_cfg.att_mtu < BLE_GATT_ATT_MTU_DEFAULT) || (m_cfg.att_mtu > NRF_SDH_BLE_GATT_MAX_MTU_SIZE))
+    {
+        bench_usage();
+    }
+
+    if(m_cfg.p_trace != NULL)
+    {
+        if(!bench_trace_load(m_cfg.p_trace)) return 1;
+        printf("trace %s: %u relay records\n", m_cfg.p_trace, m_event_count);
+    }
+    else
+    {
+        bench_synthetic_build(&m_cfg);
+        printf("synthetic: %u clusters x %u Thingies every %u ms, 1 to %u hops, up to %u copies, %u %% lost, %u s: %u relay records\n",
+               m_cfg.clusters, m_cfg.thingies, m_cfg.interval_ms, m_cfg.max_hops, m_cfg.copies, m_cfg.loss_pct,
+               m_cfg.seconds, m_event_count);
+    }
+    qsort(m_events, m_event_count, sizeof(bench_event_t), bench_event_compare);
+
+    m_truth_mask = bench_pow2_above(m_event_count) - 1;
+    m_truth = bench_calloc(m_truth_mask + 1, sizeof(bench_truth_t));
+    m_phone_mask = bench_pow2_above(m_event_count) - 1;
+    m_phone_seen = bench_calloc(m_phone_mask + 1, sizeof(uint32_t));
+
+    bench_roles_get(&relay_id, &sink_id);
+    bench_measure(relay_id, &relay_result);
+    bench_print("relay", relay_id, &relay_result, false);
+    bench_measure(sink_id, &sink_result);
+    bench_print("sink", sink_id, &sink_result, true);
+    return 0;
+}
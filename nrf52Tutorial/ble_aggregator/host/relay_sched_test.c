@@ -0,0 +1,252 @@
+// Relay scheduling test: what relay_sched.c does with the relay records main.c hands it, back at
+// their source, for this cluster, to be relayed or heard twice; how often a block goes on the air;
+// the relay levels and their hysteresis; the PHY a packet goes out on. Returns non-zero on a failed check.
+#include "relay_sched.h"
+#include "relay_pool.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_OWN_ID             5
+#define TEST_SINK_ID            0
+#define TEST_ORG_ADV_SIZE       10      // flags and the CH<id> name ahead of the relay records
+#define TEST_ADV_MAX_LENGTH     31      // legacy advertising, one block per packet
+#define TEST_RECORD_SIZE        15      // AGG_NODE_LINK_DATA_UPDATE, one fits in a packet
+
+#define TEST_CHECK(cond) do { if(!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); m_failed++; } } while(0)
+
+static uint32_t m_failed;
+static uint32_t m_processed;            // records handed to the process handler
+static uint32_t m_level_calls;
+static uint8_t  m_level;                // as the level handler was told
+
+static void test_level_set(uint8_t level)
+{
+    m_level_calls++;
+    m_level = level;
+}
+
+static void test_process(uint8_t const *p_data, uint8_t size)
+{
+    TEST_CHECK(p_data[1] == TEST_OWN_ID);
+    TEST_CHECK(size == TEST_RECORD_SIZE);
+    m_processed++;
+}
+
+static void test_init(bool multi_phy)
+{
+    relay_sched_init_t init = {.own_id = TEST_OWN_ID, .multi_phy = multi_phy,
+                               .level_handler = test_level_set, .process_handler = test_process};
+
+    relay_pool_init();
+    relay_sched_init(&init);
+    m_processed = 0;
+    m_level_calls = 0;
+    m_level = g_relay_sched.level;
+}
+
+static uint8_t const *test_record(uint8_t src, uint8_t dst, uint8_t pid, uint8_t hops)
+{
+    static uint8_t data[TEST_RECORD_SIZE];
+
+    memset(data, 0, sizeof(data));
+    data[0] = src;
+    data[1] = dst;
+    data[2] = pid;
+    data[3] = hops;
+    return data;
+}
+
+// One relay tick, returns the number of relay records in the packet
+static uint32_t test_tick(void)
+{
+    uint8_t  adv[TEST_ADV_MAX_LENGTH];
+    uint8_t  advlen = relay_sched_tick(adv, TEST_ORG_ADV_SIZE, TEST_ADV_MAX_LENGTH);
+    uint32_t count = 0;
+
+    for(uint8_t pos = TEST_ORG_ADV_SIZE; pos + 1 < advlen; pos += 1 + adv[pos])
+    {
+        count++;
+    }
+    return count;
+}
+
+// Relay ticks a single block goes on the air for
+static uint32_t test_adv_times(uint8_t hops)
+{
+    uint32_t times = 0;
+
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, TEST_SINK_ID, 0, hops), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    while(test_tick() != 0)
+    {
+        times++;
+    }
+    TEST_CHECK(g_relay_pool.used == 0);
+    return times;
+}
+
+static void test_rx(void)
+{
+    test_init(false);
+
+    TEST_CHECK(relay_sched_rx(test_record(TEST_OWN_ID, 1, 0, 1), TEST_RECORD_SIZE) == RELAY_RX_REFLECTED);
+    TEST_CHECK(g_relay_pool.used == 0);
+
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_OWN_ID, 0, 1), TEST_RECORD_SIZE) == RELAY_RX_PROCESSED);
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_OWN_ID, 0, 2), TEST_RECORD_SIZE) == RELAY_RX_DUPLICATE);
+    TEST_CHECK(m_processed == 1);
+    TEST_CHECK(g_relay_pool.used == 0);
+
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_SINK_ID, 0, 1), TEST_RECORD_SIZE) == RELAY_RX_QUEUED);
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_SINK_ID, 0, 2), TEST_RECORD_SIZE) == RELAY_RX_DUPLICATE);
+    TEST_CHECK(g_relay_pool.used == 1);
+
+    for(uint8_t pid = 1; pid < MAX_USERDATA_BUFFER_BLOCK; pid++)
+    {
+        TEST_CHECK(relay_sched_rx(test_record(1, TEST_SINK_ID, pid, 1), TEST_RECORD_SIZE) == RELAY_RX_QUEUED);
+    }
+    TEST_CHECK(relay_sched_rx(test_record(2, TEST_SINK_ID, 0, 1), TEST_RECORD_SIZE) == RELAY_RX_FULL);
+    TEST_CHECK(relay_sched_add(test_record(2, TEST_SINK_ID, 1, 1), 3) == RELAY_POOL_ADD_INVALID);
+}
+
+static void test_adv_count(void)
+{
+    test_init(false);
+
+    // few duplicates heard so far: own data and far blocks once more than the base
+    TEST_CHECK(test_adv_times(0) == RELAY_ADV_COUNT_BASE + 1);
+    TEST_CHECK(test_adv_times(1) == RELAY_ADV_COUNT_BASE);
+    TEST_CHECK(test_adv_times(RELAY_FAR_HOPS) == RELAY_ADV_COUNT_BASE + 1);
+
+    // a record relayed already heard over and over, the neighbours relay enough
+    for(uint32_t i = 0; i < 32; i++)
+    {
+        TEST_CHECK(relay_sched_heard(test_record(TEST_OWN_ID, TEST_SINK_ID, 0, 1)) != RELAY_POOL_NEW);
+    }
+    TEST_CHECK(g_relay_sched.dup_share > RELAY_DUP_DENSE);
+    TEST_CHECK(test_adv_times(1) == RELAY_ADV_COUNT_BASE - 1);
+
+    // a queued block heard from a neighbour is advertised once less
+    test_init(false);
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_SINK_ID, 9, 1), TEST_RECORD_SIZE) == RELAY_RX_QUEUED);
+    TEST_CHECK(relay_sched_heard(test_record(1, TEST_SINK_ID, 9, 2)) != RELAY_POOL_NEW);
+    TEST_CHECK(g_relay_sched.suppressed == 1);
+}
+
+static void test_levels(void)
+{
+    uint32_t ticks;
+
+    test_init(false);
+    TEST_CHECK(g_relay_sched.level == RELAY_LEVEL_NORMAL);
+
+    // a deep queue goes to burst at the next tick
+    for(uint8_t pid = 0; pid < RELAY_BURST_DEPTH + 1; pid++)
+    {
+        TEST_CHECK(relay_sched_add(test_record(1, TEST_SINK_ID, pid, 1), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    }
+    (void)test_tick();
+    TEST_CHECK((m_level == RELAY_LEVEL_BURST) && (m_level_calls == 1));
+
+    // drained, down to normal after RELAY_CALM_TICKS, to idle only after RELAY_IDLE_CALM_TICKS more
+    while(g_relay_pool.used != 0)
+    {
+        (void)test_tick();
+    }
+    for(ticks = 0; m_level != RELAY_LEVEL_NORMAL; ticks++)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(ticks <= RELAY_CALM_TICKS);
+    for(ticks = 0; (m_level != RELAY_LEVEL_IDLE) && (ticks < 2 * RELAY_IDLE_CALM_TICKS); ticks++)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(m_level == RELAY_LEVEL_IDLE);
+    TEST_CHECK(ticks == RELAY_IDLE_CALM_TICKS);
+    TEST_CHECK(g_relay_levels[RELAY_LEVEL_IDLE].adv_interval != g_relay_levels[RELAY_LEVEL_NORMAL].adv_interval);
+    TEST_CHECK(g_relay_levels[RELAY_LEVEL_BURST].adv_interval == g_relay_levels[RELAY_LEVEL_NORMAL].adv_interval);
+
+    // a block queued while idle does not wait for the slow tick
+    TEST_CHECK(relay_sched_rx(test_record(1, TEST_SINK_ID, 0x40, 1), TEST_RECORD_SIZE) == RELAY_RX_QUEUED);
+    TEST_CHECK(m_level == RELAY_LEVEL_NORMAL);
+    TEST_CHECK(m_level_calls == g_relay_sched.level_changes);
+
+    // a block now and then keeps the relay out of idle
+    for(ticks = 0; ticks < 4 * RELAY_IDLE_CALM_TICKS; ticks++)
+    {
+        if(ticks % (RELAY_IDLE_CALM_TICKS / 2) == 0)
+        {
+            (void)relay_sched_add(test_record(1, TEST_SINK_ID, (uint8_t)ticks, 1), TEST_RECORD_SIZE);
+        }
+        (void)test_tick();
+        TEST_CHECK(m_level != RELAY_LEVEL_IDLE);
+    }
+}
+
+static void test_phy(void)
+{
+    test_init(true);
+
+    // cluster 1 heard well on 1M, cluster 2 only on Coded PHY, cluster 3 not at all
+    relay_sched_nbr_heard(1, RELAY_PHY_1M, -60);
+    relay_sched_nbr_heard(2, RELAY_PHY_CODED, -90);
+    relay_sched_nbr_heard(2, RELAY_PHY_1M, -95);
+
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 1, 0, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    TEST_CHECK(test_tick() == 1);
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_1M);
+
+    // nothing left for 1M, the packet goes out on the PHY of the oldest block
+    while(g_relay_pool.used != 0)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 2, 1, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    TEST_CHECK(test_tick() == 1);
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_CODED);
+
+    // Coded PHY is kept while it has blocks, the 1M block waits at most RELAY_PHY_HOLD_TICKS packets
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 1, 2, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 3, 3, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    for(uint32_t ticks = 0; (relay_sched_tx_phy() == RELAY_PHY_CODED) && (ticks <= RELAY_PHY_HOLD_TICKS + 1); ticks++)
+    {
+        TEST_CHECK(test_tick() == 1);
+    }
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_1M);
+
+    // an empty queue stays on the PHY on air for RELAY_PHY_HOLD_TICKS ticks, then goes back to 1M
+    while(g_relay_pool.used != 0)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 3, 4, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    while(g_relay_pool.used != 0)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_CODED);
+    for(uint32_t ticks = 0; ticks < RELAY_PHY_HOLD_TICKS; ticks++)
+    {
+        (void)test_tick();
+    }
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_CODED);
+    (void)test_tick();
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_1M);
+
+    // a neighbour not heard for RELAY_PHY_NBR_TTL_SEC is not heard at all
+    g_hist_time_sec += RELAY_PHY_NBR_TTL_SEC;
+    TEST_CHECK(relay_sched_add(test_record(TEST_OWN_ID, 1, 5, 0), TEST_RECORD_SIZE) == RELAY_POOL_ADD_OK);
+    TEST_CHECK(test_tick() == 1);
+    TEST_CHECK(relay_sched_tx_phy() == RELAY_PHY_CODED);
+}
+
+int main(void)
+{
+    test_rx();
+    test_adv_count();
+    test_levels();
+    test_phy();
+
+    printf("relay_sched_test: %s\n", m_failed ? "FAILED" : "passed");
+    return m_failed ? 1 : 0;
+}
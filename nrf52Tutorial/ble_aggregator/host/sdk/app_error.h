@@ -0,0 +1,25 @@
+#ifndef APP_ERROR_H__
+#define APP_ERROR_H__
+
+// Host build: an error code other than NRF_SUCCESS stops the program where it was checked
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ble_gap.h"
+
+typedef uint32_t ret_code_t;
+
+#define APP_ERROR_CHECK(err_code)                                                           \
+    do                                                                                      \
+    {                                                                                       \
+        const uint32_t local_err_code = (err_code);                                         \
+        if (local_err_code != NRF_SUCCESS)                                                  \
+        {                                                                                   \
+            fprintf(stderr, "%s:%d: error %u\n", __FILE__, __LINE__, (unsigned)local_err_code); \
+            abort();                                                                        \
+        }                                                                                   \
+    } while (0)
+
+#define APP_ERROR_CHECK_BOOL(boolean_value) APP_ERROR_CHECK((boolean_value) ? NRF_SUCCESS : NRF_ERROR_INVALID_STATE)
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef APP_UTIL_H__
+#define APP_UTIL_H__
+
+// Host build: the helpers of the SDK util library the aggregator sources use
+
+#include <stdint.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+
+#define UNUSED_PARAMETER(x) (void)(x)
+
+#define STATIC_ASSERT(EXPR) _Static_assert((EXPR), "unspecified message")
+
+typedef struct
+{
+    uint16_t  size;
+    uint8_t * p_data;
+} uint8_array_t;
+
+static inline uint8_t uint16_encode(uint16_t value, uint8_t * p_encoded_data)
+{
+    p_encoded_data[0] = (uint8_t)value;
+    p_encoded_data[1] = (uint8_t)(value >> 8);
+    return sizeof(uint16_t);
+}
+
+static inline uint8_t uint32_encode(uint32_t value, uint8_t * p_encoded_data)
+{
+    p_encoded_data[0] = (uint8_t)value;
+    p_encoded_data[1] = (uint8_t)(value >> 8);
+    p_encoded_data[2] = (uint8_t)(value >> 16);
+    p_encoded_data[3] = (uint8_t)(value >> 24);
+    return sizeof(uint32_t);
+}
+
+static inline uint32_t uint32_big_decode(const uint8_t * p_encoded_data)
+{
+    return ((uint32_t)p_encoded_data[0] << 24) | ((uint32_t)p_encoded_data[1] << 16) |
+           ((uint32_t)p_encoded_data[2] << 8)  | (uint32_t)p_encoded_data[3];
+}
+
+#endif
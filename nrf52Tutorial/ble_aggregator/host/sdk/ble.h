@@ -0,0 +1,15 @@
+#ifndef BLE_H__
+#define BLE_H__
+
+// Host build, see ble_gap.h
+
+#include "ble_gap.h"
+
+#define BLE_GATT_ATT_MTU_DEFAULT    23
+
+typedef struct
+{
+    uint16_t evt_id;
+} ble_evt_t;
+
+#endif
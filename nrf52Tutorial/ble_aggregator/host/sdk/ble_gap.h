@@ -0,0 +1,31 @@
+#ifndef BLE_GAP_H__
+#define BLE_GAP_H__
+
+// Host build: the SoftDevice types and codes the aggregator sources use, nothing behind them
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NRF_SUCCESS                 0
+#define NRF_ERROR_NO_MEM            4
+#define NRF_ERROR_NOT_FOUND         5
+#define NRF_ERROR_INVALID_PARAM     7
+#define NRF_ERROR_INVALID_STATE     8
+#define NRF_ERROR_NULL              14
+#define NRF_ERROR_BUSY              17
+#define NRF_ERROR_RESOURCES         19
+
+#define BLE_CONN_HANDLE_INVALID     0xFFFF
+#define BLE_GAP_ADDR_LEN            6
+
+#define BLE_GAP_PHY_AUTO            0x00
+#define BLE_GAP_PHY_1MBPS           0x01
+#define BLE_GAP_PHY_2MBPS           0x02
+#define BLE_GAP_PHY_CODED           0x04
+
+typedef struct
+{
+    uint16_t conn_handle;
+} ble_gap_evt_t;
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef BLE_GATTC_QUEUE_H__
+#define BLE_GATTC_QUEUE_H__
+
+// Host build: the declarations of common/ble_gattc_queue/ble_gattc_queue.h app_aggregator.c uses,
+// host_shim.c answers them for a queue that is always empty
+
+#include <stdint.h>
+
+#define BLE_GATTC_QUEUE_SIZE            16
+
+typedef struct
+{
+    uint16_t pending;
+    uint16_t high_water;
+    uint32_t sent;
+    uint32_t dropped;
+} ble_gattc_queue_stats_t;
+
+uint16_t ble_gattc_queue_depth_get(uint16_t conn_handle);
+
+void ble_gattc_queue_stats_get(ble_gattc_queue_stats_t * p_stats);
+
+#endif
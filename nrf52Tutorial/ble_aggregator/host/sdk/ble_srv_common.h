@@ -0,0 +1,15 @@
+#ifndef BLE_SRV_COMMON_H__
+#define BLE_SRV_COMMON_H__
+
+// Host build, see ble_gap.h
+
+#include "ble.h"
+#include "app_util.h"
+
+typedef struct
+{
+    uint16_t value_handle;
+    uint16_t cccd_handle;
+} ble_gatts_char_handles_t;
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef NRF_LOG_H_
+#define NRF_LOG_H_
+
+// Host build: the benchmark prints its own results, the module logs are dropped
+
+#define NRF_LOG_ERROR(...)
+#define NRF_LOG_WARNING(...)
+#define NRF_LOG_INFO(...)
+#define NRF_LOG_DEBUG(...)
+#define NRF_LOG_HEXDUMP_INFO(p_data, len)
+
+#endif
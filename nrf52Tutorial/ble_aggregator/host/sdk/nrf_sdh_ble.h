@@ -0,0 +1,10 @@
+#ifndef NRF_SDH_BLE_H__
+#define NRF_SDH_BLE_H__
+
+// Host build: no SoftDevice events, observers are not registered
+
+#include "ble.h"
+
+#define NRF_SDH_BLE_OBSERVER(_name, _prio, _handler, _context)
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef SDK_CONFIG_H
+#define SDK_CONFIG_H
+
+// Host build: the values of pca10056/s140/config/sdk_config.h the aggregator sources use
+#define NRF_SDH_BLE_GATT_MAX_MTU_SIZE   247
+#define NRF_SDH_BLE_CENTRAL_LINK_COUNT  16
+
+#endif
@@ -54,6 +54,7 @@
 #include "nrf_sdh_ble.h"
 
 #include "app_timer.h"
+#include "app_scheduler.h"
 #include "bsp_btn_ble.h"
 #include "ble.h"
 #include "ble_hci.h"
@@ -67,7 +68,16 @@
 #include "nrf_pwr_mgmt.h"
 #include "ble_agg_config_service.h"
 #include "app_aggregator.h"
+#include "agg_trace.h"
+#include "agg_stats.h"
+#include "agg_prof.h"
+#include "thingy_db_cache.h"
+#include "agg_flash_log.h"
+#include "relay_codec.h"
+#include "relay_pool.h"
+#include "relay_sched.h"
 #include "app_uart.h"
+#include "app_util_platform.h"
 
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
@@ -81,14 +91,21 @@
 #define APP_BLE_CONN_CFG_TAG      1                                     /**< A tag that refers to the BLE stack configuration we set with @ref sd_ble_cfg_set. Default tag is @ref APP_BLE_CONN_CFG_TAG. */
 #define APP_BLE_OBSERVER_PRIO     3                                     /**< Application's BLE observer priority. You shouldn't need to modify this value. */
 
+// The BLE observers and the app_timer handlers share the relay pool, the history, the Thingy
+// windows and the phone buffer. Both run from app_scheduler in the main loop, so they never
+// preempt each other. The SoftDevice and RTC1 interrupts only queue an event.
+#if (NRF_SDH_DISPATCH_MODEL != NRF_SDH_DISPATCH_MODEL_APPSH) || (APP_TIMER_CONFIG_USE_SCHEDULER != 1)
+#error "Set NRF_SDH_DISPATCH_MODEL to NRF_SDH_DISPATCH_MODEL_APPSH and APP_TIMER_CONFIG_USE_SCHEDULER to 1 in sdk_config.h"
+#endif
+#define SCHED_MAX_EVENT_DATA_SIZE APP_TIMER_SCHED_EVENT_DATA_SIZE       /**< SoftDevice events are polled in the handler and carry no data. */
+#define SCHED_QUEUE_SIZE          32                                    /**< One entry per SoftDevice interrupt and timer timeout until the main loop comes round. */
+
 // Peripheral parameters
 
 /*------------
-//student: CLuster head Configuration
+//student: CLuster head Configuration, CLUSTER_ID and SINK_ID are in app_aggregator.h
 ----------*/
-#define CLUSTER_ID      5
 #define DEVICE_NAME             "CH"                    /**< Name of device. Will be included in the advertising data. */
-#define SINK_ID         10       
 
 //vinh
 static char const m_target_periph_name[] = "NT:";                       /**< Name of the device we try to connect to. This name is searched for in the scan report data*/
@@ -147,9 +164,53 @@ static char const m_target_blinky_name[] = "Thingy";
   #define CLUSTERHEAD_RSSI_CONNECT_LIMIT   -110
   #define APP_DEFAULT_TX_POWER        -40                               /**< Supported tx_power values: -40dBm, -20dBm, -16dBm, -12dBm, -8dBm, -4dBm, 0dBm, +3dBm and +4dBm.*/
 #endif
+
+// on_adv_report drops reports at or below the weakest limit above before parsing them, Blinkies included
+#define SCAN_RSSI_REJECT_LIMIT      MIN(THINGY_RSSI_CONNECT_LIMIT, CLUSTERHEAD_RSSI_CONNECT_LIMIT)
  
-#define MAX_USERDATA_BUFFER_BLOCK 16
-#define MAX_USERDATA_BUFFER_BLOCKSIZE 32
+//vinh
+//relay mode: with extended advertising (nRF52840/s140 only, opt in) one PDU carries as many relay blocks
+//as fit, legacy advertising carries one block per advertising event. the extended set is connectable but
+//not scannable, and phones or cluster heads scanning for legacy PDUs only do not see it at all.
+//the default build relays on legacy advertising only, so the Coded PHY relay below is compiled out too;
+//the "Debug Extended Relay" configuration of the pca10056 s140 project turns both on
+#ifndef RELAY_EXTENDED_ADV_ENABLED
+  #define RELAY_EXTENDED_ADV_ENABLED 0
+#endif
+#if (RELAY_EXTENDED_ADV_ENABLED == 1) && !defined(NRF52840_XXAA)
+#error "Extended relay advertising needs the nRF52840 and s140"
+#endif
+
+#if (RELAY_EXTENDED_ADV_ENABLED == 1)
+  #define RELAY_ADV_MAX_LENGTH  BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_CONNECTABLE_MAX_SUPPORTED
+#else
+  #define RELAY_ADV_MAX_LENGTH  BLE_GAP_ADV_SET_DATA_SIZE_MAX
+#endif
+
+//vinh
+//multi-PHY (nRF52840/s140): every scan interval covers 1M and Coded PHY, and relay packets towards
+//cluster heads that are far or only heard on Coded PHY go out on Coded PHY when extended relay advertising
+//is on, see relay_sched.h
+#ifndef SCAN_MULTI_PHY_ENABLED
+  #ifdef NRF52840_XXAA
+    #define SCAN_MULTI_PHY_ENABLED 1
+  #else
+    #define SCAN_MULTI_PHY_ENABLED 0
+  #endif
+#endif
+
+#if (SCAN_MULTI_PHY_ENABLED == 1) && (SCAN_INTERVAL < 2 * SCAN_WINDOW)
+#error "Scanning on both PHYs needs a scan interval of at least two scan windows"
+#endif
+
+#ifndef RELAY_CODED_PHY_ENABLED
+  #define RELAY_CODED_PHY_ENABLED ((SCAN_MULTI_PHY_ENABLED == 1) && (RELAY_EXTENDED_ADV_ENABLED == 1))
+#endif
+#if (RELAY_CODED_PHY_ENABLED == 1) && (RELAY_EXTENDED_ADV_ENABLED == 0)
+#error "Coded PHY advertising needs extended advertising"
+#endif
+
+#define THINGY_2M_RSSI_LIMIT        -75     /**< Thingies connected above this RSSI are asked to go to 2M PHY. */
 
 NRF_BLE_GATT_DEF(m_gatt);                                               /**< GATT module instance. */
 
@@ -171,13 +232,15 @@ APP_TIMER_DEF(m_post_message_delay_timer_id);
 APP_TIMER_DEF(m_adv_timer_id);    //timer for changing advertising packet
 APP_TIMER_DEF(m_hist_refresh_timer_id);    //timer for delete an ID in history buffer 
 APP_TIMER_DEF(m_add_edata_adv_buff_timer_id);    //timer for add average enviroment data to broadcast buffer 
+APP_TIMER_DEF(m_sink_snapshot_timer_id);    //sink: period of the batched snapshots to the phone
 
 //static volatile bool m_service_discovery_in_process = false;
 static char  m_target_clusterhead_name[20]=DEVICE_NAME;
 
 
-static uint16_t   m_service_discovery_conn_handle = BLE_CONN_HANDLE_INVALID;
 static uint16_t   m_coded_phy_conn_handle[NRF_SDH_BLE_TOTAL_LINK_COUNT];
+static uint8_t    peer_addr_LR[NRF_SDH_BLE_CENTRAL_LINK_COUNT][6];
+static bool       m_thingy_db_cached[NRF_SDH_BLE_CENTRAL_LINK_COUNT];  /**< Handles of this link came from thingy_db_cache, not discovery. */
 
 static uint16_t   m_per_con_handle       = BLE_CONN_HANDLE_INVALID;
 static ble_uuid_t m_adv_uuids[]          =                              /**< Universally unique service identifier. */
@@ -208,22 +271,14 @@ static void vf_start_broadcast_data(void);
 static void vf_start_broadcast_data2(void);
 static void vf_stop_broadcast_data(void);
 
-void relay_adv_data2(void);
 void vf_relay_adv_data3(void*);
 //void vf_adv_thingy_connected(ble_evt_t *p_gap_evt) ;
 /*  
 @brief: add a packet to buffer for advertising
 @input: data 
 @output: error=1  if buffer is full*/
-uint8_t vf_add_packet_to_buffer(uint8_array_t *data);
-uint8_t vf_add_packet_to_buffer2(uint8_array_t *data);
 uint8_t vf_add_packet_to_buffer3(uint8_array_t *data);
 
-void vf_delete_block_buffer3(bool cond);
-
-uint16_t vf_add_buff_adv_hist3(uint32_t ids);
-uint16_t vf_find_id_buff_adv_hist3(uint32_t id);
-void vf_delete_buff_adv_hist3(uint16_t pos);
 /*  
 @brief: check the destination of original incoming broadcast msg is from current node
 @input: data to check
@@ -231,56 +286,75 @@ byte[0] of data->p_data is the source
 @output: true if byte[0] match CLUSTER_ID*/
 bool vf_check_source(uint8_array_t *data);
 void vf_process_adv_command(uint8_array_t *data);
-void vf_process_adv_command3(uint8_array_t *br_data);
+static void vf_process_adv_command3(uint8_t const *p_data, uint8_t size);
 
-void relay_adv_data(void);
 void vf_relay_adv_data(void*);
-//check position of packet in buffer array
-//by comparing the 1st 3 bytes:
-//  1st: destination id of broadcast
-//  2nd: source id of broadcast
-//  3rd: packet id
-//return position if packet is found (all 3 bytes matched)
-//or 0xFFFF if no match packet in buffer
-
-static uint16_t vf_validate_relay_packet(uint8_array_t *checkdata);
-static uint16_t vf_validate_relay_packet2(uint8_array_t *checkdata);
-static uint16_t vf_validate_relay_packet3(uint8_array_t *checkdata);
+//adaptive relay scheduling, see relay_sched.h
+static void vf_relay_sched_level_set(uint8_t level);
 /*
 @modify relay data by increasing TTL, byte[2] of input
 */
 static void vf_modify_relay_data(uint8_array_t *checkdata);
 
 static void vf_tes_c_evt_handler(ble_tes_c_t * p_tes_c, ble_tes_c_evt_t * p_tes_c_evt);
-//vinh
-//add for userdata
-#define MAX_USERDATA_BUFFER MAX_USERDATA_BUFFER_BLOCK*MAX_USERDATA_BUFFER_BLOCKSIZE
-static uint8_t garr_userdata[MAX_USERDATA_BUFFER];
-uint8_array_t g_userdata={
-  .size=0,.p_data=garr_userdata};
-uint16_t g_userdata_lastpos=0;
-uint16_t g_userdata_firstpos=0;
-uint16_t g_userdata_currpos=0;
+static void thingy_db_cache_apply(uint16_t conn_handle, const tes_db_t * p_tes_db, const thingy_uis_db_t * p_uis_db);
+static bool conn_sched_holds(ble_gap_addr_t const * p_addr);
+//the active relay levels keep the advertising interval the set starts with
+STATIC_ASSERT(RELAY_ADV_INTERVAL_ACTIVE == PERIPHERAL_ADV_INTERVAL);
 uint8_t g_packetID=0;
 bool g_is_sink=false;
 
-typedef struct struct_adv_history_buff_type
-{
-  uint32_t id;
-  uint16_t  TTL;
-
-}adv_history_buff_t;
-
-#define MAX_HIST_ADV_BUFF_SIZE 128
-//#define MAX_HIST_ADV_BUFF_SIZE 8
-adv_history_buff_t g_buff_adv_hist[MAX_HIST_ADV_BUFF_SIZE];
-uint8_t g_buff_adv_hist_size=0;
-uint8_t g_buff_adv_hist_firstpos=0,g_buff_adv_hist_lastpos=0;
-
 //vinh ver4
  
 thingy_edata_t g_thingy_edata[NRF_SDH_BLE_CENTRAL_LINK_COUNT];
 
+//sensor aggregation window, one report per window. Set from the phone by APPCMD_SET_SENSOR_WINDOW
+#define SENSOR_WINDOW_DEFAULT_MS      10000
+#define SENSOR_WINDOW_MIN_MS          1000
+#define SENSOR_WINDOW_MAX_MS          240000  //app_timer takes up to 2^23 ticks at 32768 Hz
+#define SENSOR_SAMPLES_PER_WINDOW     5       //samples asked from a Thingy per window, its own default 2 s at the default window
+uint32_t g_sensor_window_ms=SENSOR_WINDOW_DEFAULT_MS;
+uint8_t  g_sensor_samples_per_window=SENSOR_SAMPLES_PER_WINDOW;
+
+//deadband reporting: a window is only relayed when a mean moved past its deadband since the last
+//report, or when the heartbeat is due. Set from the phone by APPCMD_SET_SENSOR_DEADBAND
+#define SENSOR_DEADBAND_TEMPERATURE   50      //0.50 C
+#define SENSOR_DEADBAND_PRESSURE      50      //0.50 hPa
+#define SENSOR_DEADBAND_HUMIDITY      2       //2 %
+#define SENSOR_HEARTBEAT_MS           300000  //report at least every 5 min
+typedef struct
+{
+  uint16_t temperature;   //0 reports every window
+  uint16_t pressure;
+  uint16_t humidity;
+  uint32_t heartbeat_ms;
+}sensor_deadband_t;
+sensor_deadband_t g_sensor_deadband={SENSOR_DEADBAND_TEMPERATURE, SENSOR_DEADBAND_PRESSURE,
+                                     SENSOR_DEADBAND_HUMIDITY, SENSOR_HEARTBEAT_MS};
+
+//what the sink last got from each Thingy
+typedef struct
+{
+  bool     valid;         //false until the first report after connecting
+  int32_t  temperature;
+  int32_t  pressure;
+  int32_t  humidity;
+  uint8_t  button;
+  uint32_t since_ms;      //time since that report, counted in windows
+  relay_codec_ref_t ref;  //keyframe the next compact reading refers to
+  uint8_t  since_keyframe;//reports since that keyframe
+  bool     keyframe_due;  //heartbeat, the next report is a keyframe
+}thingy_reported_t;
+thingy_reported_t g_thingy_reported[NRF_SDH_BLE_CENTRAL_LINK_COUNT];
+uint32_t g_reports_sent, g_reports_suppressed;
+
+//data updates go out as compact records (relay_codec.h), the readings of one window share a record
+#define RELAY_KEYFRAME_INTERVAL   8   //a keyframe at least every 8 reports, besides heartbeats
+//the record has to fit next to the name of any cluster head (cluster id up to 3 digits) and the flags
+#define RELAY_COMPACT_RECORD_MAX  MIN(MAX_USERDATA_BUFFER_BLOCKSIZE, RELAY_ADV_MAX_LENGTH-3-(2+sizeof(DEVICE_NAME)-1+3)-2)
+static uint8_t m_report_record[MAX_USERDATA_BUFFER_BLOCKSIZE];
+static uint8_t m_report_record_len=0;
+
 
 typedef struct struct_thingy_data_type
 {
@@ -294,10 +368,14 @@ typedef struct struct_thingy_data_type
 }thingy_data_t;
 
 void vf_adv_thingy_data(thingy_data_t*);
+static void vf_thingy_report_add(thingy_data_t*);
+static void vf_thingy_report_flush(void);
 
+#ifndef ENABLE_PIN_DEBUGGING
 #define ENABLE_PIN_DEBUGGING 0
+#endif
 
-#if(ITS_ENABLE_PIN_DEBUGGING == 1)
+#if(ENABLE_PIN_DEBUGGING == 1)
 #define DEBUG_PIN_SET(_pin) nrf_gpio_pin_set(DBG_PIN_ ## _pin)
 #define DEBUG_PIN_CLR(_pin) nrf_gpio_pin_clear(DBG_PIN_ ## _pin)
 #else
@@ -374,15 +452,74 @@ static ble_gap_conn_params_t const m_connection_param =
 };
 
 
+//vinh
+//uart_printf only copies the formatted text into m_uart_log_buf, the main loop hands it
+//to app_uart in uart_printf_process(), so BLE and timer handlers never wait on the UART.
+//Indexes run freely and are masked on access, in/out are only written by the producer/consumer side.
+#define UART_PRINTF_BUF_SIZE 1024   //must be a power of 2
+static uint8_t           m_uart_log_buf[UART_PRINTF_BUF_SIZE];
+static volatile uint16_t m_uart_log_in = 0;
+static volatile uint16_t m_uart_log_out = 0;
+static volatile uint32_t m_uart_log_dropped = 0;
+
+bool uart_log_write(const uint8_t *p_data, uint16_t len)
+{
+    uint16_t in, pos, first;
+    bool written = false;
+
+    // Several interrupt levels print, so claiming space is done with interrupts held off
+    CRITICAL_REGION_ENTER();
+    in = m_uart_log_in;
+    if ((uint16_t)(in - m_uart_log_out) + len > UART_PRINTF_BUF_SIZE)
+    {
+        // Drop the whole message rather than printing half a line
+        m_uart_log_dropped += len;
+    }
+    else
+    {
+        pos   = in & (UART_PRINTF_BUF_SIZE - 1);
+        first = MIN(len, UART_PRINTF_BUF_SIZE - pos);
+        memcpy(&m_uart_log_buf[pos], p_data, first);
+        memcpy(m_uart_log_buf, &p_data[first], len - first);
+        m_uart_log_in = in + len;
+        written = true;
+    }
+    CRITICAL_REGION_EXIT();
+    return written;
+}
+
 void uart_printf(const char *fmt, ...)
 {
-    char buf[256], *p;
+    char buf[256];
+    int len;
     va_list ap;
     va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    for (p = buf; *p; ++p)
-    app_uart_put(*p);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
+    if (len <= 0) return;
+    if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+
+    uart_log_write((const uint8_t *)buf, (uint16_t)len);
+}
+
+void uart_printf_process(void)
+{
+    uint16_t out = m_uart_log_out;
+
+    while (out != m_uart_log_in)
+    {
+        if (app_uart_put(m_uart_log_buf[out & (UART_PRINTF_BUF_SIZE - 1)]) != NRF_SUCCESS)
+        {
+            // app_uart FIFO full, go on next time round the main loop
+            break;
+        }
+        m_uart_log_out = ++out;
+    }
+}
+
+uint32_t uart_printf_dropped_get(void)
+{
+    return m_uart_log_dropped;
 }
 
 
@@ -439,7 +576,9 @@ static void gap_params_init(void)
 
 enum {APPCMD_ERROR, APPCMD_SET_LED_ALL, APPCMD_SET_LED_ON_OFF_ALL, 
       APPCMD_POST_CONNECT_MESSAGE, APPCMD_DISCONNECT_PERIPHERALS,
-      APPCMD_DISCONNECT_CENTRAL};
+      APPCMD_DISCONNECT_CENTRAL, APPCMD_SET_BATCH_MODE, APPCMD_SET_SENSOR_WINDOW,
+      APPCMD_SET_SENSOR_DEADBAND, APPCMD_SET_SINK_SNAPSHOT, APPCMD_GET_STATS,
+      APPCMD_DUMP_PROFILE};
 
 
 static volatile uint32_t agg_cmd_received = 0;
@@ -449,11 +588,19 @@ static void agg_cfg_service_data_handler(ble_agg_cfg_service_evt_t * p_evt)
 {
     if (p_evt->type == BLE_AGG_CFG_SERVICE_EVT_RX_DATA)
     {
+        uint16_t length = p_evt->params.rx_data.length;
+
+        if(length == 0)
+        {
+            return;
+        }
         //while(agg_cmd_received != 0);
         if(agg_cmd_received == 0)
         {
+            // Parameters after the command byte, cut to agg_cmd, what is missing reads as 0
+            memset(agg_cmd, 0, sizeof(agg_cmd));
+            memcpy(agg_cmd, &p_evt->params.rx_data.p_data[1], MIN(length - 1, sizeof(agg_cmd)));
             agg_cmd_received = p_evt->params.rx_data.p_data[0];
-            memcpy(agg_cmd, &p_evt->params.rx_data.p_data[1], p_evt->params.rx_data.length);
         }
         else NRF_LOG_WARNING("AGG CMD OVERFLOW!!\r\n");
     }
@@ -469,41 +616,372 @@ static void leds_init(void)
 }
 
 
-/**
- * @brief Parses advertisement data, providing length and location of the field in case
- *        matching data is found.
+/**@brief Function for finding each field of a given type in an advertising report.
  *
- * @param[in]  type       Type of data to be looked for in advertisement data.
- * @param[in]  p_advdata  Advertisement report length and pointer to report.
- * @param[out] p_typedata If data type requested is found in the data report, type data length and
- *                        pointer to data will be populated here.
+ * @details Starts at *p_offset and moves it past the field found, so calling it again
+ *          returns the next field of the same type.
+ *
+ * @param[in]     type       Type of data to be looked for in advertisement data.
+ * @param[in]     p_advdata  Advertisement report length and pointer to report.
+ * @param[in,out] p_offset   Where to start looking, updated to just after the field found.
+ * @param[out]    p_typedata If data type requested is found in the data report, type data length and
+ *                           pointer to data will be populated here.
  *
  * @retval NRF_SUCCESS if the data type is found in the report.
  * @retval NRF_ERROR_NOT_FOUND if the data type could not be found.
  */
-static uint32_t adv_report_parse(uint8_t type, uint8_array_t * p_advdata, uint8_array_t * p_typedata)
+static uint32_t adv_report_parse_next(uint8_t type, uint8_array_t * p_advdata, uint32_t * p_offset, uint8_array_t * p_typedata)
 {
-    uint32_t  index = 0;
+    uint32_t  index = *p_offset;
     uint8_t * p_data;
 
     p_data = p_advdata->p_data;
 
-    while (index < p_advdata->size)
+    while ((index + 1) < p_advdata->size)
     {
         uint8_t field_length = p_data[index];
         uint8_t field_type   = p_data[index + 1];
 
+        if ((field_length == 0) || ((index + field_length + 1) > p_advdata->size))
+        {
+            // Padding or truncated field, nothing more to parse
+            break;
+        }
         if (field_type == type)
         {
             p_typedata->p_data = &p_data[index + 2];
             p_typedata->size   = field_length - 1;
+            *p_offset = index + field_length + 1;
             return NRF_SUCCESS;
         }
         index += field_length + 1;
     }
+    *p_offset = p_advdata->size;
     return NRF_ERROR_NOT_FOUND;
 }
 
+/**@brief Fields of an advertising report that on_adv_report looks at, found in one pass. */
+typedef struct
+{
+    uint8_array_t name;             /**< Complete local name, else the short name. size 0 if neither. */
+    uint8_array_t uuid128;          /**< Incomplete list of 128-bit service UUIDs. size 0 if absent. */
+    uint32_t      manuf_offset;     /**< Offset of the first manufacturer specific field, or the report size. */
+} adv_report_fields_t;
+
+/**@brief Function for collecting all fields of interest from an advertising report in a single walk.
+ *
+ * @details manuf_offset can be handed to @ref adv_report_parse_next to step through the
+ *          manufacturer specific fields.
+ */
+static void adv_report_fields_get(uint8_array_t * p_advdata, adv_report_fields_t * p_fields)
+{
+    uint32_t  index = 0;
+    uint8_t * p_data = p_advdata->p_data;
+    bool      complete_name = false;
+
+    p_fields->name.size    = 0;
+    p_fields->uuid128.size = 0;
+    p_fields->manuf_offset = p_advdata->size;
+
+    while ((index + 1) < p_advdata->size)
+    {
+        uint8_t field_length = p_data[index];
+        uint8_t field_type   = p_data[index + 1];
+
+        if ((field_length == 0) || ((index + field_length + 1) > p_advdata->size))
+        {
+            // Padding or truncated field, nothing more to parse
+            break;
+        }
+        switch (field_type)
+        {
+            case BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME:
+                complete_name = true;
+                p_fields->name.p_data = &p_data[index + 2];
+                p_fields->name.size   = field_length - 1;
+                break;
+
+            case BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME:
+                if (!complete_name)
+                {
+                    p_fields->name.p_data = &p_data[index + 2];
+                    p_fields->name.size   = field_length - 1;
+                }
+                break;
+
+            case BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_MORE_AVAILABLE:
+                if (p_fields->uuid128.size == 0)
+                {
+                    p_fields->uuid128.p_data = &p_data[index + 2];
+                    p_fields->uuid128.size   = field_length - 1;
+                }
+                break;
+
+            case BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA:
+                if (p_fields->manuf_offset == p_advdata->size)
+                {
+                    p_fields->manuf_offset = index;
+                }
+                break;
+
+            default:
+                break;
+        }
+        index += field_length + 1;
+    }
+}
+
+/**@brief Name prefixes checked in on_adv_report, with their lengths worked out at compile time. */
+enum {SCAN_NAME_NONE, SCAN_NAME_BLINKY, SCAN_NAME_THINGY, SCAN_NAME_CLUSTERHEAD};
+
+typedef struct
+{
+    const char * p_prefix;
+    uint8_t      length;
+    uint8_t      kind;
+} scan_name_filter_t;
+
+static const scan_name_filter_t m_scan_name_table[] =
+{
+    {m_target_periph_name, sizeof(m_target_periph_name) - 1, SCAN_NAME_BLINKY},
+    {m_target_blinky_name, sizeof(m_target_blinky_name) - 1, SCAN_NAME_THINGY},     //vinh, m_target_blinky_name -> THINGY
+    {DEVICE_NAME,          sizeof(DEVICE_NAME) - 1,          SCAN_NAME_CLUSTERHEAD} //vinh, any cluster head, CH<id>
+};
+
+/**@brief Function for matching an advertised name against m_scan_name_table.
+ *
+ * @return SCAN_NAME_* of the first prefix that matches, SCAN_NAME_NONE if there is none.
+ */
+static uint8_t scan_name_match(uint8_array_t const * p_name)
+{
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_scan_name_table); i++)
+    {
+        scan_name_filter_t const * p_filter = &m_scan_name_table[i];
+
+        // First byte before memcmp, most names fail there
+        if ((p_filter->length != 0) &&
+            (p_name->size >= p_filter->length) &&
+            (p_name->p_data[0] == (uint8_t)p_filter->p_prefix[0]) &&
+            (memcmp(p_filter->p_prefix, p_name->p_data, p_filter->length) == 0))
+        {
+            return p_filter->kind;
+        }
+    }
+    return SCAN_NAME_NONE;
+}
+
+/**@brief Last verdict on_adv_report reached for a peer, so the next reports from it can skip parsing. */
+enum {SCAN_PEER_FREE, SCAN_PEER_IGNORE, SCAN_PEER_BLINKY, SCAN_PEER_THINGY, SCAN_PEER_CLUSTERHEAD};
+
+#ifndef SCAN_PEER_CACHE_SIZE
+#define SCAN_PEER_CACHE_SIZE        16
+#endif
+#define SCAN_PEER_CACHE_TTL_SEC     10      /**< Verdicts are worked out again after this many g_hist_time_sec seconds. */
+#define SCAN_PEER_CACHE_REPORT_SEC  30      /**< Period of the hit rate line printed by scan_peer_cache_report(). */
+
+typedef struct
+{
+    ble_gap_addr_t addr;
+    bool           scan_response;   /**< Adverts and scan responses carry different fields, each has its own verdict. */
+    uint8_t        verdict;         /**< SCAN_PEER_*. */
+    bool           relayed;         /**< Cluster head: every relay record in the report with this signature was handled. */
+    uint32_t       signature;       /**< Cluster head: scan_report_signature() of its last report. */
+    uint32_t       expire_time;     /**< g_hist_time_sec at which the entry is dropped. */
+    uint32_t       last_used;       /**< Lookup count at the last hit, the smallest is replaced first. */
+} scan_peer_entry_t;
+
+static struct
+{
+    scan_peer_entry_t entry[SCAN_PEER_CACHE_SIZE];
+    uint32_t          lookups;
+    uint32_t          hits;         /**< Reports dropped on the cached verdict alone. */
+} m_scan_peer_cache;
+
+/**@brief Function for hashing a whole advertising report (FNV-1a), never 0 so 0 can mean "not worked out". */
+static uint32_t scan_report_signature(uint8_array_t const * p_advdata)
+{
+    uint32_t hash = 2166136261UL;
+
+    for (uint32_t i = 0; i < p_advdata->size; i++)
+    {
+        hash = (hash ^ p_advdata->p_data[i]) * 16777619UL;
+    }
+    return hash | 1;
+}
+
+static bool scan_peer_entry_match(scan_peer_entry_t const * p_entry, ble_gap_evt_adv_report_t const * p_report)
+{
+    return (p_entry->addr.addr[0] == p_report->peer_addr.addr[0]) &&
+           (p_entry->scan_response == p_report->type.scan_response) &&
+           (p_entry->addr.addr_type == p_report->peer_addr.addr_type) &&
+           (memcmp(p_entry->addr.addr, p_report->peer_addr.addr, BLE_GAP_ADDR_LEN) == 0);
+}
+
+static bool scan_peer_entry_live(scan_peer_entry_t const * p_entry)
+{
+    return (p_entry->verdict != SCAN_PEER_FREE) && ((int32_t)(p_entry->expire_time - g_hist_time_sec) > 0);
+}
+
+/**@brief Function for accounting the relay records of a cluster head report dropped on its cached verdict.
+ *
+ * @details They were all handled when the report was first heard, now they are duplicates. They still
+ *          count for the duplicate share and suppress the blocks queued here, as in on_adv_report.
+ */
+static void scan_peer_relay_heard_again(uint8_array_t const * p_advdata)
+{
+    uint8_array_t advdata = *p_advdata;
+    uint8_array_t userdata;
+    uint32_t      offset = 0;
+
+    while (adv_report_parse_next(BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &advdata, &offset, &userdata) == NRF_SUCCESS)
+    {
+        if ((userdata.size >= 4) && !vf_check_source(&userdata) && !vf_check_destination(&userdata))
+        {
+            (void)relay_sched_heard(userdata.p_data);
+        }
+    }
+}
+
+/**@brief Function for checking whether a report can be dropped on the cached verdict for its peer.
+ *
+ * @param[out] p_signature Signature of the report if it had to be worked out, else 0.
+ */
+static bool scan_peer_cache_skip(ble_gap_evt_adv_report_t const * p_report, uint8_array_t const * p_advdata,
+                                 uint32_t * p_signature)
+{
+    bool skip = false;
+
+    *p_signature = 0;
+    m_scan_peer_cache.lookups++;
+    for (uint32_t i = 0; i < SCAN_PEER_CACHE_SIZE; i++)
+    {
+        scan_peer_entry_t * p_entry = &m_scan_peer_cache.entry[i];
+
+        if (scan_peer_entry_live(p_entry) && scan_peer_entry_match(p_entry, p_report))
+        {
+            switch (p_entry->verdict)
+            {
+                case SCAN_PEER_IGNORE:
+                    skip = true;
+                    break;
+
+                case SCAN_PEER_BLINKY:
+                    // Already queued or being connected, or no link left to connect it on
+                    skip = conn_sched_holds(&p_report->peer_addr) ||
+                           (ble_conn_state_central_conn_count() >= NRF_SDH_BLE_CENTRAL_LINK_COUNT);
+                    break;
+
+                case SCAN_PEER_THINGY:
+                    // Still too far away to connect to, or already queued or being connected
+                    skip = (p_report->rssi <= THINGY_RSSI_CONNECT_LIMIT) || conn_sched_holds(&p_report->peer_addr);
+                    break;
+
+                case SCAN_PEER_CLUSTERHEAD:
+                    // Same relay records as last time, and all of them were handled then
+                    *p_signature = scan_report_signature(p_advdata);
+                    skip = p_entry->relayed && (*p_signature == p_entry->signature);
+                    if (skip)
+                    {
+                        scan_peer_relay_heard_again(p_advdata);
+                    }
+                    break;
+            }
+            p_entry->last_used = m_scan_peer_cache.lookups;
+            if (skip)
+            {
+                m_scan_peer_cache.hits++;
+            }
+            break;
+        }
+    }
+    return skip;
+}
+
+/**@brief Function for storing a verdict, over the entry for the same peer, a dead one or the least recently used. */
+static void scan_peer_cache_put(ble_gap_evt_adv_report_t const * p_report, uint8_t verdict, uint32_t signature, bool relayed)
+{
+    scan_peer_entry_t * p_victim = &m_scan_peer_cache.entry[0];
+    uint32_t            victim_used = UINT32_MAX;
+
+    for (uint32_t i = 0; i < SCAN_PEER_CACHE_SIZE; i++)
+    {
+        scan_peer_entry_t * p_entry = &m_scan_peer_cache.entry[i];
+        uint32_t            used    = scan_peer_entry_live(p_entry) ? p_entry->last_used : 0;
+
+        if ((p_entry->verdict != SCAN_PEER_FREE) && scan_peer_entry_match(p_entry, p_report))
+        {
+            p_victim = p_entry;
+            break;
+        }
+        if (used < victim_used)
+        {
+            p_victim    = p_entry;
+            victim_used = used;
+        }
+    }
+
+    p_victim->addr          = p_report->peer_addr;
+    p_victim->scan_response = p_report->type.scan_response;
+    p_victim->verdict       = verdict;
+    p_victim->relayed       = relayed;
+    p_victim->signature     = signature;
+    p_victim->expire_time   = g_hist_time_sec + SCAN_PEER_CACHE_TTL_SEC;
+    p_victim->last_used     = m_scan_peer_cache.lookups;
+}
+
+/**@brief Function for printing the peer cache hit rate every SCAN_PEER_CACHE_REPORT_SEC, from the main loop. */
+static void scan_peer_cache_report(void)
+{
+    static uint32_t next_report = SCAN_PEER_CACHE_REPORT_SEC;
+    uint32_t        lookups, hits;
+
+    if ((int32_t)(g_hist_time_sec - next_report) < 0)
+    {
+        return;
+    }
+    next_report = g_hist_time_sec + SCAN_PEER_CACHE_REPORT_SEC;
+
+    CRITICAL_REGION_ENTER();
+    lookups = m_scan_peer_cache.lookups;
+    hits    = m_scan_peer_cache.hits;
+    m_scan_peer_cache.lookups = 0;
+    m_scan_peer_cache.hits    = 0;
+    CRITICAL_REGION_EXIT();
+
+    UART_PRINTF_INFO("Peer cache: %u of %u reports skipped (%u%%)\r\n",
+                     (unsigned int)hits, (unsigned int)lookups, (unsigned int)(lookups ? (hits * 100) / lookups : 0));
+}
+
+#if (RELAY_CODED_PHY_ENABLED == 1)
+STATIC_ASSERT(RELAY_PHY_1M == BLE_GAP_PHY_1MBPS);
+STATIC_ASSERT(RELAY_PHY_CODED == BLE_GAP_PHY_CODED);
+
+/**@brief Function for passing a report of cluster head CH<id> to the relay PHY choice. */
+static void relay_phy_nbr_heard(uint8_array_t const * p_name, uint8_t primary_phy, int8_t rssi)
+{
+    uint32_t id = 0;
+    uint32_t i  = sizeof(DEVICE_NAME) - 1;
+
+    if (p_name->size <= i)
+    {
+        return;
+    }
+    for (; i < p_name->size; i++)
+    {
+        if ((p_name->p_data[i] < '0') || (p_name->p_data[i] > '9'))
+        {
+            return;
+        }
+        id = id * 10 + (p_name->p_data[i] - '0');
+        if (id > UINT8_MAX)
+        {
+            return;
+        }
+    }
+    relay_sched_nbr_heard(id, primary_phy, rssi);
+}
+#endif
+
 static bool m_scan_mode_coded_phy = false;
 
 static void adv_led_blink_callback(void *p)
@@ -545,8 +1023,14 @@ static void scan_start(bool coded_phy)
     {
         NRF_LOG_DEBUG("Scan start: Name - %s, phy - %s", (uint32_t)m_target_periph_name, coded_phy ? "Coded" : "1Mbps");
         m_scan_buffer.len = BLE_GAP_SCAN_BUFFER_EXTENDED_MIN;
+#if (SCAN_MULTI_PHY_ENABLED == 1)
+        // Both PHYs, one window each per interval. Coded PHY is on, whatever was asked for
+        coded_phy = true;
+        m_scan_params.scan_phys = BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_CODED;
+#else
         m_scan_params.scan_phys = coded_phy ? BLE_GAP_PHY_CODED : BLE_GAP_PHY_1MBPS;
-        m_scan_params.extended = coded_phy ? 1 : 0;
+#endif
+        m_scan_params.extended = (coded_phy || (RELAY_EXTENDED_ADV_ENABLED == 1)) ? 1 : 0; //extended relay packets are only seen by an extended scanner
         ret = sd_ble_gap_scan_start(&m_scan_params, &m_scan_buffer);
         if(ret == NRF_ERROR_INVALID_STATE)
         {
@@ -570,6 +1054,215 @@ static void scan_stop(void)
     scan_led_state_set(false, false);
 }
 
+/**@brief Connection scheduler.
+ *
+ * @details The SoftDevice runs one connection attempt at a time, and it sets up m_device_being_connected_info
+ *          for the BLE_GAP_EVT_CONNECTED handler. Candidates found while scanning are queued here. As soon as a
+ *          link is up the next one is connected or scanning resumes, while DB discovery runs on the new link.
+ *          Timed out attempts go back to the end of the queue.
+ */
+#ifndef CONN_SCHED_QUEUE_SIZE
+#define CONN_SCHED_QUEUE_SIZE       8
+#endif
+#define CONN_SCHED_MAX_ATTEMPTS     3
+#define CONN_SCHED_ROUND_IDLE_SEC   10      /**< A round of connections is over when no link came up for this long. */
+
+typedef struct
+{
+    ble_gap_addr_t addr;
+    device_type_t  dev_type;
+    uint8_t        phy;
+    int8_t         rssi;                /**< Of the report it was queued on. */
+    uint8_t        attempts;
+    char           name[sizeof(m_device_name_being_connected_to)];
+} conn_candidate_t;
+
+static struct
+{
+    conn_candidate_t queue[CONN_SCHED_QUEUE_SIZE];
+    uint8_t          head;
+    uint8_t          count;
+    conn_candidate_t current;           /**< Attempt in progress while m_device_being_connected_info.dev_type is set. */
+    bool             round_active;      /**< Links are being brought up after all of them were down. */
+    uint32_t         round_start;       /**< app_timer tick of the first candidate of the round. */
+    uint32_t         round_last;        /**< app_timer tick of the last link up in the round. */
+    uint32_t         round_last_sec;    /**< g_hist_time_sec of the same. */
+    uint8_t          round_links;
+} m_conn_sched;
+
+/**@brief Milliseconds from the first candidate of the round to tick, the 24 bit RTC wraps after 512 s. */
+static uint32_t conn_sched_round_ms(uint32_t tick)
+{
+    uint32_t ticks = app_timer_cnt_diff_compute(tick, m_conn_sched.round_start);
+    return (uint32_t)(((uint64_t)ticks * 1000) / APP_TIMER_CLOCK_FREQ);
+}
+
+static bool conn_sched_push(conn_candidate_t const * p_candidate)
+{
+    if (m_conn_sched.count >= CONN_SCHED_QUEUE_SIZE)
+    {
+        return false;
+    }
+    m_conn_sched.queue[(m_conn_sched.head + m_conn_sched.count) % CONN_SCHED_QUEUE_SIZE] = *p_candidate;
+    m_conn_sched.count++;
+    return true;
+}
+
+/**@brief Function for comparing two peer addresses, the address type included. */
+static bool conn_sched_addr_equal(ble_gap_addr_t const * p_a, ble_gap_addr_t const * p_b)
+{
+    return (p_a->addr_type == p_b->addr_type) && (memcmp(p_a->addr, p_b->addr, BLE_GAP_ADDR_LEN) == 0);
+}
+
+/**@brief Function for checking whether a peer is queued or being connected. */
+static bool conn_sched_holds(ble_gap_addr_t const * p_addr)
+{
+    if ((m_device_being_connected_info.dev_type != DEVTYPE_NONE) &&
+        conn_sched_addr_equal(&m_conn_sched.current.addr, p_addr))
+    {
+        return true;
+    }
+    for (uint32_t i = 0; i < m_conn_sched.count; i++)
+    {
+        if (conn_sched_addr_equal(&m_conn_sched.queue[(m_conn_sched.head + i) % CONN_SCHED_QUEUE_SIZE].addr, p_addr))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**@brief Function for queueing a peer found while scanning, unless it is already queued or being connected.
+ *
+ * @param[in] phy  PHY to connect on.
+ */
+static void conn_sched_add(ble_gap_evt_adv_report_t const * p_report, device_type_t dev_type, uint8_t phy,
+                           uint8_t const * p_name, uint32_t name_len)
+{
+    ble_gap_addr_t const * p_addr = &p_report->peer_addr;
+    conn_candidate_t candidate;
+
+    if ((ble_conn_state_central_conn_count() >= NRF_SDH_BLE_CENTRAL_LINK_COUNT) || conn_sched_holds(p_addr))
+    {
+        return;
+    }
+
+    candidate.addr     = *p_addr;
+    candidate.dev_type = dev_type;
+    candidate.phy      = phy;
+    candidate.rssi     = p_report->rssi;
+    candidate.attempts = 0;
+    name_len = MIN(name_len, sizeof(candidate.name) - 1);
+    memcpy(candidate.name, p_name, name_len);
+    candidate.name[name_len] = 0;
+
+    if (conn_sched_push(&candidate) && !m_conn_sched.round_active &&
+        (ble_conn_state_central_conn_count() == 0) && (m_device_being_connected_info.dev_type == DEVTYPE_NONE))
+    {
+        // Startup, or every link lost at once: time how long it takes to get them back
+        m_conn_sched.round_active = true;
+        m_conn_sched.round_links  = 0;
+        m_conn_sched.round_start  = app_timer_cnt_get();
+    }
+}
+
+/**@brief Function for starting a connection to the next queued candidate.
+ *
+ * @return true if a connection attempt is in progress, so scanning must not be resumed.
+ */
+static bool conn_sched_connect_next(void)
+{
+    ret_code_t            err_code;
+    ble_gap_scan_params_t conn_scan_params;
+
+    if (m_device_being_connected_info.dev_type != DEVTYPE_NONE)
+    {
+        return true;
+    }
+    while ((m_conn_sched.count > 0) && (ble_conn_state_central_conn_count() < NRF_SDH_BLE_CENTRAL_LINK_COUNT))
+    {
+        m_conn_sched.current = m_conn_sched.queue[m_conn_sched.head];
+        m_conn_sched.head = (m_conn_sched.head + 1) % CONN_SCHED_QUEUE_SIZE;
+        m_conn_sched.count--;
+
+        memcpy(m_device_name_being_connected_to, m_conn_sched.current.name, sizeof(m_device_name_being_connected_to));
+        m_device_being_connected_info.dev_type = m_conn_sched.current.dev_type;
+        m_device_being_connected_info.phy      = m_conn_sched.current.phy;
+        // On the PHY the peer was heard on, m_scan_params keeps the PHYs scanning is configured for
+        conn_scan_params                       = m_scan_params;
+        conn_scan_params.scan_phys             = m_conn_sched.current.phy;
+
+        // Scanning is paused after a report, but may be running when called after discovery or a disconnect
+        (void)sd_ble_gap_scan_stop();
+        err_code = sd_ble_gap_connect(&m_conn_sched.current.addr, &conn_scan_params, &m_connection_param, APP_BLE_CONN_CFG_TAG);
+        if (err_code == NRF_SUCCESS)
+        {
+            scan_led_state_set(false, false);
+            return true;
+        }
+        NRF_LOG_ERROR("Connection Request Failed, reason %d", err_code);
+        m_device_being_connected_info.dev_type = DEVTYPE_NONE;
+    }
+    return false;
+}
+
+/**@brief Function for going on after a connection, a failed attempt, a disconnect or a finished discovery. */
+static void conn_sched_resume(void)
+{
+    if (!conn_sched_connect_next())
+    {
+        scan_start(m_scan_mode_coded_phy);
+    }
+}
+
+/**@brief Function for handling a connection attempt that timed out, the peer gets CONN_SCHED_MAX_ATTEMPTS tries. */
+static void conn_sched_on_timeout(void)
+{
+    m_device_being_connected_info.dev_type = DEVTYPE_NONE;
+    if (++m_conn_sched.current.attempts < CONN_SCHED_MAX_ATTEMPTS)
+    {
+        (void)conn_sched_push(&m_conn_sched.current);
+    }
+    conn_sched_resume();
+}
+
+static void conn_sched_round_end(void)
+{
+    m_conn_sched.round_active = false;
+    UART_PRINTF_INFO("All %d links connected in %u ms\r\n", (int)m_conn_sched.round_links,
+                     (unsigned int)conn_sched_round_ms(m_conn_sched.round_last));
+}
+
+/**@brief Function for timing each link of a round, called from BLE_GAP_EVT_CONNECTED. */
+static void conn_sched_on_connected(void)
+{
+    if (!m_conn_sched.round_active)
+    {
+        return;
+    }
+    m_conn_sched.round_last     = app_timer_cnt_get();
+    m_conn_sched.round_last_sec = g_hist_time_sec;
+    m_conn_sched.round_links++;
+    UART_PRINTF_INFO("Central link %d up %u ms after the first candidate\r\n", (int)m_conn_sched.round_links,
+                     (unsigned int)conn_sched_round_ms(m_conn_sched.round_last));
+    if (ble_conn_state_central_conn_count() >= NRF_SDH_BLE_CENTRAL_LINK_COUNT)
+    {
+        conn_sched_round_end();
+    }
+}
+
+/**@brief Function for reporting time-to-all-connected once no more links come up, from the main loop. */
+static void conn_sched_report(void)
+{
+    CRITICAL_REGION_ENTER();
+    if (m_conn_sched.round_active && (m_conn_sched.round_links > 0) &&
+        ((int32_t)(g_hist_time_sec - m_conn_sched.round_last_sec) >= CONN_SCHED_ROUND_IDLE_SEC))
+    {
+        conn_sched_round_end();
+    }
+    CRITICAL_REGION_EXIT();
+}
+
 
 /**@brief Handles events coming from the LED Button central module.
  *
@@ -601,8 +1294,6 @@ static void lbs_c_evt_handler(ble_lbs_c_t * p_lbs_c, ble_lbs_c_evt_t * p_lbs_c_e
                 conn_params.conn_sup_timeout  = SUPERVISION_TIMEOUT;
 
                 sd_ble_gap_conn_param_update(p_lbs_c_evt->conn_handle, &conn_params);
-                
-                scan_start(m_scan_mode_coded_phy);
             } 
             break; // BLE_LBS_C_EVT_DISCOVERY_COMPLETE
 
@@ -651,6 +1342,8 @@ static void thingy_uis_c_evt_handler(ble_thingy_uis_c_t * p_thingy_uis_c, ble_th
         {
             NRF_LOG_INFO("Thingy UI service discovered on conn_handle 0x%x\r\n", p_thingy_uis_c_evt->conn_handle);
             
+            thingy_db_cache_uis_store(peer_addr_LR[p_thingy_uis_c_evt->conn_handle], &p_thingy_uis_c->peer_thingy_uis_db);
+
             // Thingy UI service discovered. Enable notification of Button.
             err_code = ble_thingy_uis_c_button_notif_enable(p_thingy_uis_c);
             APP_ERROR_CHECK(err_code);
@@ -664,8 +1357,6 @@ static void thingy_uis_c_evt_handler(ble_thingy_uis_c_t * p_thingy_uis_c, ble_th
             conn_params.conn_sup_timeout  = SUPERVISION_TIMEOUT;
 
             sd_ble_gap_conn_param_update(p_thingy_uis_c_evt->conn_handle, &conn_params);
-            
-            scan_start(m_scan_mode_coded_phy);
 
         } break; // BLE_LBS_C_EVT_DISCOVERY_COMPLETE
 
@@ -677,15 +1368,21 @@ static void thingy_uis_c_evt_handler(ble_thingy_uis_c_t * p_thingy_uis_c, ble_th
             if(g_is_sink==false)
             {
                 g_thingy_edata[p_thingy_uis_c_evt->conn_handle].button=p_thingy_uis_c_evt->params.button.button_state;
+                if(!g_thingy_reported[p_thingy_uis_c_evt->conn_handle].valid)
+                {//no window with data has closed yet, the means are not readings. The first window
+                 //report carries the button, vf_thingy_report_due() is true until one is sent
+                    break;
+                }
                 //vinh ver3
                 //send button state to sink
                 thingy_data.local_id=p_thingy_uis_c_evt->conn_handle;
                 thingy_data.link_state=AGG_NODE_LINK_DATA_UPDATE;
                 thingy_data.button=p_thingy_uis_c_evt->params.button.button_state;
-                thingy_data.temperature= g_thingy_edata[p_thingy_uis_c_evt->conn_handle].temperature.avg;
-                thingy_data.pressure=g_thingy_edata[p_thingy_uis_c_evt->conn_handle].pressure.avg;
-                thingy_data.humidity=g_thingy_edata[p_thingy_uis_c_evt->conn_handle].humidity.avg;
-                vf_adv_thingy_data(&thingy_data);  //broadcast data to sink
+                thingy_data.temperature= g_thingy_edata[p_thingy_uis_c_evt->conn_handle].temperature.done.mean;
+                thingy_data.pressure=g_thingy_edata[p_thingy_uis_c_evt->conn_handle].pressure.done.mean;
+                thingy_data.humidity=g_thingy_edata[p_thingy_uis_c_evt->conn_handle].humidity.done.mean;
+                vf_thingy_report_add(&thingy_data);  //broadcast data to sink
+                vf_thingy_report_flush();
             }
             else
             {
@@ -714,179 +1411,105 @@ static void on_adv_report(ble_evt_t const * p_ble_evt)
 {
     uint32_t      err_code;
     uint8_array_t adv_data;
-    uint8_array_t dev_name;
-    uint8_array_t service_uuid;
+    adv_report_fields_t fields;
     //vinh
     uint8_array_t userdata;
-    size_t i,trim_pos;
-    //vinh
-    static char str_uart[128],str2[10];
-    static uint16_t str_uart_len=0;
+    uint32_t userdata_offset;
+    int8_t rssi;
+    uint8_t name_kind;
+    uint32_t signature;
+    bool relayed;
     //NRF_LOG_INFO("ADV");
+    AGG_PROF_BEGIN(AGG_PROF_ADV_REPORT);
 
     if (m_device_being_connected_info.dev_type == DEVTYPE_NONE)
     {
 
         // For readibility.
         ble_gap_evt_t  const * p_gap_evt  = &p_ble_evt->evt.gap_evt;
-        ble_gap_addr_t const * peer_addr  = &p_gap_evt->params.adv_report.peer_addr;
 
-        // Prepare advertisement report for parsing.
+        rssi=p_gap_evt->params.adv_report.rssi;
         adv_data.p_data = (uint8_t *)p_gap_evt->params.adv_report.data.p_data;
         adv_data.size   = p_gap_evt->params.adv_report.data.len;
 
-        // Search for advertising names.
-        bool found_name = false, found_blinky_name = false,found_clusterhead_data=false;
-        err_code = adv_report_parse(BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME,
-                                    &adv_data,
-                                    &dev_name);
-        if (err_code != NRF_SUCCESS)
+        // Cheapest checks first: too weak for every filter below, or a peer whose verdict still holds
+        if ((rssi > SCAN_RSSI_REJECT_LIMIT) && !scan_peer_cache_skip(&p_gap_evt->params.adv_report, &adv_data, &signature))
         {
-            // Look for the short local name if it was not found as complete.
-            err_code = adv_report_parse(BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME, &adv_data, &dev_name);
-            if (err_code != NRF_SUCCESS)
+            // Prepare advertisement report for parsing, all fields in one pass.
+            adv_report_fields_get(&adv_data, &fields);
+
+            name_kind = scan_name_match(&fields.name);
+
+            if (name_kind == SCAN_NAME_NONE)
             {
-                // If we can't parse the data, then exit.
-                //return;
+                scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_IGNORE, 0, false);
             }
-            else
+            else if (name_kind == SCAN_NAME_BLINKY)
             {
-                found_name = true;
+                // The name goes on to the smart phone later, without the filter prefix
+                conn_sched_add(&p_gap_evt->params.adv_report, DEVTYPE_BLINKY, p_gap_evt->params.adv_report.primary_phy,
+                               fields.name.p_data + m_scan_name_table[0].length,
+                               fields.name.size - m_scan_name_table[0].length);
+                scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_BLINKY, 0, false);
             }
-        }
-        else
-        {
-            found_name = true;
-        }
-
-        if (found_name)
-        {
-            //NRF_LOG_INFO("ADV name: %s", dev_name.p_data);
-            // Check if the device name matches the BLINKY name filter
-            if (strlen(m_target_periph_name) != 0)
+            else if (name_kind == SCAN_NAME_THINGY)
             {
-                if (memcmp(m_target_periph_name, dev_name.p_data, strlen(m_target_periph_name)) == 0)
+                // Look for Thingy UUID
+                // Filter on RSSI to avoid connecting to everything in the room
+                static const uint8_t thingy_service_uuid[] = {0x42, 0x00, 0x74, 0xA9, 0xFF, 0x52, 0x10, 0x9B, 0x33, 0x49, 0x35, 0x9B, 0x00, 0x01, 0x68, 0xEF};
+
+                if ((fields.uuid128.size < 16) || (memcmp(fields.uuid128.p_data, thingy_service_uuid, 16) != 0))
                 {
-                    // Copy the name to a static variable, to pass it on to the smart phone later
-                    if(dev_name.size > strlen(m_target_periph_name))
-                    {
-                        memcpy(m_device_name_being_connected_to, 
-                               dev_name.p_data + strlen(m_target_periph_name), 
-                               dev_name.size - strlen(m_target_periph_name));
-                        m_device_name_being_connected_to[dev_name.size - strlen(m_target_periph_name)] = 0;
-                    }
-                    m_device_being_connected_info.dev_type = DEVTYPE_BLINKY;
+                    // Thingy name without the Thingy service
+                    scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_IGNORE, 0, false);
                 }
-                else if(memcmp(m_target_blinky_name, dev_name.p_data, strlen(m_target_blinky_name)) == 0) //vinh, m_target_blinky_name -> THINGY
+                else if (rssi <= THINGY_RSSI_CONNECT_LIMIT)
                 {
-
-                    found_blinky_name = true;
-                    //vinh, not add Thingy to the list here since check RSSI at below code 
+                    scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_THINGY, 0, false);
+                }
+                else
+                {
+                    NRF_LOG_INFO("Named Thingy!!");
+                    // Thingies advertise on 1M, the link goes to 2M later if it is strong enough
+                    conn_sched_add(&p_gap_evt->params.adv_report, DEVTYPE_THINGY, BLE_GAP_PHY_1MBPS,
+                                   fields.name.p_data, fields.name.size);
+                    scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_THINGY, 0, false);
                 }
-
-
-                //else if(memcmp(m_target_clusterhead_name, dev_name.p_data, strlen(m_target_clusterhead_name)) == 0) //vinh, m_target_clusterhead_name -> CLUSTERHEAD
- 
-                /*--------------------------------
-                //student: advertising receive--
-                ------------------------*/
-                else if(memcmp((const uint8_t *) DEVICE_NAME, dev_name.p_data, strlen((const uint8_t *) DEVICE_NAME)) == 0) //vinh, m_target_clusterhead_name -> CLUSTERHEAD
-              {//found clusterhead name
-                  found_clusterhead_data= true;
-
-                  //vinh
-                  uint32_t counter = app_timer_cnt_get();
-                  uart_printf("find cluster head @time:%d\n\r", counter);//print to COM port
-
-                  //parse data
-                  err_code = adv_report_parse(BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &adv_data, &userdata);
-                  if((err_code == NRF_SUCCESS)&&(p_gap_evt->params.adv_report.rssi >CLUSTERHEAD_RSSI_CONNECT_LIMIT))
-                  {//have user data
-                    uart_printf("find userdata, $RSSI=%d \n\r",p_gap_evt->params.adv_report.rssi);
-                    str_uart[0]=0;
-                    for(i=0;i<userdata.size;i++)
-                    {
-                     sprintf(str2,"%d ",userdata.p_data[i]);
-                     strcat(str_uart,str2);
-                    }
-                    strcat(str_uart,"\n\r");
-                    uart_printf(str_uart);
-
-                      
-                    if(vf_check_source(&userdata)==true)
-                    {//message return to source, do nothing
-                       strcpy(str_uart,"reflect data \n\r");
-                       uart_printf(str_uart); //print to COM port
-                    }
-                    else
-                    {//message from another source
-                        if(vf_check_destination(&userdata)==true)
-                        {//match destination -> process data 
-                            strcpy(str_uart,"process data \n\r");
-                            uart_printf(str_uart);  //print to COM port
-                            vf_process_adv_command3(&userdata); 
-                        }
-                        else 
-                        {//not destination -> message to be relayed
-                        //validate message(check for redundant message in buffer)
-                          if(vf_validate_relay_packet3(&userdata)==0xFFFF) 
-                            err_code=vf_add_packet_to_buffer3(&userdata); //new message, add msg to buffer for advertising
-                          else
-                            uart_printf("Redundant packet\n\r"); //message has already been in buffer 
-                        }
-                    }//end message from another source
-                  }//end having user data
-              }//end found cluster head
             }
-            //vinh ver3
-            //relay_adv_data2();  //broadcast next packet in buffer
+            /*--------------------------------
+            //student: advertising receive--
+            ------------------------*/
+            else if (name_kind == SCAN_NAME_CLUSTERHEAD)
+            {//found clusterhead name
+#if (RELAY_CODED_PHY_ENABLED == 1)
+                relay_phy_nbr_heard(&fields.name, p_gap_evt->params.adv_report.primary_phy, rssi);
+#endif
+                //parse data, an extended advertising packet carries several relay records
+                relayed=(rssi > CLUSTERHEAD_RSSI_CONNECT_LIMIT);
+                userdata_offset=relayed ? fields.manuf_offset : adv_data.size;
+                while(adv_report_parse_next(BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &adv_data, &userdata_offset, &userdata) == NRF_SUCCESS)
+                {//have user data
+                  if(userdata.size<4) continue; //shorter than source, destination, packet id, hop counts
+                  //binary trace record instead of a text dump, the report timestamp comes with it
+                  AGG_TRACE2(AGG_TRACE_EVT_ADV_USERDATA, (uint8_t *)&rssi, 1, userdata.p_data, userdata.size);
+
+                  //back at its source: dropped, for this cluster: processed once, else relayed once
+                  if(relay_sched_rx(userdata.p_data, userdata.size)==RELAY_RX_FULL)
+                    relayed=false; //buffer full, take this report again next time
+                }//end having user data
+
+                //the same report again is then dropped before relay_pool_validate
+                if(signature==0) signature=scan_report_signature(&adv_data);
+                scan_peer_cache_put(&p_gap_evt->params.adv_report, SCAN_PEER_CLUSTERHEAD, signature, relayed);
+            }//end found cluster head
             /*-----------------
             end clusterhead advertising recevier handler
             ---------------------*/
 
-        
-            // Look for Thingy UUID
-            // Filter on RSSI to avoid connecting to everything in the room
-            const uint8_t thingy_service_uuid[] = {0x42, 0x00, 0x74, 0xA9, 0xFF, 0x52, 0x10, 0x9B, 0x33, 0x49, 0x35, 0x9B, 0x00, 0x01, 0x68, 0xEF};
-            //vinh 
-            //if(p_gap_evt->params.adv_report.rssi > THINGY_RSSI_CONNECT_LIMIT || found_blinky_name)
-            if(p_gap_evt->params.adv_report.rssi > THINGY_RSSI_CONNECT_LIMIT && found_blinky_name)
-            {
-                err_code = adv_report_parse(BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_MORE_AVAILABLE, &adv_data, &service_uuid);
-                if (err_code == NRF_SUCCESS)
-                {
-                    if (memcmp(service_uuid.p_data, thingy_service_uuid, 16) == 0)
-                    {
-                        NRF_LOG_INFO(found_blinky_name ? "Named Thingy!!" : "Thingy!!");
-                        if(found_name)
-                        {
-                            memcpy(m_device_name_being_connected_to, 
-                                   dev_name.p_data, dev_name.size);
-                            m_device_name_being_connected_to[dev_name.size] = 0;
-                        }
-                        m_device_being_connected_info.dev_type = DEVTYPE_THINGY;
-                    }
-                }
-            }
-
-        
-
-
-            if ((m_device_being_connected_info.dev_type != DEVTYPE_NONE)&& (found_clusterhead_data==false))
-            //vinh, add cluster head to check condition   
-            {
-                m_device_being_connected_info.phy = m_scan_params.scan_phys;
-            
-                // Initiate connection.
-                err_code = sd_ble_gap_connect(peer_addr, &m_scan_params, &m_connection_param, APP_BLE_CONN_CFG_TAG);
-                if (err_code != NRF_SUCCESS)
-                {
-                    NRF_LOG_ERROR("Connection Request Failed, reason %d", err_code);
-                }
-            }
         }
     }
-    if(m_device_being_connected_info.dev_type == DEVTYPE_NONE)
+    // Initiate connection to a queued candidate, or go on scanning
+    if(!conn_sched_connect_next())
     {
         // As of SoftDevice version 6.0 scanning must be started manually after each received packet
         err_code = sd_ble_gap_scan_start(NULL, &m_scan_buffer);
@@ -896,13 +1519,9 @@ static void on_adv_report(ble_evt_t const * p_ble_evt)
         }
         else APP_ERROR_CHECK(err_code);
     }
-    else
-    {
-        scan_led_state_set(false, false);
-    }
+    AGG_PROF_STOP(AGG_PROF_ADV_REPORT);
 }
 
-static uint8_t peer_addr_LR[NRF_SDH_BLE_CENTRAL_LINK_COUNT][6];
 
 /**@brief Function for handling BLE events.
  *
@@ -918,9 +1537,12 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 
     //vinh ver3
     thingy_data_t thingy_data;
+    tes_db_t        cached_tes_db;
+    thingy_uis_db_t cached_uis_db;
 
     // For readability.
     ble_gap_evt_t const * p_gap_evt = &p_ble_evt->evt.gap_evt;
+    AGG_PROF_BEGIN(AGG_PROF_BLE_EVT);
     //NRF_LOG_INFO("Evt: %i", p_ble_evt->header.evt_id);
     switch (p_ble_evt->header.evt_id)
     {
@@ -943,6 +1565,10 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                              p_gap_evt->conn_handle);
 
                 memcpy(&peer_addr_LR[p_gap_evt->conn_handle][0], &p_gap_evt->params.connected.peer_addr.addr[0], 6);
+                if(p_gap_evt->conn_handle < NRF_SDH_BLE_CENTRAL_LINK_COUNT)
+                {
+                    m_thingy_db_cached[p_gap_evt->conn_handle] = false;
+                }
 
                 //APP_ERROR_CHECK_BOOL(p_gap_evt->conn_handle < NRF_SDH_BLE_CENTRAL_LINK_COUNT);
 
@@ -964,6 +1590,25 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                         err_code = ble_tes_c_handles_assign(&m_thingy_tes_c[p_gap_evt->conn_handle], p_gap_evt->conn_handle, NULL);
                         APP_ERROR_CHECK(err_code);
 
+                        if(p_gap_evt->conn_handle < NRF_SDH_BLE_CENTRAL_LINK_COUNT)
+                        {
+                            m_thingy_db_cached[p_gap_evt->conn_handle] =
+                                thingy_db_cache_find(p_gap_evt->params.connected.peer_addr.addr, &cached_tes_db, &cached_uis_db);
+                        }
+
+                        if (m_conn_sched.current.rssi > THINGY_2M_RSSI_LIMIT)
+                        {
+                            // Strong enough for 2M, a Thingy that turns it down stays on 1M
+                            ble_gap_phys_t const phys =
+                            {
+                                .rx_phys = BLE_GAP_PHY_2MBPS,
+                                .tx_phys = BLE_GAP_PHY_2MBPS,
+                            };
+                            if (sd_ble_gap_phy_update(p_gap_evt->conn_handle, &phys) != NRF_SUCCESS)
+                            {
+                                NRF_LOG_WARNING("2M PHY request failed on 0x%x", p_gap_evt->conn_handle);
+                            }
+                        }
 
                         //vinh ver2
                         if(g_is_sink==false)
@@ -985,13 +1630,21 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                         break;
                 }
 
-                m_service_discovery_conn_handle = p_gap_evt->conn_handle;
-                memset(&m_db_disc[p_gap_evt->conn_handle], 0x00, sizeof(ble_db_discovery_t));
-                err_code = ble_db_discovery_start(&m_db_disc[p_gap_evt->conn_handle],
-                                                  p_gap_evt->conn_handle);
-                if (err_code != NRF_ERROR_BUSY)
+                if(p_gap_evt->conn_handle < NRF_SDH_BLE_CENTRAL_LINK_COUNT && m_thingy_db_cached[p_gap_evt->conn_handle])
                 {
-                    APP_ERROR_CHECK(err_code);
+                    // Known Thingy, use the handles of its last discovery
+                    NRF_LOG_INFO("Connection 0x%x uses cached GATT handles.", p_gap_evt->conn_handle);
+                    thingy_db_cache_apply(p_gap_evt->conn_handle, &cached_tes_db, &cached_uis_db);
+                }
+                else
+                {
+                    memset(&m_db_disc[p_gap_evt->conn_handle], 0x00, sizeof(ble_db_discovery_t));
+                    err_code = ble_db_discovery_start(&m_db_disc[p_gap_evt->conn_handle],
+                                                      p_gap_evt->conn_handle);
+                    if (err_code != NRF_ERROR_BUSY)
+                    {
+                        APP_ERROR_CHECK(err_code);
+                    }
                 }
                 
                 err_code = sd_ble_gap_rssi_start(p_gap_evt->conn_handle, 5, 4);
@@ -1008,22 +1661,21 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 {
                     bsp_board_led_off(CENTRAL_SCANNING_LED);
                 }
-                else
-                {
-                    // Resume scanning.
-                    //bsp_board_led_on(CENTRAL_SCANNING_LED);
-                    //scan_start();
-                }
                 
                 m_device_being_connected_info.dev_type = DEVTYPE_NONE;
 
-                // check if it was a coded phy connection
-                if(BLE_GAP_PHY_CODED == m_scan_params.scan_phys)
+                // check if it was a coded phy connection, on the PHY the link was made on: with
+                // SCAN_MULTI_PHY_ENABLED m_scan_params.scan_phys holds both PHYs
+                if(BLE_GAP_PHY_CODED == m_device_being_connected_info.phy)
                 {
                     coded_phy_conn_count++;
                     m_coded_phy_conn_handle[p_gap_evt->conn_handle] = p_gap_evt->conn_handle;
                     bsp_board_led_on(CODED_PHY_LED);
                 }
+
+                // Next candidate or resume scanning now, discovery on this link runs alongside
+                conn_sched_on_connected();
+                conn_sched_resume();
             }
             // Handle links as a peripheral here
             else
@@ -1061,11 +1713,6 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                              p_gap_evt->conn_handle,
                              p_gap_evt->params.disconnected.reason);
 
-                if(p_gap_evt->conn_handle == m_service_discovery_conn_handle)
-                {
-                    m_service_discovery_conn_handle = BLE_CONN_HANDLE_INVALID;
-                }
-                
                 // Notify aggregator service
                 app_aggregator_on_central_disconnect(p_gap_evt);
 
@@ -1080,7 +1727,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 }
 
                 //vinh
-                uart_printf("Disconnect in main \n\r");
+                UART_PRINTF_INFO("Disconnect in main \n\r");
 
                 //vinh
                 if(g_is_sink==false)
@@ -1093,8 +1740,8 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 //vf_adv_thingy_data(p_gap_evt,AGG_NODE_LINK_CONNECTED); //advertising to sink new thingy 
                 }
                 
-                // Start scanning, in case the disconnect happened during service discovery
-                scan_start(m_scan_mode_coded_phy);
+                // A link is free again: connect a queued candidate or go on scanning
+                conn_sched_resume();
             }
             // Handle peripheral disconnect
             else
@@ -1108,6 +1755,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 m_per_con_handle = BLE_CONN_HANDLE_INVALID;
                 
                 app_aggregator_clear_buffer();
+                app_aggregator_att_mtu_set(BLE_GATT_ATT_MTU_DEFAULT);
                 app_timer_stop(m_post_message_delay_timer_id);
                 
                 bsp_board_led_off(PERIPHERAL_ADV_CON_LED);
@@ -1129,7 +1777,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 // This can only happen with central (initiator request timeout)
                 NRF_LOG_INFO("Connection request timed out.");
 
-                scan_start(m_scan_mode_coded_phy);
+                conn_sched_on_timeout();
             }
             else if(p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_SCAN)
             {
@@ -1188,6 +1836,32 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             APP_ERROR_CHECK(err_code);
         } break;
 
+        case BLE_GATTC_EVT_WRITE_RSP:
+        {
+            uint16_t conn_handle = p_ble_evt->evt.gattc_evt.conn_handle;
+
+            // A CCCD write refused on cached handles means the Thingy's database changed since it
+            // was cached (e.g. new firmware). Drop the entry and fall back to a full discovery.
+            // A refused sampling config is only a value the Thingy does not take, the CCCD
+            // writes queued before it already checked the handles.
+            if(conn_handle < NRF_SDH_BLE_CENTRAL_LINK_COUNT && m_thingy_db_cached[conn_handle] &&
+               p_ble_evt->evt.gattc_evt.gatt_status != BLE_GATT_STATUS_SUCCESS &&
+               p_ble_evt->evt.gattc_evt.params.write_rsp.handle != m_thingy_tes_c[conn_handle].peer_tes_db.config_handle)
+            {
+                NRF_LOG_INFO("Cached GATT handles of 0x%x are stale (0x%x), starting DB discovery.",
+                             conn_handle, p_ble_evt->evt.gattc_evt.gatt_status);
+                m_thingy_db_cached[conn_handle] = false;
+                thingy_db_cache_remove(peer_addr_LR[conn_handle]);
+
+                memset(&m_db_disc[conn_handle], 0x00, sizeof(ble_db_discovery_t));
+                err_code = ble_db_discovery_start(&m_db_disc[conn_handle], conn_handle);
+                if (err_code != NRF_ERROR_BUSY)
+                {
+                    APP_ERROR_CHECK(err_code);
+                }
+            }
+        } break;
+
         case BLE_GATTS_EVT_TIMEOUT:
         {
                 //vinh
@@ -1208,6 +1882,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             // No implementation needed.
             break;
     }
+    AGG_PROF_STOP(AGG_PROF_BLE_EVT);
 }
 
 
@@ -1221,6 +1896,7 @@ static void services_init(void)
     memset(&agg_cfg_service_init, 0, sizeof(agg_cfg_service_init));
 
     agg_cfg_service_init.data_handler = agg_cfg_service_data_handler;
+    agg_cfg_service_init.stats_handler = agg_stats_serialize;
 
     err_code = ble_agg_cfg_service_init(&m_agg_cfg_service, &agg_cfg_service_init);
     APP_ERROR_CHECK(err_code);
@@ -1306,14 +1982,17 @@ static void ble_stack_init(void)
 static uint8_t m_adv_handle = 0;
 static uint8_t m_adv_handle2 = 0;
 static ble_advdata_t adv_data = {0}; 
-static uint8_t adv_data_buf[ADV_MAX_LENGTH];
+//vinh, advertising data is double buffered: the SoftDevice reads the pair adv_packet points to
+//while the next data is prepared in the other one, see vf_adv_data_commit()
+static uint8_t adv_data_buf[2][RELAY_ADV_MAX_LENGTH];
 static uint8_t m_adv_data_buf[ADV_MAX_LENGTH];
 static uint8_t m_sr_data_buf[ADV_MAX_LENGTH];
 //static uint8_t adv_data_buf2[ADV_MAX_LENGTH];
 static uint8_t rolling_count=0;
 
 static ble_advdata_t sr_data = {0}; 
-static uint8_t sr_data_buf[ADV_MAX_LENGTH];
+static uint8_t sr_data_buf[2][ADV_MAX_LENGTH];
+static uint8_t m_adv_buf_idx = 0;   //buffer pair in use by the SoftDevice
 static ble_gap_adv_data_t adv_packet;
 static ble_gap_adv_data_t adv_packet2;
 static ble_gap_adv_params_t adv_params = {0};
@@ -1327,488 +2006,171 @@ static ble_advertising_t  gp_advertising={
 .adv_data.scan_rsp_data.len=ADV_MAX_LENGTH
 };
 
-
-
-void relay_adv_data(void)
+/*---------------------
+@Brief: get the advertising buffer which is not in use by the SoftDevice,
+  with the original advertising data (flags, name...) already in its first org_adv_data_size bytes
+*/
+static uint8_t * vf_adv_data_spare_buf_get(void)
 {
+    uint8_t *p_spare=adv_data_buf[m_adv_buf_idx^1];
 
-    ret_code_t err_code;
-    uint8_t i;
-
-    uint8_t advlen=org_adv_data_size;
-    static uint8_t relay_data[32];
-     uint16_t pos=g_userdata_firstpos;
-    uint8_t relay_size=g_userdata.p_data[pos++];
-    if(g_userdata.size>0)
-    {
-      while(1)
-      {
-          pos=g_userdata_firstpos;
-          relay_size=g_userdata.p_data[pos++];
-          if((relay_size==0)||(g_userdata.size>MAX_USERDATA_BUFFER)\
-                    ||(g_userdata_firstpos==g_userdata_lastpos))
-          {//reset array
-            g_userdata_firstpos=g_userdata_lastpos;
-            g_userdata.p_data[g_userdata_firstpos]=0;
-            g_userdata.size=0;
-            break;
-          }
-          else
-          {
-            g_userdata.size-=relay_size;
-            relay_data[0]=relay_size+1;
-            relay_data[1]=0xff; //type: MANU
-           
-            if(g_userdata_firstpos+relay_size<MAX_USERDATA_BUFFER)
-            {
-              memcpy(&relay_data[2],&g_userdata.p_data[pos],relay_size-1);
-              g_userdata_firstpos+=relay_size;
-            }
-            else
-            {
-              memcpy(&relay_data[2],&g_userdata.p_data[pos],MAX_USERDATA_BUFFER-pos);
-              memcpy(&relay_data[2+MAX_USERDATA_BUFFER-pos],&g_userdata.p_data[0],relay_size-(MAX_USERDATA_BUFFER-pos)-1);
-              g_userdata_firstpos=relay_size-(MAX_USERDATA_BUFFER-pos)-1;
-            }
-
-            if(relay_data[5]<8) 
-            {
-              //g_userdata.p_data[1]+=1;
-              //adv_packet.adv_data.p_data[advlen++]=g_userdata.size+1; //length
-              //adv_packet.adv_data.p_data[advlen++]=0xff; //type
-              //memcpy(&adv_packet.adv_data.p_data[advlen],g_userdata.p_data,g_userdata.size);
-              memcpy(&adv_packet.adv_data.p_data[advlen],relay_data,relay_size+1);
-              adv_packet.adv_data.len=org_adv_data_size+relay_size+1;
-    
-
-
-             uart_printf("hello %d hello @%d ",adv_packet.adv_data.len,g_userdata_firstpos );
-             for(int i=0;i<adv_packet.adv_data.len;i++)
-              {
-                uart_printf("%d  ",adv_packet.adv_data.p_data[i] );
-              }
-              uart_printf("\n\r");
-              //nrf_delay_ms(100);
-
-             break;
-
-            }
-          }
-      }//while
-    }
-
-    
-}
-
-
-void vf_delete_block_buffer(void)
-{//remove current block to the chain
-  uint8_t pos,nextpos,prepos;
-  pos=g_userdata_currpos;
-            if(g_userdata.size==1)
-            {//only 1 block
-              g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE]=0x00;
-              g_userdata_firstpos=g_userdata_currpos=g_userdata_lastpos=0;
-              g_userdata.size--;
-            }
-            else
-            {
-              if(pos==g_userdata_firstpos)
-              {//current block is the first block
-                 nextpos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];                 
-                 g_userdata.p_data[nextpos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]=0x00;
-                 g_userdata_currpos=nextpos;
-              }
-              else if (pos==g_userdata_lastpos)
-              {//current block is the last block
-                prepos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+2];
-                 g_userdata.p_data[prepos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=0x00;
-                g_userdata_currpos=g_userdata_firstpos;
-              }
-              else{
-                 nextpos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];
-                 prepos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+2];
-                 g_userdata.p_data[nextpos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]=prepos;
-                 g_userdata.p_data[prepos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=nextpos;
-                 g_userdata_currpos=nextpos;
-              }
-              g_userdata.size--;
-            }
+    memcpy(p_spare,adv_data_buf[m_adv_buf_idx],org_adv_data_size);
+    return p_spare;
 }
 
-
 /*---------------------
-@Brief: remove a block from advertising buffer chain
-input: @ref cond:
-                    true: remove block ids (0x00AABBCC, AA:<source id>, BB<dest id>, CC<packet id)) will be added to hist buff
-                    false: not added
-       @ref g_userdata_currpos: block to be deleted in advertising buffer (g_userdata)
-ouput:
-update:
-  g_userdata_currpos: point to next position in buffer
-  g_userdata.size: number of used block in buffer
+@Brief: hand the spare buffer with len bytes of advertising data to the SoftDevice.
+  while advertising the SoftDevice switches to it at the next advertising event, so there is
+  no stop/start and the buffer it is reading is never written. On failure the old data stays on air.
 */
-
-void vf_delete_block_buffer3(bool cond)
-{//remove current block to the chain
-  uint16_t pos,nextpos,prepos,pos1;
-  size_t i;
-  uint32_t ids;
-
-  //save current id
-  pos1=g_userdata_currpos;
-  pos=g_userdata_currpos*MAX_USERDATA_BUFFER_BLOCKSIZE;
-  ids=((uint32_t)g_userdata.p_data[pos+5]<<16)+((uint32_t)g_userdata.p_data[pos+6]<<8)+(uint32_t)g_userdata.p_data[pos+7];
-
-  if(g_userdata.size==0)
-  {//no available block in buffer
-    return;
-  }
-  else if(g_userdata.size==1)
-  {//only 1 block, then reset all pointer to initial state
-    g_userdata.p_data[pos]=0x00;
-    g_userdata.p_data[pos+1]=g_userdata.p_data[pos+2]=0xFF;//NULL
-    g_userdata_firstpos=g_userdata_currpos=g_userdata_lastpos=0;
-    g_userdata.size=0;
-   
-  }
-  else
-  {
-    if(pos1==g_userdata_firstpos)
-    {//current block is the first block
-       nextpos=g_userdata.p_data[pos+1];
-       g_userdata.p_data[pos]=0x00;//mark deleted block as free block
-       g_userdata.p_data[pos+1]=g_userdata.p_data[pos+2]=0xFF;//NULL
-
-       g_userdata.p_data[nextpos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]= 0xFF; //NULL
-       g_userdata_firstpos=nextpos;
-
-       //vinh ver4
-       //if(g_userdata_currpos==pos1)
-       //{
-          g_userdata_currpos=g_userdata_firstpos;
-       //}
-
+static void vf_adv_data_commit(uint8_t len)
+{
+    ret_code_t err_code;
+    ble_gap_adv_data_t new_packet;
+    uint8_t spare=m_adv_buf_idx^1;
+
+    new_packet.adv_data.p_data=adv_data_buf[spare];
+    new_packet.adv_data.len=len;
+    if(adv_packet.scan_rsp_data.p_data!=NULL)
+    {//the SoftDevice wants new buffers for both while advertising
+      memcpy(sr_data_buf[spare],adv_packet.scan_rsp_data.p_data,adv_packet.scan_rsp_data.len);
+      new_packet.scan_rsp_data.p_data=sr_data_buf[spare];
+      new_packet.scan_rsp_data.len=adv_packet.scan_rsp_data.len;
     }
-    else if (pos1==g_userdata_lastpos)
-    {//current block is the last block
-      prepos=g_userdata.p_data[pos+2];
-       g_userdata.p_data[pos]=0x00; //mark as free block
-       g_userdata.p_data[pos+1]=g_userdata.p_data[pos+2]=0xFF;//NULL
-
-       g_userdata.p_data[prepos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]= 0xFF; //NULL
-       g_userdata_lastpos=prepos;
-      
-       //vinh ver4
-       //if(g_userdata_currpos==pos1)
-       //{
-          g_userdata_currpos=g_userdata_firstpos;
-       //}
+    else
+    {
+      new_packet.scan_rsp_data.p_data=NULL;
+      new_packet.scan_rsp_data.len=0;
     }
-    else{
-       nextpos=g_userdata.p_data[pos+1];
-       prepos=g_userdata.p_data[pos+2];
-       g_userdata.p_data[pos]=0x00; //mark as free block
-       g_userdata.p_data[pos+1]=g_userdata.p_data[pos+2]=0xFF;//NULL
-
-       g_userdata.p_data[nextpos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]=prepos;
-       g_userdata.p_data[prepos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=nextpos;
-      
-       //vinh ver4if(g_userdata_currpos==pos1)
-       //{
-          g_userdata_currpos=nextpos;
-       //}
 
+    err_code=sd_ble_gap_adv_set_configure(&m_adv_handle, &new_packet, NULL);
+    if(err_code==NRF_SUCCESS)
+    {
+      adv_packet=new_packet;
+      m_adv_buf_idx=spare;
+    }
+    else
+    {
+      UART_PRINTF_INFO("adv data update failed %d \n\r",err_code);
     }
-    g_userdata.size--;
-
-
-
-  }
-    uart_printf("delete block %d, new curr pos:%d, new size: %d \n\r",pos1,g_userdata_currpos,g_userdata.size);
- 
-  if(cond==true)
-  {// add ids to history buffer
-      vf_add_buff_adv_hist3(ids);
-  }
 }
 
-
-
-
+static bool m_adv_params_pending=false;  //adv_params changed, not yet handed to the SoftDevice
 
 /*---------------------
-@Brief: advertising a packet in buffer by pasting it to user data field of adv struct
-g_userdata_currpos: packet to be sent
-g_userdata_firstpos: first packet block in buffer
-g_userdata_lastpos: last packet block in buffer
-g_userdata.size: number of used block in buffer
+@Brief: hand changed adv_params to the SoftDevice. They can only be set while not advertising, so a running
+  advertising set is restarted. only called at the end of a relay tick, so the interval and the PHY changed
+  in one tick cost one restart. not advertising while the phone is connected, they are then taken at the next start
 */
-
-void relay_adv_data2(void)
+static void vf_adv_params_apply(void)
 {
-
     ret_code_t err_code;
-    uint8_t i,j=0;
+    bool was_advertising;
 
-    uint8_t advlen=org_adv_data_size;
-    static uint8_t relay_data[32];
-     uint16_t pos=g_userdata_firstpos;
-    uint8_t relay_size;
+    if(!m_adv_params_pending) return;
+    m_adv_params_pending=false;
 
-    while(g_userdata.size>0) //check nubmer of used block
+    was_advertising=(sd_ble_gap_adv_stop(m_adv_handle)==NRF_SUCCESS);
+    err_code=sd_ble_gap_adv_set_configure(&m_adv_handle, &adv_packet, &adv_params);
+    if(err_code!=NRF_SUCCESS)
     {
-          pos=g_userdata_currpos;
-          if(g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4]==0)
-          {//size of data =0 ->delete block
-            vf_delete_block_buffer();
-          }
-          else if(g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4+4]>=4) //max TTL=4
-          {//TTL expired ->delete block
-            vf_delete_block_buffer();
-          }
-          else
-          {
-            if(g_userdata_currpos==g_userdata_lastpos) //reach lastpos -> first pos 
-                g_userdata_currpos=g_userdata_firstpos;
-            else
-              g_userdata_currpos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];
-
-            relay_size= g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4];
-            g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4+4]++; //increase TTL
-
-            relay_data[0]=relay_size;
-            relay_data[1]=0xff; //type: MANUFACTURER  
-            memcpy(&relay_data[2],&g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5],relay_size);
-            memcpy(&adv_packet.adv_data.p_data[advlen],relay_data,relay_size+1);
-            adv_packet.adv_data.len=org_adv_data_size+relay_size+1;
-
-             uart_printf("adv relay data *%d (len)%d @%d",j,adv_packet.adv_data.len,pos );
-              j++;
-             for(int i=0;i<adv_packet.adv_data.len;i++)
-              {
-                uart_printf("%d  ",adv_packet.adv_data.p_data[i] );
-              }
-              uart_printf("\n\r"); 
-            break;
-          }
-
-    }//while
-   
+      UART_PRINTF_INFO("adv params update failed %d \n\r",err_code);
+    }
+    if(was_advertising)
+    {
+      err_code=sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
+      APP_ERROR_CHECK(err_code);
+    }
 }
 
-
 /*---------------------
-@Brief: advertising a packet in buffer by pasting it to user data field of adv struct
-g_userdata_currpos: packet to be sent
-g_userdata_firstpos: first packet block in buffer
-g_userdata_lastpos: last packet block in buffer
-g_userdata.size: number of used block in buffer
+@Brief: relay_sched_level_handler_t, the relay tick and the advertising interval follow the new level.
+  the interval only changes between idle and active, it is taken at the end of the next relay tick
 */
-
-void vf_relay_adv_data3(void* p_indata)
+static void vf_relay_sched_level_set(uint8_t level)
 {
-
     ret_code_t err_code;
-    uint8_t i,j=0;
 
-    uint8_t advlen=org_adv_data_size;
-    static uint8_t relay_data[32];
-    uint8_t relay_size;
-    size_t pos;
-//TODO: size=0 -> stop broadcast
+    err_code=app_timer_stop(m_adv_timer_id);
+    APP_ERROR_CHECK(err_code);
+    err_code=app_timer_start(m_adv_timer_id, APP_TIMER_TICKS(g_relay_levels[level].tick_ms), 0);
+    APP_ERROR_CHECK(err_code);
 
- 
-    while(g_userdata.size>0) //check nubmer of used block
+    if(adv_params.interval!=g_relay_levels[level].adv_interval)
     {
-          if(g_userdata.p_data[g_userdata_currpos*MAX_USERDATA_BUFFER_BLOCKSIZE+4]==0)
-          {//size of broadcast data =0 (invalid block) ->delete block, not add to history buffer
-            vf_delete_block_buffer3(false);
-          }
-          else
-          {
-          //vinh ver4
-            pos=g_userdata_currpos;   //get position of data block to be transfered 
-            relay_size= g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4];
-            relay_data[0]=relay_size;
-            relay_data[1]=0xff; //type: MANUFACTURER  
-            memcpy(&relay_data[2],&g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5],relay_size-1);
-            relay_data[5]++; //increase hop counts
-
-            memcpy(&adv_packet.adv_data.p_data[advlen],relay_data,relay_size+1); //copy data to broadcast
-            adv_packet.adv_data.len=org_adv_data_size+relay_size+1;
-
-            uart_printf("adv relay data (len)%d @%d, data: ",adv_packet.adv_data.len,pos );
-            j++;
-            for(int i=0;i<adv_packet.adv_data.len;i++)
-            {
-                uart_printf("%d  ",adv_packet.adv_data.p_data[i] );
-            }
-            uart_printf("\n\r");
-
-            if(--g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+3]==0)
-            { // advertised more than 2 times, then move this block to history buffer
-                vf_delete_block_buffer3(true);
-                uart_printf("buffer state: new currpos=%d, data:",g_userdata_currpos);
-                for(i=0;i<MAX_USERDATA_BUFFER_BLOCK;i++)
-                {
-                  uart_printf("%d ",g_userdata.p_data[i*MAX_USERDATA_BUFFER_BLOCKSIZE]);
-                }
-                uart_printf("\n\r");
-            }
-            else
-            {
-              //vinh ver4
-              if(g_userdata_currpos==g_userdata_lastpos) //reach lastpos -> first pos 
-                g_userdata_currpos=g_userdata_firstpos;
-              else
-                g_userdata_currpos=g_userdata.p_data[g_userdata_currpos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];
-              uart_printf("buffer state: new currpos=%d \n\r",g_userdata_currpos);
-            }
-
-            break;
-          }
-
-        if(g_userdata.size==0) vf_stop_broadcast_data();
-
-    }//while
-   
+      adv_params.interval=g_relay_levels[level].adv_interval;
+      m_adv_params_pending=true;
+    }
+    UART_PRINTF_INFO("Relay level %d: tick %d ms, adv interval %d\r\n", level,
+                     g_relay_levels[level].tick_ms, g_relay_levels[level].adv_interval);
 }
 
-/*
-@brief: modify relay data by increasing TTL, byte[3] of input
+#if (RELAY_CODED_PHY_ENABLED == 1)
+/*---------------------
+@Brief: advertise on this PHY from the next advertising event on, primary and secondary channels alike.
+  without relay records the set is on 1M, where phones find it. a PHY change restarts the set at the end
+  of the relay tick, vf_relay_adv_data3 keeps the PHY as long as it can
 */
-static void vf_modify_relay_data(uint8_array_t *checkdata)
+static void vf_relay_phy_set(uint8_t phy)
 {
-  checkdata->p_data[3]++;
+    if(adv_params.primary_phy==phy) return;
+    adv_params.primary_phy=phy;
+    adv_params.secondary_phy=phy;
+    m_adv_params_pending=true;
+    NRF_LOG_DEBUG("Relay PHY %s", (phy==BLE_GAP_PHY_CODED) ? "Coded" : "1M");
 }
+#endif
 
-/*
-@brief: validate relay data, looking up in the buffer to find an element match with new data:
-1. source addr (byte 0), destination addr(byte 1), packet id(byte2) 
-2. if (1.) match, check time to live (byte 3) and update the new to old if the new is higher
- 
-3.  if (1.) not match, return 0xFFFF -> new packet
+/*---------------------
+@Brief: advertising packets in buffer by pasting them to user data field of adv struct
+  one manufacturer specific AD record per block, as many blocks as fit in RELAY_ADV_MAX_LENGTH
+  (a single block with legacy advertising)
+g_relay_pool.head: packet to be sent
+g_relay_pool.tail: last packet block in buffer
+g_relay_pool.used: number of used block in buffer
 */
-static uint16_t vf_validate_relay_packet(uint8_array_t *checkdata)
+
+void vf_relay_adv_data3(void* p_indata)
 {
 
-  uint8_t src_id=0;
-  uint8_array_t userdata;
-  uint8_t cmpdata[4];
-  uint8_t i,size;
-  size_t temp_pos=g_userdata_firstpos;
-  size_t pos=g_userdata_firstpos;
-  while(pos!=g_userdata_lastpos)
-  {
-      temp_pos=pos+1;
-      for(i=0;i<4;i++)
-      {
-        if(temp_pos>=MAX_USERDATA_BUFFER)
-        {
-          temp_pos=0;
-        }
-        cmpdata[i]=garr_userdata[temp_pos++];
-      }
-      if(memcmp(checkdata->p_data,cmpdata,3)==0)
-      {//matched
-        if(checkdata->p_data[3]>cmpdata[3])
-        {//update TTL if new is higher than old
-          garr_userdata[temp_pos-1]=checkdata->p_data[3];
-        }
+    uint8_t advlen=org_adv_data_size;
+    uint8_t *p_adv=vf_adv_data_spare_buf_get(); //never write the buffer on air
+    uint8_t trace[4];
+    AGG_PROF_BEGIN(AGG_PROF_RELAY_ADV);
+
+    //one PHY per packet with multi-PHY relaying, the relay level follows the queue depth
+    advlen=relay_sched_tick(p_adv, advlen, RELAY_ADV_MAX_LENGTH);
+#if (RELAY_CODED_PHY_ENABLED == 1)
+    vf_relay_phy_set(relay_sched_tx_phy());
+#endif
 
-        return pos;
-      }
-      else
-      {//unmatched, check next packet in buffer
+    if((advlen==org_adv_data_size)&&(adv_packet.adv_data.len==org_adv_data_size))
+    {//nothing relayed before and nothing to relay now
+      vf_adv_params_apply();
+      AGG_PROF_STOP(AGG_PROF_RELAY_ADV);
+      return;
+    }
+    //an empty buffer clears the relay records, so the last packet is not repeated forever
+    vf_adv_data_commit(advlen);
+    vf_adv_params_apply();
 
-        size=g_userdata.p_data[pos];
-        if(size+pos<=MAX_USERDATA_BUFFER)
-        {
-          pos+=size;
-        }
-        else
-        {
-          pos=0+size-(MAX_USERDATA_BUFFER-pos);
-        }
-      }
-  }
-  return 0xFFFF;
+    //the relayed records themselves were traced when they were added
+    trace[0]=advlen;
+    trace[1]=g_relay_pool.used;
+    trace[2]=(uint8_t)g_relay_pool.alloc_count;
+    trace[3]=(uint8_t)g_relay_pool.fail_count;
+    AGG_TRACE(AGG_TRACE_EVT_RELAY_TX, trace, 4);
+    AGG_PROF_STOP(AGG_PROF_RELAY_ADV);
 }
 
-
 /*
-@brief: validate relay data, looking up in the buffer to find an element match with new data:
-1. source id (byte 0), destination id(byte 1), packet id(byte2) 
-2. if (1.) match, check time to live (byte 3) and update the new to old if the new is higher
- return the position of match item
-3.  if (1.) not match, return 0xFFFF -> new packet
+@brief: modify relay data by increasing TTL, byte[3] of input
 */
-static uint16_t vf_validate_relay_packet2(uint8_array_t *checkdata)
+static void vf_modify_relay_data(uint8_array_t *checkdata)
 {
-
-  uint8_t src_id=0;
-  uint8_array_t userdata;
-  uint8_t cmpdata[4];
-  uint8_t i,size;
-  size_t temp_pos=g_userdata_firstpos;
-  size_t pos=g_userdata_firstpos;
-
-  if(g_userdata.size==0)
-    return 0xFFFF;
-  else if(g_userdata.size==1)
-  {
-      temp_pos=pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5;    
-      for(i=0;i<4;i++)
-      {
-        cmpdata[i]=g_userdata.p_data[temp_pos++];
-      }
-      if(memcmp(checkdata->p_data,cmpdata,3)==0)
-      {
-     /*check TTL
-        if(checkdata->p_data[3]>cmpdata[3])
-        {//update TTL if new is higher than old
-          g_userdata.p_data[temp_pos-1]=checkdata->p_data[3];
-        }*/
-
-        return pos;
-      }
-      else
-      {
-        return 0xFFFF;
-      }
-
-  }
-  else
-  {
-    while(pos!=g_userdata_lastpos)
-   {
-      temp_pos=pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5;    
-      for(i=0;i<4;i++)
-      {
-        cmpdata[i]=g_userdata.p_data[temp_pos++];
-      }
-      if(memcmp(checkdata->p_data,cmpdata,3)==0)
-      {
-      /*check TTL
-        if(checkdata->p_data[3]>cmpdata[3])
-        {//update TTL if new is higher than old
-          g_userdata.p_data[temp_pos-1]=checkdata->p_data[3];
-        }*/
-
-        return pos;
-      }
-      else
-      {//unmatched, check next packet in buffer
-        pos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];
-      }
-    }
-  }
-  return 0xFFFF;
+  checkdata->p_data[3]++;
 }
 
-
-
 /*--------------------
 @brief: modify input data to preparing send back to the source
 */
@@ -1822,162 +2184,191 @@ void vf_process_adv_command(uint8_array_t *data)
 }
 
 
-/*-----------------------------------------------
-@brief: validate incomming data, check whether this message was recevice before.
-@input: *checkdata:  source addr (byte 0), destination addr(byte 1), packet id(byte2)
-   -> merge into 32 bits var ids= 0x00AABBCC, with AA is source id, BB is destination id, CC is packet id
-@operation:
-  compare ids with:
-    - history buffer which contains ids of old messages
-        which was either removed from advertising buffer(g_userdata) or processed.
-    - if no matched item in history buffer, compare with current advertising buffer(g_userdata)
-
-@return
-   if matched found, return the position of the packet
-      in history buffer (=0x8000+pos) or advertising buffer (pos)
-    else return 0xFFFF -> new packet
+/*----------
+@brief: put the compact record being built on the relay buffer
 */
-static uint16_t vf_validate_relay_packet3(uint8_array_t *checkdata)
+static void vf_thingy_report_flush(void)
 {
-  uint8_t *cmpdata_pos;
-  uint16_t i;
-  uint32_t ids=0,cmp_data;
-  size_t temp_pos;
-  size_t pos=g_userdata_firstpos;
+  uint8_array_t idata;
 
-  ids=((uint32_t)checkdata->p_data[0]<<16)+((uint32_t)checkdata->p_data[1]<<8)+(uint32_t)(checkdata->p_data[2]);
+  if(m_report_record_len<=RELAY_CODEC_HEADER_LENGTH) return; //no reading in it
 
-  //check history buffer
-  if (vf_find_id_buff_adv_hist3(ids)!=0xFFFF)
-  {
-    uart_printf("find in history buffer: 0x%x \n\r", i);
-    return i+8000; //already in history buffer
+  m_report_record[2]=g_packetID++; //packet No
+  idata.p_data=m_report_record;
+  idata.size=m_report_record_len;
+  AGG_TRACE(AGG_TRACE_EVT_THINGY_DATA, idata.p_data, idata.size);
+  vf_add_packet_to_buffer3(&idata);
+  m_report_record_len=0;
+}
 
-  }
-  //check current buffer
-  if(g_userdata.size==0)
-    return 0xFFFF;
-  else
+static uint8_t vf_thingy_report_encode(thingy_data_t *data, relay_codec_reading_t *p_reading, bool keyframe)
+{
+  if(m_report_record_len==0)
   {
-    uart_printf("ids in operating buffer: ");
-    do
-    {
-      uart_printf("0x%x ,",i);
-      temp_pos=pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5; 
-      cmpdata_pos=&g_userdata.p_data[temp_pos];
-      cmp_data=((*cmpdata_pos)<<16)+((*(cmpdata_pos+1))<<8)+(*(cmpdata_pos+2));
-      if(cmp_data==ids)
-      {
-        uart_printf("find in operating buffer: 0x%x \n\r", i);
-        return pos;
-      }
-      else
-      {
-        return 0xFFFF;
-      }
-      pos=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1];
-    }
-    while (pos!=g_userdata_lastpos);
+    m_report_record[0]=CLUSTER_ID; //cluster source id
+    m_report_record[1]=SINK_ID; //cluster destination id
+    m_report_record[2]=0; //packet No, given at flush
+    m_report_record[3]=0; //hop counts
+    m_report_record[4]=AGG_NODE_LINK_DATA_COMPACT;
+    m_report_record_len=RELAY_CODEC_HEADER_LENGTH;
   }
-
-  return 0xFFFF;
+  return relay_codec_reading_encode(&m_report_record[m_report_record_len], RELAY_COMPACT_RECORD_MAX-m_report_record_len,
+                                    data->local_id, p_reading, &g_thingy_reported[data->local_id].ref, keyframe);
 }
 
-
-
 /*----------
-@brief: add an id value to buffer of adverting history
-@input: id value (0x00AABBCC, AA: source id, BB: dest id, CC:packet id)
-@ouput: position in the array g_buff_adv_hist,
-    0xFFFF if this id has already been in the buffer
-----------------------*/
-uint16_t vf_add_buff_adv_hist3(uint32_t ids)
+@brief: add a data update to the compact record and remember it as the last report of that Thingy,
+  vf_thingy_report_flush() sends the record
+*/
+static void vf_thingy_report_add(thingy_data_t *data)
 {
-  uint16_t i;
+  thingy_reported_t *p_rep;
+  relay_codec_reading_t reading;
+  bool keyframe;
+  uint8_t len;
 
-    //check current id has already been in history buffer?
-    if((i=vf_find_id_buff_adv_hist3(ids))!=0xFFFF) return 0xFFFF; //yes -> quit
-
-    g_buff_adv_hist[g_buff_adv_hist_lastpos].id=ids;
-    g_buff_adv_hist[g_buff_adv_hist_lastpos].TTL=10; //timeout 10 sec
-    if(g_buff_adv_hist_size!=MAX_HIST_ADV_BUFF_SIZE)
-    {
-      if(++g_buff_adv_hist_lastpos==MAX_HIST_ADV_BUFF_SIZE)
-          g_buff_adv_hist_lastpos=0;
-    }
+  if(data->local_id>=NRF_SDH_BLE_CENTRAL_LINK_COUNT || data->local_id>RELAY_CODEC_LOCAL_ID_MAX)
+  {
+    vf_adv_thingy_data(data);
+    return;
+  }
+  p_rep=&g_thingy_reported[data->local_id];
+  reading.temperature=(int16_t)data->temperature;
+  reading.pressure=(int32_t)data->pressure;
+  reading.humidity=(int16_t)data->humidity;
+  reading.button=data->button;
+  keyframe=p_rep->keyframe_due||(p_rep->since_keyframe>=RELAY_KEYFRAME_INTERVAL);
+
+  len=vf_thingy_report_encode(data, &reading, keyframe);
+  if(len==0)
+  {//record full, start the next one
+    vf_thingy_report_flush();
+    len=vf_thingy_report_encode(data, &reading, keyframe);
+  }
+  if(len==0)
+  {//does not fit an empty record either, only with absurd values
+    vf_adv_thingy_data(data);
+  }
+  else
+  {
+    if(m_report_record[m_report_record_len+1]&RELAY_CODEC_FLAG_KEYFRAME)
+      p_rep->since_keyframe=0;
     else
-    {
-      if(++g_buff_adv_hist_lastpos==MAX_HIST_ADV_BUFF_SIZE)
-          g_buff_adv_hist_lastpos=0;
-      g_buff_adv_hist_firstpos=g_buff_adv_hist_lastpos;
-    }
+      p_rep->since_keyframe++;
+    m_report_record_len+=len;
+  }
+
+  p_rep->valid=true;
+  p_rep->temperature=reading.temperature;
+  p_rep->pressure=reading.pressure;
+  p_rep->humidity=reading.humidity;
+  p_rep->button=reading.button;
+  p_rep->since_ms=0;
+  p_rep->keyframe_due=false;
+  g_reports_sent++;
+}
 
-    if(g_buff_adv_hist_size<MAX_HIST_ADV_BUFF_SIZE) g_buff_adv_hist_size++;
-      
+static bool vf_outside_deadband(int32_t value, int32_t reported, uint16_t deadband)
+{
+  int32_t diff=value-reported;
 
-    uart_printf("add to history 0x%x, lastpos:%d, fisrtpos:%d, size:%d \n\r", \
-                ids,g_buff_adv_hist_lastpos,g_buff_adv_hist_firstpos,g_buff_adv_hist_size);
-  return g_buff_adv_hist_size;
+  if(diff<0) diff=-diff;
+  return (deadband==0)||(diff>=deadband);
 }
 
 /*----------
-@brief: delete an element in buffer of advertising history
-@input: position
+@brief: decide at the end of a window whether a Thingy is reported
+@input: i link of the Thingy, its windows are closed
+@output: true if the mean of any sensor left its deadband, the button changed or the heartbeat is due
 */
-void vf_delete_buff_adv_hist3(uint16_t pos)
+static bool vf_thingy_report_due(int i)
 {
-  uint16_t i,size;
+  thingy_reported_t *p_rep=&g_thingy_reported[i];
+  thingy_edata_t *p_edata=&g_thingy_edata[i];
 
-    if(g_buff_adv_hist_size==0)   return;
-    g_buff_adv_hist_size--;
-    if(++g_buff_adv_hist_firstpos==MAX_HIST_ADV_BUFF_SIZE)
-      g_buff_adv_hist_firstpos=0;
-  return ;
+  if(p_rep->valid==false) return true;
+
+  p_rep->since_ms+=g_sensor_window_ms;
+  if(p_rep->since_ms>=g_sensor_deadband.heartbeat_ms)
+  {
+    p_rep->keyframe_due=true; //a sink that lost a keyframe is back in step after at most one heartbeat
+    return true;
+  }
+  if(p_edata->button!=p_rep->button) return true;
+  if(vf_outside_deadband(p_edata->temperature.done.mean, p_rep->temperature, g_sensor_deadband.temperature)) return true;
+  if(vf_outside_deadband(p_edata->pressure.done.mean, p_rep->pressure, g_sensor_deadband.pressure)) return true;
+  if(vf_outside_deadband(p_edata->humidity.done.mean, p_rep->humidity, g_sensor_deadband.humidity)) return true;
+  return false;
 }
 
 /*----------
-@brief: search for position of id value (0x00AABBCC, AA: source id, BB: dest id, CC:packet id)
- in buffer advertising history
-@input: id value
-@ouput: position in the array g_buff_adv_hist, 0xFFFF if no match position
+@brief: ask a Thingy for g_sensor_samples_per_window samples per aggregation window,
+  so it does not send samples that are only averaged away. Only the intervals of the
+  averaged sensors change, the rest of the Thingy config is kept as read from it;
+  until it has been read, the read is queued and this is called again on BLE_TES_C_EVT_CONFIG_READ
 */
-uint16_t vf_find_id_buff_adv_hist3(uint32_t id)
+static void vf_tes_sampling_config_send(ble_tes_c_t *p_tes_c)
 {
-  uint16_t i;
+  ble_tes_config_t config;
+  uint16_t interval;
+  uint32_t err_code;
 
-    if(g_buff_adv_hist_size==0) return 0xFFFF;
-    if(g_buff_adv_hist_firstpos<g_buff_adv_hist_lastpos)
-    {
-        for(i=g_buff_adv_hist_firstpos;i<g_buff_adv_hist_lastpos;i++)
-        {
-          if(id==g_buff_adv_hist[i].id)
-          {
-            return i ;
-          }
-        }
-    }
-    else
-    {
-        for(i=g_buff_adv_hist_firstpos;i<MAX_HIST_ADV_BUFF_SIZE;i++)
-        {
-          if(id==g_buff_adv_hist[i].id)
-          {
-            return i ;
-          }
-        }
-        for(i=0;i<g_buff_adv_hist_lastpos;i++)
-        {
-          if(id==g_buff_adv_hist[i].id)
-          {
-            return i ;
-          }
-        }
-    }
+  if(!p_tes_c->config_valid)
+  {
+    err_code=ble_tes_c_config_read(p_tes_c);
+    if(err_code!=NRF_SUCCESS)
+      UART_PRINTF_INFO("Thingy @%d config read failed 0x%x\n\r", p_tes_c->conn_handle, err_code);
+    return;
+  }
+
+  interval=vf_ble_tes_sampling_interval_ms(g_sensor_window_ms, g_sensor_samples_per_window);
+  config=p_tes_c->config;
+  config.temperature_interval_ms=interval;
+  config.pressure_interval_ms=interval;
+  config.humidity_interval_ms=interval;
+
+  err_code=ble_tes_c_config_write(p_tes_c, &config);
+  if(err_code!=NRF_SUCCESS)
+    UART_PRINTF_INFO("Thingy @%d config write failed 0x%x\n\r", p_tes_c->conn_handle, err_code);
+}
+
+/*----------
+@brief: change the aggregation window, restarts the open windows and reconfigures the connected Thingies
+@input: window_ms   clamped to SENSOR_WINDOW_MIN_MS..SENSOR_WINDOW_MAX_MS
+        samples     samples per window asked from the Thingies, 0 keeps the current number
+*/
+static void vf_sensor_window_set(uint32_t window_ms, uint8_t samples)
+{
+  uint32_t err_code;
+  int i;
+
+  if(window_ms<SENSOR_WINDOW_MIN_MS) window_ms=SENSOR_WINDOW_MIN_MS;
+  if(window_ms>SENSOR_WINDOW_MAX_MS) window_ms=SENSOR_WINDOW_MAX_MS;
+  g_sensor_window_ms=window_ms;
+  if(samples!=0) g_sensor_samples_per_window=samples;
 
-  return 0xFFFF;
+  err_code=app_timer_stop(m_add_edata_adv_buff_timer_id);
+  APP_ERROR_CHECK(err_code);
+  err_code=app_timer_start(m_add_edata_adv_buff_timer_id, APP_TIMER_TICKS(g_sensor_window_ms), 0);
+  APP_ERROR_CHECK(err_code);
+
+  for(i=0;i<NRF_SDH_BLE_CENTRAL_LINK_COUNT;i++)
+  {
+    //samples taken at the old rate would blend into the first new window
+    g_thingy_edata[i].temperature.sum=0;
+    g_thingy_edata[i].temperature.cnt=0;
+    g_thingy_edata[i].pressure.sum=0;
+    g_thingy_edata[i].pressure.cnt=0;
+    g_thingy_edata[i].humidity.sum=0;
+    g_thingy_edata[i].humidity.cnt=0;
+    if(m_thingy_tes_c[i].conn_handle!=BLE_CONN_HANDLE_INVALID)
+      vf_tes_sampling_config_send(&m_thingy_tes_c[i]);
+  }
+  UART_PRINTF_INFO("Sensor window %u ms, %d samples\n\r", g_sensor_window_ms, g_sensor_samples_per_window);
 }
 
 //vinh ver4
+//once per aggregation window: close the windows of all Thingies and report them
 void vf_add_edata_adv_buff_callback(void * p_context)
 {
 
@@ -1994,12 +2385,28 @@ void vf_add_edata_adv_buff_callback(void * p_context)
 
     if(m_thingy_tes_c[i].conn_handle!=BLE_CONN_HANDLE_INVALID)
     {
-      temperature=vf_ble_tes_average_temperature(&g_thingy_edata[i]);
-      pressure=vf_ble_tes_average_pressure(&g_thingy_edata[i]);
-      humidity=vf_ble_tes_average_humidity(&g_thingy_edata[i]);
+      vf_ble_tes_window_close(&g_thingy_edata[i]);
+      temperature=(int16_t)g_thingy_edata[i].temperature.done.mean;
+      pressure=g_thingy_edata[i].pressure.done.mean;
+      humidity=(int16_t)g_thingy_edata[i].humidity.done.mean;
       button_state=g_thingy_edata[i].button;
+      UART_PRINTF_DEBUG("Thingy @%d window n:%d/%d/%d T:%d..%d P:%d..%d H:%d..%d\n\r", i,
+                        g_thingy_edata[i].temperature.done.cnt, g_thingy_edata[i].pressure.done.cnt,
+                        g_thingy_edata[i].humidity.done.cnt,
+                        g_thingy_edata[i].temperature.done.min, g_thingy_edata[i].temperature.done.max,
+                        g_thingy_edata[i].pressure.done.min, g_thingy_edata[i].pressure.done.max,
+                        g_thingy_edata[i].humidity.done.min, g_thingy_edata[i].humidity.done.max);
+      if(!vf_ble_tes_window_has_data(&g_thingy_edata[i]))
+      {//a sensor with no sample yet would be reported, and taken as a keyframe, as 0
+        continue;
+      }
       if(g_is_sink==false)
       {
+         if(vf_thingy_report_due(i)==false)
+         {
+           g_reports_suppressed++;
+           continue;
+         }
          //send button state to sink
          thingy_data.local_id=m_thingy_tes_c[i].conn_handle;
          thingy_data.link_state=AGG_NODE_LINK_DATA_UPDATE;
@@ -2007,8 +2414,9 @@ void vf_add_edata_adv_buff_callback(void * p_context)
          thingy_data.temperature=temperature;
          thingy_data.pressure=pressure;
          thingy_data.humidity=humidity;
-         vf_adv_thingy_data(&thingy_data);  //add data to buffer
-         uart_printf("Thingy ENV handle:%d, i:%d \n\r", m_thingy_tes_c[i].conn_handle,i);
+         vf_thingy_report_add(&thingy_data);  //add data to buffer
+         UART_PRINTF_DEBUG("Thingy ENV handle:%d, i:%d, reports sent:%u suppressed:%u \n\r", m_thingy_tes_c[i].conn_handle,i,
+                     g_reports_sent,g_reports_suppressed);
 
       }
       else
@@ -2036,207 +2444,35 @@ void vf_add_edata_adv_buff_callback(void * p_context)
       }
     }
   }
-  
+  vf_thingy_report_flush(); //the readings of this window, few records for all Thingies
 
 }
 
 /*----------
-@brief: search for position of id value (0x00AABBCC, AA: source id, BB: dest id, CC:packet id)
- in buffer advertising history
-@input: id value
-@ouput: position in the array g_buff_adv_hist, 0xFFFF if no match position
+@brief: 1 sec tick of the advertising history clock
+  entries carry their own expiry time, so nothing has to be walked or compacted here
 */
 void vf_refresh_history_buff_callback(void * p_context)
 {
-  uint16_t i,j,count=0;
-  uint8_t str1[432]="delete hist buff:",str2[10];
-
-    if(g_buff_adv_hist_size==0) return;
-
-
-    if(g_buff_adv_hist_firstpos<g_buff_adv_hist_lastpos)
-    {
-        for(i=g_buff_adv_hist_firstpos;i<g_buff_adv_hist_lastpos;i++)
-        {
-          if(g_buff_adv_hist[i].TTL>0)
-          {
-            g_buff_adv_hist[i].TTL--; ;
-          }
-        }
-    }
-    else
-    {
-        for(i=g_buff_adv_hist_firstpos;i<MAX_HIST_ADV_BUFF_SIZE;i++)
-        {
-          if(g_buff_adv_hist[i].TTL>0)
-          {
-            g_buff_adv_hist[i].TTL--; ;
-          }
-        }
-        for(i=0;i<g_buff_adv_hist_lastpos;i++)
-        {
-          if(g_buff_adv_hist[i].TTL>0)
-          {
-            g_buff_adv_hist[i].TTL--; ;
-          }
-        }
-    }
-
-    if(g_buff_adv_hist_firstpos<g_buff_adv_hist_lastpos)
-    {
-      for(i=g_buff_adv_hist_firstpos;i<g_buff_adv_hist_lastpos;i++)
-      {
-          if( g_buff_adv_hist[i].TTL==0) break;
-
-      }
-      if(i!=g_buff_adv_hist_lastpos)
-      {
-        count=1;
-
-        sprintf(str2,"%d ",i);
-        strcat(str1,str2);
-
-        for(j=i+1;j<g_buff_adv_hist_lastpos;j++)
-        {
-            if(g_buff_adv_hist[j].TTL!=0)
-            {
-              g_buff_adv_hist[i++]=g_buff_adv_hist[j];
-
-              sprintf(str2,"%d ",j);
-              strcat(str1,str2);
-
-            }
-            else
-            {
-              count++;
-            }
-
-        }
-        g_buff_adv_hist_lastpos=i;
-        g_buff_adv_hist_size-=count;
-
-        strcat(str1,"\n\r");
-        uart_printf(str1);
-      }
-
-    }
-    else
-    {
-      for(i=g_buff_adv_hist_firstpos;i<MAX_HIST_ADV_BUFF_SIZE;i++)
-      {
-          if( g_buff_adv_hist[i].TTL==0) break;
-
-      }
-      if(i!=MAX_HIST_ADV_BUFF_SIZE)
-      {
-        count=1;
-
-        sprintf(str2,"%d ",i);
-        strcat(str1,str2);
-
-        for(j=i+1;j<MAX_HIST_ADV_BUFF_SIZE;j++)
-        {
-            if(g_buff_adv_hist[j].TTL!=0)
-            {
-              g_buff_adv_hist[i++]=g_buff_adv_hist[j];
-              sprintf(str2,"%d ",j);
-              strcat(str1,str2);
-
-            }
-            else
-            {
-              count++;
-            }
-
-        }
-        for(j=0;j<g_buff_adv_hist_lastpos;j++)
-        {
-            if(g_buff_adv_hist[j].TTL!=0)
-            {
-              g_buff_adv_hist[i++]=g_buff_adv_hist[j];
-              sprintf(str2,"%d ",j);
-              strcat(str1,str2);
-
-            }
-            else
-            {
-              count++;
-            }
-            if(i>=MAX_HIST_ADV_BUFF_SIZE) i=0;
-
-        }
-
-        g_buff_adv_hist_lastpos=i;
-        g_buff_adv_hist_size-=count;
-
-        strcat(str1,"\n\r");
-        uart_printf(str1);
-      }
-      else
-      {
-          for(i=0;i<g_buff_adv_hist_lastpos;i++)
-          {
-              if( g_buff_adv_hist[j].TTL==0) break;
-
-          }
-          if(i!=g_buff_adv_hist_lastpos)
-          {
-            count=1;
-              sprintf(str2,"%d ",i);
-              strcat(str1,str2);
-            for(j=i+1;j<g_buff_adv_hist_lastpos;j++)
-            {
-                if(g_buff_adv_hist[j].TTL!=0)
-                {
-                  g_buff_adv_hist[i++]=g_buff_adv_hist[j];
-                  sprintf(str2,"%d ",j);
-                  strcat(str1,str2);
-                }
-                else
-                {
-                  count++;
-                }
-
-            }
-            g_buff_adv_hist_lastpos=i;
-            g_buff_adv_hist_size-=count;
-
-            strcat(str1,"\n\r");
-            uart_printf(str1);
-          }
-      }
-
-    }
-
-
-  
-
-
-  return;
-
-
+  AGG_PROF_BEGIN(AGG_PROF_HIST_REFRESH);
+  g_hist_time_sec++;
+  AGG_TRACE(AGG_TRACE_EVT_HIST_TICK, (uint8_t *)&g_hist_time_sec, 4);
+  AGG_PROF_STOP(AGG_PROF_HIST_REFRESH);
 }
 
 /*--------------------
-@brief: process command from the source
-    1. compare new data has been processed before by buffer of advertising history
-    2. If not, process command, else quit
+@brief: relay_sched_process_handler_t, process command from the source
+  relay_sched_rx has checked it against the history already and adds its id there after this
 @input: broadcast data
 */
-void vf_process_adv_command3(uint8_array_t *br_data)
+static void vf_process_adv_command3(uint8_t const *p_data, uint8_t size)
 {//send to phone
   //if(g_is_sink==true) vinh doing
-  uint32_t ids;
-  ids=(((uint32_t)br_data->p_data[0])<<16)+(((uint32_t)br_data->p_data[1])<<8)+((uint32_t)br_data->p_data[2]);
-  uart_printf("ids:0x%x \n\r", ids);
-
-  if(vf_validate_relay_packet3(br_data)==0xFFFF)
-  {//new data
-    vf_app_adv_data_send_to_phone(br_data); //process -> send data to phone
-    vf_add_buff_adv_hist3(ids); //add this id to history buffer
-  }
-  else 
-    uart_printf("duplicate command \n\r");
+  uint8_array_t br_data;
+
+  br_data.p_data=(uint8_t *)p_data; //only read
+  br_data.size=size;
+  vf_app_adv_data_send_to_phone(&br_data); //process -> send data to phone
 }
 
 
@@ -2252,8 +2488,6 @@ static void vf_start_broadcast_data(void)
     uint8_array_t buffdata;
     ret_code_t err_code;
     uart_printf("add start broadcast data\n\r");
-    err_code=sd_ble_gap_adv_stop(m_adv_handle);
-    uart_printf("$r1 %d ",err_code);
  /*
    static bool k1=false;   
     if(k1==true)
@@ -2289,13 +2523,8 @@ static void vf_start_broadcast_data(void)
   buff[19]=14;
   buffdata.p_data=&buff[2];
   buffdata.size=18;
-  vf_add_packet_to_buffer3(&buffdata);
+  vf_add_packet_to_buffer3(&buffdata); //goes on air with the next vf_relay_adv_data3()
   //memcpy(&adv_packet.adv_data.p_data[org_adv_data_size],buff,20);
-
-
-  err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
-    //APP_ERROR_CHECK(err_code);
-  uart_printf("$r3 %d ",err_code);
 }
 
 
@@ -2310,8 +2539,6 @@ static void vf_start_broadcast_data2(void)
     uint8_array_t buffdata;
     ret_code_t err_code;
     uart_printf("add start broadcast data\n\r");
-    err_code=sd_ble_gap_adv_stop(m_adv_handle); //stop advertising
-    uart_printf("$err1 %d ",err_code); 
  /*
    static bool k1=false;   
     if(k1==true)
@@ -2348,32 +2575,19 @@ static void vf_start_broadcast_data2(void)
   buffdata.p_data=&buff[0];
   buffdata.size=18;
   //vf_add_packet_to_buffer2(&buffdata);
-  memcpy(&adv_packet.adv_data.p_data[org_adv_data_size],buff,20);
-
-
-  err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG); //start advertising
-    //APP_ERROR_CHECK(err_code);
-  uart_printf("$err2 %d ",err_code);
+  memcpy(&vf_adv_data_spare_buf_get()[org_adv_data_size],buff,20);
+  vf_adv_data_commit(org_adv_data_size+20);
 }
 
 
 static void vf_stop_broadcast_data(void)
 {
 
-    uint8_t buff[32];
-    uint8_t i;
-    ret_code_t err_code;
     uart_printf(" stop broadcast userdata \n\r");
 
-    err_code=sd_ble_gap_adv_stop(m_adv_handle);
-    //uart_printf("$r1 %d ",err_code);
-
-    memset(buff,0,32);
-    memcpy(&adv_packet.adv_data.p_data[org_adv_data_size],buff,20);   
-
-       err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
-    //APP_ERROR_CHECK(err_code);
-    //uart_printf("$r3 %d ",err_code);
+    //keep advertising, only without user data
+    (void)vf_adv_data_spare_buf_get();
+    vf_adv_data_commit(org_adv_data_size);
 }
 
 bool vf_check_source(uint8_array_t *data)
@@ -2393,7 +2607,7 @@ void vf_adv_thingy_data(thingy_data_t *data)
 {
 
 
-  uint8_t data_arr[32],str1[20],i;
+  uint8_t data_arr[32];
   uint8_array_t idata;
 //vinh doing
 
@@ -2440,13 +2654,7 @@ void vf_adv_thingy_data(thingy_data_t *data)
   }
 
 
-  uart_printf(" Add Thingy data to buffer: ");
-  for(i=0;i<idata.size;i++)
-  {
-    sprintf(str1,"%d ",idata.p_data[i]);
-    uart_printf(str1);
-  }
-  uart_printf("\r\n");
+  AGG_TRACE(AGG_TRACE_EVT_THINGY_DATA, idata.p_data, idata.size);
   vf_add_packet_to_buffer3(&idata);
   
   //vinh ver3
@@ -2454,211 +2662,28 @@ void vf_adv_thingy_data(thingy_data_t *data)
 }
 
 
-uint8_t vf_add_packet_to_buffer(uint8_array_t *data)
-{
-  uint8_array_t *userdata=data;
-  uint8_t err_code=0;
-  size_t trim_pos,i;
-  if((g_userdata.size+userdata->size+1)<=MAX_USERDATA_BUFFER)
-  {//buffer not overflow
-      g_userdata.size+=userdata->size+1;
-      g_userdata.p_data[g_userdata_lastpos++]=userdata->size+1;
-
-      if((g_userdata_lastpos+userdata->size)>=MAX_USERDATA_BUFFER)
-      {
-          memcpy(&g_userdata.p_data[g_userdata_lastpos],userdata->p_data,MAX_USERDATA_BUFFER-g_userdata_lastpos);
-          trim_pos=MAX_USERDATA_BUFFER-g_userdata_lastpos;
-          g_userdata_lastpos=userdata->size-(MAX_USERDATA_BUFFER-g_userdata_lastpos);
-          memcpy(&g_userdata.p_data[0],&userdata->p_data[trim_pos],g_userdata_lastpos);
-      }
-      else
-      {
-         memcpy(&g_userdata.p_data[g_userdata_lastpos],userdata->p_data,userdata->size);
-         g_userdata_lastpos+=userdata->size;
-      }
-      uart_printf("add packet to buffer");
-      uart_printf("@%d $%d $%d *",g_userdata_lastpos,userdata->size,g_userdata.size);
-      if(g_userdata_firstpos+g_userdata.size<MAX_USERDATA_BUFFER)
-      {
-          for(i=g_userdata_firstpos;i<g_userdata_firstpos+g_userdata.size;i++)
-          {
-           uart_printf("%d ", g_userdata.p_data[i]);
-            //sprintf(str_uart, "%d ",userdata.p_data[i]);
-          }
-      }
-      else
-      {
-            for(i=g_userdata_firstpos;i<MAX_USERDATA_BUFFER;i++)
-            {
-             uart_printf("%d ", g_userdata.p_data[i]);
-            //sprintf(str_uart, "%d ",userdata.p_data[i]);
-            }
-            for(i=0;i<g_userdata_lastpos;i++)
-            {
-             uart_printf("%d ", g_userdata.p_data[i]);
-            //sprintf(str_uart, "%d ",userdata.p_data[i]);
-            }
-      }
-      uart_printf("\n\r");
-  }//end buffer not full
-  else
-  {
-    uart_printf("Buffer full");
-    err_code=1;
-  }
-  return err_code;
-}
-
-
-uint8_t vf_add_packet_to_buffer2(uint8_array_t *data)
-{
-//each block include 32 bytes
-//byte 0: block property: 0x0: free, 0xFF: used
-//byte 1: pointer to next available block,0xFF is NULL
-//byte 2: pointer to previous available block,0xFF is NULL
-//byte 4..n:size + data
-//g_userdata_lastpos: position of last block in buffer
-//g_userdata_firstpos: position of last block in buffer
-  uint8_array_t *userdata=data;
-  uint8_t err_code=1;
-  size_t pos,i;
-  if((g_userdata.size)<MAX_USERDATA_BUFFER_BLOCK)
-  {//buffer not overflow
-
-      for(i=0;i<MAX_USERDATA_BUFFER_BLOCK;i++)
-      {
-        if(g_userdata.p_data[i*MAX_USERDATA_BUFFER_BLOCKSIZE]==0) //found free block
-        {
-          err_code=0;
-          break;
-        }
-      }
-      
-      if(err_code==0)
-      {  
-      //found free block
-        pos=i;
-        if( g_userdata.size==0)
-        {
-          g_userdata.p_data[pos*32+1]=g_userdata.p_data[pos*32+2]=0xFF; 
-          g_userdata_currpos=g_userdata_lastpos=g_userdata_firstpos=pos;
-        }
-        else
-        {
-          g_userdata.p_data[g_userdata_lastpos*32+1]=pos; //update previous "next block pointer"
-          g_userdata.p_data[pos*32+2]=g_userdata_lastpos; //update current "pre block pointer"
-          g_userdata_lastpos=pos; //update last position
-        }
-        g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE]=0xFF;  //mark as used block
-        g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4]=userdata->size+1; //number of data byte in this block, include this byte
-        memcpy(&g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5],userdata->p_data,userdata->size);
-        g_userdata.size++; 
-      }
-  
-
-  }//end buffer not full
-
-  if (err_code==0)
-  {
-       uart_printf("@%d $%d $%d *",g_userdata.size,g_userdata_lastpos,userdata->size); 
-       for(i=0;i<userdata->size+1+4;i++)
-       {
-          uart_printf("%d ", g_userdata.p_data[g_userdata_lastpos*MAX_USERDATA_BUFFER_BLOCKSIZE+i]);
-       }
-      uart_printf("\n\r");
-  }
-  else
-  {
-    uart_printf("Buffer full");
-  }
-  return err_code;
-}
-
-
 /*--------------------------------
-@brief: add broadcast data to buffer for advertising
+@brief: add broadcast data to buffer for advertising, see relay_pool_add
 @input: user data in *data
-@output: return value 0: success, 1: buffer full
-
-data is coupled into buffer at the posiont pointed by g_userdata_lastpos
-
-Structure of a block (32 bytes)
-  byte 0: block property: 0x0: free, 0xFF: used
-  byte 1: pointer to next available block,0xFF is NULL
-  byte 2: pointer to previous available block,0xFF is NULL
-  byte 3: number of advertsing times before removing
-  byte 4: size (=(size of broadcase data)+1)
-  byte 5..n: broadcast data
-          broadcast data (br_data)
-            byte 0: source id
-            byte 1: destination id
-            byte 2: packet id
-            byte 3: hop counts
-            byte 4..18: user data 
-
-//g_userdata_lastpos: position of last block in buffer
-//g_userdata_firstpos: position of last block in buffer
-//g_userdata_currpos: position of current block which is adverting
-//g_userdata : buffer
+@output: return value 0: success, 1: buffer full or invalid size
+  the advertising times follow the relay scheduling, an idle relay goes to work at once
 ---------*/
 
 uint8_t vf_add_packet_to_buffer3(uint8_array_t *br_data)
 {
+  uint8_t err=relay_sched_add(br_data->p_data, br_data->size);
 
-  uint8_array_t *userdata=br_data;
-  uint8_t err_code=1;
-  size_t pos,i;
-  if((g_userdata.size)<MAX_USERDATA_BUFFER_BLOCK)
-  {//buffer not overflow
-
-      for(i=0;i<MAX_USERDATA_BUFFER_BLOCK;i++)
-      {
-        if(g_userdata.p_data[i*MAX_USERDATA_BUFFER_BLOCKSIZE]==0) //found free block
-        {
-          err_code=0;
-          break;
-        }
-      }
-      
-      if(err_code==0)
-      {  
-      //found free block
-        pos=i;
-        if( g_userdata.size==0)
-        {
-          g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]=0xFF; //pointer to next and previous block
-          g_userdata_currpos=g_userdata_lastpos=g_userdata_firstpos=pos;
-        }
-        else
-        {
-          g_userdata.p_data[g_userdata_lastpos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=pos; //update previous "next block pointer"
-          g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+2]=g_userdata_lastpos; //update current "pre block pointer"
-          g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+1]=0xFF; //pointer to next block is NULL
-          g_userdata_lastpos=pos; //update last position
-        }
-        g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE]=0xFF;  //mark as used block
-        g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+3]=2;  //advertise 2 times before remove this block
-        g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+4]=userdata->size+1; //number of data byte in this block, include this byte
-        memcpy(&g_userdata.p_data[pos*MAX_USERDATA_BUFFER_BLOCKSIZE+5],userdata->p_data,userdata->size);
-        g_userdata.size++;
-      } 
-
-  }//end buffer not overflow
-
-  if (err_code==0)
+  if(err==RELAY_POOL_ADD_INVALID)
   {
-       uart_printf("add data to buffer firstpos:%d, currpos:%d, lastpos:$%d buffsize:$%d *",g_userdata_firstpos,g_userdata_currpos,g_userdata_lastpos,g_userdata.size); 
-       for(i=0;i<userdata->size+1+4;i++)
-       {
-          uart_printf("%d ", g_userdata.p_data[g_userdata_lastpos*MAX_USERDATA_BUFFER_BLOCKSIZE+i]);
-       }
-      uart_printf("\n\r");
+    UART_PRINTF_DEBUG("Invalid size %d\n\r",br_data->size);
+    return 1;
   }
-  else
+  if(err==RELAY_POOL_ADD_FULL)
   {
-    uart_printf("Buffer full");
+    UART_PRINTF_DEBUG("Buffer full");
+    return 1;
   }
-  return err_code;
+  return 0;
 }
 
 /**@brief Handles events coming from the Thingy Environment central module.
@@ -2666,6 +2691,7 @@ uint8_t vf_add_packet_to_buffer3(uint8_array_t *br_data)
 static void vf_tes_c_evt_handler(ble_tes_c_t * p_tes_c, ble_tes_c_evt_t * p_tes_c_evt)
 {
     uint16_t connection_handle=p_tes_c_evt->conn_handle;
+    AGG_PROF_BEGIN(AGG_PROF_TES_C_EVT);
     switch (p_tes_c_evt->evt_type)
     {
         case BLE_TES_C_EVT_DISCOVERY_COMPLETE:
@@ -2675,7 +2701,8 @@ static void vf_tes_c_evt_handler(ble_tes_c_t * p_tes_c, ble_tes_c_evt_t * p_tes_
            err_code = ble_tes_c_handles_assign(&m_thingy_tes_c[p_tes_c_evt->conn_handle],
                                                p_tes_c_evt->conn_handle,
                                                &p_tes_c_evt->params.peer_db);
-            uart_printf("Thingy Environment service discovered on conn_handle 0x%x.", p_tes_c_evt->conn_handle);
+            UART_PRINTF_INFO("Thingy Environment service discovered on conn_handle 0x%x.", p_tes_c_evt->conn_handle);
+            thingy_db_cache_tes_store(peer_addr_LR[p_tes_c_evt->conn_handle], &p_tes_c->peer_tes_db);
 
             // Thingy Environment service discovered. Enable notification of sensor data.
             err_code = ble_tes_c_temperature_notif_enable(p_tes_c);
@@ -2684,6 +2711,10 @@ static void vf_tes_c_evt_handler(ble_tes_c_t * p_tes_c, ble_tes_c_evt_t * p_tes_
             APP_ERROR_CHECK(err_code);
             err_code = ble_tes_c_humidity_notif_enable(p_tes_c);
             APP_ERROR_CHECK(err_code);
+            vf_ble_tes_window_reset(&g_thingy_edata[connection_handle]);
+            g_thingy_reported[connection_handle].valid=false;
+            g_thingy_reported[connection_handle].ref.valid=false;
+            vf_tes_sampling_config_send(p_tes_c);
             //err_code = ble_tes_c_gas_notif_enable(p_tes_c);
             //APP_ERROR_CHECK(err_code);
             //err_code = ble_tes_c_color_notif_enable(p_tes_c);
@@ -2698,43 +2729,51 @@ static void vf_tes_c_evt_handler(ble_tes_c_t * p_tes_c, ble_tes_c_evt_t * p_tes_
             ble_tes_temperature_t temperature = p_tes_c_evt->params.value.temperature_data;
             vf_ble_tes_add_sum_temperature(&g_thingy_edata[connection_handle],temperature);         
 
-            uart_printf("Got Thingy @%d temperature: %d,%d, sum:%d \n\r",p_tes_c_evt->conn_handle,\
-                    temperature.integer, temperature.decimal,g_thingy_edata[connection_handle].temperature);
+            UART_PRINTF_DEBUG("Got Thingy @%d temperature: %d,%d, n:%d \n\r",p_tes_c_evt->conn_handle,\
+                    temperature.integer, temperature.decimal,g_thingy_edata[connection_handle].temperature.cnt);
         } break; // BLE_TES_C_EVT_TEMPERATURE_NOTIFICATION
         case BLE_TES_C_EVT_PRESSURE_NOTIFICATION:
         {
             ble_tes_pressure_t pressure = p_tes_c_evt->params.value.pressure_data;
             vf_ble_tes_add_sum_pressure(&g_thingy_edata[connection_handle],pressure); 
 
-            uart_printf("Got Thingy @%d pressure: %d,%d \n\r",connection_handle, pressure.integer, pressure.decimal);
+            UART_PRINTF_DEBUG("Got Thingy @%d pressure: %d,%d \n\r",connection_handle, pressure.integer, pressure.decimal);
         } break; // BLE_TES_C_EVT_PRESSURE_NOTIFICATION
         case BLE_TES_C_EVT_HUMIDITY_NOTIFICATION:
         {
             ble_tes_humidity_t humidity = p_tes_c_evt->params.value.humidity_data;
             vf_ble_tes_add_sum_humidity(&g_thingy_edata[connection_handle],humidity); 
 
-            uart_printf("Got Thingy @%d humidity: %d \n\r",connection_handle,humidity);
+            UART_PRINTF_DEBUG("Got Thingy @%d humidity: %d \n\r",connection_handle,humidity);
         } break; // BLE_TES_C_EVT_HUMIDITY_NOTIFICATION
         case BLE_TES_C_EVT_GAS_NOTIFICATION:
         {
             ble_tes_gas_t gas = p_tes_c_evt->params.value.gas_data;
-            uart_printf("Got C02: %d \n\r", gas.eco2_ppm);
-            uart_printf("Got organic components: %d \n\r", gas.tvoc_ppb);
+            UART_PRINTF_DEBUG("Got C02: %d \n\r", gas.eco2_ppm);
+            UART_PRINTF_DEBUG("Got organic components: %d \n\r", gas.tvoc_ppb);
         } break; // BLE_TES_C_EVT_GAS_NOTIFICATION
         case BLE_TES_C_EVT_COLOR_NOTIFICATION:
         {
             ble_tes_color_t color = p_tes_c_evt->params.value.color_data;
-            uart_printf("Got color. R%d, G%d, B%d, C%d \n\r", color.red, color.green, color.blue, color.clear);
+            UART_PRINTF_DEBUG("Got color. R%d, G%d, B%d, C%d \n\r", color.red, color.green, color.blue, color.clear);
         } break; // BLE_TES_C_EVT_COLOR_NOTIFICATION
         case BLE_TES_C_EVT_CONFIG_NOTIFICATION:
         {
             // No implementation. 
         } break; // BLE_TES_C_EVT_CONFIG_NOTIFICATION
+        case BLE_TES_C_EVT_CONFIG_READ:
+        {
+            if(p_tes_c->config_valid)
+              vf_tes_sampling_config_send(p_tes_c);
+            else
+              UART_PRINTF_INFO("Thingy @%d config read failed, sampling not changed\n\r", p_tes_c->conn_handle);
+        } break; // BLE_TES_C_EVT_CONFIG_READ
 
         default:
             // No implementation needed.
             break;
     }
+    AGG_PROF_STOP(AGG_PROF_TES_C_EVT);
 }
 
 
@@ -2752,13 +2791,20 @@ static void advertising_data_set(void)
     adv_data.include_appearance = false;
 
 
+#if (RELAY_EXTENDED_ADV_ENABLED == 1)
+    //extended connectable advertising has no scan response, the service uuid goes in the advertising data
+    adv_data.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+    adv_data.uuids_complete.p_uuids = m_adv_uuids;
+#else
     sr_data.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
     sr_data.uuids_complete.p_uuids = m_adv_uuids;
+#endif
  
  
-    adv_packet.adv_data.p_data = &adv_data_buf[0];
-    adv_packet.adv_data.len = ADV_MAX_LENGTH;
-    adv_packet.scan_rsp_data.p_data = sr_data_buf;
+    m_adv_buf_idx = 0;
+    adv_packet.adv_data.p_data = adv_data_buf[m_adv_buf_idx];
+    adv_packet.adv_data.len = RELAY_ADV_MAX_LENGTH;
+    adv_packet.scan_rsp_data.p_data = sr_data_buf[m_adv_buf_idx];
     adv_packet.scan_rsp_data.len = ADV_MAX_LENGTH;
 
     
@@ -2767,8 +2813,13 @@ static void advertising_data_set(void)
     err_code = ble_advdata_encode(&adv_data, adv_packet.adv_data.p_data, &adv_packet.adv_data.len);
     APP_ERROR_CHECK(err_code);
     
+#if (RELAY_EXTENDED_ADV_ENABLED == 1)
+    adv_packet.scan_rsp_data.p_data = NULL;
+    adv_packet.scan_rsp_data.len = 0;
+#else
     err_code = ble_advdata_encode(&sr_data, adv_packet.scan_rsp_data.p_data, &adv_packet.scan_rsp_data.len);
     APP_ERROR_CHECK(err_code);
+#endif
 
    //vinh
     org_adv_data_size=adv_packet.adv_data.len;
@@ -2779,14 +2830,18 @@ static void advertising_data_set(void)
     org_adv_data_size=adv_packet.adv_data.len;  //mark the start position of datafield 
 
 
-    memset(&adv_packet.adv_data.p_data[org_adv_data_size],0,20);
-    adv_packet.adv_data.len=org_adv_data_size+20; //length
+    //relay records are appended by vf_relay_adv_data3()
+    adv_packet.adv_data.len=org_adv_data_size; //length
 
     
     //adv_params.properties.connectable = 1;
     //adv_params.properties.scannable = 1;
     //adv_params.properties.legacy_pdu = 1;
+#if (RELAY_EXTENDED_ADV_ENABLED == 1)
+    adv_params.properties.type = BLE_GAP_ADV_TYPE_EXTENDED_CONNECTABLE_NONSCANNABLE_UNDIRECTED;
+#else
     adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+#endif
     adv_params.p_peer_addr   = NULL;
     adv_params.filter_policy = BLE_GAP_ADV_FP_ANY;
     adv_params.interval      = PERIPHERAL_ADV_INTERVAL;
@@ -2814,8 +2869,8 @@ static void advertising_start(void)
     err_code = app_timer_start(m_adv_led_blink_timer_id, APP_TIMER_TICKS(500), 0);
     APP_ERROR_CHECK(err_code);
 
-    //vinh, start advertising timer with 200ms interval to change advertising packet in buffer
-    err_code = app_timer_start(m_adv_timer_id, APP_TIMER_TICKS(200), 0);
+    //vinh, start advertising timer to change advertising packet in buffer, its period follows the relay level
+    err_code = app_timer_start(m_adv_timer_id, APP_TIMER_TICKS(g_relay_levels[g_relay_sched.level].tick_ms), 0);
     APP_ERROR_CHECK(err_code);
 
     //timer for delete a history id if history buffer
@@ -2828,7 +2883,8 @@ static void advertising_start(void)
 /**@brief Function for writing to the LED characteristic of all connected clients.
  *
  * @details Based on if the button is pressed or released, this function writes a high or low
- *          LED status to the server.
+ *          LED status to the server. A link with its budget of GATTC requests waiting
+ *          (NRF_ERROR_NO_MEM) is skipped.
  *
  * @param[in] button_action The button action (press/release).
  *            Determines if the LEDs of the servers will be ON or OFF.
@@ -2849,7 +2905,8 @@ static ret_code_t led_status_send_to_all(uint8_t button_action)
             //err_code = ble_thingy_uis_led_set_constant(&m_thingy_uis_c[i], button_action ? 255 : 0, button_action ? 255 : 0, button_action ? 255 : 0);
             if (err_code != NRF_SUCCESS &&
                 err_code != BLE_ERROR_INVALID_CONN_HANDLE &&
-                err_code != NRF_ERROR_INVALID_STATE)
+                err_code != NRF_ERROR_INVALID_STATE &&
+                err_code != NRF_ERROR_NO_MEM)
             {
                 return err_code;
             }
@@ -2878,7 +2935,8 @@ static ret_code_t led_status_send_by_mask(uint8_t button_action, uint8_t r, uint
                 err_code = ble_thingy_uis_led_set_constant(&m_thingy_uis_c[i], button_action ? r : 0, button_action ? g : 0, button_action ? b : 0);
                 if (err_code != NRF_SUCCESS &&
                     err_code != BLE_ERROR_INVALID_CONN_HANDLE &&
-                    err_code != NRF_ERROR_INVALID_STATE)
+                    err_code != NRF_ERROR_INVALID_STATE &&
+                    err_code != NRF_ERROR_NO_MEM)
                 {
                     return err_code;
                 }
@@ -2904,7 +2962,8 @@ ret_code_t led_status_on_off_send_by_mask(bool on, uint32_t mask)
                 err_code = ble_thingy_uis_led_set_on_off(&m_thingy_uis_c[i], on);
                 if (err_code != NRF_SUCCESS &&
                     err_code != BLE_ERROR_INVALID_CONN_HANDLE &&
-                    err_code != NRF_ERROR_INVALID_STATE)
+                    err_code != NRF_ERROR_INVALID_STATE &&
+                    err_code != NRF_ERROR_NO_MEM)
                 {
                     return err_code;
                 }
@@ -3073,6 +3132,38 @@ static void db_disc_handler(ble_db_discovery_evt_t * p_evt)
 }
 
 
+/**@brief Assigns cached handles to a Thingy link in place of DB discovery.
+ *
+ * @details Runs the same discovery complete handling as a fresh discovery, so notifications
+ *          are enabled and the connection parameters updated the same way.
+ *
+ * @param[in] conn_handle  The Thingy link.
+ * @param[in] p_tes_db     Thingy Environment Service handles.
+ * @param[in] p_uis_db     Thingy UI Service handles.
+ */
+static void thingy_db_cache_apply(uint16_t conn_handle, const tes_db_t * p_tes_db, const thingy_uis_db_t * p_uis_db)
+{
+    ret_code_t             err_code;
+    ble_thingy_uis_c_evt_t uis_evt;
+    ble_tes_c_evt_t        tes_evt;
+
+    err_code = ble_thingy_uis_c_handles_assign(&m_thingy_uis_c[conn_handle], conn_handle, p_uis_db);
+    APP_ERROR_CHECK(err_code);
+
+    memset(&uis_evt, 0, sizeof(uis_evt));
+    uis_evt.evt_type       = BLE_THINGY_UIS_C_EVT_DISCOVERY_COMPLETE;
+    uis_evt.conn_handle    = conn_handle;
+    uis_evt.params.peer_db = *p_uis_db;
+    thingy_uis_c_evt_handler(&m_thingy_uis_c[conn_handle], &uis_evt);
+
+    memset(&tes_evt, 0, sizeof(tes_evt));
+    tes_evt.evt_type       = BLE_TES_C_EVT_DISCOVERY_COMPLETE;
+    tes_evt.conn_handle    = conn_handle;
+    tes_evt.params.peer_db = *p_tes_db;
+    vf_tes_c_evt_handler(&m_thingy_tes_c[conn_handle], &tes_evt);
+}
+
+
 /** @brief Database discovery initialization.
  */
 static void db_discovery_init(void)
@@ -3223,6 +3314,33 @@ void post_message_connect_callback(void *p)
     app_aggregator_update_link_status();
 }
 
+static void sink_snapshot_callback(void *p)
+{
+    app_aggregator_sink_snapshot();
+}
+
+//period 0 sends every relayed reading to the phone as it arrives, as without snapshots
+static void sink_snapshot_period_set(uint32_t period_ms)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(m_sink_snapshot_timer_id);
+    APP_ERROR_CHECK(err_code);
+    app_aggregator_sink_snapshot_mode_set(period_ms != 0);
+    if(period_ms != 0)
+    {
+        err_code = app_timer_start(m_sink_snapshot_timer_id, APP_TIMER_TICKS(period_ms), 0);
+        APP_ERROR_CHECK(err_code);
+    }
+}
+
+/** @brief Function for initializing the event scheduler, before the timers and the SoftDevice.
+ */
+static void scheduler_init(void)
+{
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+}
+
 /** @brief Function for initializing the timer.
  */
 static void timer_init(void)
@@ -3245,6 +3363,23 @@ static void timer_init(void)
     //vinh ver4
     err_code = app_timer_create(&m_add_edata_adv_buff_timer_id, APP_TIMER_MODE_REPEATED, vf_add_edata_adv_buff_callback);
 
+    err_code = app_timer_create(&m_sink_snapshot_timer_id, APP_TIMER_MODE_REPEATED, sink_snapshot_callback);
+    APP_ERROR_CHECK(err_code);
+
+}
+
+
+/**@brief Function for handling events from the GATT module.
+ *
+ * @details Keeps the aggregator informed of the ATT MTU on the phone link, so that
+ *          notifications can be packed up to the negotiated payload size.
+ */
+static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt)
+{
+    if((p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED) && (p_evt->conn_handle == m_per_con_handle))
+    {
+        app_aggregator_att_mtu_set(p_evt->params.att_mtu_effective);
+    }
 }
 
 
@@ -3252,10 +3387,10 @@ static void timer_init(void)
  */
 static void gatt_init(void)
 {
-    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, NULL);
+    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, gatt_evt_handler);
     APP_ERROR_CHECK(err_code);
     
-    err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, 64);
+    err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
     APP_ERROR_CHECK(err_code);
 }
 
@@ -3295,6 +3430,41 @@ static void process_app_commands()
             case APPCMD_DISCONNECT_CENTRAL://disconnect to phone event
                 sd_ble_gap_disconnect(m_per_con_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
                 break;
+
+            case APPCMD_SET_BATCH_MODE: //pack several records per notification, see AGG_BLE_RECORD_BATCH
+                app_aggregator_batch_mode_set(agg_cmd[0] != 0);
+                break;
+
+            case APPCMD_SET_SENSOR_WINDOW: //window in seconds (16 bit, little endian), samples per window (0: unchanged)
+                vf_sensor_window_set(uint16_decode(&agg_cmd[0]) * 1000, agg_cmd[2]);
+                break;
+
+            case APPCMD_SET_SENSOR_DEADBAND: //temperature, pressure (hundredths), humidity (%), heartbeat (s), 16 bit little endian each
+                g_sensor_deadband.temperature=uint16_decode(&agg_cmd[0]);
+                g_sensor_deadband.pressure=uint16_decode(&agg_cmd[2]);
+                g_sensor_deadband.humidity=uint16_decode(&agg_cmd[4]);
+                g_sensor_deadband.heartbeat_ms=uint16_decode(&agg_cmd[6]) * 1000;
+                break;
+
+            case APPCMD_SET_SINK_SNAPSHOT: //snapshot period in ms (16 bit, little endian), 0: off. Records are batched while on
+                sink_snapshot_period_set(uint16_decode(&agg_cmd[0]));
+                break;
+
+            case APPCMD_GET_STATS: //reply with AGG_BLE_STATS records, then clear the statistics if agg_cmd[0] is not 0
+                app_aggregator_stats_send();
+                if(agg_cmd[0] != 0)
+                {
+                    agg_stats_clear();
+                }
+                break;
+
+            case APPCMD_DUMP_PROFILE: //print the cycle counts of the hot handlers on the UART, then clear them if agg_cmd[0] is not 0
+                agg_prof_dump();
+                if(agg_cmd[0] != 0)
+                {
+                    agg_prof_clear();
+                }
+                break;
             
             default:
                 break;
@@ -3310,6 +3480,7 @@ static void process_app_commands()
 int main(void)
 {
     uint32_t err_code;
+    relay_sched_init_t relay_init={CLUSTER_ID, (RELAY_CODED_PHY_ENABLED == 1), vf_relay_sched_level_set, vf_process_adv_command3};
 
     //vinh
     //name clusterhead and string to detect blinky group
@@ -3320,12 +3491,8 @@ int main(void)
     /*s='A'+CLUSTER_ID-1;
     m_target_blinky_name[0]=m_target_blinky_name[1]=s;
     m_target_blinky_name[2]=0;*/
-    g_userdata_currpos=g_userdata_lastpos=g_userdata_firstpos;
-    g_userdata.size=0;  
-    memset(garr_userdata,0,sizeof(garr_userdata));
-    memset(&g_buff_adv_hist,0,sizeof(g_buff_adv_hist));
-    g_buff_adv_hist_firstpos=g_buff_adv_hist_lastpos=0;
-    g_buff_adv_hist_size=0;
+    relay_pool_init();
+    relay_sched_init(&relay_init);
 
     memset(g_thingy_edata,0,sizeof(g_thingy_edata));
 
@@ -3335,12 +3502,18 @@ int main(void)
       g_is_sink=false;
 
 
+    agg_stats_init();
+    agg_prof_init();
     log_init();
+    scheduler_init();
     timer_init();
     uart_init();
+    agg_trace_init();
     leds_init();
     buttons_init();
     ble_stack_init();
+    thingy_db_cache_init();
+    agg_flash_log_init();
     gap_params_init();
     gatt_init();
     services_init();
@@ -3367,7 +3540,7 @@ int main(void)
     }
     // Start scanning for peripherals and initiate connection to devices which  advertise.
     scan_start(false);
-    err_code = app_timer_start(m_add_edata_adv_buff_timer_id, APP_TIMER_TICKS(10000), 0); //timer for perodically updating Thingy data to phone
+    err_code = app_timer_start(m_add_edata_adv_buff_timer_id, APP_TIMER_TICKS(g_sensor_window_ms), 0); //timer for perodically updating Thingy data to phone
     APP_ERROR_CHECK(err_code);
 
     // Start advertising
@@ -3378,15 +3551,23 @@ int main(void)
     
     for (;;)
     {
+        app_sched_execute(); //BLE events and timer timeouts queued since the last round
+
         if(m_per_con_handle != BLE_CONN_HANDLE_INVALID) //vinh BLE is ongoing
         {
+            AGG_PROF_BEGIN(AGG_PROF_PHONE_FLUSH);
             while(app_aggregator_flush_ble_commands()); //flush all command in buffer
+            AGG_PROF_STOP(AGG_PROF_PHONE_FLUSH);
         }
 
         process_app_commands();
 
         device_list_print();
         
+        scan_peer_cache_report();
+        conn_sched_report();
+        uart_printf_process();
+
         while(NRF_LOG_PROCESS());
 
         power_manage();
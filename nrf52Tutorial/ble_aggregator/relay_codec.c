@@ -0,0 +1,173 @@
+#include "relay_codec.h"
+#include <string.h>
+
+#define RELAY_CODEC_SENSOR_COUNT    3
+
+static const uint8_t m_sensor_flag[RELAY_CODEC_SENSOR_COUNT] =
+{
+    RELAY_CODEC_FLAG_TEMPERATURE, RELAY_CODEC_FLAG_PRESSURE, RELAY_CODEC_FLAG_HUMIDITY
+};
+
+// Small magnitudes of either sign become small unsigned numbers: 0, -1, 1, -2 -> 0, 1, 2, 3
+static uint32_t relay_codec_zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t relay_codec_unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// 7 bits per byte, least significant first, bit 7 set while more bytes follow
+static uint8_t relay_codec_varint_put(uint8_t *p_buf, uint32_t value)
+{
+    uint8_t len = 0;
+
+    while (value >= 0x80)
+    {
+        p_buf[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p_buf[len++] = (uint8_t)value;
+    return len;
+}
+
+static uint8_t relay_codec_varint_get(uint8_t const *p_buf, uint8_t len, uint32_t *p_value)
+{
+    uint32_t value = 0;
+    uint8_t  i;
+
+    for (i = 0; i < len && i < 5; i++)
+    {
+        value |= (uint32_t)(p_buf[i] & 0x7F) << (7 * i);
+        if ((p_buf[i] & 0x80) == 0)
+        {
+            *p_value = value;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static void relay_codec_values_get(relay_codec_reading_t const *p_reading, int32_t *p_value)
+{
+    p_value[0] = p_reading->temperature;
+    p_value[1] = p_reading->pressure;
+    p_value[2] = p_reading->humidity;
+}
+
+uint8_t relay_codec_reading_encode(uint8_t *p_buf, uint8_t max_len, uint8_t local_id,
+                                   relay_codec_reading_t const *p_reading, relay_codec_ref_t *p_ref, bool keyframe)
+{
+    uint8_t reading[RELAY_CODEC_READING_MAX];
+    int32_t value[RELAY_CODEC_SENSOR_COUNT];
+    int32_t base[RELAY_CODEC_SENSOR_COUNT];
+    uint8_t gen;
+    uint8_t len = 2;
+    uint8_t i;
+
+    keyframe = keyframe || !p_ref->valid;
+    gen      = keyframe ? (uint8_t)((p_ref->gen + 1) & 0x03) : p_ref->gen;
+
+    relay_codec_values_get(p_reading, value);
+    relay_codec_values_get(&p_ref->keyframe, base);
+
+    reading[0] = (local_id & RELAY_CODEC_LOCAL_ID_MAX) | (uint8_t)(gen << RELAY_CODEC_GEN_POS);
+    if (p_reading->button)
+    {
+        reading[0] |= RELAY_CODEC_BUTTON;
+    }
+    reading[1] = keyframe ? RELAY_CODEC_FLAG_KEYFRAME : 0;
+
+    for (i = 0; i < RELAY_CODEC_SENSOR_COUNT; i++)
+    {
+        int32_t field = keyframe ? value[i] : value[i] - base[i];
+
+        if (keyframe || field != 0)
+        {
+            reading[1] |= m_sensor_flag[i];
+            len += relay_codec_varint_put(&reading[len], relay_codec_zigzag(field));
+        }
+    }
+
+    if (len > max_len)
+    {
+        return 0;
+    }
+    memcpy(p_buf, reading, len);
+
+    if (keyframe)
+    {
+        p_ref->keyframe = *p_reading;
+        p_ref->gen      = gen;
+        p_ref->valid    = true;
+    }
+    return len;
+}
+
+uint8_t relay_codec_entry_decode(uint8_t const *p_buf, uint8_t len, relay_codec_entry_t *p_entry)
+{
+    uint8_t  pos = 2;
+    uint8_t  used;
+    uint32_t field;
+    uint8_t  i;
+
+    if (len < 2)
+    {
+        return 0;
+    }
+    p_entry->local_id = p_buf[0] & RELAY_CODEC_LOCAL_ID_MAX;
+    p_entry->button   = (p_buf[0] & RELAY_CODEC_BUTTON) ? 1 : 0;
+    p_entry->gen      = p_buf[0] >> RELAY_CODEC_GEN_POS;
+    p_entry->flags    = p_buf[1];
+
+    for (i = 0; i < RELAY_CODEC_SENSOR_COUNT; i++)
+    {
+        p_entry->value[i] = 0;
+        if (p_entry->flags & m_sensor_flag[i])
+        {
+            used = relay_codec_varint_get(&p_buf[pos], len - pos, &field);
+            if (used == 0)
+            {
+                return 0;
+            }
+            p_entry->value[i] = relay_codec_unzigzag(field);
+            pos += used;
+        }
+    }
+    return pos;
+}
+
+bool relay_codec_entry_apply(relay_codec_entry_t const *p_entry, relay_codec_ref_t *p_ref, relay_codec_reading_t *p_reading)
+{
+    int32_t value[RELAY_CODEC_SENSOR_COUNT];
+    uint8_t i;
+
+    if (p_entry->flags & RELAY_CODEC_FLAG_KEYFRAME)
+    {
+        memset(&p_ref->keyframe, 0, sizeof(p_ref->keyframe));
+        p_ref->gen   = p_entry->gen;
+        p_ref->valid = true;
+    }
+    else if (!p_ref->valid || p_ref->gen != p_entry->gen)
+    {
+        return false;
+    }
+
+    relay_codec_values_get(&p_ref->keyframe, value);
+    for (i = 0; i < RELAY_CODEC_SENSOR_COUNT; i++)
+    {
+        value[i] += p_entry->value[i];
+    }
+    p_reading->temperature = (int16_t)value[0];
+    p_reading->pressure    = value[1];
+    p_reading->humidity    = (int16_t)value[2];
+    p_reading->button      = p_entry->button;
+
+    if (p_entry->flags & RELAY_CODEC_FLAG_KEYFRAME)
+    {
+        p_ref->keyframe = *p_reading;
+    }
+    return true;
+}
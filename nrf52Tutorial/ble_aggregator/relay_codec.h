@@ -0,0 +1,69 @@
+#ifndef __RELAY_CODEC_H
+#define __RELAY_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Compact relay record for Thingy readings, link state AGG_NODE_LINK_DATA_COMPACT:
+//   byte 0..3:     source cluster, destination cluster, packet id, hop counts (as every relay record)
+//   byte 4:        AGG_NODE_LINK_DATA_COMPACT
+//   byte 5..:      readings until the end of the record
+// Reading:
+//   byte 0:        bits 0-4 local id, bit 5 button, bits 6-7 keyframe generation
+//   byte 1:        RELAY_CODEC_FLAG_*
+//   byte 2..:      one zigzag varint per flagged sensor, temperature, pressure, humidity in that order
+// A keyframe carries the values themselves and starts a new generation. Other readings carry the
+// change since the keyframe of their generation, sensors that did not change are left out. Deltas
+// against the keyframe instead of the previous reading survive lost records: a receiver that missed
+// a keyframe sees the generation change and drops readings until the next keyframe.
+#define RELAY_CODEC_HEADER_LENGTH       5
+#define RELAY_CODEC_READING_MAX         (2 + 3 * 5)     // 32 bit varints take up to 5 bytes
+
+#define RELAY_CODEC_LOCAL_ID_MAX        31
+#define RELAY_CODEC_BUTTON              0x20
+#define RELAY_CODEC_GEN_POS             6
+
+#define RELAY_CODEC_FLAG_KEYFRAME       0x01
+#define RELAY_CODEC_FLAG_TEMPERATURE    0x02
+#define RELAY_CODEC_FLAG_PRESSURE       0x04
+#define RELAY_CODEC_FLAG_HUMIDITY       0x08
+
+typedef struct
+{
+    int32_t pressure;       // hundredths of hPa
+    int16_t temperature;    // hundredths of C
+    int16_t humidity;       // %
+    uint8_t button;
+}relay_codec_reading_t;
+
+// Keyframe a Thingy's readings refer to, kept per Thingy by the sender and by the sink
+typedef struct
+{
+    relay_codec_reading_t keyframe;
+    uint8_t               gen;
+    bool                  valid;
+}relay_codec_ref_t;
+
+// One reading as it is on the air
+typedef struct
+{
+    uint8_t local_id;
+    uint8_t button;
+    uint8_t gen;
+    uint8_t flags;
+    int32_t value[3];       // temperature, pressure, humidity, values or deltas
+}relay_codec_entry_t;
+
+// Appends a reading to a record. A keyframe is sent if keyframe is set or p_ref is not valid yet,
+// p_ref then refers to it. Returns the bytes written, 0 (p_ref untouched) if max_len is too short.
+uint8_t relay_codec_reading_encode(uint8_t *p_buf, uint8_t max_len, uint8_t local_id,
+                                   relay_codec_reading_t const *p_reading, relay_codec_ref_t *p_ref, bool keyframe);
+
+// Reads the reading at p_buf. Returns the bytes used, 0 if the reading is cut short.
+uint8_t relay_codec_entry_decode(uint8_t const *p_buf, uint8_t len, relay_codec_entry_t *p_entry);
+
+// Turns an entry into the reading it stands for, a keyframe becomes the new p_ref.
+// False if it is a delta on a keyframe p_ref does not have.
+bool relay_codec_entry_apply(relay_codec_entry_t const *p_entry, relay_codec_ref_t *p_ref, relay_codec_reading_t *p_reading);
+
+#endif
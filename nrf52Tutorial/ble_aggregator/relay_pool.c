@@ -0,0 +1,371 @@
+#include "relay_pool.h"
+#include "agg_stats.h"
+#include "agg_trace.h"
+#include <string.h>
+
+//relay block pool: garr_userdata is cut in MAX_USERDATA_BUFFER_BLOCK blocks which only hold
+//broadcast data, the bookkeeping of each block is kept apart in g_relay_pool
+#define MAX_USERDATA_BUFFER MAX_USERDATA_BUFFER_BLOCK*MAX_USERDATA_BUFFER_BLOCKSIZE
+#define RELAY_BLOCK_DATA(pos) (&garr_userdata[(pos)*MAX_USERDATA_BUFFER_BLOCKSIZE])
+static uint8_t garr_userdata[MAX_USERDATA_BUFFER];
+
+relay_pool_t g_relay_pool;
+
+typedef struct struct_adv_history_buff_type
+{
+  uint32_t id;
+  uint32_t expire_time; //g_hist_time_sec at which the entry is dropped, 0: slot never used
+
+}adv_history_buff_t;
+
+static adv_history_buff_t g_buff_adv_hist[MAX_HIST_ADV_BUFF_SIZE];
+uint32_t g_hist_time_sec=1;
+
+static uint32_t relay_pool_ids(uint8_t const *p_data)
+{
+  return ((uint32_t)p_data[0]<<16)+((uint32_t)p_data[1]<<8)+(uint32_t)p_data[2];
+}
+
+/*---------------------
+@Brief: put all blocks in the free list, empty the relay queue and the history
+*/
+void relay_pool_init(void)
+{
+  uint8_t i;
+
+  memset(garr_userdata,0,sizeof(garr_userdata));
+  for(i=0;i<MAX_USERDATA_BUFFER_BLOCK;i++)
+  {
+    g_relay_pool.block[i].next=i+1;
+    g_relay_pool.block[i].adv_count=0;
+    g_relay_pool.block[i].size=0;
+  }
+  g_relay_pool.block[MAX_USERDATA_BUFFER_BLOCK-1].next=RELAY_BLOCK_NULL;
+  g_relay_pool.free_head=0;
+  g_relay_pool.head=g_relay_pool.tail=RELAY_BLOCK_NULL;
+  g_relay_pool.used=0;
+
+  memset(g_buff_adv_hist,0,sizeof(g_buff_adv_hist));
+  g_hist_time_sec=1;
+}
+
+/*---------------------
+@Brief: take a block from the free list
+@return: block position, RELAY_BLOCK_NULL if no free block
+*/
+static uint8_t relay_block_alloc(void)
+{
+  uint8_t pos=g_relay_pool.free_head;
+
+  if(pos==RELAY_BLOCK_NULL) return RELAY_BLOCK_NULL;
+  g_relay_pool.free_head=g_relay_pool.block[pos].next;
+  g_relay_pool.block[pos].next=RELAY_BLOCK_NULL;
+  g_relay_pool.alloc_count++;
+  return pos;
+}
+
+/*---------------------
+@Brief: give a block back to the free list
+*/
+static void relay_block_free(uint8_t pos)
+{
+  g_relay_pool.block[pos].size=0;
+  g_relay_pool.block[pos].next=g_relay_pool.free_head;
+  g_relay_pool.free_head=pos;
+}
+
+/*---------------------
+@Brief: remove the current block (g_relay_pool.head) from advertising buffer chain
+input: @ref cond:
+                    true: remove block ids (0x00AABBCC, AA:<source id>, BB<dest id>, CC<packet id)) will be added to hist buff
+                    false: not added
+update:
+  g_relay_pool.head: point to next block in buffer
+  g_relay_pool.used: number of used block in buffer
+*/
+static void relay_pool_delete_head(bool cond)
+{
+  uint8_t pos;
+  uint32_t ids;
+  uint8_t trace[4];
+
+  if(g_relay_pool.used==0)
+  {//no available block in buffer
+    return;
+  }
+
+  //save current id
+  pos=g_relay_pool.head;
+  ids=relay_pool_ids(RELAY_BLOCK_DATA(pos));
+
+  g_relay_pool.head=g_relay_pool.block[pos].next;
+  if(--g_relay_pool.used==0)
+  {
+    g_relay_pool.tail=RELAY_BLOCK_NULL;
+  }
+  relay_block_free(pos);
+  trace[0]=pos;
+  trace[1]=g_relay_pool.head;
+  trace[2]=g_relay_pool.used;
+  trace[3]=cond;
+  AGG_TRACE(AGG_TRACE_EVT_RELAY_DELETE, trace, 4);
+
+  if(cond==true)
+  {// add ids to history buffer
+      relay_hist_add(ids);
+  }
+}
+
+/*---------------------
+@Brief: move the current block to the end of the relay queue, so blocks are advertised in turn
+*/
+static void relay_pool_rotate(void)
+{
+  uint8_t pos=g_relay_pool.head;
+
+  if(g_relay_pool.used<2) return;
+  g_relay_pool.head=g_relay_pool.block[pos].next;
+  g_relay_pool.block[pos].next=RELAY_BLOCK_NULL;
+  g_relay_pool.block[g_relay_pool.tail].next=pos;
+  g_relay_pool.tail=pos;
+}
+
+/*--------------------------------
+@brief: add broadcast data to buffer for advertising
+  data is copied into a free block of garr_userdata which is put at the end of the relay queue
+*/
+uint8_t relay_pool_add(uint8_t const *p_data, uint16_t size, uint8_t adv_count)
+{
+  uint8_t pos;
+  uint8_t trace[2];
+
+  if((size==0)||(size>MAX_USERDATA_BUFFER_BLOCKSIZE))
+  {
+    g_relay_pool.fail_count++;
+    AGG_STATS_COUNT(AGG_STATS_CNT_RELAY_INVALID);
+    return RELAY_POOL_ADD_INVALID;
+  }
+
+  pos=relay_block_alloc();
+  if(pos==RELAY_BLOCK_NULL)
+  {//buffer overflow
+    g_relay_pool.fail_count++;
+    AGG_STATS_COUNT(AGG_STATS_CNT_RELAY_FULL);
+    return RELAY_POOL_ADD_FULL;
+  }
+
+  g_relay_pool.block[pos].adv_count=adv_count;  //advertising times before removing this block
+  g_relay_pool.block[pos].size=size;
+  memcpy(RELAY_BLOCK_DATA(pos),p_data,size);
+
+  if(g_relay_pool.used==0)
+  {
+    g_relay_pool.head=pos;
+  }
+  else
+  {
+    g_relay_pool.block[g_relay_pool.tail].next=pos; //update previous "next block pointer"
+  }
+  g_relay_pool.tail=pos; //update last position
+  g_relay_pool.used++;
+  AGG_STATS_COUNT(AGG_STATS_CNT_RELAY_ADDED);
+  AGG_STATS_HIST(AGG_STATS_HIST_RELAY_POOL, g_relay_pool.used);
+
+  trace[0]=pos;
+  trace[1]=g_relay_pool.used;
+  AGG_TRACE2(AGG_TRACE_EVT_RELAY_ADD, trace, 2, RELAY_BLOCK_DATA(pos), size);
+  return RELAY_POOL_ADD_OK;
+}
+
+/*---------------------
+@Brief: paste the queued blocks to the user data field of an advertising packet
+  one manufacturer specific AD record per block, from g_relay_pool.head on
+*/
+uint8_t relay_pool_pack(uint8_t *p_adv, uint8_t advlen, uint8_t max_len, relay_pool_filter_t p_filter)
+{
+  uint8_t *p_record;
+  uint8_t relay_size;
+  uint8_t pos,count;
+
+  count=g_relay_pool.used;
+  while(count-->0) //each block at most once per advertising packet
+  {
+        pos=g_relay_pool.head;   //get position of data block to be transfered
+        if(g_relay_pool.block[pos].size==0)
+        {//size of broadcast data =0 (invalid block) ->delete block, not add to history buffer
+          relay_pool_delete_head(false);
+          continue;
+        }
+
+        if((p_filter!=NULL)&&!p_filter(RELAY_BLOCK_DATA(pos)))
+        {//not for this packet, advertising times kept
+          relay_pool_rotate();
+          continue;
+        }
+
+        relay_size=g_relay_pool.block[pos].size+1; //AD length: type byte + broadcast data
+        if(advlen+relay_size+1>max_len) break; //no room left in this packet
+
+        p_record=&p_adv[advlen];
+        p_record[0]=relay_size;
+        p_record[1]=0xff; //type: MANUFACTURER
+        memcpy(&p_record[2],RELAY_BLOCK_DATA(pos),relay_size-1);
+        p_record[5]++; //increase hop counts
+        advlen+=relay_size+1;
+
+        if(--g_relay_pool.block[pos].adv_count==0)
+        { // advertised often enough, then move this block to history buffer
+            relay_pool_delete_head(true);
+        }
+        else
+        {
+          relay_pool_rotate(); //next block in buffer, back to the oldest after the last one
+        }
+  }
+  return advlen;
+}
+
+uint8_t const * relay_pool_head_get(void)
+{
+  return (g_relay_pool.used==0) ? NULL : RELAY_BLOCK_DATA(g_relay_pool.head);
+}
+
+/*-----------------------------------------------
+@brief: validate incomming data, check whether this message was recevice before.
+@input: *p_data:  source addr (byte 0), destination addr(byte 1), packet id(byte2)
+@operation:
+  compare ids with:
+    - history buffer which contains ids of old messages
+        which was either removed from advertising buffer(g_relay_pool) or processed.
+    - if no matched item in history buffer, compare with current advertising buffer(g_relay_pool)
+*/
+uint16_t relay_pool_validate(uint8_t const *p_data)
+{
+  uint16_t i;
+  uint32_t ids;
+  uint8_t pos=g_relay_pool.head;
+
+  ids=relay_pool_ids(p_data);
+
+  //check history buffer
+  if ((i=relay_hist_find(ids))!=RELAY_POOL_NEW)
+  {
+    i+=RELAY_POOL_HIST_BASE; //already in history buffer
+    AGG_STATS_COUNT(AGG_STATS_CNT_VALIDATE_HIST_HIT);
+  }
+  else
+  {
+    //check current buffer
+    while(pos!=RELAY_BLOCK_NULL)
+    {
+        if(relay_pool_ids(RELAY_BLOCK_DATA(pos))==ids)
+        {
+          i=pos;
+          break;
+        }
+        pos=g_relay_pool.block[pos].next;
+    }
+    AGG_STATS_COUNT((i==RELAY_POOL_NEW) ? AGG_STATS_CNT_VALIDATE_NEW : AGG_STATS_CNT_VALIDATE_POOL_HIT);
+  }
+
+  AGG_TRACE2(AGG_TRACE_EVT_VALIDATE, p_data, 3, (uint8_t *)&i, 2);
+  return i;
+}
+
+bool relay_pool_suppress(uint16_t validate_result)
+{
+  if((validate_result<MAX_USERDATA_BUFFER_BLOCK)&&(g_relay_pool.block[validate_result].adv_count>1))
+  {
+    g_relay_pool.block[validate_result].adv_count--;
+    return true;
+  }
+  return false;
+}
+
+static uint16_t relay_hist_hash(uint32_t id)
+{
+  //Knuth multiplicative hash, the high bits are the best mixed
+  return (uint16_t)(((id*2654435761UL)>>16)&(MAX_HIST_ADV_BUFF_SIZE-1));
+}
+
+static bool relay_hist_is_live(uint16_t pos)
+{
+  return (int32_t)(g_buff_adv_hist[pos].expire_time-g_hist_time_sec)>0;
+}
+
+/*----------
+@brief: add an id value to buffer of adverting history
+  the id takes an expired slot in its probe window, or the one closest to expiry
+----------------------*/
+uint16_t relay_hist_add(uint32_t ids)
+{
+  uint16_t i,pos,victim;
+  uint8_t trace[4];
+
+    //check current id has already been in history buffer?
+    if(relay_hist_find(ids)!=RELAY_POOL_NEW) return RELAY_POOL_NEW; //yes -> quit
+
+    pos=victim=relay_hist_hash(ids);
+    for(i=0;i<HIST_ADV_PROBE_LENGTH;i++)
+    {
+      if(relay_hist_is_live(pos)==false)
+      {
+        victim=pos;
+        break;
+      }
+      if((int32_t)(g_buff_adv_hist[pos].expire_time-g_buff_adv_hist[victim].expire_time)<0)
+        victim=pos;
+      pos=(pos+1)&(MAX_HIST_ADV_BUFF_SIZE-1);
+    }
+
+    g_buff_adv_hist[victim].id=ids;
+    g_buff_adv_hist[victim].expire_time=g_hist_time_sec+HIST_ADV_TTL_SEC;
+
+    trace[0]=(uint8_t)(ids>>16);
+    trace[1]=(uint8_t)(ids>>8);
+    trace[2]=(uint8_t)ids;
+    trace[3]=(uint8_t)victim;
+    AGG_TRACE(AGG_TRACE_EVT_HIST_ADD, trace, 4);
+  return victim;
+}
+
+/*----------
+@brief: delete an element in buffer of advertising history
+*/
+void relay_hist_delete(uint16_t pos)
+{
+    if(pos>=MAX_HIST_ADV_BUFF_SIZE) return;
+    g_buff_adv_hist[pos].expire_time=g_hist_time_sec; //expires now
+}
+
+/*----------
+@brief: search for position of id value in buffer advertising history
+*/
+uint16_t relay_hist_find(uint32_t id)
+{
+  uint16_t i,pos;
+
+    pos=relay_hist_hash(id);
+    for(i=0;i<HIST_ADV_PROBE_LENGTH;i++)
+    {
+      if(g_buff_adv_hist[pos].id==id && relay_hist_is_live(pos))
+      {
+        return pos;
+      }
+      if(g_buff_adv_hist[pos].expire_time==0) break; //never used, id cannot be further on
+      pos=(pos+1)&(MAX_HIST_ADV_BUFF_SIZE-1);
+    }
+
+  return RELAY_POOL_NEW;
+}
+
+uint16_t relay_hist_live_count(void)
+{
+  uint16_t i,count=0;
+
+  for(i=0;i<MAX_HIST_ADV_BUFF_SIZE;i++)
+  {
+    if(relay_hist_is_live(i)) count++;
+  }
+  return count;
+}
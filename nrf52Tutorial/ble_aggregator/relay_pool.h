@@ -0,0 +1,106 @@
+#ifndef __RELAY_POOL_H
+#define __RELAY_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Relay pool and relay history of a cluster head, with no SoftDevice, app_timer or UART in it,
+// so the relay logic can be built and driven on a host as well. The caller owns the radio side:
+// it puts what relay_pool_pack() wrote on the air, ticks g_hist_time_sec once per second and
+// chooses how often each block is advertised.
+//
+// Relay record (broadcast data), as held in a block:
+//   byte 0:        source cluster
+//   byte 1:        destination cluster
+//   byte 2:        packet id
+//   byte 3:        hop counts
+//   byte 4..:      user data
+// The first 3 bytes form the id 0x00AABBCC (AA source, BB destination, CC packet id) that
+// duplicates are recognized by, in the relay queue and in the history of records relayed.
+#ifndef MAX_USERDATA_BUFFER_BLOCK
+#define MAX_USERDATA_BUFFER_BLOCK 16
+#endif
+#define MAX_USERDATA_BUFFER_BLOCKSIZE 32
+
+#define RELAY_BLOCK_NULL 0xFF
+#if (MAX_USERDATA_BUFFER_BLOCK >= RELAY_BLOCK_NULL)
+#error "MAX_USERDATA_BUFFER_BLOCK does not fit the 8 bit block index"
+#endif
+
+// Open addressing hash set of relayed ids, an id lives in one of HIST_ADV_PROBE_LENGTH slots
+// after its hash, so find/add never scan the whole table
+#define MAX_HIST_ADV_BUFF_SIZE 128   // must be a power of 2
+#define HIST_ADV_PROBE_LENGTH 8
+#define HIST_ADV_TTL_SEC 10          // timeout 10 sec
+
+// relay_pool_validate() results besides the block of a record still queued
+#define RELAY_POOL_NEW          0xFFFF
+#define RELAY_POOL_HIST_BASE    8000    // + history slot
+
+// relay_pool_add() results
+#define RELAY_POOL_ADD_OK       0
+#define RELAY_POOL_ADD_INVALID  1       // size 0 or above MAX_USERDATA_BUFFER_BLOCKSIZE
+#define RELAY_POOL_ADD_FULL     2
+
+typedef struct struct_relay_block_type
+{
+  uint8_t next;       //next block in the free list or in the relay queue, RELAY_BLOCK_NULL is NULL
+  uint8_t adv_count;  //number of advertising times left before removing
+  uint8_t size;       //size of broadcast data
+
+}relay_block_t;
+
+typedef struct struct_relay_pool_type
+{
+  relay_block_t block[MAX_USERDATA_BUFFER_BLOCK];
+  uint8_t free_head;    //first free block
+  uint8_t head;         //block to be advertised next, oldest block of the relay queue
+  uint8_t tail;         //newest block of the relay queue
+  uint8_t used;         //number of used block in buffer
+  uint32_t alloc_count; //blocks handed out since start
+  uint32_t fail_count;  //packets dropped, buffer full or too long
+
+}relay_pool_t;
+
+// Picks the relay records relay_pool_pack() puts in a packet
+typedef bool (*relay_pool_filter_t)(uint8_t const *p_data);
+
+// Read only outside relay_pool.c
+extern relay_pool_t g_relay_pool;
+
+// Seconds since start, history entries expire by it. Ticked by the caller, starts at 1
+extern uint32_t g_hist_time_sec;
+
+// Empties the relay queue and the history, restarts g_hist_time_sec
+void relay_pool_init(void);
+
+// Queues a copy of a relay record at the end of the relay queue, advertised adv_count times
+uint8_t relay_pool_add(uint8_t const *p_data, uint16_t size, uint8_t adv_count);
+
+// Appends one manufacturer specific AD record per queued block, hop counts increased, to the
+// advertising data of advlen bytes, as many as fit in max_len. Each block goes in at most once;
+// the blocks written are moved to the end of the queue, or to the history when their advertising
+// times are used up. Blocks p_filter (NULL: all) turns down go to the end of the queue as they are.
+// Returns the new advertising data length.
+uint8_t relay_pool_pack(uint8_t *p_adv, uint8_t advlen, uint8_t max_len, relay_pool_filter_t p_filter);
+
+// Relay record of the block to be advertised next, NULL if the queue is empty
+uint8_t const * relay_pool_head_get(void);
+
+// Looks up the id of a relay record in the history, then in the relay queue.
+// Returns RELAY_POOL_HIST_BASE + slot, the block, or RELAY_POOL_NEW.
+uint16_t relay_pool_validate(uint8_t const *p_data);
+
+// A neighbour relays a queued block too: it is advertised once less, but at least once more.
+// Returns true if its advertising times were cut.
+bool relay_pool_suppress(uint16_t validate_result);
+
+// Return the slot of the id, RELAY_POOL_NEW (0xFFFF) if it is already in the history (add) or not (find)
+uint16_t relay_hist_add(uint32_t ids);
+uint16_t relay_hist_find(uint32_t id);
+void relay_hist_delete(uint16_t pos);
+
+// Ids in the history that have not expired, walks the whole table
+uint16_t relay_hist_live_count(void);
+
+#endif
@@ -0,0 +1,292 @@
+#include "relay_sched.h"
+#include "relay_pool.h"
+#include "agg_stats.h"
+#include "agg_trace.h"
+#include <string.h>
+
+const relay_level_t g_relay_levels[RELAY_LEVEL_COUNT]=
+{
+  {1000, RELAY_ADV_INTERVAL_IDLE},    //idle
+  {200,  RELAY_ADV_INTERVAL_ACTIVE},  //the old fixed settings
+  {100,  RELAY_ADV_INTERVAL_ACTIVE},  //burst
+};
+
+relay_sched_t g_relay_sched={RELAY_LEVEL_NORMAL, 0, RELAY_DUP_SPARSE, 0, 0};
+
+static relay_sched_init_t m_init;
+
+enum {RELAY_PHY_IDX_1M, RELAY_PHY_IDX_CODED, RELAY_PHY_IDX_COUNT};
+
+typedef struct
+{
+  uint8_t  cluster_id;
+  int8_t   rssi[RELAY_PHY_IDX_COUNT];         //running average of the reports on 1M and Coded PHY
+  uint32_t heard_sec[RELAY_PHY_IDX_COUNT];    //g_hist_time_sec of the last of them, 0: never
+}relay_phy_nbr_t;
+
+static relay_phy_nbr_t m_relay_phy_nbr[RELAY_PHY_NBR_COUNT];
+static uint8_t         m_relay_tx_phy=RELAY_PHY_1M;  //PHY of the relay packet being built
+static uint8_t         m_relay_phy_hold;             //relay packets the oldest block has waited for its PHY,
+                                                     //or ticks the queue has been empty
+
+void relay_sched_init(relay_sched_init_t const *p_init)
+{
+  m_init=*p_init;
+  g_relay_sched.level=RELAY_LEVEL_NORMAL;
+  g_relay_sched.calm_ticks=0;
+  g_relay_sched.dup_share=RELAY_DUP_SPARSE;
+  g_relay_sched.level_changes=0;
+  g_relay_sched.suppressed=0;
+  memset(m_relay_phy_nbr,0,sizeof(m_relay_phy_nbr));
+  m_relay_tx_phy=RELAY_PHY_1M;
+  m_relay_phy_hold=0;
+}
+
+/*---------------------
+@Brief: move to another relay level, the caller makes the relay tick and the advertising interval follow it
+*/
+static void relay_sched_level_set(uint8_t level)
+{
+  if(level==g_relay_sched.level) return;
+  g_relay_sched.level=level;
+  g_relay_sched.calm_ticks=0;
+  g_relay_sched.level_changes++;
+  if(m_init.level_handler!=NULL) m_init.level_handler(level);
+}
+
+/*---------------------
+@Brief: once per relay tick, follow the queue depth. Up at once, down after RELAY_CALM_TICKS,
+  and to idle, which changes the advertising interval, after RELAY_IDLE_CALM_TICKS
+*/
+static void relay_sched_update(void)
+{
+  uint8_t target;
+
+  if(g_relay_pool.used==0) target=RELAY_LEVEL_IDLE;
+  else if(g_relay_pool.used<RELAY_BURST_DEPTH) target=RELAY_LEVEL_NORMAL;
+  else target=RELAY_LEVEL_BURST;
+
+  if(target>g_relay_sched.level)
+  {
+    relay_sched_level_set(target);
+  }
+  else if(target<g_relay_sched.level)
+  {
+    if(++g_relay_sched.calm_ticks>=((g_relay_sched.level==RELAY_LEVEL_NORMAL) ? RELAY_IDLE_CALM_TICKS : RELAY_CALM_TICKS))
+      relay_sched_level_set(g_relay_sched.level-1);
+  }
+  else
+  {
+    g_relay_sched.calm_ticks=0;
+  }
+}
+
+/*---------------------
+@Brief: advertising times of a new block. Own data (hop counts 0) and blocks which came far have
+  no other copy close by and get one more, so do all blocks where few duplicates are heard;
+  where most records heard are duplicates the neighbours relay them anyway and one less is enough
+*/
+static uint8_t relay_sched_adv_count(uint8_t const *p_data)
+{
+  uint8_t hops=p_data[3];
+  uint8_t count=RELAY_ADV_COUNT_BASE;
+
+  if((hops==0)||(hops>=RELAY_FAR_HOPS)) count++;
+  if(g_relay_sched.dup_share>RELAY_DUP_DENSE) count--;
+  else if(g_relay_sched.dup_share<RELAY_DUP_SPARSE) count++;
+
+  if(count<1) count=1;
+  if(count>RELAY_ADV_COUNT_MAX) count=RELAY_ADV_COUNT_MAX;
+  return count;
+}
+
+/*---------------------
+@Brief: a block was queued, an idle relay goes to work without waiting for its slow tick
+*/
+uint8_t relay_sched_add(uint8_t const *p_data, uint8_t size)
+{
+  uint8_t err;
+
+  if(size<4) return RELAY_POOL_ADD_INVALID; //shorter than source, destination, packet id, hop counts
+  err=relay_pool_add(p_data, size, relay_sched_adv_count(p_data));
+  if((err==RELAY_POOL_ADD_OK)&&(g_relay_sched.level==RELAY_LEVEL_IDLE))
+    relay_sched_level_set(RELAY_LEVEL_NORMAL);
+  return err;
+}
+
+/*---------------------
+@Brief: account a relay record heard from another cluster head
+  a queued block heard from a neighbour has reached it already (Trickle style suppression), it is
+  advertised once less, but at least once more
+*/
+uint16_t relay_sched_heard(uint8_t const *p_data)
+{
+  uint16_t found=relay_pool_validate(p_data);
+  uint16_t sample=(found==RELAY_POOL_NEW) ? 0 : 256;
+
+  g_relay_sched.dup_share=(uint16_t)((g_relay_sched.dup_share*15+sample)/16);
+
+  if(relay_pool_suppress(found))
+    g_relay_sched.suppressed++;
+  return found;
+}
+
+uint8_t relay_sched_rx(uint8_t const *p_data, uint8_t size)
+{
+  uint32_t ids;
+  uint8_t err;
+
+  if(p_data[0]==m_init.own_id)
+  {//message return to source, do nothing
+    AGG_TRACE(AGG_TRACE_EVT_RELAY_REFLECT, p_data, 3);
+    return RELAY_RX_REFLECTED;
+  }
+
+  if(p_data[1]==m_init.own_id)
+  {//match destination -> process data once, the history keeps its id
+    AGG_TRACE(AGG_TRACE_EVT_RELAY_PROCESS, p_data, 3);
+    AGG_STATS_COUNT(AGG_STATS_CNT_RELAY_PROCESSED);
+    if(relay_pool_validate(p_data)!=RELAY_POOL_NEW) return RELAY_RX_DUPLICATE;
+
+    ids=((uint32_t)p_data[0]<<16)+((uint32_t)p_data[1]<<8)+(uint32_t)p_data[2];
+    if(m_init.process_handler!=NULL) m_init.process_handler(p_data, size);
+    relay_hist_add(ids);
+    return RELAY_RX_PROCESSED;
+  }
+
+  //not destination -> message to be relayed, unless it is in the buffer or the history already
+  if(relay_sched_heard(p_data)!=RELAY_POOL_NEW)
+  {
+    AGG_TRACE(AGG_TRACE_EVT_RELAY_REDUNDANT, p_data, 3);
+    return RELAY_RX_DUPLICATE;
+  }
+  err=relay_sched_add(p_data, size);
+  return (err==RELAY_POOL_ADD_OK) ? RELAY_RX_QUEUED : RELAY_RX_FULL;
+}
+
+static bool relay_phy_nbr_recent(relay_phy_nbr_t const *p_nbr, uint8_t idx)
+{
+  return (p_nbr->heard_sec[idx]!=0)&&((int32_t)(g_hist_time_sec-p_nbr->heard_sec[idx])<RELAY_PHY_NBR_TTL_SEC);
+}
+
+static uint32_t relay_phy_nbr_last_heard(relay_phy_nbr_t const *p_nbr)
+{
+  return ((int32_t)(p_nbr->heard_sec[RELAY_PHY_IDX_CODED]-p_nbr->heard_sec[RELAY_PHY_IDX_1M])>0) ?
+         p_nbr->heard_sec[RELAY_PHY_IDX_CODED] : p_nbr->heard_sec[RELAY_PHY_IDX_1M];
+}
+
+static relay_phy_nbr_t *relay_phy_nbr_find(uint8_t cluster_id)
+{
+  uint8_t i;
+
+  for(i=0;i<RELAY_PHY_NBR_COUNT;i++)
+  {
+    if((relay_phy_nbr_last_heard(&m_relay_phy_nbr[i])!=0)&&(m_relay_phy_nbr[i].cluster_id==cluster_id))
+      return &m_relay_phy_nbr[i];
+  }
+  return NULL;
+}
+
+/*---------------------
+@Brief: store a report of a cluster head, over its entry or the one heard longest ago
+*/
+void relay_sched_nbr_heard(uint8_t cluster_id, uint8_t phy, int8_t rssi)
+{
+  relay_phy_nbr_t *p_nbr=relay_phy_nbr_find(cluster_id);
+  uint8_t idx=(phy==RELAY_PHY_CODED) ? RELAY_PHY_IDX_CODED : RELAY_PHY_IDX_1M;
+  uint8_t i;
+
+  if(p_nbr==NULL)
+  {
+    p_nbr=&m_relay_phy_nbr[0];
+    for(i=1;i<RELAY_PHY_NBR_COUNT;i++)
+    {
+      if((int32_t)(relay_phy_nbr_last_heard(&m_relay_phy_nbr[i])-relay_phy_nbr_last_heard(p_nbr))<0)
+        p_nbr=&m_relay_phy_nbr[i];
+    }
+    memset(p_nbr,0,sizeof(*p_nbr));
+    p_nbr->cluster_id=cluster_id;
+  }
+
+  if(relay_phy_nbr_recent(p_nbr, idx))
+    p_nbr->rssi[idx]=(int8_t)((3*p_nbr->rssi[idx]+rssi)/4);
+  else
+    p_nbr->rssi[idx]=rssi;
+  p_nbr->heard_sec[idx]=g_hist_time_sec;
+}
+
+/*---------------------
+@Brief: PHY of the relay records for a destination cluster. 1M while the destination is heard well
+  on it. Coded PHY if it is heard on Coded PHY but weakly on 1M, or not heard at all: it is then some
+  hops away, and the longer range of Coded PHY saves some of them. One only heard weakly on 1M may
+  not scan on Coded PHY and stays on 1M.
+*/
+static uint8_t relay_phy_select(uint8_t cluster_id)
+{
+  relay_phy_nbr_t const *p_nbr=relay_phy_nbr_find(cluster_id);
+  bool heard_1m;
+
+  if(p_nbr==NULL) return RELAY_PHY_CODED;
+  heard_1m=relay_phy_nbr_recent(p_nbr, RELAY_PHY_IDX_1M);
+  if(heard_1m&&(p_nbr->rssi[RELAY_PHY_IDX_1M]>RELAY_PHY_1M_RSSI_LIMIT)) return RELAY_PHY_1M;
+  if(relay_phy_nbr_recent(p_nbr, RELAY_PHY_IDX_CODED)) return RELAY_PHY_CODED;
+  return heard_1m ? RELAY_PHY_1M : RELAY_PHY_CODED;
+}
+
+//relay_pool_filter_t of relay_pool_pack(), the records for m_relay_tx_phy
+static bool relay_phy_accept(uint8_t const *p_data)
+{
+  return relay_phy_select(p_data[1])==m_relay_tx_phy;
+}
+
+/*---------------------
+@Brief: one PHY per packet. a PHY change restarts the advertising set, so the PHY on air is kept while
+  it has blocks queued, for at most RELAY_PHY_HOLD_TICKS packets once the oldest block is for the other
+  one, and while the queue has been empty for less than RELAY_PHY_HOLD_TICKS ticks
+*/
+static uint8_t relay_sched_pack_phy(uint8_t *p_adv, uint8_t advlen, uint8_t max_len)
+{
+  uint8_t const *p_head=relay_pool_head_get();
+  uint8_t len;
+
+  if(p_head==NULL)
+  {
+    if((m_relay_tx_phy==RELAY_PHY_1M)||(++m_relay_phy_hold>RELAY_PHY_HOLD_TICKS))
+    {
+      m_relay_tx_phy=RELAY_PHY_1M;
+      m_relay_phy_hold=0;
+    }
+  }
+  else if(relay_phy_select(p_head[1])==m_relay_tx_phy)
+  {
+    m_relay_phy_hold=0;
+  }
+  else if(++m_relay_phy_hold>RELAY_PHY_HOLD_TICKS)
+  {
+    m_relay_tx_phy=relay_phy_select(p_head[1]);
+    m_relay_phy_hold=0;
+  }
+  len=relay_pool_pack(p_adv, advlen, max_len, relay_phy_accept);
+  if((len==advlen)&&((p_head=relay_pool_head_get())!=NULL))
+  {//no block left for the PHY on air, change to the one of the oldest block
+    m_relay_tx_phy=relay_phy_select(p_head[1]);
+    m_relay_phy_hold=0;
+    len=relay_pool_pack(p_adv, advlen, max_len, relay_phy_accept);
+  }
+  return len;
+}
+
+uint8_t relay_sched_tick(uint8_t *p_adv, uint8_t advlen, uint8_t max_len)
+{
+  if(m_init.multi_phy)
+    advlen=relay_sched_pack_phy(p_adv, advlen, max_len);
+  else
+    advlen=relay_pool_pack(p_adv, advlen, max_len, NULL);
+  relay_sched_update();
+  return advlen;
+}
+
+uint8_t relay_sched_tx_phy(void)
+{
+  return m_relay_tx_phy;
+}
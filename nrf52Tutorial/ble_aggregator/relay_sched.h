@@ -0,0 +1,122 @@
+#ifndef __RELAY_SCHED_H
+#define __RELAY_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Relay scheduling and the relay side of a cluster head, on top of relay_pool.h and like it with
+// no SoftDevice, app_timer or UART in it. The relay tick and the advertising interval follow the
+// depth of the relay queue, fast while it is deep, slow while it is empty. The number of times a
+// block is advertised follows its hop count and how many of the relay records heard are duplicates.
+// With several PHYs the records for each destination go out on the PHY its cluster head is heard on.
+// The caller owns the radio side: it calls relay_sched_tick() from the relay timer and puts the
+// packet on the air, on relay_sched_tx_phy(), and follows the level changes it is told of.
+#ifndef RELAY_BURST_DEPTH
+#define RELAY_BURST_DEPTH       4     //blocks queued from which the fastest level is used
+#endif
+#ifndef RELAY_CALM_TICKS
+#define RELAY_CALM_TICKS        5     //ticks the queue stays below a level before stepping down
+#endif
+#ifndef RELAY_IDLE_CALM_TICKS
+#define RELAY_IDLE_CALM_TICKS   150   //ticks the queue stays empty before going idle, 30 s at the normal tick.
+                                      //longer than a sensor window, so a relay with traffic does not flap
+#endif
+#if (RELAY_IDLE_CALM_TICKS > 255) || (RELAY_CALM_TICKS > 255)
+#error "the calm ticks are counted in 8 bits"
+#endif
+#define RELAY_ADV_COUNT_BASE    2     //advertising times of a relayed block, the old fixed value
+#define RELAY_ADV_COUNT_MAX     4
+#define RELAY_FAR_HOPS          3     //from this hop count a block is advertised once more
+#define RELAY_DUP_DENSE         128   //duplicate share (1/256) above which the neighbours relay enough, once less
+#define RELAY_DUP_SPARSE        32    //below it a block is alone on its way, once more
+
+#ifndef RELAY_ADV_INTERVAL_ACTIVE
+#define RELAY_ADV_INTERVAL_ACTIVE 100 //0.625 ms units, PERIPHERAL_ADV_INTERVAL of main.c
+#endif
+#define RELAY_ADV_INTERVAL_IDLE   640 //400 ms, nothing but the name to send
+
+enum {RELAY_LEVEL_IDLE, RELAY_LEVEL_NORMAL, RELAY_LEVEL_BURST, RELAY_LEVEL_COUNT};
+
+typedef struct
+{
+  uint16_t tick_ms;         //period of the relay tick
+  uint16_t adv_interval;    //advertising interval in 0.625 ms units
+}relay_level_t;
+
+//the advertising interval can only be set by restarting the advertising set, which loses the
+//packets on air, so it only changes between idle and the active levels; burst only makes the tick faster
+extern const relay_level_t g_relay_levels[RELAY_LEVEL_COUNT];
+
+typedef struct
+{
+  uint8_t  level;           //RELAY_LEVEL_*
+  uint8_t  calm_ticks;      //ticks the queue has been below the current level
+  uint16_t dup_share;       //duplicates among the relay records heard, 1/256, running average
+  uint32_t level_changes;
+  uint32_t suppressed;      //advertising times saved by duplicates heard of queued blocks
+}relay_sched_t;
+
+// Read only outside relay_sched.c
+extern relay_sched_t g_relay_sched;
+
+// PHYs, the values of BLE_GAP_PHY_1MBPS and BLE_GAP_PHY_CODED
+#define RELAY_PHY_1M                0x01
+#define RELAY_PHY_CODED             0x04
+
+// Cluster heads heard, per primary PHY, so the relay records for each of them go out on the PHY
+// that reaches it. A neighbour is refreshed by every report of it, at least once per peer cache
+// TTL of main.c while it is in range.
+#ifndef RELAY_PHY_NBR_COUNT
+#define RELAY_PHY_NBR_COUNT         8
+#endif
+#define RELAY_PHY_NBR_TTL_SEC       30      //not heard on a PHY for this long, not heard on it at all
+#define RELAY_PHY_1M_RSSI_LIMIT     -80     //heard above this on 1M, 1M reaches it reliably
+#define RELAY_PHY_HOLD_TICKS        8       //relay packets the oldest block waits for its PHY while the other one has
+                                            //blocks, and relay ticks the queue stays empty before Coded goes back to 1M
+
+// relay_sched_rx() results
+#define RELAY_RX_REFLECTED      0     //back at its source
+#define RELAY_RX_PROCESSED      1     //for this cluster, new, handed to the process handler
+#define RELAY_RX_QUEUED         2     //for another cluster, new, queued for relaying
+#define RELAY_RX_FULL           3     //for another cluster, new, but the pool had no room
+#define RELAY_RX_DUPLICATE      4     //in the relay queue or the history already
+
+// Called on a level change, the relay tick and the advertising interval are to follow g_relay_levels[level]
+typedef void (*relay_sched_level_handler_t)(uint8_t level);
+
+// Called with a new relay record for this cluster
+typedef void (*relay_sched_process_handler_t)(uint8_t const *p_data, uint8_t size);
+
+typedef struct
+{
+  uint8_t                       own_id;             //cluster of this node
+  bool                          multi_phy;          //relay on 1M and Coded PHY, else on 1M alone
+  relay_sched_level_handler_t   level_handler;
+  relay_sched_process_handler_t process_handler;
+}relay_sched_init_t;
+
+// Starts at RELAY_LEVEL_NORMAL on 1M with no neighbour known, after relay_pool_init()
+void relay_sched_init(relay_sched_init_t const *p_init);
+
+// A report of cluster head cluster_id on primary PHY phy
+void relay_sched_nbr_heard(uint8_t cluster_id, uint8_t phy, int8_t rssi);
+
+// Handles a relay record heard from a cluster head: a record for this cluster goes to the process
+// handler, one for another cluster is queued for relaying. Returns RELAY_RX_*.
+uint8_t relay_sched_rx(uint8_t const *p_data, uint8_t size);
+
+// Accounts a relay record for another cluster that was handled before, as relay_sched_rx() would.
+// Returns the relay_pool_validate() result.
+uint16_t relay_sched_heard(uint8_t const *p_data);
+
+// Queues a relay record, advertised as often as the relay scheduling says. Returns RELAY_POOL_ADD_*.
+uint8_t relay_sched_add(uint8_t const *p_data, uint8_t size);
+
+// Once per relay tick: builds the next packet from the advertising data of advlen bytes, see
+// relay_pool_pack(), and follows the queue depth. Returns the new advertising data length.
+uint8_t relay_sched_tick(uint8_t *p_adv, uint8_t advlen, uint8_t max_len);
+
+// PHY of the packet of the last relay_sched_tick()
+uint8_t relay_sched_tx_phy(void);
+
+#endif
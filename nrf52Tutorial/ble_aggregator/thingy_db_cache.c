@@ -0,0 +1,325 @@
+#include "thingy_db_cache.h"
+#include "app_aggregator.h"
+#include "app_error.h"
+#include "app_util.h"
+#include "nrf_fstorage.h"
+#include "nrf_fstorage_sd.h"
+#include <stddef.h>
+#include <string.h>
+
+#define THINGY_DB_CACHE_MAGIC       0x32424454  // "TDB2", bump when the record layout changes
+
+#define THINGY_DB_CACHE_FLAG_TES    0x01
+#define THINGY_DB_CACHE_FLAG_UIS    0x02
+#define THINGY_DB_CACHE_FLAG_ALL    (THINGY_DB_CACHE_FLAG_TES | THINGY_DB_CACHE_FLAG_UIS)
+
+// One record of the flash log, a later record of the same address replaces an earlier one.
+// The magic word is written last, so a record cut short by a reset is never taken as valid.
+typedef struct
+{
+    uint8_t         addr[BLE_GAP_ADDR_LEN];
+    uint8_t         flags;      // THINGY_DB_CACHE_FLAG_*, 0 removes the address
+    uint8_t         reserved;
+    tes_db_t        tes_db;
+    thingy_uis_db_t uis_db;
+    uint32_t        magic;
+}thingy_db_cache_record_t;
+
+STATIC_ASSERT(sizeof(thingy_db_cache_record_t) % sizeof(uint32_t) == 0);
+
+#define THINGY_DB_CACHE_RECORD_SIZE     sizeof(thingy_db_cache_record_t)
+#define THINGY_DB_CACHE_RECORD_COUNT    (THINGY_DB_CACHE_FLASH_PAGE_SIZE / THINGY_DB_CACHE_RECORD_SIZE)
+
+typedef struct
+{
+    thingy_db_cache_record_t record;
+    bool                     in_use;
+    bool                     dirty;     // newer than its last record in flash
+    uint32_t                 last_used;
+}thingy_db_cache_entry_t;
+
+enum {THINGY_DB_CACHE_IDLE, THINGY_DB_CACHE_WRITE, THINGY_DB_CACHE_ERASE};
+
+static struct
+{
+    thingy_db_cache_entry_t  entry[THINGY_DB_CACHE_SIZE];
+    thingy_db_cache_record_t write_buf;     // fstorage reads the source of a write after the call returns
+    uint32_t                 write_slot;    // next unused record of the page
+    uint8_t                  write_entry;
+    uint8_t                  state;
+    bool                     compact;       // page full, erase it and write the live entries back
+    bool                     ready;
+    uint32_t                 use_count;
+}m_thingy_db_cache;
+
+static void thingy_db_cache_fstorage_evt_handler(nrf_fstorage_evt_t *p_evt);
+
+NRF_FSTORAGE_DEF(nrf_fstorage_t m_thingy_db_fstorage) =
+{
+    .evt_handler = thingy_db_cache_fstorage_evt_handler,
+    .start_addr  = THINGY_DB_CACHE_FLASH_ADDR,
+    .end_addr    = THINGY_DB_CACHE_FLASH_ADDR + THINGY_DB_CACHE_FLASH_PAGE_SIZE - 1,
+};
+
+static uint32_t thingy_db_cache_slot_addr(uint32_t slot)
+{
+    return THINGY_DB_CACHE_FLASH_ADDR + slot * THINGY_DB_CACHE_RECORD_SIZE;
+}
+
+// Starts the next flash operation, at most one is in flight so write_buf stays untouched until it is done
+static void thingy_db_cache_flush(void)
+{
+    ret_code_t err_code;
+    uint8_t    i;
+
+    if (!m_thingy_db_cache.ready || m_thingy_db_cache.state != THINGY_DB_CACHE_IDLE)
+    {
+        return;
+    }
+
+    for (i = 0; i < THINGY_DB_CACHE_SIZE; i++)
+    {
+        if (m_thingy_db_cache.entry[i].in_use && m_thingy_db_cache.entry[i].dirty)
+        {
+            break;
+        }
+    }
+    if (i == THINGY_DB_CACHE_SIZE && !m_thingy_db_cache.compact)
+    {
+        return;
+    }
+
+    if (m_thingy_db_cache.compact || m_thingy_db_cache.write_slot >= THINGY_DB_CACHE_RECORD_COUNT)
+    {
+        m_thingy_db_cache.compact = true;
+        err_code = nrf_fstorage_erase(&m_thingy_db_fstorage, THINGY_DB_CACHE_FLASH_ADDR, 1, NULL);
+        if (err_code == NRF_SUCCESS)
+        {
+            m_thingy_db_cache.state = THINGY_DB_CACHE_ERASE;
+        }
+        return;
+    }
+
+    m_thingy_db_cache.write_buf       = m_thingy_db_cache.entry[i].record;
+    m_thingy_db_cache.write_buf.magic = THINGY_DB_CACHE_MAGIC;
+    m_thingy_db_cache.write_entry     = i;
+    err_code = nrf_fstorage_write(&m_thingy_db_fstorage, thingy_db_cache_slot_addr(m_thingy_db_cache.write_slot),
+                                  &m_thingy_db_cache.write_buf, THINGY_DB_CACHE_RECORD_SIZE, NULL);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_thingy_db_cache.state = THINGY_DB_CACHE_WRITE;
+    }
+}
+
+static void thingy_db_cache_fstorage_evt_handler(nrf_fstorage_evt_t *p_evt)
+{
+    thingy_db_cache_entry_t *p_entry;
+    uint8_t                  i;
+
+    m_thingy_db_cache.state = THINGY_DB_CACHE_IDLE;
+    if (p_evt->result != NRF_SUCCESS)
+    {
+        // Try again with the next change rather than hammering the flash. A failed write may
+        // have left part of a record behind, so that slot is not used again.
+        if (p_evt->id == NRF_FSTORAGE_EVT_WRITE_RESULT)
+        {
+            m_thingy_db_cache.write_slot++;
+        }
+        return;
+    }
+
+    if (p_evt->id == NRF_FSTORAGE_EVT_ERASE_RESULT)
+    {
+        m_thingy_db_cache.write_slot = 0;
+        m_thingy_db_cache.compact    = false;
+        for (i = 0; i < THINGY_DB_CACHE_SIZE; i++)
+        {
+            p_entry = &m_thingy_db_cache.entry[i];
+            if (p_entry->in_use && p_entry->record.flags == 0)
+            {
+                // Removed peers need no record once the page is empty
+                p_entry->in_use = false;
+            }
+            p_entry->dirty = p_entry->in_use;
+        }
+    }
+    else if (p_evt->id == NRF_FSTORAGE_EVT_WRITE_RESULT)
+    {
+        m_thingy_db_cache.write_slot++;
+        p_entry = &m_thingy_db_cache.entry[m_thingy_db_cache.write_entry];
+        // The entry may have changed or been replaced while the record was written
+        if (p_entry->in_use && memcmp(&p_entry->record, &m_thingy_db_cache.write_buf,
+                                      offsetof(thingy_db_cache_record_t, magic)) == 0)
+        {
+            p_entry->dirty = false;
+            if (p_entry->record.flags == 0)
+            {
+                p_entry->in_use = false;
+            }
+        }
+    }
+
+    thingy_db_cache_flush();
+}
+
+static thingy_db_cache_entry_t *thingy_db_cache_entry_get(const uint8_t *p_addr, bool create)
+{
+    thingy_db_cache_entry_t *p_entry = NULL;
+    thingy_db_cache_entry_t *p_oldest = &m_thingy_db_cache.entry[0];
+
+    for (uint8_t i = 0; i < THINGY_DB_CACHE_SIZE; i++)
+    {
+        thingy_db_cache_entry_t *p = &m_thingy_db_cache.entry[i];
+
+        if (!p->in_use)
+        {
+            if (p_entry == NULL)
+            {
+                p_entry = p;
+            }
+            continue;
+        }
+        if (memcmp(p->record.addr, p_addr, BLE_GAP_ADDR_LEN) == 0)
+        {
+            return p;
+        }
+        if (p->last_used < p_oldest->last_used || !p_oldest->in_use)
+        {
+            p_oldest = p;
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+    if (p_entry == NULL)
+    {
+        p_entry = p_oldest;
+    }
+    memset(p_entry, 0, sizeof(thingy_db_cache_entry_t));
+    memcpy(p_entry->record.addr, p_addr, BLE_GAP_ADDR_LEN);
+    p_entry->in_use = true;
+    return p_entry;
+}
+
+static bool thingy_db_cache_slot_erased(const thingy_db_cache_record_t *p_record)
+{
+    const uint32_t *p_word = (const uint32_t *)p_record;
+
+    for (uint32_t i = 0; i < THINGY_DB_CACHE_RECORD_SIZE / sizeof(uint32_t); i++)
+    {
+        if (p_word[i] != 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void thingy_db_cache_init(void)
+{
+    ret_code_t               err_code;
+    thingy_db_cache_record_t record;
+    thingy_db_cache_entry_t *p_entry;
+    uint32_t                 peers = 0;
+
+    memset(&m_thingy_db_cache, 0, sizeof(m_thingy_db_cache));
+
+    err_code = nrf_fstorage_init(&m_thingy_db_fstorage, &nrf_fstorage_sd, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    // Replay the log, appending continues after the last slot that is not erased
+    for (uint32_t slot = 0; slot < THINGY_DB_CACHE_RECORD_COUNT; slot++)
+    {
+        err_code = nrf_fstorage_read(&m_thingy_db_fstorage, thingy_db_cache_slot_addr(slot), &record, sizeof(record));
+        APP_ERROR_CHECK(err_code);
+
+        if (record.magic == THINGY_DB_CACHE_MAGIC)
+        {
+            p_entry = thingy_db_cache_entry_get(record.addr, true);
+            p_entry->record    = record;
+            p_entry->in_use    = (record.flags != 0);
+            p_entry->last_used = ++m_thingy_db_cache.use_count;
+            m_thingy_db_cache.write_slot = slot + 1;
+        }
+        else if (!thingy_db_cache_slot_erased(&record))
+        {
+            m_thingy_db_cache.write_slot = slot + 1;
+        }
+    }
+
+    for (uint8_t i = 0; i < THINGY_DB_CACHE_SIZE; i++)
+    {
+        if (m_thingy_db_cache.entry[i].in_use)
+        {
+            peers++;
+        }
+    }
+    m_thingy_db_cache.ready = true;
+
+    UART_PRINTF_INFO("Thingy DB cache: %d peers, %d of %d records used\r\n",
+                     peers, m_thingy_db_cache.write_slot, THINGY_DB_CACHE_RECORD_COUNT);
+}
+
+bool thingy_db_cache_find(const uint8_t *p_addr, tes_db_t *p_tes_db, thingy_uis_db_t *p_uis_db)
+{
+    thingy_db_cache_entry_t *p_entry = thingy_db_cache_entry_get(p_addr, false);
+
+    if (p_entry == NULL || p_entry->record.flags != THINGY_DB_CACHE_FLAG_ALL)
+    {
+        return false;
+    }
+    *p_tes_db = p_entry->record.tes_db;
+    *p_uis_db = p_entry->record.uis_db;
+    p_entry->last_used = ++m_thingy_db_cache.use_count;
+    return true;
+}
+
+void thingy_db_cache_tes_store(const uint8_t *p_addr, const tes_db_t *p_tes_db)
+{
+    thingy_db_cache_entry_t *p_entry = thingy_db_cache_entry_get(p_addr, true);
+
+    p_entry->last_used = ++m_thingy_db_cache.use_count;
+    if ((p_entry->record.flags & THINGY_DB_CACHE_FLAG_TES) &&
+        memcmp(&p_entry->record.tes_db, p_tes_db, sizeof(tes_db_t)) == 0)
+    {
+        return;
+    }
+    p_entry->record.tes_db = *p_tes_db;
+    p_entry->record.flags |= THINGY_DB_CACHE_FLAG_TES;
+    p_entry->dirty = true;
+    thingy_db_cache_flush();
+}
+
+void thingy_db_cache_uis_store(const uint8_t *p_addr, const thingy_uis_db_t *p_uis_db)
+{
+    thingy_db_cache_entry_t *p_entry = thingy_db_cache_entry_get(p_addr, true);
+
+    p_entry->last_used = ++m_thingy_db_cache.use_count;
+    if ((p_entry->record.flags & THINGY_DB_CACHE_FLAG_UIS) &&
+        memcmp(&p_entry->record.uis_db, p_uis_db, sizeof(thingy_uis_db_t)) == 0)
+    {
+        return;
+    }
+    p_entry->record.uis_db = *p_uis_db;
+    p_entry->record.flags |= THINGY_DB_CACHE_FLAG_UIS;
+    p_entry->dirty = true;
+    thingy_db_cache_flush();
+}
+
+void thingy_db_cache_remove(const uint8_t *p_addr)
+{
+    thingy_db_cache_entry_t *p_entry = thingy_db_cache_entry_get(p_addr, false);
+
+    if (p_entry == NULL || p_entry->record.flags == 0)
+    {
+        return;
+    }
+    // Kept until the removal record is in flash, otherwise the old handles come back after a reset
+    memset(&p_entry->record.tes_db, 0, sizeof(tes_db_t));
+    memset(&p_entry->record.uis_db, 0, sizeof(thingy_uis_db_t));
+    p_entry->record.flags = 0;
+    p_entry->dirty = true;
+    thingy_db_cache_flush();
+}
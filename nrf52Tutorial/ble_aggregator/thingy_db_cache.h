@@ -0,0 +1,46 @@
+#ifndef __THINGY_DB_CACHE_H
+#define __THINGY_DB_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_gap.h"
+#include "ble_tes_c.h"
+#include "ble_thingy_uis_c.h"
+
+// GATT handles found by discovery on each Thingy, keyed by peer address and kept in one flash page
+// so a reconnect (also after a reset) can assign them without running discovery again.
+// The page is a log of thingy_db_cache_record_t, only erased and rewritten from RAM when it is full.
+
+// Last flash page, the flash log (agg_flash_log.h) is below it. FLASH_SIZE in the SES projects
+// stops the application below both.
+#ifndef THINGY_DB_CACHE_FLASH_ADDR
+#if defined(NRF52840_XXAA)
+#define THINGY_DB_CACHE_FLASH_ADDR      0xFF000
+#else
+#define THINGY_DB_CACHE_FLASH_ADDR      0x7F000
+#endif
+#endif
+
+#define THINGY_DB_CACHE_FLASH_PAGE_SIZE 0x1000
+
+// Thingies remembered in RAM, the least recently used one is replaced when it is full
+#ifndef THINGY_DB_CACHE_SIZE
+#define THINGY_DB_CACHE_SIZE            16
+#endif
+
+// Opens the flash page and loads the cache, call after the SoftDevice is enabled
+void thingy_db_cache_init(void);
+
+// Copies the cached handles of both services, false if the peer is unknown or only partly discovered
+bool thingy_db_cache_find(const uint8_t *p_addr, tes_db_t *p_tes_db, thingy_uis_db_t *p_uis_db);
+
+// Results of a completed discovery. Flash is only written when the handles changed, in the
+// background one record at a time. Call from the BLE event handlers, like the other functions.
+void thingy_db_cache_tes_store(const uint8_t *p_addr, const tes_db_t *p_tes_db);
+
+void thingy_db_cache_uis_store(const uint8_t *p_addr, const thingy_uis_db_t *p_uis_db);
+
+// Forgets a peer whose cached handles turned out to be stale
+void thingy_db_cache_remove(const uint8_t *p_addr);
+
+#endif
@@ -45,14 +45,19 @@
  * @brief Touchscreen driver for FT6206 chip.
  *
  * Touchscreen: https://www.adafruit.com/product/1947
- * This file contains the source code for the FT6206 touchscreen controller chip running in polled mode.
- * (interrupt mode requires hardware modification).
+ * This file contains the source code for the FT6206 touchscreen controller chip running in polled mode,
+ * or in interrupt mode with FT6206_INT_PIN defined (interrupt mode requires hardware modification).
+ * The GUI update function runs when touch input or ft6206_gui_update_request() made it due, and every
+ * FT6206_GUI_IDLE_INTERVAL_MS otherwise.
  * 
  */
 #include "ft6206.h"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
+#ifdef FT6206_INT_PIN
+#include "nrf_drv_gpiote.h"
+#endif
 
 uint8_t const ft6206_ven_id_reg_addr = FT6206_REG_VENDID;
 uint8_t const ft6206_chip_id_reg_addr = FT6206_REG_CHIPID;
@@ -67,12 +72,21 @@ static void ft6206_get_touch_bg(void);   //Read touch register of FT6206 in non-
 static void get_touch_cb(ret_code_t result, void *p_user_data);  //Callback function for read touch register function 
 static void ft6206_get_point(void);  //Post-processing of touch controller data gotten from a burst read
 static long map(long x, long in_min, long in_max, long out_min, long out_max);  //Mapping function for orientation
+static void gui_timer_restart(uint32_t timeout_ms);  //Run timeout_handler after timeout_ms, at once if 0
+
+static volatile bool m_touch_active;     //Panel touched, touch registers are read every FT6206_TOUCH_INTERVAL_MS
+static volatile bool m_touch_reported;   //Last touch passed to the GUI was a press
+static volatile bool m_gui_dirty;        //GUI update due
+static uint32_t      m_gui_updated_at;   //app_timer counter at the last GUI update
 
 // Set threshold.
 static uint8_t const default_config[] = { FT6206_REG_THRESHHOLD, FT6206_DEFAULT_THRESSHOLD };
+// INT stays low while touched, one edge per touch
+static uint8_t const int_mode_config[] = { FT6206_REG_G_MODE, 0x00 };
 static app_twi_transfer_t const ft6206_init_transfers[FT6206_INIT_TRANSFER_COUNT] =
 {
-    APP_TWI_WRITE(FT6206_ADDR, default_config, sizeof(default_config), 0)
+    APP_TWI_WRITE(FT6206_ADDR, default_config, sizeof(default_config), 0),
+    APP_TWI_WRITE(FT6206_ADDR, int_mode_config, sizeof(int_mode_config), 0)
 };
 
 static void twi_config(void)
@@ -95,6 +109,8 @@ static void get_data_cb(ret_code_t result, void *p_user_data)
 {   
     ft6206_get_point();
     m_gui_fns_struct.gtu(m_x, m_y, 1);
+    m_touch_reported = true;
+    ft6206_gui_update_request();
 }
 
 //MQ  burst read on TWI: keep reading n registers with no TWI STOP assertion on bus
@@ -125,8 +141,14 @@ static void get_touch_cb(ret_code_t result, void *p_user_data)
     }
     else {        
         is_touchscreen_pressed = 0;
+        m_touch_active = false;
         //NRF_LOG_INFO("touch count is 0\r\n");
-        m_gui_fns_struct.gtu(-1, -1, 0);        
+        // Only the release itself needs a GUI update
+        if (m_touch_reported) {
+            m_touch_reported = false;
+            m_gui_fns_struct.gtu(-1, -1, 0);
+            ft6206_gui_update_request();
+        }
     }
     if (is_touchscreen_pressed == DEBOUNCE_SENSITIVITY) {        
         ft6206_get_all_registers_bg();
@@ -195,9 +217,12 @@ extern int UG_TextboxHide(void *, int);
 extern void* ptr_window7;
 #endif
 
-// Timeout handler for the repeated timer
+// Timeout handler for the single shot GUI timer, it restarts itself as long as there is something to do
 static void timeout_handler(void * p_context)
 {
+    uint32_t next_ms = FT6206_GUI_IDLE_INTERVAL_MS;
+    bool     idle_due;
+
 #if 0
     static bool switcher = true;
     NRF_LOG_INFO("tick\r\n");
@@ -211,10 +236,67 @@ static void timeout_handler(void * p_context)
 //        UG_TextboxShow( ptr_window7, 0 );
     switcher = !switcher; 
 #endif    
-    ft6206_get_touch_bg();
-    m_gui_fns_struct.gu(); //call GUI lib update function periodically
+#ifndef FT6206_INT_PIN
+    m_touch_active = true;  //No INT line, the panel has to be asked
+#endif
+    if (m_touch_active) {
+        ft6206_get_touch_bg();
+        next_ms = FT6206_TOUCH_INTERVAL_MS;
+    }
+
+    idle_due = (FT6206_GUI_IDLE_INTERVAL_MS > 0) &&
+               (app_timer_cnt_diff_compute(app_timer_cnt_get(), m_gui_updated_at) >=
+                APP_TIMER_TICKS(FT6206_GUI_IDLE_INTERVAL_MS));
+    if (m_gui_dirty || idle_due) {
+        m_gui_dirty = false;
+        m_gui_updated_at = app_timer_cnt_get();
+        m_gui_fns_struct.gu(); //call GUI lib update function
+    }
+
+    if (next_ms > 0) {
+        gui_timer_restart(next_ms);
+    }
+}
+
+static void gui_timer_restart(uint32_t timeout_ms)
+{
+    uint32_t ticks = (timeout_ms > 0) ? APP_TIMER_TICKS(timeout_ms) : APP_TIMER_MIN_TIMEOUT_TICKS;
+
+    if (ticks < APP_TIMER_MIN_TIMEOUT_TICKS) {
+        ticks = APP_TIMER_MIN_TIMEOUT_TICKS;
+    }
+    APP_ERROR_CHECK(app_timer_stop(m_gui_timer_id));
+    APP_ERROR_CHECK(app_timer_start(m_gui_timer_id, ticks, NULL));
 }
 
+void ft6206_gui_update_request(void)
+{
+    m_gui_dirty = true;
+    gui_timer_restart(0);
+}
+
+#ifdef FT6206_INT_PIN
+// INT went low: a finger is on the panel, read it until it reports no more touches
+static void touch_int_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    m_touch_active = true;
+    gui_timer_restart(0);
+}
+
+static void touch_int_config(void)
+{
+    //PORT event instead of an IN channel, costs nothing while waiting
+    nrf_drv_gpiote_in_config_t config = GPIOTE_CONFIG_IN_SENSE_HITOLO(false);
+
+    if (!nrf_drv_gpiote_is_init()) {
+        APP_ERROR_CHECK(nrf_drv_gpiote_init());
+    }
+    config.pull = NRF_GPIO_PIN_PULLUP;
+    APP_ERROR_CHECK(nrf_drv_gpiote_in_init(FT6206_INT_PIN, &config, touch_int_handler));
+    nrf_drv_gpiote_in_event_enable(FT6206_INT_PIN, true);
+}
+#endif
+
 static void timer_init(void)
 {
     //rtc_config();
@@ -223,10 +305,12 @@ static void timer_init(void)
     err_code = app_timer_init();
     APP_ERROR_CHECK(err_code);
     
-    err_code = app_timer_create(&m_gui_timer_id, APP_TIMER_MODE_REPEATED, timeout_handler);
+    err_code = app_timer_create(&m_gui_timer_id, APP_TIMER_MODE_SINGLE_SHOT, timeout_handler);
     APP_ERROR_CHECK(err_code);
     
-    err_code = app_timer_start(m_gui_timer_id, APP_TIMER_TICKS(50), NULL);
+    //First update draws the whole GUI
+    m_gui_dirty = true;
+    err_code = app_timer_start(m_gui_timer_id, APP_TIMER_TICKS(FT6206_TOUCH_INTERVAL_MS), NULL);
     APP_ERROR_CHECK(err_code);
 }
 
@@ -244,5 +328,8 @@ void init_ft6206(void *gui_touch_update_function, void *gui_update_function)
     m_gui_fns_struct.gu  = (gui_update)gui_update_function;
     twi_config();
     APP_ERROR_CHECK(app_twi_perform(&m_app_twi, ft6206_init_transfers, FT6206_INIT_TRANSFER_COUNT, NULL)); //blocking TWI write
+#ifdef FT6206_INT_PIN
+    touch_int_config();
+#endif
     timer_init();
 }
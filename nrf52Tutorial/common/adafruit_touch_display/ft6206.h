@@ -72,11 +72,26 @@ extern "C" {
 #define FT6206_REG_FIRMVERS     0xA6
 #define FT6206_REG_CHIPID       0xA3
 #define FT6206_REG_VENDID       0xA8
+#define FT6206_REG_G_MODE       0xA4    // 0: INT low as long as the panel is touched, 1: INT pulse per report
 
 #define FT6206_NUMBER_OF_REGISTERS 32
 
 // calibrated for Adafruit 2.8" ctp screen
 #define FT6206_DEFAULT_THRESSHOLD 128
+
+// Define FT6206_INT_PIN (board header or project) to read the touch registers only after the INT
+// line went low, instead of every FT6206_TOUCH_INTERVAL_MS. The shield needs its IRQ pad wired.
+//#define FT6206_INT_PIN ARDUINO_7_PIN
+
+// Touch registers are read at this rate while the panel is touched, always without FT6206_INT_PIN
+#ifndef FT6206_TOUCH_INTERVAL_MS
+#define FT6206_TOUCH_INTERVAL_MS    50
+#endif
+
+// GUI update when nothing asked for one, 0 for none. Touch input and ft6206_gui_update_request() update at once
+#ifndef FT6206_GUI_IDLE_INTERVAL_MS
+#define FT6206_GUI_IDLE_INTERVAL_MS 1000
+#endif
      
 extern uint8_t const ft6206_ven_id_reg_addr;
 extern uint8_t const ft6206_chip_id_reg_addr;
@@ -99,7 +114,7 @@ extern uint8_t const ft6206_read_data_reg_addr;
 #define FT6206_READ_DATA(p_buffer) \
     FT6206_READ(&ft6206_read_data_reg_addr, p_buffer, 16) 
 
-#define FT6206_INIT_TRANSFER_COUNT 1
+#define FT6206_INIT_TRANSFER_COUNT 2
 #define FT6206_NUM_TOUCH_REG_TRANSFER_COUNT 1
 
 extern app_twi_transfer_t const
@@ -117,6 +132,9 @@ static struct gui_functions_struct m_gui_fns_struct ={0}; /* Holds function ptrs
 
 void init_ft6206(void *gui_touch_update_function, void *gui_update_function);
 
+/* Asks for a GUI update as soon as possible, call after changing what the GUI shows. */
+void ft6206_gui_update_request(void);
+
 
 #define BUFFER_SIZE  FT6206_NUMBER_OF_REGISTERS
 static uint8_t m_buffer[BUFFER_SIZE] = {0};  //Buffer for TWI burst read from sensor.
@@ -43,7 +43,7 @@
 #if NRF_MODULE_ENABLED(ILI9341)
 
 #include "nrf_lcd_ext.h"
-#include "nrf_drv_spi.h"
+#include "nrfx_spim.h"
 #include "nrf_delay.h"
 #include "nrf_gpio.h"
 #include "boards.h"
@@ -121,40 +121,164 @@
 #define ILI9341_MADCTL_BGR 0x08
 #define ILI9341_MADCTL_MH  0x04
 
-static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(ILI9341_SPI_INSTANCE);
+#ifndef ILI9341_SPI_FREQUENCY
+#define ILI9341_SPI_FREQUENCY   NRF_SPIM_FREQ_4M
+#endif
+
+// Largest single EasyDMA transfer: 255 bytes on nRF52832, 65535 on nRF52840.
+#define ILI9341_DMA_MAX_LEN     ((1UL << SPIM0_EASYDMA_MAXCNT_SIZE) - 1)
+
+// Fill pattern, and bounce buffer for pixel data EasyDMA cannot reach (flash). Even, whole pixels.
+#ifndef ILI9341_DMA_BUF_SIZE
+#define ILI9341_DMA_BUF_SIZE    ((ILI9341_DMA_MAX_LEN < 512) ? (ILI9341_DMA_MAX_LEN & ~1UL) : 512)
+#endif
+
+/**
+ * @brief Pixel data on their way to the LCD.
+ *
+ * Pixel data are sent in chunks as large as EasyDMA takes, each chunk is started from the SPIM
+ * interrupt when the previous one is done, so drawing returns as soon as the first chunk is started.
+ */
+typedef struct
+{
+    uint8_t const * p_data;     /**< Next bytes to send, the pattern if repeat is set. */
+    uint32_t        left;       /**< Bytes still to send. */
+    bool            repeat;     /**< Fill: the same pattern is sent until left is 0. */
+    bool            bounce;     /**< p_data not in RAM, chunks are copied through m_dma_buf. */
+    bool            notify;     /**< Call m_done_handler at the end. */
+    uint32_t        row_len;    /**< Bytes of a row, 0 if p_data is one block. */
+    uint32_t        row_left;   /**< Bytes of the current row still to send. */
+    uint32_t        row_skip;   /**< Bytes from the end of a row to the start of the next. */
+    volatile bool   busy;
+} ili9341_xfer_t;
+
+static const nrfx_spim_t      spi = NRFX_SPIM_INSTANCE(ILI9341_SPI_INSTANCE);
+static ili9341_xfer_t         m_xfer;
+static nrf_lcd_done_handler_t m_done_handler;
+static uint8_t                m_dma_buf[ILI9341_DMA_BUF_SIZE];
+
+static void xfer_next(void)
+{
+    uint8_t const * p_tx = m_xfer.p_data;
+    size_t          len  = MIN(m_xfer.left, ILI9341_DMA_MAX_LEN);
+
+    if (m_xfer.repeat || m_xfer.bounce)
+    {
+        len = MIN(len, sizeof(m_dma_buf));
+    }
+    if (m_xfer.row_len > 0)
+    {
+        len = MIN(len, m_xfer.row_left);
+    }
+    if (m_xfer.bounce)
+    {
+        memcpy(m_dma_buf, m_xfer.p_data, len);
+        p_tx = m_dma_buf;
+    }
+    if (!m_xfer.repeat)
+    {
+        m_xfer.p_data += len;
+    }
+    m_xfer.left -= len;
+
+    if (m_xfer.row_len > 0)
+    {
+        m_xfer.row_left -= len;
+        if (m_xfer.row_left == 0)
+        {
+            m_xfer.p_data  += m_xfer.row_skip;
+            m_xfer.row_left = m_xfer.row_len;
+        }
+    }
+
+    nrfx_spim_xfer_desc_t const xfer = NRFX_SPIM_XFER_TX(p_tx, len);
+    APP_ERROR_CHECK(nrfx_spim_xfer(&spi, &xfer, 0));
+}
+
+static void spim_event_handler(nrfx_spim_evt_t const * p_event, void * p_context)
+{
+    if (m_xfer.left > 0)
+    {
+        xfer_next();
+        return;
+    }
+
+    m_xfer.busy = false;
+    if (m_xfer.notify && (m_done_handler != NULL))
+    {
+        m_done_handler();
+    }
+}
+
+/**
+ * @brief Function for waiting until the pixel data drawn last have been sent.
+ *
+ * @note Must not be called from an interrupt with a priority as high as or higher than the SPIM's.
+ */
+static void spi_wait(void)
+{
+    while (m_xfer.busy)
+    {
+        __WFE();
+    }
+}
+
+static void xfer_start(const void * data, uint32_t size, bool repeat, bool notify)
+{
+    spi_wait();
+    if (size == 0)
+    {
+        return;
+    }
+
+    m_xfer.p_data  = data;
+    m_xfer.left    = size;
+    m_xfer.repeat  = repeat;
+    m_xfer.bounce  = !repeat && !nrfx_is_in_ram(data);
+    m_xfer.notify  = notify;
+    m_xfer.row_len = 0;
+    m_xfer.busy    = true;
+    xfer_next();
+}
 
 static inline void spi_write(const void * data, size_t size)
 {
-    APP_ERROR_CHECK(nrf_drv_spi_transfer(&spi, data, size, NULL, 0));
+    xfer_start(data, size, false, false);
+    spi_wait();
 }
 
 static inline void write_command(uint8_t c)
 {
+    spi_wait();
     nrf_gpio_pin_clear(ILI9341_DC_PIN);
     spi_write(&c, sizeof(c));
 }
 
 static inline void write_data(uint8_t c)
 {
+    spi_wait();
     nrf_gpio_pin_set(ILI9341_DC_PIN);
     spi_write(&c, sizeof(c));
 }
 
+static inline void write_data_range(uint16_t start, uint16_t end)
+{
+    uint8_t const data[4] = {start >> 8, start, end >> 8, end};
+
+    nrf_gpio_pin_set(ILI9341_DC_PIN);
+    spi_write(data, sizeof(data));
+}
+
+// Waits for the pixel data before, the SPI is then free for the new window until RAMWR is sent
 static void set_addr_window(uint16_t x_0, uint16_t y_0, uint16_t x_1, uint16_t y_1)
 {
     ASSERT(x_0 <= x_1);
     ASSERT(y_0 <= y_1);
 
     write_command(ILI9341_CASET);
-    write_data(x_0 >> 8);
-    write_data(x_0);
-    write_data(x_1 >> 8);
-    write_data(x_1);
+    write_data_range(x_0, x_1);
     write_command(ILI9341_PASET);
-    write_data(y_0 >> 8);
-    write_data(y_0);
-    write_data(y_1 >> 8);
-    write_data(y_1);
+    write_data_range(y_0, y_1);
     write_command(ILI9341_RAMWR);
 }
 
@@ -267,15 +391,15 @@ static ret_code_t hardware_init(void)
 
     nrf_gpio_cfg_output(ILI9341_DC_PIN);
 
-    nrf_drv_spi_config_t spi_config = NRF_DRV_SPI_DEFAULT_CONFIG;
+    nrfx_spim_config_t spi_config = NRFX_SPIM_DEFAULT_CONFIG;
 
     spi_config.sck_pin  = ILI9341_SCK_PIN;
     spi_config.miso_pin = ILI9341_MISO_PIN;
     spi_config.mosi_pin = ILI9341_MOSI_PIN;
     spi_config.ss_pin   = ILI9341_SS_PIN;
-    spi_config.frequency = SPI_FREQUENCY_FREQUENCY_M4;
+    spi_config.frequency = ILI9341_SPI_FREQUENCY;
 
-    err_code = nrf_drv_spi_init(&spi, &spi_config, NULL, NULL);
+    err_code = nrfx_spim_init(&spi, &spi_config, spim_event_handler, NULL);
     return err_code;
 }
 
@@ -296,7 +420,8 @@ static ret_code_t ili9341_init(void)
 
 static void ili9341_uninit(void)
 {
-    nrf_drv_spi_uninit(&spi);
+    spi_wait();
+    nrfx_spim_uninit(&spi);
 }
 
 static void ili9341_pixel_draw(uint16_t x, uint16_t y, uint32_t color)
@@ -351,57 +476,56 @@ static void ili9341_rect_draw_old(uint16_t x, uint16_t y, uint16_t width, uint16
     nrf_gpio_pin_clear(ILI9341_DC_PIN);
 }
 
+// Returns once the fill is started, the pattern in m_dma_buf is sent until the window is full
 static void ili9341_rect_draw(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint32_t color)
 {
-    static uint8_t data[32];
-    
     set_addr_window(x, y, x + width - 1, y + height - 1);
 
-    for(int i = 0; i < 16; i++)
+    for (uint32_t i = 0; i < sizeof(m_dma_buf); i += 2)
     {
-       data[i*2] = color >> 8;
-       data[i*2+1] = color;
+        m_dma_buf[i]     = color >> 8;
+        m_dma_buf[i + 1] = color;
     }
 
     nrf_gpio_pin_set(ILI9341_DC_PIN);
+    xfer_start(m_dma_buf, (uint32_t)width * height * 2, true, true);
+}
 
-    uint32_t bytes_left = height * width * 2;
-
-    do
-    {
-        if(bytes_left > 32)
-        {
-            spi_write(data, sizeof(data));
-            bytes_left -= 16;
-        }
-        else
-        {
-           spi_write(data, bytes_left);
-           bytes_left = 0;
-        }
-    
-    }while(bytes_left > 0); 
+// Returns once the first chunk is started, p_data must stay untouched until the transfer is done
+static void ili9341_buffer_draw(uint16_t x, uint16_t y, uint16_t width, uint16_t height, void * p_data, uint32_t length)
+{
+    set_addr_window(x, y, x + width - 1, y + height - 1);
 
-    nrf_gpio_pin_clear(ILI9341_DC_PIN);
+    nrf_gpio_pin_set(ILI9341_DC_PIN);
+    xfer_start(p_data, length, false, true);
 }
 
-static void ili9341_buffer_draw(uint16_t x, uint16_t y, uint16_t width, uint16_t height, void * p_data, uint32_t length)
+// As ili9341_buffer_draw, for a window out of a larger buffer with rows of stride pixels
+static void ili9341_window_draw(uint16_t x, uint16_t y, uint16_t width, uint16_t height, void const * p_data, uint16_t stride)
 {
-    uint32_t spi_max_length, spi_length;
-    
     set_addr_window(x, y, x + width - 1, y + height - 1);
 
     nrf_gpio_pin_set(ILI9341_DC_PIN);
-    spi_max_length = 250; //(1 << SPIM0_EASYDMA_MAXCNT_SIZE - 4))
-    do
-    {
-        spi_length = (length > spi_max_length) ? spi_max_length : length;
-        spi_write(p_data, spi_length);
-        length -= spi_length;
-        p_data += spi_length;        
-    }while(length > 0);
+    m_xfer.p_data   = p_data;
+    m_xfer.left     = (uint32_t)width * height * 2;
+    m_xfer.repeat   = false;
+    m_xfer.bounce   = !nrfx_is_in_ram(p_data);
+    m_xfer.notify   = true;
+    m_xfer.row_len  = (uint32_t)width * 2;
+    m_xfer.row_left = m_xfer.row_len;
+    m_xfer.row_skip = (uint32_t)(stride - width) * 2;
+    m_xfer.busy     = true;
+    xfer_next();
+}
 
-    nrf_gpio_pin_clear(ILI9341_DC_PIN);    
+static bool ili9341_busy_check(void)
+{
+    return m_xfer.busy;
+}
+
+static void ili9341_done_handler_set(nrf_lcd_done_handler_t handler)
+{
+    m_done_handler = handler;
 }
 
 static void ili9341_dummy_display(void)
@@ -450,6 +574,9 @@ const nrf_lcd_t nrf_lcd_ili9341 = {
     .lcd_display = ili9341_dummy_display,
     .lcd_rotation_set = ili9341_rotation_set,
     .lcd_display_invert = ili9341_display_invert,
+    .lcd_window_draw = ili9341_window_draw,
+    .lcd_busy_check = ili9341_busy_check,
+    .lcd_done_handler_set = ili9341_done_handler_set,
     .p_lcd_cb = &ili9341_cb
 };
 
@@ -51,6 +51,242 @@
 #include "nrf_log.h"
 NRF_LOG_MODULE_REGISTER();
 
+// Rows of the frame buffer flushed together, a band is the smallest region sent again
+#ifndef NRF_GFX_FB_BAND_HEIGHT
+#define NRF_GFX_FB_BAND_HEIGHT  8
+#endif
+
+#define NRF_GFX_FB_ROWS_MAX     320
+#define NRF_GFX_FB_BANDS_MAX    CEIL_DIV(NRF_GFX_FB_ROWS_MAX, NRF_GFX_FB_BAND_HEIGHT)
+
+/**
+ * @brief Columns of a band changed since they were last sent, none if xs > xe.
+ */
+typedef struct
+{
+    uint16_t xs;
+    uint16_t xe;
+} gfx_fb_band_t;
+
+/**
+ * @brief Frame buffer over a part of the screen.
+ *
+ * Pixels are kept row by row at the width of the area, so a run of dirty bands is one block
+ * that goes to the LCD in a single draw, a window of it if the LCD takes rows with a stride.
+ */
+typedef struct
+{
+    nrf_lcd_t const * p_instance;                   /**< LCD the frame buffer belongs to, NULL if none. */
+    nrf_gfx_rect_t    area;                         /**< Part of the screen in the frame buffer. */
+    uint16_t        * p_buf;                        /**< area.width * area.height pixels, high byte first. */
+    gfx_fb_band_t     dirty[NRF_GFX_FB_BANDS_MAX];
+} gfx_fb_t;
+
+static gfx_fb_t m_fb;
+
+// Intersection of a rectangle with the frame buffer area, false if there is none
+static bool fb_clip(nrf_lcd_t const * p_instance,
+                    uint16_t x,
+                    uint16_t y,
+                    uint16_t width,
+                    uint16_t height,
+                    nrf_gfx_rect_t * p_clip)
+{
+    uint16_t x_end;
+    uint16_t y_end;
+
+    if (m_fb.p_instance != p_instance)
+    {
+        return false;
+    }
+
+    x_end = MIN(x + width, m_fb.area.x + m_fb.area.width);
+    y_end = MIN(y + height, m_fb.area.y + m_fb.area.height);
+    x     = MAX(x, m_fb.area.x);
+    y     = MAX(y, m_fb.area.y);
+    if ((x >= x_end) || (y >= y_end))
+    {
+        return false;
+    }
+
+    p_clip->x      = x;
+    p_clip->y      = y;
+    p_clip->width  = x_end - x;
+    p_clip->height = y_end - y;
+    return true;
+}
+
+static bool fb_covers(nrf_lcd_t const * p_instance,
+                      uint16_t x,
+                      uint16_t y,
+                      uint16_t width,
+                      uint16_t height)
+{
+    nrf_gfx_rect_t clip;
+
+    return fb_clip(p_instance, x, y, width, height, &clip) &&
+           (clip.width == width) && (clip.height == height);
+}
+
+static inline uint16_t * fb_pixel(uint16_t x, uint16_t y)
+{
+    return &m_fb.p_buf[(uint32_t)(y - m_fb.area.y) * m_fb.area.width + (x - m_fb.area.x)];
+}
+
+static void fb_mark(nrf_gfx_rect_t const * p_clip)
+{
+    uint16_t first = (p_clip->y - m_fb.area.y) / NRF_GFX_FB_BAND_HEIGHT;
+    uint16_t last  = (p_clip->y + p_clip->height - 1 - m_fb.area.y) / NRF_GFX_FB_BAND_HEIGHT;
+
+    for (uint16_t band = first; band <= last; band++)
+    {
+        m_fb.dirty[band].xs = MIN(m_fb.dirty[band].xs, p_clip->x);
+        m_fb.dirty[band].xe = MAX(m_fb.dirty[band].xe, p_clip->x + p_clip->width - 1);
+    }
+}
+
+static inline bool fb_band_dirty(uint16_t band)
+{
+    return m_fb.dirty[band].xs <= m_fb.dirty[band].xe;
+}
+
+static inline void fb_band_clean(uint16_t band)
+{
+    m_fb.dirty[band].xs = UINT16_MAX;
+    m_fb.dirty[band].xe = 0;
+}
+
+// Sends a clipped rectangle of the frame buffer, full rows are one block
+static void fb_send(nrf_lcd_t const * p_instance, nrf_gfx_rect_t const * p_clip)
+{
+    if (p_clip->width == m_fb.area.width)
+    {
+        p_instance->lcd_buffer_draw(p_clip->x,
+                                    p_clip->y,
+                                    p_clip->width,
+                                    p_clip->height,
+                                    fb_pixel(p_clip->x, p_clip->y),
+                                    (uint32_t)p_clip->height * p_clip->width * 2);
+    }
+    else if (p_instance->lcd_window_draw != NULL)
+    {
+        p_instance->lcd_window_draw(p_clip->x,
+                                    p_clip->y,
+                                    p_clip->width,
+                                    p_clip->height,
+                                    fb_pixel(p_clip->x, p_clip->y),
+                                    m_fb.area.width);
+    }
+    else
+    {
+        for (uint16_t row = p_clip->y; row < p_clip->y + p_clip->height; row++)
+        {
+            p_instance->lcd_buffer_draw(p_clip->x, row, p_clip->width, 1,
+                                        fb_pixel(p_clip->x, row), p_clip->width * 2);
+        }
+    }
+}
+
+/**
+ * @brief Function for filling the part of a rectangle in the frame buffer.
+ *
+ * @param[in] mark  False if the rectangle is drawn to the LCD directly as well, the frame buffer
+ *                  then only follows it and nothing has to be flushed.
+ */
+static void fb_fill(nrf_lcd_t const * p_instance,
+                    uint16_t x,
+                    uint16_t y,
+                    uint16_t width,
+                    uint16_t height,
+                    uint32_t color,
+                    bool mark)
+{
+    nrf_gfx_rect_t clip;
+    uint16_t       pixel = (uint16_t)((color >> 8) | (color << 8));
+
+    if (!fb_clip(p_instance, x, y, width, height, &clip))
+    {
+        return;
+    }
+
+    for (uint16_t row = clip.y; row < clip.y + clip.height; row++)
+    {
+        uint16_t * p_pixel = fb_pixel(clip.x, row);
+
+        for (uint16_t i = 0; i < clip.width; i++)
+        {
+            p_pixel[i] = pixel;
+        }
+    }
+
+    if (mark)
+    {
+        fb_mark(&clip);
+    }
+}
+
+// As fb_fill, with pixels from a buffer of width * height pixels in LCD byte order
+static void fb_copy(nrf_lcd_t const * p_instance,
+                    uint16_t x,
+                    uint16_t y,
+                    uint16_t width,
+                    uint16_t height,
+                    uint8_t const * p_data,
+                    bool mark)
+{
+    nrf_gfx_rect_t clip;
+
+    if (!fb_clip(p_instance, x, y, width, height, &clip))
+    {
+        return;
+    }
+
+    for (uint16_t row = clip.y; row < clip.y + clip.height; row++)
+    {
+        memcpy(fb_pixel(clip.x, row),
+               &p_data[((uint32_t)(row - y) * width + (clip.x - x)) * 2],
+               clip.width * 2);
+    }
+
+    if (mark)
+    {
+        fb_mark(&clip);
+    }
+}
+
+// Sends every run of dirty bands as one window over their dirty columns, the last one may
+// still be on its way on return
+static void fb_flush(nrf_lcd_t const * p_instance)
+{
+    uint16_t bands = CEIL_DIV(m_fb.area.height, NRF_GFX_FB_BAND_HEIGHT);
+
+    for (uint16_t band = 0; band < bands; band++)
+    {
+        uint16_t       first = band;
+        uint16_t       xs    = UINT16_MAX;
+        uint16_t       xe    = 0;
+        nrf_gfx_rect_t clip;
+
+        if (!fb_band_dirty(band))
+        {
+            continue;
+        }
+        while ((band < bands) && fb_band_dirty(band))
+        {
+            xs = MIN(xs, m_fb.dirty[band].xs);
+            xe = MAX(xe, m_fb.dirty[band].xe);
+            fb_band_clean(band);
+            band++;
+        }
+
+        clip.x      = xs;
+        clip.y      = m_fb.area.y + first * NRF_GFX_FB_BAND_HEIGHT;
+        clip.width  = xe - xs + 1;
+        clip.height = m_fb.area.y + MIN(band * NRF_GFX_FB_BAND_HEIGHT, m_fb.area.height) - clip.y;
+        fb_send(p_instance, &clip);
+    }
+}
+
 static inline void pixel_draw(nrf_lcd_t const * p_instance,
                               uint16_t x,
                               uint16_t y,
@@ -64,6 +300,15 @@ static inline void pixel_draw(nrf_lcd_t const * p_instance,
         return;
     }
 
+    if (fb_covers(p_instance, x, y, 1, 1))
+    {
+        nrf_gfx_rect_t const clip = NRF_GFX_RECT(x, y, 1, 1);
+
+        *fb_pixel(x, y) = (uint16_t)((color >> 8) | (color << 8));
+        fb_mark(&clip);
+        return;
+    }
+
     p_instance->lcd_pixel_draw(x, y, color);
 }
 
@@ -92,6 +337,13 @@ static void rect_draw(nrf_lcd_t const * p_instance,
         height = lcd_height - y;
     }
 
+    if (fb_covers(p_instance, x, y, width, height))
+    {
+        fb_fill(p_instance, x, y, width, height, color, true);
+        return;
+    }
+    fb_fill(p_instance, x, y, width, height, color, false);
+
     p_instance->lcd_rect_draw(x, y, width, height, color);
 }
 
@@ -121,6 +373,16 @@ static void buffer_draw(nrf_lcd_t const * p_instance,
         height = lcd_height - y;
     }
 
+    if ((length >= (uint32_t)width * height * 2) && fb_covers(p_instance, x, y, width, height))
+    {
+        fb_copy(p_instance, x, y, width, height, p_data, true);
+        return;
+    }
+    if (length >= (uint32_t)width * height * 2)
+    {
+        fb_copy(p_instance, x, y, width, height, p_data, false);
+    }
+
     p_instance->lcd_buffer_draw(x, y, width, height, p_data, length);
 }
 
@@ -544,9 +806,106 @@ void nrf_gfx_display(nrf_lcd_t const * p_instance)
 {
     ASSERT(p_instance != NULL);
 
+    if (m_fb.p_instance == p_instance)
+    {
+        fb_flush(p_instance);
+    }
     p_instance->lcd_display();
 }
 
+ret_code_t nrf_gfx_framebuffer_set(nrf_lcd_t const * p_instance,
+                                   nrf_gfx_rect_t const * p_area,
+                                   uint16_t * p_buf,
+                                   size_t size)
+{
+    ASSERT(p_instance != NULL);
+    ASSERT(p_instance->p_lcd_cb->state != NRFX_DRV_STATE_UNINITIALIZED);
+
+    if ((p_area == NULL) || (p_buf == NULL))
+    {
+        m_fb.p_instance = NULL;
+        return NRF_SUCCESS;
+    }
+
+    if ((p_area->width == 0) ||
+        (p_area->height == 0) ||
+        (p_area->height > NRF_GFX_FB_ROWS_MAX) ||
+        (p_area->x + p_area->width > nrf_gfx_width_get(p_instance)) ||
+        (p_area->y + p_area->height > nrf_gfx_height_get(p_instance)) ||
+        (size < (uint32_t)p_area->width * p_area->height * sizeof(uint16_t)))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    // The LCD may still read the buffer given before
+    while (nrf_gfx_busy_check(p_instance))
+    {
+    }
+
+    m_fb.p_instance = p_instance;
+    m_fb.area       = *p_area;
+    m_fb.p_buf      = p_buf;
+    for (uint16_t band = 0; band < NRF_GFX_FB_BANDS_MAX; band++)
+    {
+        m_fb.dirty[band].xs = p_area->x;
+        m_fb.dirty[band].xe = p_area->x + p_area->width - 1;
+    }
+
+    return NRF_SUCCESS;
+}
+
+void nrf_gfx_display_area(nrf_lcd_t const * p_instance, nrf_gfx_rect_t const * p_rect)
+{
+    nrf_gfx_rect_t clip;
+    uint16_t       first;
+    uint16_t       last;
+
+    ASSERT(p_instance != NULL);
+    ASSERT(p_rect != NULL);
+
+    if (!fb_clip(p_instance, p_rect->x, p_rect->y, p_rect->width, p_rect->height, &clip))
+    {
+        p_instance->lcd_display();
+        return;
+    }
+    fb_send(p_instance, &clip);
+
+    // Bands whose rows and dirty columns have all been sent are clean now
+    first = CEIL_DIV(clip.y - m_fb.area.y, NRF_GFX_FB_BAND_HEIGHT);
+    last  = (clip.y + clip.height - m_fb.area.y) / NRF_GFX_FB_BAND_HEIGHT;
+    if (clip.y + clip.height == m_fb.area.y + m_fb.area.height)
+    {
+        // The last band may be shorter
+        last = CEIL_DIV(m_fb.area.height, NRF_GFX_FB_BAND_HEIGHT);
+    }
+    for (uint16_t band = first; band < last; band++)
+    {
+        if ((m_fb.dirty[band].xs >= clip.x) && (m_fb.dirty[band].xe < clip.x + clip.width))
+        {
+            fb_band_clean(band);
+        }
+    }
+
+    p_instance->lcd_display();
+}
+
+bool nrf_gfx_busy_check(nrf_lcd_t const * p_instance)
+{
+    ASSERT(p_instance != NULL);
+
+    return (p_instance->lcd_busy_check != NULL) && p_instance->lcd_busy_check();
+}
+
+void nrf_gfx_done_handler_set(nrf_lcd_t const * p_instance, nrf_lcd_done_handler_t handler)
+{
+    ASSERT(p_instance != NULL);
+
+    if (p_instance->lcd_done_handler_set != NULL)
+    {
+        p_instance->lcd_done_handler_set(handler);
+    }
+}
+
 void nrf_gfx_rotation_set(nrf_lcd_t const * p_instance, nrf_lcd_rotation_t rotation)
 {
     ASSERT(p_instance != NULL);
@@ -267,10 +267,62 @@ void nrf_gfx_background_set(nrf_lcd_t const * p_instance, uint16_t const * img_b
 /**
  * @brief Function for displaying data from an internal frame buffer.
  *
+ * Sends the parts of the frame buffer set with @ref nrf_gfx_framebuffer_set that changed since the last call.
+ *
  * @param[in] p_instance            Pointer to the LCD instance.
  */
 void nrf_gfx_display(nrf_lcd_t const * p_instance);
 
+/**
+ * @brief Function for displaying a rectangle of the frame buffer.
+ *
+ * Sends the part of the rectangle in the frame buffer whether it changed or not, bands that
+ * changed only inside the rectangle are clean afterwards.
+ *
+ * @param[in] p_instance            Pointer to the LCD instance.
+ * @param[in] p_rect                Pointer to the rectangle.
+ */
+void nrf_gfx_display_area(nrf_lcd_t const * p_instance, nrf_gfx_rect_t const * p_rect);
+
+/**
+ * @brief Function for drawing a part of the screen to RAM.
+ *
+ * Drawings covered by the area go to p_buf only and reach the LCD with the next @ref nrf_gfx_display,
+ * which sends only the bands of rows that changed. Drawings partly in the area go to the LCD and
+ * to the buffer. The content of p_buf is sent with the first @ref nrf_gfx_display.
+ * Drawing to the buffer while @ref nrf_gfx_busy_check is true may show in the band being sent,
+ * the next @ref nrf_gfx_display corrects it.
+ *
+ * @param[in] p_instance            Pointer to the LCD instance.
+ * @param[in] p_area                Part of the screen, NULL to draw to the LCD directly again.
+ * @param[in] p_buf                 p_area->width * p_area->height pixels.
+ * @param[in] size                  Size of p_buf in bytes.
+ *
+ * @retval NRF_ERROR_INVALID_PARAM  If the area is not on the screen or p_buf is too small.
+ * @retval NRF_SUCCESS              If drawings in the area go to p_buf from now on.
+ *
+ * @note The area is in the coordinates of the current rotation, set it again after rotating.
+ */
+ret_code_t nrf_gfx_framebuffer_set(nrf_lcd_t const * p_instance,
+                                   nrf_gfx_rect_t const * p_area,
+                                   uint16_t * p_buf,
+                                   size_t size);
+
+/**
+ * @brief Function for checking whether drawn pixels are still being sent to the LCD.
+ *
+ * @param[in] p_instance            Pointer to the LCD instance.
+ */
+bool nrf_gfx_busy_check(nrf_lcd_t const * p_instance);
+
+/**
+ * @brief Function for setting the handler called when a fill or buffer has been sent to the LCD.
+ *
+ * @param[in] p_instance            Pointer to the LCD instance.
+ * @param[in] handler               Handler called in interrupt context, NULL for none.
+ */
+void nrf_gfx_done_handler_set(nrf_lcd_t const * p_instance, nrf_lcd_done_handler_t handler);
+
 /**
  * @brief Function for setting screen rotation.
  *
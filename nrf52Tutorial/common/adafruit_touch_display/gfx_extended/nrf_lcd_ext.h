@@ -62,6 +62,11 @@ typedef enum{
     NRF_LCD_ROTATE_270          /**< Rotate 270 degrees, clockwise. */
 }nrf_lcd_rotation_t;
 
+/**
+ * @brief Handler called when pixel data passed to the LCD have been sent, in interrupt context.
+ */
+typedef void (* nrf_lcd_done_handler_t)(void);
+
 /**
  * @brief LCD instance control block.
  */
@@ -102,6 +107,8 @@ typedef struct
     /**
      * @brief Function for drawing a filled rectangle.
      *
+     * The LCD may still be filling the rectangle after the function returned, see @ref lcd_busy_check.
+     *
      * @param[in] x             Horizontal coordinate of the point where to start drawing the rectangle.
      * @param[in] y             Vertical coordinate of the point where to start drawing the rectangle.
      * @param[in] width         Width of the image.
@@ -113,6 +120,9 @@ typedef struct
     /**
      * @brief Function for drawing a buffer to memory.
      *
+     * The LCD may still be reading p_data after the function returned, p_data must not change
+     * until @ref lcd_busy_check returns false.
+     *
      * @param[in] x             Horizontal coordinate of the point where to start drawing the rectangle.
      * @param[in] y             Vertical coordinate of the point where to start drawing the rectangle.
      * @param[in] width         Width of the image.
@@ -145,6 +155,37 @@ typedef struct
      */
     void (* lcd_display_invert)(bool invert);
 
+    /**
+     * @brief Function for drawing a window out of a larger buffer.
+     *
+     * As @ref lcd_buffer_draw, the rows of the window are stride pixels apart in p_data.
+     * May be NULL, the window is then drawn row by row with @ref lcd_buffer_draw.
+     *
+     * @param[in] x             Horizontal coordinate of the point where to start drawing the window.
+     * @param[in] y             Vertical coordinate of the point where to start drawing the window.
+     * @param[in] width         Width of the window.
+     * @param[in] height        Height of the window.
+     * @param[in] p_data        Pointer to the first pixel of the window.
+     * @param[in] stride        Pixels from the start of a row in p_data to the start of the next.
+     */
+    void (* lcd_window_draw)(uint16_t x, uint16_t y, uint16_t width, uint16_t height, void const * p_data, uint16_t stride);
+
+    /**
+     * @brief Function for checking whether pixel data are still being sent to the LCD.
+     *
+     * May be NULL for LCDs that draw before returning.
+     */
+    bool (* lcd_busy_check)(void);
+
+    /**
+     * @brief Function for setting the handler called each time a rectangle or buffer has been sent.
+     *
+     * May be NULL for LCDs that draw before returning.
+     *
+     * @param[in] handler       Handler, NULL for none.
+     */
+    void (* lcd_done_handler_set)(nrf_lcd_done_handler_t handler);
+
     /**
      * @brief Pointer to the LCD instance control block.
      */
@@ -58,6 +58,9 @@
  void _UG_CheckboxUpdate(UG_WINDOW* wnd, UG_OBJECT* obj);
  void _UG_ImageUpdate(UG_WINDOW* wnd, UG_OBJECT* obj);
  void _UG_PutChar( char chr, UG_S16 x, UG_S16 y, UG_COLOR fc, UG_COLOR bc, const UG_FONT* font);
+#ifdef USE_DIRTY_AREAS
+ void _UG_DirtyAreasFlush( void );
+#endif
 
  /* Pointer to the gui */
 static UG_GUI* gui;
@@ -4593,6 +4596,9 @@ UG_S16 UG_Init( UG_GUI* g, void (*p)(UG_S16,UG_S16,UG_COLOR), UG_S16 x, UG_S16 y
       g->driver[i].driver = NULL;
       g->driver[i].state = 0;
    }
+#ifdef USE_DIRTY_AREAS
+   g->dirty_cnt = 0;
+#endif
 
    gui = g;
    return 1;
@@ -4638,6 +4644,9 @@ UG_S16 UG_Init(UG_GUI* g, UG_S16 x, UG_S16 y, const nrf_lcd_t *p_nrf_lcd)
       g->driver[i].driver = NULL;
       g->driver[i].state = 0;
    }
+#ifdef USE_DIRTY_AREAS
+   g->dirty_cnt = 0;
+#endif
 
    gui = g;
    
@@ -4647,6 +4656,7 @@ UG_S16 UG_Init(UG_GUI* g, UG_S16 x, UG_S16 y, const nrf_lcd_t *p_nrf_lcd)
    UG_DriverRegister(DRIVER_DRAW_LINE, (void*)_HW_draw_line);
    UG_DriverRegister(DRIVER_FILL_FRAME, (void*)_HW_fill_frame);
    UG_DriverRegister(DRIVER_DRAW_BUFFER, (void*)_HW_draw_buffer);
+   UG_DriverRegister(DRIVER_FLUSH_AREA, (void*)_HW_flush_area);
          
    return 1;
 }
@@ -5389,7 +5399,11 @@ void _UG_PutChar( char chr, UG_S16 x, UG_S16 y, UG_COLOR fc, UG_COLOR bc, const
    /* Extended option, using draw_buffer function */
    else if(gui->driver[DRIVER_DRAW_BUFFER].state & DRIVER_ENABLED) 
    {
-      static uint16_t char_buf[16*16];
+      /* The LCD may still be sending the last character, so characters alternate between two buffers */
+      static uint16_t char_bufs[2][16*16];
+      static UG_U8 char_buf_index;
+      uint16_t* char_buf = char_bufs[char_buf_index];
+      char_buf_index ^= 1;
       fc = (fc << 8) | (fc >> 8);
       bc = (bc << 8) | (bc >> 8);
       if (font->font_type == FONT_TYPE_1BPP)
@@ -5703,12 +5717,19 @@ void _UG_UpdateObjects( UG_WINDOW* wnd )
          if ( objstate & OBJ_STATE_UPDATE )
          {
             obj->update(wnd,obj);
+#ifdef USE_DIRTY_AREAS
+            UG_DirtyAreaAdd(obj->a_abs.xs, obj->a_abs.ys, obj->a_abs.xe, obj->a_abs.ye);
+#endif
          }
          if ( (objstate & OBJ_STATE_VISIBLE) && (objstate & OBJ_STATE_TOUCH_ENABLE) )
          {
             if ( (objtouch & (OBJ_TOUCH_STATE_CHANGED | OBJ_TOUCH_STATE_IS_PRESSED)) )
             {
                obj->update(wnd,obj);
+#ifdef USE_DIRTY_AREAS
+               /* Only a touch that changed the object's state redrew it */
+               if ( obj->event != OBJ_EVENT_NONE ) UG_DirtyAreaAdd(obj->a_abs.xs, obj->a_abs.ys, obj->a_abs.xe, obj->a_abs.ye);
+#endif
             }
          }
       }
@@ -5880,8 +5901,100 @@ void UG_Update( void )
          _UG_HandleEvents( wnd );
       }
    }
+
+#ifdef USE_DIRTY_AREAS
+   _UG_DirtyAreasFlush();
+#endif
 }
 
+#ifdef USE_DIRTY_AREAS
+static UG_U32 _UG_AreaSize( const UG_AREA* a )
+{
+   return (UG_U32)(a->xe - a->xs + 1) * (UG_U32)(a->ye - a->ys + 1);
+}
+
+static void _UG_AreaUnion( const UG_AREA* a, const UG_AREA* b, UG_AREA* u )
+{
+   u->xs = ( a->xs < b->xs )? a->xs : b->xs;
+   u->ys = ( a->ys < b->ys )? a->ys : b->ys;
+   u->xe = ( a->xe > b->xe )? a->xe : b->xe;
+   u->ye = ( a->ye > b->ye )? a->ye : b->ye;
+}
+
+/* Adds a redrawn area to the set passed to DRIVER_FLUSH_AREA at the end of UG_Update.
+   Areas are merged while their bounding box costs no more than both of them, overlapping or
+   adjacent rows of a list become one. If the set is full, the new area joins the one it
+   enlarges least. */
+void UG_DirtyAreaAdd( UG_S16 xs, UG_S16 ys, UG_S16 xe, UG_S16 ye )
+{
+   UG_AREA a,u;
+   UG_U8 i,best;
+   UG_U32 growth,best_growth;
+
+   if ( xs < 0 ) xs = 0;
+   if ( ys < 0 ) ys = 0;
+   if ( xe >= gui->x_dim ) xe = gui->x_dim - 1;
+   if ( ye >= gui->y_dim ) ye = gui->y_dim - 1;
+   if ( (xe < xs) || (ye < ys) ) return;
+
+   a.xs = xs;
+   a.ys = ys;
+   a.xe = xe;
+   a.ye = ye;
+
+   /* A merged area may reach further areas, so start over after each merge */
+   i = 0;
+   while ( i < gui->dirty_cnt )
+   {
+      _UG_AreaUnion( &a, &gui->dirty[i], &u );
+      if ( _UG_AreaSize(&u) <= _UG_AreaSize(&a) + _UG_AreaSize(&gui->dirty[i]) )
+      {
+         a = u;
+         gui->dirty[i] = gui->dirty[--gui->dirty_cnt];
+         i = 0;
+      }
+      else
+      {
+         i++;
+      }
+   }
+
+   if ( gui->dirty_cnt < UG_DIRTY_AREAS_MAX )
+   {
+      gui->dirty[gui->dirty_cnt++] = a;
+      return;
+   }
+
+   best = 0;
+   best_growth = 0xFFFFFFFF;
+   for( i=0; i<gui->dirty_cnt; i++ )
+   {
+      _UG_AreaUnion( &a, &gui->dirty[i], &u );
+      growth = _UG_AreaSize(&u) - _UG_AreaSize(&gui->dirty[i]);
+      if ( growth < best_growth )
+      {
+         best_growth = growth;
+         best = i;
+      }
+   }
+   _UG_AreaUnion( &a, &gui->dirty[best], &gui->dirty[best] );
+}
+
+void _UG_DirtyAreasFlush( void )
+{
+   UG_U8 i;
+
+   if ( gui->driver[DRIVER_FLUSH_AREA].state & DRIVER_ENABLED )
+   {
+      for( i=0; i<gui->dirty_cnt; i++ )
+      {
+         ((UG_RESULT(*)(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2))gui->driver[DRIVER_FLUSH_AREA].driver)(gui->dirty[i].xs,gui->dirty[i].ys,gui->dirty[i].xe,gui->dirty[i].ye);
+      }
+   }
+   gui->dirty_cnt = 0;
+}
+#endif
+
 void UG_WaitForUpdate( void )
 {
    gui->state |= UG_SATUS_WAIT_FOR_UPDATE;
@@ -6591,6 +6704,9 @@ UG_RESULT _UG_WindowDrawTitle( UG_WINDOW* wnd )
 
       /* Draw title */
       UG_FillFrame(xs,ys,xe,ys+wnd->title.height-1,txt.bc);
+#ifdef USE_DIRTY_AREAS
+      UG_DirtyAreaAdd(xs,ys,xe,ys+wnd->title.height-1);
+#endif
 
       /* Draw title text */
       txt.str = wnd->title.str;
@@ -6626,6 +6742,10 @@ void _UG_WindowUpdate( UG_WINDOW* wnd )
    /* Is the window visible? */
    if ( wnd->state & WND_STATE_VISIBLE )
    {
+#ifdef USE_DIRTY_AREAS
+      /* Only the title, added when it is drawn, if the rest stays */
+      if ( !(wnd->state & WND_STATE_REDRAW_TITLE) ) UG_DirtyAreaAdd(xs,ys,xe,ye);
+#endif
       /* 3D style? */
       if ( (wnd->style & WND_STYLE_3D) && !(wnd->state & WND_STATE_REDRAW_TITLE) )
       {
@@ -6659,7 +6779,10 @@ void _UG_WindowUpdate( UG_WINDOW* wnd )
    }
    else
    {
-      UG_FillFrame(wnd->xs,wnd->xs,wnd->xe,wnd->ye,gui->desktop_color);
+      UG_FillFrame(wnd->xs,wnd->ys,wnd->xe,wnd->ye,gui->desktop_color);
+#ifdef USE_DIRTY_AREAS
+      UG_DirtyAreaAdd(wnd->xs,wnd->ys,wnd->xe,wnd->ye);
+#endif
    }
 }
 
@@ -6671,6 +6794,9 @@ UG_RESULT _UG_WindowClear( UG_WINDOW* wnd )
       {
          wnd->state &= ~WND_STATE_VISIBLE;
          UG_FillFrame( wnd->xs, wnd->ys, wnd->xe, wnd->ye, gui->desktop_color );
+#ifdef USE_DIRTY_AREAS
+         UG_DirtyAreaAdd( wnd->xs, wnd->ys, wnd->xe, wnd->ye );
+#endif
 
          if ( wnd != gui->active_window )
          {
@@ -8375,6 +8501,18 @@ UG_RESULT _HW_draw_buffer(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2, void *p_da
     return UG_RESULT_OK;    
 }
 
+UG_RESULT _HW_flush_area(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2)
+{
+    nrf_gfx_rect_t rect;
+
+    rect.x = x1;
+    rect.y = y1;
+    rect.width = x2 - x1 + 1;
+    rect.height = y2 - y1 + 1;
+    nrf_gfx_display_area(p_lcd, &rect);
+    return UG_RESULT_OK;
+}
+
 void UserSetPixel (UG_S16 x, UG_S16 y, UG_COLOR c) 
 {
     nrf_gfx_point_t pt;
@@ -548,11 +548,12 @@ typedef struct
 #define DRIVER_ENABLED                                (1<<1)
 
 /* Supported drivers */
-#define NUMBER_OF_DRIVERS                             4
+#define NUMBER_OF_DRIVERS                             5
 #define DRIVER_DRAW_LINE                              0
 #define DRIVER_FILL_FRAME                             1
 #define DRIVER_FILL_AREA                              2
 #define DRIVER_DRAW_BUFFER                            3
+#define DRIVER_FLUSH_AREA                             4
 
 /* -------------------------------------------------------------------------------- */
 /* -- µGUI CORE STRUCTURE                                                        -- */
@@ -585,6 +586,10 @@ typedef struct
    UG_COLOR desktop_color;
    UG_U8 state;
    UG_DRIVER driver[NUMBER_OF_DRIVERS];
+#ifdef USE_DIRTY_AREAS
+   UG_AREA dirty[UG_DIRTY_AREAS_MAX];
+   UG_U8 dirty_cnt;
+#endif
 } UG_GUI;
 
 #define UG_SATUS_WAIT_FOR_UPDATE                      (1<<0)
@@ -919,6 +924,9 @@ void UG_WaitForUpdate( void );
 void UG_Update( void );
 void UG_DrawBMP( UG_S16 xp, UG_S16 yp, UG_BMP* bmp );
 void UG_TouchUpdate( UG_S16 xp, UG_S16 yp, UG_U8 state );
+#ifdef USE_DIRTY_AREAS
+void UG_DirtyAreaAdd( UG_S16 xs, UG_S16 ys, UG_S16 xe, UG_S16 ye );
+#endif
 
 /* Driver functions */
 void UG_DriverRegister( UG_U8 type, void* driver );
@@ -1059,6 +1067,7 @@ UG_RESULT UG_ImageSetBMP( UG_WINDOW* wnd, UG_U8 id, const UG_BMP* bmp );
 static UG_RESULT _HW_draw_line(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2, UG_COLOR c);
 static UG_RESULT _HW_fill_frame( UG_S16 x1, UG_S16 y1, UG_S16 x2 , UG_S16 y2 , UG_COLOR c);
 static UG_RESULT _HW_draw_buffer(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2, void *p_data, UG_U32 length);
+static UG_RESULT _HW_flush_area(UG_S16 x1, UG_S16 y1, UG_S16 x2, UG_S16 y2);
 UG_S16 UG_Init( UG_GUI* g, UG_S16 x, UG_S16 y, const nrf_lcd_t *p_nrf_lcd);
 static void UserSetPixel (UG_S16 x, UG_S16 y, UG_COLOR c);
 static const nrf_lcd_t *p_lcd;
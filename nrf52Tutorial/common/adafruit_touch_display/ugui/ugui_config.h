@@ -60,6 +60,11 @@ typedef signed long int       UG_S32;
 #define USE_PRERENDER_EVENT
 #define USE_POSTRENDER_EVENT
 
+/* Collect the areas UG_Update redraws and pass them to DRIVER_FLUSH_AREA, merged into at most
+   UG_DIRTY_AREAS_MAX rectangles */
+#define USE_DIRTY_AREAS
+#define UG_DIRTY_AREAS_MAX  8
+
 /* MQ 10/18/2017  This define will enable Nordic changes: namely bake in the HW acceleration function in this code.  This way these
                   functions won't have to be put into source code for new projects each time so long as this library is included and 
                   NORDIC_GUI is defined.
@@ -0,0 +1,330 @@
+#include "sdk_common.h"
+#include "ble_gattc_queue.h"
+#include "ble_gattc.h"
+#include "ble_srv_common.h"
+#include "nrf_sdh_ble.h"
+#define NRF_LOG_MODULE_NAME ble_gattc_queue
+#include "nrf_log.h"
+NRF_LOG_MODULE_REGISTER();
+
+#define REQ_NONE        0xFF                /**< End of a request list. */
+#define REQ_OP_READ     0                   /**< Not a BLE_GATT_OP_*, those used here are all non-zero. */
+
+STATIC_ASSERT(BLE_GATTC_QUEUE_SIZE < REQ_NONE);
+
+/**@brief A queued read or write. */
+typedef struct
+{
+    uint16_t handle;                        /**< Attribute to read or write. */
+    uint8_t  op;                            /**< REQ_OP_READ, BLE_GATT_OP_WRITE_REQ or BLE_GATT_OP_WRITE_CMD. */
+    uint8_t  len;
+    uint8_t  next;                          /**< Next request of the same link, or of the free list. */
+    uint8_t  value[BLE_GATTC_QUEUE_VALUE_MAX];
+} gattc_req_t;
+
+/**@brief Requests of one link, oldest first. */
+typedef struct
+{
+    uint8_t head;
+    uint8_t tail;
+    uint8_t depth;
+    bool    busy;                           /**< A read or write request waits for its response. */
+} gattc_link_t;
+
+static gattc_req_t             m_req[BLE_GATTC_QUEUE_SIZE];
+static gattc_link_t            m_link[BLE_GATTC_QUEUE_LINK_COUNT];
+static uint8_t                 m_free = REQ_NONE;
+static bool                    m_initialized;
+static ble_gattc_queue_stats_t m_stats;
+
+static void on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context);
+
+NRF_SDH_BLE_OBSERVER(m_ble_gattc_queue_obs, BLE_GATTC_QUEUE_BLE_OBSERVER_PRIO, on_ble_evt, NULL);
+
+
+/**@brief Function for building the free list and emptying all links, done on first use.
+ */
+static void queue_init(void)
+{
+    for (uint8_t i = 0; i < BLE_GATTC_QUEUE_SIZE; i++)
+    {
+        m_req[i].next = (i + 1 < BLE_GATTC_QUEUE_SIZE) ? i + 1 : REQ_NONE;
+    }
+    m_free = 0;
+
+    for (uint8_t i = 0; i < BLE_GATTC_QUEUE_LINK_COUNT; i++)
+    {
+        m_link[i].head  = REQ_NONE;
+        m_link[i].tail  = REQ_NONE;
+        m_link[i].depth = 0;
+        m_link[i].busy  = false;
+    }
+    m_initialized = true;
+}
+
+
+/**@brief Function for taking the oldest request off a link and returning it to the free list.
+ */
+static void link_pop(gattc_link_t * p_link)
+{
+    uint8_t index = p_link->head;
+
+    p_link->head = m_req[index].next;
+    if (p_link->head == REQ_NONE)
+    {
+        p_link->tail = REQ_NONE;
+    }
+    p_link->depth--;
+    m_stats.pending--;
+
+    m_req[index].next = m_free;
+    m_free            = index;
+}
+
+
+/**@brief Function for passing the requests of a link to the SoftDevice, as far as it takes them.
+ *
+ * @details Writes without response may pass an outstanding request, only the order of the
+ *          requests among themselves matters for the peer.
+ */
+static void link_process(uint16_t conn_handle)
+{
+    gattc_link_t * p_link = &m_link[conn_handle];
+
+    while (p_link->head != REQ_NONE)
+    {
+        gattc_req_t * p_req = &m_req[p_link->head];
+        uint32_t      err_code;
+
+        if ((p_req->op != BLE_GATT_OP_WRITE_CMD) && p_link->busy)
+        {
+            return;
+        }
+
+        if (p_req->op == REQ_OP_READ)
+        {
+            err_code = sd_ble_gattc_read(conn_handle, p_req->handle, 0);
+        }
+        else
+        {
+            ble_gattc_write_params_t write_params;
+
+            memset(&write_params, 0, sizeof(write_params));
+            write_params.write_op = p_req->op;
+            write_params.handle   = p_req->handle;
+            write_params.len      = p_req->len;
+            write_params.p_value  = p_req->value;
+            err_code = sd_ble_gattc_write(conn_handle, &write_params);
+        }
+
+        if ((err_code == NRF_ERROR_BUSY) || (err_code == NRF_ERROR_RESOURCES))
+        {
+            // Link busy with another request or TX queue full, try again on the next GATTC event
+            return;
+        }
+
+        if (err_code == NRF_SUCCESS)
+        {
+            m_stats.sent++;
+            if (p_req->op != BLE_GATT_OP_WRITE_CMD)
+            {
+                p_link->busy = true;
+            }
+        }
+        else
+        {
+            NRF_LOG_WARNING("Request on link 0x%x, handle 0x%x rejected: 0x%x.",
+                            conn_handle, p_req->handle, err_code);
+            m_stats.dropped++;
+        }
+        link_pop(p_link);
+    }
+}
+
+
+/**@brief Function for dropping everything queued on a link.
+ */
+static void link_flush(uint16_t conn_handle)
+{
+    gattc_link_t * p_link = &m_link[conn_handle];
+
+    while (p_link->head != REQ_NONE)
+    {
+        link_pop(p_link);
+    }
+    p_link->busy = false;
+}
+
+
+/**@brief Function for adding a request to the tail of its link and sending what can be sent.
+ */
+static uint32_t req_add(uint16_t conn_handle, uint16_t handle, uint8_t op, uint8_t const * p_value, uint16_t len)
+{
+    gattc_link_t * p_link;
+    gattc_req_t  * p_req;
+    uint8_t        index;
+
+    if ((conn_handle >= BLE_GATTC_QUEUE_LINK_COUNT) ||
+        (handle == BLE_GATT_HANDLE_INVALID) ||
+        (len > BLE_GATTC_QUEUE_VALUE_MAX))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    if (!m_initialized)
+    {
+        queue_init();
+    }
+
+    // A link over its budget does not take the slots of the links being set up
+    if ((m_free == REQ_NONE) || (m_link[conn_handle].depth >= BLE_GATTC_QUEUE_LINK_BUDGET))
+    {
+        m_stats.dropped++;
+        return NRF_ERROR_NO_MEM;
+    }
+
+    index  = m_free;
+    p_req  = &m_req[index];
+    m_free = p_req->next;
+
+    p_req->handle = handle;
+    p_req->op     = op;
+    p_req->len    = len;
+    p_req->next   = REQ_NONE;
+    if (len > 0)
+    {
+        memcpy(p_req->value, p_value, len);
+    }
+
+    p_link = &m_link[conn_handle];
+    if (p_link->tail == REQ_NONE)
+    {
+        p_link->head = index;
+    }
+    else
+    {
+        m_req[p_link->tail].next = index;
+    }
+    p_link->tail = index;
+    p_link->depth++;
+
+    m_stats.pending++;
+    if (m_stats.pending > m_stats.high_water)
+    {
+        m_stats.high_water = m_stats.pending;
+    }
+
+    link_process(conn_handle);
+    return NRF_SUCCESS;
+}
+
+
+static void on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
+{
+    uint16_t evt_id = p_ble_evt->header.evt_id;
+    uint16_t conn_handle;
+
+    if (!m_initialized)
+    {
+        return;
+    }
+
+    if (evt_id == BLE_GAP_EVT_DISCONNECTED)
+    {
+        if (p_ble_evt->evt.gap_evt.conn_handle < BLE_GATTC_QUEUE_LINK_COUNT)
+        {
+            link_flush(p_ble_evt->evt.gap_evt.conn_handle);
+        }
+        return;
+    }
+
+    if ((evt_id < BLE_GATTC_EVT_BASE) || (evt_id > BLE_GATTC_EVT_LAST))
+    {
+        return;
+    }
+    conn_handle = p_ble_evt->evt.gattc_evt.conn_handle;
+    if (conn_handle >= BLE_GATTC_QUEUE_LINK_COUNT)
+    {
+        return;
+    }
+
+    switch (evt_id)
+    {
+        case BLE_GATTC_EVT_READ_RSP:
+        case BLE_GATTC_EVT_WRITE_RSP:
+            m_link[conn_handle].busy = false;
+            break;
+
+        case BLE_GATTC_EVT_TIMEOUT:
+            // The link is unusable, it will be disconnected
+            return;
+
+        default:
+            break;
+    }
+
+    // Any GATTC event may mean the SoftDevice now takes a request it refused before
+    link_process(conn_handle);
+}
+
+
+uint32_t ble_gattc_queue_write(uint16_t        conn_handle,
+                               uint16_t        handle,
+                               uint8_t         write_op,
+                               uint8_t const * p_value,
+                               uint16_t        len)
+{
+    if ((write_op != BLE_GATT_OP_WRITE_REQ) && (write_op != BLE_GATT_OP_WRITE_CMD))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if ((len > 0) && (p_value == NULL))
+    {
+        return NRF_ERROR_NULL;
+    }
+    return req_add(conn_handle, handle, write_op, p_value, len);
+}
+
+
+uint32_t ble_gattc_queue_read(uint16_t conn_handle, uint16_t handle)
+{
+    return req_add(conn_handle, handle, REQ_OP_READ, NULL, 0);
+}
+
+
+uint32_t ble_gattc_queue_cccd_configure(uint16_t conn_handle, uint16_t handle_cccd, bool enable)
+{
+    uint16_t cccd_val = enable ? BLE_GATT_HVX_NOTIFICATION : 0;
+    uint8_t  value[BLE_CCCD_VALUE_LEN];
+
+    NRF_LOG_DEBUG("Configuring CCCD. CCCD Handle = %d, Connection Handle = %d",
+        handle_cccd, conn_handle);
+
+    value[0] = LSB_16(cccd_val);
+    value[1] = MSB_16(cccd_val);
+
+    // Descriptors only take write requests
+    return ble_gattc_queue_write(conn_handle, handle_cccd, BLE_GATT_OP_WRITE_REQ, value, sizeof(value));
+}
+
+
+uint8_t ble_gattc_queue_write_op_get(ble_gatt_char_props_t const * p_char_props)
+{
+    return p_char_props->write_wo_resp ? BLE_GATT_OP_WRITE_CMD : BLE_GATT_OP_WRITE_REQ;
+}
+
+
+uint16_t ble_gattc_queue_depth_get(uint16_t conn_handle)
+{
+    if (!m_initialized || (conn_handle >= BLE_GATTC_QUEUE_LINK_COUNT))
+    {
+        return 0;
+    }
+    return m_link[conn_handle].depth;
+}
+
+
+void ble_gattc_queue_stats_get(ble_gattc_queue_stats_t * p_stats)
+{
+    *p_stats = m_stats;
+}
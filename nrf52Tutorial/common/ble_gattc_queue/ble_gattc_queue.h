@@ -0,0 +1,129 @@
+/**@file
+ *
+ * @defgroup ble_gattc_queue GATT Client request queue
+ * @{
+ * @brief Shared queue of GATT client reads and writes for all client modules.
+ *
+ * @details Replaces the private TX buffers of the client modules. Requests wait in one pool of
+ *          slots, each link keeps its own FIFO of them. A link has at most one read or write
+ *          request outstanding, as ATT allows, but the links do not wait on each other. Writes
+ *          without response do not wait for an outstanding request, they are only held back
+ *          by the SoftDevice TX queue. Requests refused with NRF_ERROR_BUSY, for example while
+ *          DB discovery uses the link, are sent again on the next GATTC event of the link.
+ *
+ *          The module has its own BLE observer and needs no initialization.
+ */
+
+#ifndef BLE_GATTC_QUEUE_H__
+#define BLE_GATTC_QUEUE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#include "ble_gatt.h"
+#include "sdk_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BLE_GATTC_QUEUE_LINK_BUDGET
+#define BLE_GATTC_QUEUE_LINK_BUDGET     8       /**< Requests waiting at once on one link. A Thingy set up from
+                                                     cached handles queues 6 at once, phone LED writes follow. */
+#endif
+
+#ifndef BLE_GATTC_QUEUE_SIZE
+#define BLE_GATTC_QUEUE_SIZE            (BLE_GATTC_QUEUE_LINK_BUDGET * NRF_SDH_BLE_CENTRAL_LINK_COUNT) /**< Requests waiting at once, over all links. At most 254. */
+#endif
+
+#ifndef BLE_GATTC_QUEUE_VALUE_MAX
+#define BLE_GATTC_QUEUE_VALUE_MAX       20      /**< Longest value of a write, fits the default ATT MTU. */
+#endif
+
+#define BLE_GATTC_QUEUE_LINK_COUNT      NRF_SDH_BLE_TOTAL_LINK_COUNT
+
+#define BLE_GATTC_QUEUE_BLE_OBSERVER_PRIO   1   /**< Before the client modules, so a response frees the link before they queue more. */
+
+/**@brief Queue usage, for the log. */
+typedef struct
+{
+    uint16_t pending;       /**< Requests waiting now. */
+    uint16_t high_water;    /**< Most requests ever waiting at once. */
+    uint32_t sent;          /**< Requests passed to the SoftDevice. */
+    uint32_t dropped;       /**< Requests refused because the queue was full, or rejected by the SoftDevice. */
+} ble_gattc_queue_stats_t;
+
+
+/**@brief Function for queueing a write.
+ *
+ * @param[in] conn_handle Connection handle.
+ * @param[in] handle      Attribute handle to write.
+ * @param[in] write_op    BLE_GATT_OP_WRITE_REQ or BLE_GATT_OP_WRITE_CMD.
+ * @param[in] p_value     Value to write, copied into the queue.
+ * @param[in] len         Length of the value, at most BLE_GATTC_QUEUE_VALUE_MAX.
+ *
+ * @retval NRF_SUCCESS             The write is queued or already sent.
+ * @retval NRF_ERROR_INVALID_PARAM Bad connection handle, attribute handle or length.
+ * @retval NRF_ERROR_NO_MEM        The link has BLE_GATTC_QUEUE_LINK_BUDGET requests waiting, or the queue is full.
+ */
+uint32_t ble_gattc_queue_write(uint16_t        conn_handle,
+                               uint16_t        handle,
+                               uint8_t         write_op,
+                               uint8_t const * p_value,
+                               uint16_t        len);
+
+
+/**@brief Function for queueing a read. The response arrives as BLE_GATTC_EVT_READ_RSP.
+ *
+ * @param[in] conn_handle Connection handle.
+ * @param[in] handle      Attribute handle to read.
+ *
+ * @return See @ref ble_gattc_queue_write.
+ */
+uint32_t ble_gattc_queue_read(uint16_t conn_handle, uint16_t handle);
+
+
+/**@brief Function for queueing a CCCD write that enables or disables notifications.
+ *
+ * @param[in] conn_handle Connection handle.
+ * @param[in] handle_cccd Handle of the CCCD.
+ * @param[in] enable      Whether to enable notifications.
+ *
+ * @return See @ref ble_gattc_queue_write.
+ */
+uint32_t ble_gattc_queue_cccd_configure(uint16_t conn_handle, uint16_t handle_cccd, bool enable);
+
+
+/**@brief Function for picking the write operation a characteristic allows.
+ *
+ * @param[in] p_char_props Properties found by discovery.
+ *
+ * @return BLE_GATT_OP_WRITE_CMD if the characteristic takes writes without response,
+ *         BLE_GATT_OP_WRITE_REQ otherwise.
+ */
+uint8_t ble_gattc_queue_write_op_get(ble_gatt_char_props_t const * p_char_props);
+
+
+/**@brief Function for getting the number of requests waiting on a link.
+ *
+ * @param[in] conn_handle Connection handle.
+ *
+ * @return Requests queued and not yet passed to the SoftDevice.
+ */
+uint16_t ble_gattc_queue_depth_get(uint16_t conn_handle);
+
+
+/**@brief Function for getting the queue usage.
+ *
+ * @param[out] p_stats Queue usage.
+ */
+void ble_gattc_queue_stats_get(ble_gattc_queue_stats_t * p_stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLE_GATTC_QUEUE_H__
+
+/** @} */
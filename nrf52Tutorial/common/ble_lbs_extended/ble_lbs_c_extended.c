@@ -45,100 +45,11 @@
 #include "ble_types.h"
 #include "ble_srv_common.h"
 #include "ble_gattc.h"
+#include "ble_gattc_queue.h"
 #define NRF_LOG_MODULE_NAME ble_lbs_c
 #include "nrf_log.h"
 NRF_LOG_MODULE_REGISTER();
 
-#define TX_BUFFER_MASK         0x07                  /**< TX Buffer mask, must be a mask of continuous zeroes, followed by continuous sequence of ones: 000...111. */
-#define TX_BUFFER_SIZE         (TX_BUFFER_MASK + 1)  /**< Size of send buffer, which is 1 higher than the mask. */
-
-#define WRITE_MESSAGE_LENGTH   BLE_CCCD_VALUE_LEN    /**< Length of the write message for CCCD. */
-#define WRITE_MESSAGE_LENGTH   BLE_CCCD_VALUE_LEN    /**< Length of the write message for CCCD. */
-
-typedef enum
-{
-    READ_REQ,  /**< Type identifying that this tx_message is a read request. */
-    WRITE_REQ  /**< Type identifying that this tx_message is a write request. */
-} tx_request_t;
-
-/**@brief Structure for writing a message to the peer, i.e. CCCD.
- */
-typedef struct
-{
-    uint8_t                  gattc_value[WRITE_MESSAGE_LENGTH];  /**< The message to write. */
-    ble_gattc_write_params_t gattc_params;                       /**< GATTC parameters for this message. */
-} write_params_t;
-
-/**@brief Structure for holding data to be transmitted to the connected central.
- */
-typedef struct
-{
-    uint16_t     conn_handle;  /**< Connection handle to be used when transmitting this message. */
-    tx_request_t type;         /**< Type of this message, i.e. read or write message. */
-    union
-    {
-        uint16_t       read_handle;  /**< Read request message. */
-        write_params_t write_req;    /**< Write request message. */
-    } req;
-} tx_message_t;
-
-
-static tx_message_t m_tx_buffer[TX_BUFFER_SIZE];  /**< Transmit buffer for messages to be transmitted to the central. */
-static uint32_t     m_tx_insert_index = 0;        /**< Current index in the transmit buffer where the next message should be inserted. */
-static uint32_t     m_tx_index = 0;               /**< Current index in the transmit buffer from where the next message to be transmitted resides. */
-
-
-/**@brief Function for passing any pending request from the buffer to the stack.
- */
-static void tx_buffer_process(void)
-{
-    if (m_tx_index != m_tx_insert_index)
-    {
-        uint32_t err_code;
-
-        if (m_tx_buffer[m_tx_index].type == READ_REQ)
-        {
-            err_code = sd_ble_gattc_read(m_tx_buffer[m_tx_index].conn_handle,
-                                         m_tx_buffer[m_tx_index].req.read_handle,
-                                         0);
-        }
-        else
-        {
-            err_code = sd_ble_gattc_write(m_tx_buffer[m_tx_index].conn_handle,
-                                          &m_tx_buffer[m_tx_index].req.write_req.gattc_params);
-        }
-        if (err_code == NRF_SUCCESS)
-        {
-            NRF_LOG_DEBUG("SD Read/Write API returns Success..");
-            m_tx_index++;
-            m_tx_index &= TX_BUFFER_MASK;
-        }
-        else
-        {
-            NRF_LOG_DEBUG("SD Read/Write API returns error. This message sending will be "
-                "attempted again..");
-        }
-    }
-}
-
-
-/**@brief Function for handling write response events.
- *
- * @param[in] p_ble_lbs_c Pointer to the Led Button Client structure.
- * @param[in] p_ble_evt   Pointer to the BLE event received.
- */
-static void on_write_rsp(ble_lbs_c_t * p_ble_lbs_c, ble_evt_t const * p_ble_evt)
-{
-    // Check if the event if on the link for this instance
-    if (p_ble_lbs_c->conn_handle != p_ble_evt->evt.gattc_evt.conn_handle)
-    {
-        return;
-    }
-    // Check if there is any message to be sent across to the peer and send it.
-    tx_buffer_process();
-}
-
-
 /**@brief Function for handling Handle Value Notification received from the SoftDevice.
  *
  * @details This function will uses the Handle Value Notification received from the SoftDevice
@@ -193,6 +104,8 @@ static void on_disconnected(ble_lbs_c_t * p_ble_lbs_c, ble_evt_t const * p_ble_e
         p_ble_lbs_c->peer_lbs_db.button_handle      = BLE_GATT_HANDLE_INVALID;
         p_ble_lbs_c->peer_lbs_db.led_handle         = BLE_GATT_HANDLE_INVALID;
         p_ble_lbs_c->peer_lbs_db.led_color_handle   = BLE_GATT_HANDLE_INVALID;
+        p_ble_lbs_c->peer_lbs_db.led_write_op       = BLE_GATT_OP_WRITE_REQ;
+        p_ble_lbs_c->peer_lbs_db.led_color_write_op = BLE_GATT_OP_WRITE_REQ;
     }
 }
 
@@ -206,6 +119,7 @@ void ble_lbs_on_db_disc_evt(ble_lbs_c_t * p_ble_lbs_c, ble_db_discovery_evt_t co
     {
         ble_lbs_c_evt_t evt;
 
+        memset(&evt, 0, sizeof(evt));
         evt.evt_type    = BLE_LBS_C_EVT_DISCOVERY_COMPLETE;
         evt.conn_handle = p_evt->conn_handle;
 
@@ -215,10 +129,12 @@ void ble_lbs_on_db_disc_evt(ble_lbs_c_t * p_ble_lbs_c, ble_db_discovery_evt_t co
             switch (p_char->characteristic.uuid.uuid)
             {
                 case LBS_UUID_LED_CHAR:
-                    evt.params.peer_db.led_handle = p_char->characteristic.handle_value;
+                    evt.params.peer_db.led_handle   = p_char->characteristic.handle_value;
+                    evt.params.peer_db.led_write_op = ble_gattc_queue_write_op_get(&p_char->characteristic.char_props);
                     break;
                 case LBS_UUID_LED_COL_CHAR:
-                    evt.params.peer_db.led_color_handle = p_char->characteristic.handle_value;
+                    evt.params.peer_db.led_color_handle   = p_char->characteristic.handle_value;
+                    evt.params.peer_db.led_color_write_op = ble_gattc_queue_write_op_get(&p_char->characteristic.char_props);
                     break;
                 case LBS_UUID_BUTTON_CHAR:
                     evt.params.peer_db.button_handle      = p_char->characteristic.handle_value;
@@ -263,6 +179,8 @@ uint32_t ble_lbs_c_init(ble_lbs_c_t * p_ble_lbs_c, ble_lbs_c_init_t * p_ble_lbs_
     p_ble_lbs_c->peer_lbs_db.button_handle      = BLE_GATT_HANDLE_INVALID;
     p_ble_lbs_c->peer_lbs_db.led_handle         = BLE_GATT_HANDLE_INVALID;
     p_ble_lbs_c->peer_lbs_db.led_color_handle   = BLE_GATT_HANDLE_INVALID;
+    p_ble_lbs_c->peer_lbs_db.led_write_op       = BLE_GATT_OP_WRITE_REQ;
+    p_ble_lbs_c->peer_lbs_db.led_color_write_op = BLE_GATT_OP_WRITE_REQ;
     p_ble_lbs_c->conn_handle                    = BLE_CONN_HANDLE_INVALID;
     p_ble_lbs_c->evt_handler                    = p_ble_lbs_c_init->evt_handler;
 
@@ -294,10 +212,6 @@ void ble_lbs_c_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
             on_hvx(p_ble_lbs_c, p_ble_evt);
             break;
 
-        case BLE_GATTC_EVT_WRITE_RSP:
-            on_write_rsp(p_ble_lbs_c, p_ble_evt);
-            break;
-
         case BLE_GAP_EVT_DISCONNECTED:
             on_disconnected(p_ble_lbs_c, p_ble_evt);
             break;
@@ -308,40 +222,6 @@ void ble_lbs_c_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
 }
 
 
-/**@brief Function for configuring the CCCD.
- *
- * @param[in] conn_handle The connection handle on which to configure the CCCD.
- * @param[in] handle_cccd The handle of the CCCD to be configured.
- * @param[in] enable      Whether to enable or disable the CCCD.
- *
- * @return NRF_SUCCESS if the CCCD configure was successfully sent to the peer.
- */
-static uint32_t cccd_configure(uint16_t conn_handle, uint16_t handle_cccd, bool enable)
-{
-    NRF_LOG_DEBUG("Configuring CCCD. CCCD Handle = %d, Connection Handle = %d",
-        handle_cccd,conn_handle);
-
-    tx_message_t * p_msg;
-    uint16_t       cccd_val = enable ? BLE_GATT_HVX_NOTIFICATION : 0;
-
-    p_msg              = &m_tx_buffer[m_tx_insert_index++];
-    m_tx_insert_index &= TX_BUFFER_MASK;
-
-    p_msg->req.write_req.gattc_params.handle   = handle_cccd;
-    p_msg->req.write_req.gattc_params.len      = WRITE_MESSAGE_LENGTH;
-    p_msg->req.write_req.gattc_params.p_value  = p_msg->req.write_req.gattc_value;
-    p_msg->req.write_req.gattc_params.offset   = 0;
-    p_msg->req.write_req.gattc_params.write_op = BLE_GATT_OP_WRITE_REQ;
-    p_msg->req.write_req.gattc_value[0]        = LSB_16(cccd_val);
-    p_msg->req.write_req.gattc_value[1]        = MSB_16(cccd_val);
-    p_msg->conn_handle                         = conn_handle;
-    p_msg->type                                = WRITE_REQ;
-
-    tx_buffer_process();
-    return NRF_SUCCESS;
-}
-
-
 uint32_t ble_lbs_c_button_notif_enable(ble_lbs_c_t * p_ble_lbs_c)
 {
     VERIFY_PARAM_NOT_NULL(p_ble_lbs_c);
@@ -351,9 +231,9 @@ uint32_t ble_lbs_c_button_notif_enable(ble_lbs_c_t * p_ble_lbs_c)
         return NRF_ERROR_INVALID_STATE;
     }
 
-    return cccd_configure(p_ble_lbs_c->conn_handle,
-                          p_ble_lbs_c->peer_lbs_db.button_cccd_handle,
-                          true);
+    return ble_gattc_queue_cccd_configure(p_ble_lbs_c->conn_handle,
+                                          p_ble_lbs_c->peer_lbs_db.button_cccd_handle,
+                                          true);
 }
 
 
@@ -368,22 +248,11 @@ uint32_t ble_lbs_led_status_send(ble_lbs_c_t * p_ble_lbs_c, uint8_t status)
 
     NRF_LOG_DEBUG("writing LED status 0x%x", status);
 
-    tx_message_t * p_msg;
-
-    p_msg              = &m_tx_buffer[m_tx_insert_index++];
-    m_tx_insert_index &= TX_BUFFER_MASK;
-
-    p_msg->req.write_req.gattc_params.handle   = p_ble_lbs_c->peer_lbs_db.led_handle;
-    p_msg->req.write_req.gattc_params.len      = sizeof(status);
-    p_msg->req.write_req.gattc_params.p_value  = p_msg->req.write_req.gattc_value;
-    p_msg->req.write_req.gattc_params.offset   = 0;
-    p_msg->req.write_req.gattc_params.write_op = BLE_GATT_OP_WRITE_CMD;
-    p_msg->req.write_req.gattc_value[0]        = status;
-    p_msg->conn_handle                         = p_ble_lbs_c->conn_handle;
-    p_msg->type                                = WRITE_REQ;
-
-    tx_buffer_process();
-    return NRF_SUCCESS;
+    return ble_gattc_queue_write(p_ble_lbs_c->conn_handle,
+                                 p_ble_lbs_c->peer_lbs_db.led_handle,
+                                 p_ble_lbs_c->peer_lbs_db.led_write_op,
+                                 &status,
+                                 sizeof(status));
 }
 
 
@@ -403,22 +272,14 @@ uint32_t ble_lbs_led_color_send(ble_lbs_c_t * p_ble_lbs_c, uint8_t *colors)
 
     NRF_LOG_INFO("writing LED color %i, %i, %i", colors[0], colors[1], colors[2]);
 
-    tx_message_t * p_msg;
+    // The server takes the color as 4 bytes, the last one unused
+    uint8_t value[4] = {colors[0], colors[1], colors[2], 0};
 
-    p_msg              = &m_tx_buffer[m_tx_insert_index++];
-    m_tx_insert_index &= TX_BUFFER_MASK;
-
-    p_msg->req.write_req.gattc_params.handle   = p_ble_lbs_c->peer_lbs_db.led_color_handle;
-    p_msg->req.write_req.gattc_params.len      = 4;
-    p_msg->req.write_req.gattc_params.p_value  = p_msg->req.write_req.gattc_value;
-    p_msg->req.write_req.gattc_params.offset   = 0;
-    p_msg->req.write_req.gattc_params.write_op = BLE_GATT_OP_WRITE_CMD;
-    memcpy(p_msg->req.write_req.gattc_value, colors, 3);
-    p_msg->conn_handle                         = p_ble_lbs_c->conn_handle;
-    p_msg->type                                = WRITE_REQ;
-
-    tx_buffer_process();
-    return NRF_SUCCESS;
+    return ble_gattc_queue_write(p_ble_lbs_c->conn_handle,
+                                 p_ble_lbs_c->peer_lbs_db.led_color_handle,
+                                 p_ble_lbs_c->peer_lbs_db.led_color_write_op,
+                                 value,
+                                 sizeof(value));
 }
 
 
@@ -120,6 +120,8 @@ typedef struct
     uint16_t button_handle;       /**< Handle of the Button characteristic as provided by the SoftDevice. */
     uint16_t led_handle;          /**< Handle of the LED characteristic as provided by the SoftDevice. */
     uint16_t led_color_handle;    /**< Handle of the LED color characteristic as provided by the SoftDevice. */
+    uint8_t  led_write_op;        /**< Write operation the LED characteristic allows, BLE_GATT_OP_WRITE_CMD or BLE_GATT_OP_WRITE_REQ. */
+    uint8_t  led_color_write_op;  /**< Write operation the LED color characteristic allows. */
 } lbs_db_t;
 
 /**@brief LED Button Event structure. */
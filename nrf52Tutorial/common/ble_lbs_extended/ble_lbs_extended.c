@@ -132,8 +132,9 @@ uint32_t ble_lbs_init(ble_lbs_t * p_lbs, const ble_lbs_init_t * p_lbs_init)
     add_char_params.uuid_type        = p_lbs->uuid_type;
     add_char_params.init_len         = sizeof(uint8_t);
     add_char_params.max_len          = sizeof(uint8_t);
-    add_char_params.char_props.read  = 1;
-    add_char_params.char_props.write = 1;
+    add_char_params.char_props.read          = 1;
+    add_char_params.char_props.write         = 1;
+    add_char_params.char_props.write_wo_resp = 1;
 
     add_char_params.read_access  = SEC_OPEN;
     add_char_params.write_access = SEC_OPEN;
@@ -150,8 +151,9 @@ uint32_t ble_lbs_init(ble_lbs_t * p_lbs, const ble_lbs_init_t * p_lbs_init)
     add_char_params.uuid_type        = p_lbs->uuid_type;
     add_char_params.init_len         = sizeof(uint32_t);
     add_char_params.max_len          = sizeof(uint32_t);
-    add_char_params.char_props.read  = 1;
-    add_char_params.char_props.write = 1;
+    add_char_params.char_props.read          = 1;
+    add_char_params.char_props.write         = 1;
+    add_char_params.char_props.write_wo_resp = 1;
 
     add_char_params.read_access  = SEC_OPEN;
     add_char_params.write_access = SEC_OPEN;
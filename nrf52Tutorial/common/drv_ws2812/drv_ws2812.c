@@ -1,28 +1,93 @@
-
 #include <nrfx.h>
 #include <string.h>
 #include <nrfx_pwm.h>
 #include <hal/nrf_gpio.h>
 #include "drv_ws2812.h"
 
-#define WS2812_T1H                  14 | 0x8000
-#define WS2812_T0H                  6 | 0x8000
+#define WS2812_T1H                  (14 | 0x8000)
+#define WS2812_T0H                  (6 | 0x8000)
+#define WS2812_RESET                (0 | 0x8000)    // low for the whole bit, latches the LEDs
 
 #if defined(NEOPIXEL_RING)
-#define LED_MATRIX_TOTAL_BYTE_WIDTH	LED_MATRIX_WIDTH * LED_MATRIX_HEIGHT * 4
-#define LED_MATRIX_TOTAL_BIT_WIDTH	LED_MATRIX_TOTAL_BYTE_WIDTH * 8
+#define WS2812_BYTES_PER_LED        4
 #else
-#define LED_MATRIX_TOTAL_BYTE_WIDTH	LED_MATRIX_WIDTH * LED_MATRIX_HEIGHT * 3
-#define LED_MATRIX_TOTAL_BIT_WIDTH	LED_MATRIX_TOTAL_BYTE_WIDTH * 8
+#define WS2812_BYTES_PER_LED        3
 #endif
+#define WS2812_BITS_PER_LED         (WS2812_BYTES_PER_LED * 8)
+
+#define LED_MATRIX_TOTAL_LEDS       (LED_MATRIX_WIDTH * LED_MATRIX_HEIGHT)
+#define LED_MATRIX_TOTAL_BYTE_WIDTH	(LED_MATRIX_TOTAL_LEDS * WS2812_BYTES_PER_LED)
+#define LED_MATRIX_TOTAL_BIT_WIDTH	(LED_MATRIX_TOTAL_BYTE_WIDTH * 8)
+
+#if defined(DRV_WS2812_STREAMING)
+#define WS2812_STREAM_HALF_LENGTH   (DRV_WS2812_STREAM_LEDS * WS2812_BITS_PER_LED)
+#define WS2812_STREAM_CHUNKS        ((LED_MATRIX_TOTAL_LEDS + DRV_WS2812_STREAM_LEDS - 1) / DRV_WS2812_STREAM_LEDS)
+#endif
+
+// PWM duty cycles of the 4 bits of a nibble, most significant bit first
+#define WS2812_BIT(n, bit)          ((((n) >> (bit)) & 0x01) ? WS2812_T1H : WS2812_T0H)
+#define WS2812_NIBBLE(n)            { WS2812_BIT(n, 3), WS2812_BIT(n, 2), WS2812_BIT(n, 1), WS2812_BIT(n, 0) }
+
+static const uint16_t m_nibble_to_pwm[16][4] =
+{
+    WS2812_NIBBLE(0x0), WS2812_NIBBLE(0x1), WS2812_NIBBLE(0x2), WS2812_NIBBLE(0x3),
+    WS2812_NIBBLE(0x4), WS2812_NIBBLE(0x5), WS2812_NIBBLE(0x6), WS2812_NIBBLE(0x7),
+    WS2812_NIBBLE(0x8), WS2812_NIBBLE(0x9), WS2812_NIBBLE(0xA), WS2812_NIBBLE(0xB),
+    WS2812_NIBBLE(0xC), WS2812_NIBBLE(0xD), WS2812_NIBBLE(0xE), WS2812_NIBBLE(0xF)
+};
 
 
 static rgb_color_t led_matrix_buffer[LED_MATRIX_WIDTH][LED_MATRIX_HEIGHT];
 
 static nrfx_pwm_t m_pwm0 = NRFX_PWM_INSTANCE(0);
-static nrf_pwm_values_individual_t pwm_duty_cycle_values[LED_MATRIX_TOTAL_BIT_WIDTH];
+// Only channel 1 drives a pin, all channels share one duty cycle per bit
+#if defined(DRV_WS2812_STREAMING)
+static nrf_pwm_values_common_t pwm_duty_cycle_values[2 * WS2812_STREAM_HALF_LENGTH];
+static volatile uint32_t m_stream_next;     // next chunk of LEDs to be converted
+#else
+static nrf_pwm_values_common_t pwm_duty_cycle_values[LED_MATRIX_TOTAL_BIT_WIDTH];
+static uint32_t m_led_dirty[(LED_MATRIX_TOTAL_LEDS + 31) / 32];     // LEDs changed since the last conversion
+#endif
 volatile bool pwm_sequencue_finished = true;
 
+// Writes the duty cycles of one LED, the bytes in buffer order
+static void convert_led_to_pwm(nrf_pwm_values_common_t * p_pwm, uint32_t led)
+{
+    uint8_t const * ptr = (uint8_t const *)led_matrix_buffer + led * WS2812_BYTES_PER_LED;
+
+    for(int i = 0; i < WS2812_BYTES_PER_LED; i++)
+    {
+        memcpy(p_pwm,     m_nibble_to_pwm[*ptr >> 4],   sizeof(m_nibble_to_pwm[0]));
+        memcpy(p_pwm + 4, m_nibble_to_pwm[*ptr & 0x0F], sizeof(m_nibble_to_pwm[0]));
+        p_pwm += 8;
+        ptr++;
+    }
+}
+
+#if defined(DRV_WS2812_STREAMING)
+// Converts a chunk of LEDs into one half of the sequence, the line is held low past the last LED
+static void stream_chunk_fill(nrf_pwm_values_common_t * p_half, uint32_t chunk)
+{
+    uint32_t led = chunk * DRV_WS2812_STREAM_LEDS;
+
+    for(int i = 0; i < DRV_WS2812_STREAM_LEDS; i++, led++)
+    {
+        if(led < LED_MATRIX_TOTAL_LEDS)
+        {
+            convert_led_to_pwm(p_half, led);
+        }
+        else
+        {
+            for(int bit = 0; bit < WS2812_BITS_PER_LED; bit++)
+            {
+                p_half[bit] = WS2812_RESET;
+            }
+        }
+        p_half += WS2812_BITS_PER_LED;
+    }
+}
+#endif
+
 void pwm_handler(nrfx_pwm_evt_type_t event_type)
 {
     switch(event_type)
@@ -30,18 +95,45 @@ void pwm_handler(nrfx_pwm_evt_type_t event_type)
 	case NRFX_PWM_EVT_FINISHED:
 	    pwm_sequencue_finished = true;
 	    break;
+#if defined(DRV_WS2812_STREAMING)
+	// That half has been sent and the other one plays now
+	case NRFX_PWM_EVT_END_SEQ0:
+	    stream_chunk_fill(&pwm_duty_cycle_values[0], m_stream_next++);
+	    break;
+	case NRFX_PWM_EVT_END_SEQ1:
+	    stream_chunk_fill(&pwm_duty_cycle_values[WS2812_STREAM_HALF_LENGTH], m_stream_next++);
+	    break;
+#endif
 	default:
 	    break;
     }
 }
 
+#if defined(DRV_WS2812_STREAMING)
+static nrf_pwm_sequence_t pwm_sequence[2] =
+{
+    {
+        .values.p_common = &pwm_duty_cycle_values[0],
+        .length          = WS2812_STREAM_HALF_LENGTH,
+        .repeats         = 0,
+        .end_delay       = 0
+    },
+    {
+        .values.p_common = &pwm_duty_cycle_values[WS2812_STREAM_HALF_LENGTH],
+        .length          = WS2812_STREAM_HALF_LENGTH,
+        .repeats         = 0,
+        .end_delay       = 0
+    }
+};
+#else
 static nrf_pwm_sequence_t pwm_sequence =
 {
-    .values.p_individual = pwm_duty_cycle_values,
+    .values.p_common = pwm_duty_cycle_values,
     .length          = (sizeof(pwm_duty_cycle_values) / sizeof(uint16_t)),
     .repeats         = 0,
     .end_delay       = 0
 };
+#endif
 
 static uint32_t pwm_init(void)
 {
@@ -50,7 +142,7 @@ static uint32_t pwm_init(void)
     pwm_config.output_pins[1] = WS2812_PIN; 
     pwm_config.output_pins[2] = NRFX_PWM_PIN_NOT_USED;
     pwm_config.output_pins[3] = NRFX_PWM_PIN_NOT_USED;
-    pwm_config.load_mode    = NRF_PWM_LOAD_INDIVIDUAL;
+    pwm_config.load_mode    = NRF_PWM_LOAD_COMMON;
     // WS2812 protocol requires a 800 kHz PWM frequency. PWM Top value = 20 and Base Clock = 16 MHz achieves this
     pwm_config.top_value    = 20; 
     pwm_config.base_clock   = NRF_PWM_CLK_16MHz;
@@ -59,35 +151,35 @@ static uint32_t pwm_init(void)
 }
 
 
-
+#if !defined(DRV_WS2812_STREAMING)
 static void convert_rgb_to_pwm_sequence(void)
 {
-    uint8_t * ptr = (uint8_t *)led_matrix_buffer;
-    uint32_t i = 0;
-    for(int led = 0; led < LED_MATRIX_TOTAL_BYTE_WIDTH; led++)
+    for(uint32_t word = 0; word < NRFX_ARRAY_SIZE(m_led_dirty); word++)
     {
-        for(int bit = 7; bit >= 0; bit--)
+        uint32_t dirty = m_led_dirty[word];
+
+        m_led_dirty[word] = 0;
+        while(dirty != 0)
         {
-            uint8_t b = (*ptr >> bit) & 0x01;
-            uint16_t pwm = 0;
-            if(b == 1)
-            {
-                pwm = WS2812_T1H;
-            }
-            else
-            {
-                pwm = WS2812_T0H;
-            }
-            pwm_duty_cycle_values[i++].channel_1 = pwm;
+            uint32_t led = word * 32 + __CLZ(__RBIT(dirty));
+
+            convert_led_to_pwm(&pwm_duty_cycle_values[led * WS2812_BITS_PER_LED], led);
+            dirty &= dirty - 1;
         }
-        ptr++;
     }
 }
+#endif
 
 uint32_t drv_ws2812_init(void)
 {   
-    volatile uint32_t size = sizeof(led_matrix_buffer);
     memset(led_matrix_buffer, 0x00, sizeof(led_matrix_buffer));   
+#if !defined(DRV_WS2812_STREAMING)
+    // Nothing converted yet
+    for(uint32_t led = 0; led < LED_MATRIX_TOTAL_LEDS; led++)
+    {
+        m_led_dirty[led / 32] |= 1UL << (led % 32);
+    }
+#endif
     return pwm_init();
 }
 
@@ -97,32 +189,54 @@ uint32_t drv_ws2812_display(void)
     {
         return NRF_ERROR_BUSY;
     }
+#if defined(DRV_WS2812_STREAMING)
+    stream_chunk_fill(&pwm_duty_cycle_values[0], 0);
+    stream_chunk_fill(&pwm_duty_cycle_values[WS2812_STREAM_HALF_LENGTH], 1);
+    m_stream_next = 2;
+    pwm_sequencue_finished = false;
+    // Each loop plays both halves, an odd chunk count ends on a half held low
+    uint32_t err_code = nrfx_pwm_complex_playback(&m_pwm0, &pwm_sequence[0], &pwm_sequence[1],
+                                                  (WS2812_STREAM_CHUNKS + 1) / 2,
+                                                  NRFX_PWM_FLAG_STOP | NRFX_PWM_FLAG_SIGNAL_END_SEQ0 |
+                                                  NRFX_PWM_FLAG_SIGNAL_END_SEQ1);
+#else
     convert_rgb_to_pwm_sequence();
     pwm_sequencue_finished = false;
     uint32_t err_code = nrfx_pwm_simple_playback(&m_pwm0, &pwm_sequence, 1, NRFX_PWM_FLAG_STOP);
+#endif
     return err_code;
 }
 
 uint32_t drv_ws2812_pixel_draw(uint16_t x, uint16_t y, uint32_t color)
 {
-    uint32_t err_code = NRF_SUCCESS;
     if(x > LED_MATRIX_WIDTH - 1)
     {
-        err_code = NRF_ERROR_INVALID_PARAM;
+        return NRF_ERROR_INVALID_PARAM;
     }
     if(y > LED_MATRIX_HEIGHT - 1)
     {
-	err_code = NRF_ERROR_INVALID_PARAM;
+	return NRF_ERROR_INVALID_PARAM;
     }
- 
+
+    rgb_color_t led;
+    memset(&led, 0, sizeof(led));
 #if defined(NEOPIXEL_RING)
-    led_matrix_buffer[x][y].w = (color & 0xFF000000) >> 24;
+    led.w = (color & 0xFF000000) >> 24;
 #endif
-    led_matrix_buffer[x][y].r = (color & 0x00FF0000) >> 16;
-    led_matrix_buffer[x][y].g = (color & 0x0000FF00) >> 8;
-    led_matrix_buffer[x][y].b = (color & 0x000000FF);
-    
-    return err_code;
+    led.r = (color & 0x00FF0000) >> 16;
+    led.g = (color & 0x0000FF00) >> 8;
+    led.b = (color & 0x000000FF);
+
+    if(memcmp(&led_matrix_buffer[x][y], &led, sizeof(led)) != 0)
+    {
+        led_matrix_buffer[x][y] = led;
+#if !defined(DRV_WS2812_STREAMING)
+        uint32_t index = x * LED_MATRIX_HEIGHT + y;
+        m_led_dirty[index / 32] |= 1UL << (index % 32);
+#endif
+    }
+
+    return NRF_SUCCESS;
 }
 
 uint32_t drv_ws2812_rectangle_draw(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint32_t color)
@@ -138,4 +252,3 @@ uint32_t drv_ws2812_rectangle_draw(uint16_t x, uint16_t y, uint16_t width, uint1
     }
     return NRF_SUCCESS;
 }
-
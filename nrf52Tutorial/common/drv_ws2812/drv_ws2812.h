@@ -7,6 +7,14 @@
 
 #define WS2812_PIN  NRF_GPIO_PIN_MAP(1,7)
 
+// Define DRV_WS2812_STREAMING to play the PWM sequence from two halves of DRV_WS2812_STREAM_LEDS LEDs
+// each, refilled while the other half plays, instead of holding 48 bytes per LED for the whole strip.
+// A half plays for DRV_WS2812_STREAM_LEDS * 30 us, its refill must not be held off longer than that.
+//#define DRV_WS2812_STREAMING
+#ifndef DRV_WS2812_STREAM_LEDS
+#define DRV_WS2812_STREAM_LEDS  16
+#endif
+
 typedef enum
 {
     RED	    = 0x00FF0000,
@@ -36,6 +44,8 @@ uint32_t drv_ws2812_init(void);
 
 /**
  * @brief This function must be called to draw the actual buffer onto the LED matrix
+ *          Only LEDs changed since the last call are converted, with DRV_WS2812_STREAMING
+ *          the strip is converted while it is sent and drawing shows up in a running frame
  */
 uint32_t drv_ws2812_display(void);
 